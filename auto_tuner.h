@@ -0,0 +1,175 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+// Online search of the number of threads and chunks used by each parallel stage of the
+// simulation. Each candidate runs for a few frames, keeping the best time measured.
+// First we search the number of threads, with the default chunks per thread, and then the
+// number of chunks for the best number of threads. The fastest configuration is kept until
+// the number of particles changes significantly or the pool is resized.
+struct AutoTuner {
+
+  struct Config {
+    int num_threads = 1;
+    int num_splits = 1;
+  };
+
+  struct Stage {
+    const char*         name = nullptr;
+    int                 default_splits_per_thread = 1;
+    Config              current;
+    Config              best;
+    double              best_time = DBL_MAX;
+    bool                pinned = false;
+    bool                tuning = false;
+    int                 phase = 0;
+    int                 candidate = 0;
+    int                 num_samples = 0;
+    double              candidate_time = DBL_MAX;
+    std::vector<Config> candidates;
+  };
+
+  static constexpr int    samples_per_candidate = 4;      // The first one is discarded
+  static constexpr int    min_particles = 1024;
+  static constexpr double retune_particles_change = 0.2;
+
+  std::vector<Stage> stages;              // Indexed by the stage id
+  int                pool_size = 1;
+  int                tuned_particles = 0;
+
+  // Only the first time, so the stages pinned keep their configuration when the sim is initialized again
+  void addStage(int stage_id, const char* name, int default_splits_per_thread) {
+    if (isStage(stage_id))
+      return;
+    if ((int)stages.size() <= stage_id)
+      stages.resize(stage_id + 1);
+    Stage& s = stages[stage_id];
+    s.name = name;
+    s.default_splits_per_thread = default_splits_per_thread;
+    s.current = defaultConfig(s);
+    s.best = s.current;
+  }
+
+  bool isStage(int stage_id) const {
+    return stage_id < (int)stages.size() && stages[stage_id].name;
+  }
+
+  bool isTuning() const {
+    for (auto& s : stages) {
+      if (s.tuning)
+        return true;
+    }
+    return false;
+  }
+
+  const Config& config(int stage_id) const {
+    return stages[stage_id].current;
+  }
+
+  Config defaultConfig(const Stage& s) const {
+    return Config{ pool_size, pool_size * s.default_splits_per_thread };
+  }
+
+  // Restarts the search of all the stages not pinned
+  void reset(int new_pool_size, int num_particles) {
+    pool_size = std::max(new_pool_size, 1);
+    tuned_particles = num_particles;
+    for (auto& s : stages) {
+      if (!s.name || s.pinned)
+        continue;
+      s.current = defaultConfig(s);
+      s.best = s.current;
+      s.best_time = DBL_MAX;
+      s.tuning = num_particles >= min_particles;
+      if (s.tuning)
+        startPhase(s, 0);
+    }
+  }
+
+  void checkParticles(int num_particles) {
+    double change = fabs((double)num_particles - tuned_particles) / std::max(tuned_particles, 1);
+    if (change > retune_particles_change && num_particles >= min_particles)
+      reset(pool_size, num_particles);
+  }
+
+  // Keeps the best configuration found so far
+  void stop() {
+    for (auto& s : stages) {
+      if (!s.tuning)
+        continue;
+      s.tuning = false;
+      s.current = s.best;
+    }
+  }
+
+  void pin(int stage_id, bool how) {
+    Stage& s = stages[stage_id];
+    s.pinned = how;
+    if (how) {
+      s.tuning = false;
+      s.current = s.best;
+    }
+  }
+
+  // Time of the stage with the current configuration
+  void record(int stage_id, double elapsed) {
+    if (!isStage(stage_id))
+      return;
+    Stage& s = stages[stage_id];
+    if (!s.tuning)
+      return;
+    if (s.num_samples++ > 0)
+      s.candidate_time = std::min(s.candidate_time, elapsed);
+    if (s.num_samples < samples_per_candidate)
+      return;
+
+    if (s.candidate_time < s.best_time) {
+      s.best_time = s.candidate_time;
+      s.best = s.current;
+    }
+    s.candidate++;
+    if (s.candidate < (int)s.candidates.size()) {
+      startCandidate(s);
+      return;
+    }
+    if (s.phase == 0) {
+      startPhase(s, 1);
+      return;
+    }
+    s.tuning = false;
+    s.current = s.best;
+    dbg("AutoTuner: %s uses %d threads and %d chunks (%1.3f ms)\n", s.name, s.best.num_threads, s.best.num_splits, s.best_time * 1e3);
+  }
+
+private:
+
+  void startPhase(Stage& s, int phase) {
+    s.phase = phase;
+    s.candidates.clear();
+    if (phase == 0) {
+      // 1, 2, 4, ... and the pool size
+      for (int n = 1; n < pool_size; n *= 2)
+        s.candidates.push_back({ n, n * s.default_splits_per_thread });
+      s.candidates.push_back({ pool_size, pool_size * s.default_splits_per_thread });
+    }
+    else {
+      int n = s.best.num_threads;
+      for (int splits_per_thread : { 1, 2, 4, 8 }) {
+        if (splits_per_thread != s.default_splits_per_thread)
+          s.candidates.push_back({ n, n * splits_per_thread });
+      }
+    }
+    s.candidate = 0;
+    startCandidate(s);
+  }
+
+  void startCandidate(Stage& s) {
+    s.current = s.candidates[s.candidate];
+    s.num_samples = 0;
+    s.candidate_time = DBL_MAX;
+  }
+
+};
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <immintrin.h>
+#include <climits>
+#include "particles_vec.h"
+
 struct CPUSpatialSubdivision {
 
 	using u32 = uint32_t;
@@ -80,6 +84,22 @@ struct CPUSpatialSubdivision {
 		Range ranges[max_ranges];
 	};
 
+	// Returns the cell associated to the coords in this frame, or nullptr if the cell is empty
+	inline const CellInfo* findCell(Int3 coords) const {
+		// Get the cell_id, rehashing the integer coords
+		u32 cell_id = gridHash(coords);
+		while (true) {
+			const CellInfo* cell = &cells_info[cell_id];
+			// If the cell is not used, fine, otherwise the coord must match
+			if (cell->tag != current_tag)
+				return nullptr;
+			if (cell->coords == coords)
+				return cell;
+			// or it means we need to find the next cell (open address hash)
+			cell_id = (cell_id + 1) & hash_mask;
+		}
+	}
+
 	void collectRanges(NearRanges& near_ranges, u32 cell_id) const {
 		//PROFILE_SCOPED_NAMED("Ranges");
 		const CellInfo& cell_info = cells_info[cell_id];
@@ -94,21 +114,9 @@ struct CPUSpatialSubdivision {
 				for (int ix = -1; ix < 2; ++ix) {
 					j_grid.x = i_grid.x + ix;
 
-					const CellInfo* cell_j = nullptr;
-					// Get the neighbour cell_id, rehashing the integer coords
-					u32 jcell_id = gridHash(j_grid);
-					
-					while (true) {
-						cell_j = &cells_info[jcell_id];
-						// If the cell is not used, fine, otherwise the coord must match
-						if ((cell_j->tag != current_tag) || (cell_j->coords == j_grid))
-							break;
-						// or it means we need to find the next cell (open address hash)
-						jcell_id = (jcell_id + 1) & hash_mask;
-					}
-
-					// Confirm again the cell contains data in this frame
-					if (cell_j->tag != current_tag)
+					// Confirm the cell contains data in this frame
+					const CellInfo* cell_j = findCell(j_grid);
+					if (!cell_j)
 						continue;
 
 					// Keep the range
@@ -121,6 +129,427 @@ struct CPUSpatialSubdivision {
 		near_ranges.n = n;
 	}
 
+	// -------------------------------------------------------------------------
+	// Region queries
+	// Each shape provides its bounds and a test of 8 points at once, returning the mask of the points inside
+	struct QuerySphere {
+		VEC3  center;
+		float radius = 0.0f;
+		void bounds(VEC3& pmin, VEC3& pmax) const {
+			pmin = center - VEC3::ones * radius;
+			pmax = center + VEC3::ones * radius;
+		}
+		bool isInside(VEC3 p) const {
+			return (p - center).lengthSquared() <= radius * radius;
+		}
+		__m256 isInside8(__m256 px, __m256 py, __m256 pz) const {
+			__m256 dx = _mm256_sub_ps(px, _mm256_set1_ps(center.x));
+			__m256 dy = _mm256_sub_ps(py, _mm256_set1_ps(center.y));
+			__m256 dz = _mm256_sub_ps(pz, _mm256_set1_ps(center.z));
+			__m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+			return _mm256_cmp_ps(d2, _mm256_set1_ps(radius * radius), _CMP_LE_OQ);
+		}
+	};
+
+	struct QueryAABB {
+		VEC3 pmin;
+		VEC3 pmax;
+		void bounds(VEC3& out_min, VEC3& out_max) const {
+			out_min = pmin;
+			out_max = pmax;
+		}
+		bool isInside(VEC3 p) const {
+			return p.x >= pmin.x && p.y >= pmin.y && p.z >= pmin.z && p.x <= pmax.x && p.y <= pmax.y && p.z <= pmax.z;
+		}
+		__m256 isInside8(__m256 px, __m256 py, __m256 pz) const {
+			__m256 mx = _mm256_and_ps(_mm256_cmp_ps(px, _mm256_set1_ps(pmin.x), _CMP_GE_OQ), _mm256_cmp_ps(px, _mm256_set1_ps(pmax.x), _CMP_LE_OQ));
+			__m256 my = _mm256_and_ps(_mm256_cmp_ps(py, _mm256_set1_ps(pmin.y), _CMP_GE_OQ), _mm256_cmp_ps(py, _mm256_set1_ps(pmax.y), _CMP_LE_OQ));
+			__m256 mz = _mm256_and_ps(_mm256_cmp_ps(pz, _mm256_set1_ps(pmin.z), _CMP_GE_OQ), _mm256_cmp_ps(pz, _mm256_set1_ps(pmax.z), _CMP_LE_OQ));
+			return _mm256_and_ps(mx, _mm256_and_ps(my, mz));
+		}
+	};
+
+	// Box centered at center, with the orthonormal axis and half sizes along each axis
+	struct QueryOrientedBox {
+		VEC3 center;
+		VEC3 axis[3] = { VEC3::axis_x, VEC3::axis_y, VEC3::axis_z };
+		VEC3 half_size;
+		void bounds(VEC3& pmin, VEC3& pmax) const {
+			VEC3 extent;
+			extent.x = fabsf(axis[0].x) * half_size.x + fabsf(axis[1].x) * half_size.y + fabsf(axis[2].x) * half_size.z;
+			extent.y = fabsf(axis[0].y) * half_size.x + fabsf(axis[1].y) * half_size.y + fabsf(axis[2].y) * half_size.z;
+			extent.z = fabsf(axis[0].z) * half_size.x + fabsf(axis[1].z) * half_size.y + fabsf(axis[2].z) * half_size.z;
+			pmin = center - extent;
+			pmax = center + extent;
+		}
+		bool isInside(VEC3 p) const {
+			VEC3 d = p - center;
+			return fabsf(d.dot(axis[0])) <= half_size.x && fabsf(d.dot(axis[1])) <= half_size.y && fabsf(d.dot(axis[2])) <= half_size.z;
+		}
+		__m256 isInside8(__m256 px, __m256 py, __m256 pz) const {
+			__m256 dx = _mm256_sub_ps(px, _mm256_set1_ps(center.x));
+			__m256 dy = _mm256_sub_ps(py, _mm256_set1_ps(center.y));
+			__m256 dz = _mm256_sub_ps(pz, _mm256_set1_ps(center.z));
+			const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+			__m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+			const float* hs = &half_size.x;
+			for (int k = 0; k < 3; ++k) {
+				__m256 proj = _mm256_add_ps(_mm256_add_ps(
+					_mm256_mul_ps(dx, _mm256_set1_ps(axis[k].x)),
+					_mm256_mul_ps(dy, _mm256_set1_ps(axis[k].y))),
+					_mm256_mul_ps(dz, _mm256_set1_ps(axis[k].z)));
+				proj = _mm256_andnot_ps(sign_mask, proj);
+				mask = _mm256_and_ps(mask, _mm256_cmp_ps(proj, _mm256_set1_ps(hs[k]), _CMP_LE_OQ));
+			}
+			return mask;
+		}
+	};
+
+	// All the points at distance <= radius of the segment a-b
+	struct QueryCapsule {
+		VEC3  a;
+		VEC3  b;
+		float radius = 0.0f;
+		void bounds(VEC3& pmin, VEC3& pmax) const {
+			pmin = VEC3::Min(a, b) - VEC3::ones * radius;
+			pmax = VEC3::Max(a, b) + VEC3::ones * radius;
+		}
+		bool isInside(VEC3 p) const {
+			VEC3 ab = b - a;
+			float len2 = ab.lengthSquared();
+			float t = len2 > 0.0f ? Math::clamp((p - a).dot(ab) / len2, 0.0f, 1.0f) : 0.0f;
+			return (p - (a + ab * t)).lengthSquared() <= radius * radius;
+		}
+		__m256 isInside8(__m256 px, __m256 py, __m256 pz) const {
+			VEC3 ab = b - a;
+			float len2 = ab.lengthSquared();
+			float inv_len2 = len2 > 0.0f ? 1.0f / len2 : 0.0f;
+			__m256 dx = _mm256_sub_ps(px, _mm256_set1_ps(a.x));
+			__m256 dy = _mm256_sub_ps(py, _mm256_set1_ps(a.y));
+			__m256 dz = _mm256_sub_ps(pz, _mm256_set1_ps(a.z));
+			__m256 abx = _mm256_set1_ps(ab.x);
+			__m256 aby = _mm256_set1_ps(ab.y);
+			__m256 abz = _mm256_set1_ps(ab.z);
+			__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, abx), _mm256_mul_ps(dy, aby)), _mm256_mul_ps(dz, abz)), _mm256_set1_ps(inv_len2));
+			t = _mm256_min_ps(_mm256_max_ps(t, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+			dx = _mm256_sub_ps(dx, _mm256_mul_ps(abx, t));
+			dy = _mm256_sub_ps(dy, _mm256_mul_ps(aby, t));
+			dz = _mm256_sub_ps(dz, _mm256_mul_ps(abz, t));
+			__m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+			return _mm256_cmp_ps(d2, _mm256_set1_ps(radius * radius), _CMP_LE_OQ);
+		}
+	};
+
+	// Calls fn(range) for each non-empty cell overlapping the box [pmin,pmax]
+	// The cells are visited in the same order they are stored, so the ranges are in increasing order
+	template< typename Fn >
+	void onEachRangeInAABB(VEC3 pmin, VEC3 pmax, Fn fn) const {
+		if (cells_ranges.empty())
+			return;
+		Int3 cmin = gridCoords(pmin);
+		Int3 cmax = gridCoords(pmax);
+		int64_t num_query_cells = (int64_t)(cmax.x - cmin.x + 1) * (int64_t)(cmax.y - cmin.y + 1) * (int64_t)(cmax.z - cmin.z + 1);
+
+		// If the query covers more cells than the ones in use, just check the used cells
+		if (num_query_cells > (int64_t)cells_ranges.size()) {
+			for (const CellRange& cell_range : cells_ranges) {
+				const Int3& c = cells_info[cell_range.cell_id].coords;
+				if (c.x >= cmin.x && c.x <= cmax.x && c.y >= cmin.y && c.y <= cmax.y && c.z >= cmin.z && c.z <= cmax.z)
+					fn(cell_range.range);
+			}
+			return;
+		}
+
+		// Same order used in sortCells
+		Int3 coords;
+		for (coords.y = cmin.y; coords.y <= cmax.y; ++coords.y) {
+			for (coords.x = cmin.x; coords.x <= cmax.x; ++coords.x) {
+				for (coords.z = cmin.z; coords.z <= cmax.z; ++coords.z) {
+					const CellInfo* cell = findCell(coords);
+					if (cell)
+						fn(cells_ranges[cell->range_idx].range);
+				}
+			}
+		}
+	}
+
+	// Contiguous ranges of particles in the cells overlapping [pmin,pmax]. Adjacent cells are merged
+	void collectRangesInAABB(VEC3 pmin, VEC3 pmax, std::vector<Range>& out_ranges) const {
+		out_ranges.clear();
+		onEachRangeInAABB(pmin, pmax, [&](const Range& r) {
+			if (!out_ranges.empty() && out_ranges.back().last == r.first)
+				out_ranges.back().last = r.last;
+			else
+				out_ranges.push_back(r);
+			});
+	}
+
+	// Calls fn(idx) for each particle inside the shape. Only the cells overlapping the bounds
+	// of the shape, expanded by margin, are visited. Use the margin when the positions have moved
+	// since the last call to setPoints
+	template< typename Shape, typename Fn >
+	void query(const Shape& shape, const ParticlesVec& pos, float margin, Fn fn) const {
+		VEC3 pmin, pmax;
+		shape.bounds(pmin, pmax);
+		pmin -= VEC3::ones * margin;
+		pmax += VEC3::ones * margin;
+		onEachRangeInAABB(pmin, pmax, [&](const Range& r) {
+			u32 j = r.first;
+			for (; j + 8 <= r.last; j += 8) {
+				__m256 mask = shape.isInside8(_mm256_loadu_ps(pos.x + j), _mm256_loadu_ps(pos.y + j), _mm256_loadu_ps(pos.z + j));
+				int mask_bits = _mm256_movemask_ps(mask);
+				u32 lane = 0;
+				while (mask_bits) {
+					if (mask_bits & 1)
+						fn(j + lane);
+					++lane;
+					mask_bits >>= 1;
+				}
+			}
+			for (; j < r.last; ++j) {
+				if (shape.isInside(pos.get(j)))
+					fn(j);
+			}
+			});
+	}
+
+	// -------------------------------------------------------------------------
+	// Ray casting
+	struct RayHit {
+		float t = FLT_MAX;
+		u32   idx = ~0U;
+		bool  isValid() const { return idx != ~0U; }
+	};
+
+	// DDA traversal of the grid along the ray, dir must be normalized. Each cell visited by the ray
+	// is expanded by ring cells in each direction, so particles close to the ray but in another cell are
+	// not missed. Because the traversal is monotonic in each axis, after the first cell we only need to
+	// visit the leading face of the window, and each cell is visited once.
+	// fn(range, t_enter) is called with t_enter of the ray cell, and returns false to stop the traversal
+	template< typename Fn >
+	void onEachRangeAlongRay(VEC3 src, VEC3 dir, float max_dist, int ring, Fn fn) const {
+		if (cells_ranges.empty())
+			return;
+
+		// Clip the ray against the bounds of the used cells, expanded by the ring
+		const float cell_size = 1.0f / grid_scale;
+		VEC3 bmin = getCellCoords(Int3(cells_min.x - ring, cells_min.y - ring, cells_min.z - ring));
+		VEC3 bmax = getCellCoords(Int3(cells_max.x + ring + 1, cells_max.y + ring + 1, cells_max.z + ring + 1));
+		float t_near = 0.0f;
+		float t_far = max_dist;
+		for (int k = 0; k < 3; ++k) {
+			if (fabsf(dir[k]) < 1e-8f) {
+				if (src[k] < bmin[k] || src[k] > bmax[k])
+					return;
+				continue;
+			}
+			float inv_d = 1.0f / dir[k];
+			float t0 = (bmin[k] - src[k]) * inv_d;
+			float t1 = (bmax[k] - src[k]) * inv_d;
+			if (t0 > t1)
+				std::swap(t0, t1);
+			t_near = std::max(t_near, t0);
+			t_far = std::min(t_far, t1);
+		}
+		if (t_near > t_far)
+			return;
+
+		VEC3 p = src + dir * t_near;
+		Int3 c = gridCoords(p);
+		int   step[3];
+		float t_max[3];
+		float t_delta[3];
+		int* cc = &c.x;
+		for (int k = 0; k < 3; ++k) {
+			if (dir[k] > 0.0f) {
+				step[k] = 1;
+				t_max[k] = t_near + ((cc[k] + 1) * cell_size - p[k]) / dir[k];
+				t_delta[k] = cell_size / dir[k];
+			}
+			else if (dir[k] < 0.0f) {
+				step[k] = -1;
+				t_max[k] = t_near + (cc[k] * cell_size - p[k]) / dir[k];
+				t_delta[k] = -cell_size / dir[k];
+			}
+			else {
+				step[k] = 0;
+				t_max[k] = FLT_MAX;
+				t_delta[k] = FLT_MAX;
+			}
+		}
+
+		auto visit = [&](Int3 coords, float t_enter) {
+			const CellInfo* cell = findCell(coords);
+			if (!cell)
+				return true;
+			return fn(cells_ranges[cell->range_idx].range, t_enter);
+		};
+
+		// Full window around the first cell
+		for (int dz = -ring; dz <= ring; ++dz)
+			for (int dy = -ring; dy <= ring; ++dy)
+				for (int dx = -ring; dx <= ring; ++dx)
+					if (!visit(Int3(c.x + dx, c.y + dy, c.z + dz), t_near))
+						return;
+
+		float t_enter = t_near;
+		while (true) {
+			// Advance along the axis with the closest boundary
+			int axis = (t_max[0] < t_max[1]) ? (t_max[0] < t_max[2] ? 0 : 2) : (t_max[1] < t_max[2] ? 1 : 2);
+			t_enter = t_max[axis];
+			if (t_enter > t_far)
+				break;
+			cc[axis] += step[axis];
+			t_max[axis] += t_delta[axis];
+
+			// Only the leading face of the window is new
+			int a1 = (axis + 1) % 3;
+			int a2 = (axis + 2) % 3;
+			Int3 coords = c;
+			int* co = &coords.x;
+			co[axis] = cc[axis] + ring * step[axis];
+			for (int o2 = -ring; o2 <= ring; ++o2) {
+				co[a2] = cc[a2] + o2;
+				for (int o1 = -ring; o1 <= ring; ++o1) {
+					co[a1] = cc[a1] + o1;
+					if (!visit(coords, t_enter))
+						return;
+				}
+			}
+		}
+	}
+
+	// Tests the particles in the range vs the ray, as spheres of the given radius. For each hit, calls
+	// fn(idx, t, dist_to_ray) where t is the distance to the entry point of the sphere (0 if src is inside)
+	// Returns false if fn requested to stop
+	template< typename Fn >
+	static bool raycastRange(const ParticlesVec& pos, const Range& r, VEC3 src, VEC3 dir, float max_dist, float radius, Fn fn) {
+		const float r2 = radius * radius;
+		auto report = [&](u32 j, float d2, float tca) {
+			float thc = sqrtf(std::max(r2 - d2, 0.0f));
+			return fn(j, std::max(tca - thc, 0.0f), sqrtf(std::max(d2, 0.0f)));
+		};
+
+		__m256 sx = _mm256_set1_ps(src.x);
+		__m256 sy = _mm256_set1_ps(src.y);
+		__m256 sz = _mm256_set1_ps(src.z);
+		__m256 dx = _mm256_set1_ps(dir.x);
+		__m256 dy = _mm256_set1_ps(dir.y);
+		__m256 dz = _mm256_set1_ps(dir.z);
+		__m256 r2_vec = _mm256_set1_ps(r2);
+		__m256 max_dist_vec = _mm256_set1_ps(max_dist);
+
+		u32 j = r.first;
+		for (; j + 8 <= r.last; j += 8) {
+			__m256 ox = _mm256_sub_ps(_mm256_loadu_ps(pos.x + j), sx);
+			__m256 oy = _mm256_sub_ps(_mm256_loadu_ps(pos.y + j), sy);
+			__m256 oz = _mm256_sub_ps(_mm256_loadu_ps(pos.z + j), sz);
+			__m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ox, dx), _mm256_mul_ps(oy, dy)), _mm256_mul_ps(oz, dz));
+			// Distance to the ray from the perpendicular vector, |o|^2 - tca^2 loses precision far from src
+			__m256 px = _mm256_sub_ps(ox, _mm256_mul_ps(tca, dx));
+			__m256 py = _mm256_sub_ps(oy, _mm256_mul_ps(tca, dy));
+			__m256 pz = _mm256_sub_ps(oz, _mm256_mul_ps(tca, dz));
+			__m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, px), _mm256_mul_ps(py, py)), _mm256_mul_ps(pz, pz));
+			// Hit if the ray passes close enough, the exit point is in front, and the entry before max_dist
+			__m256 thc = _mm256_sqrt_ps(_mm256_max_ps(_mm256_sub_ps(r2_vec, d2), _mm256_setzero_ps()));
+			__m256 mask = _mm256_cmp_ps(d2, r2_vec, _CMP_LE_OQ);
+			mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(tca, thc), _mm256_setzero_ps(), _CMP_GE_OQ));
+			mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_sub_ps(tca, thc), max_dist_vec, _CMP_LE_OQ));
+			int mask_bits = _mm256_movemask_ps(mask);
+			if (!mask_bits)
+				continue;
+			alignas(32) float d2s[8];
+			alignas(32) float tcas[8];
+			_mm256_store_ps(d2s, d2);
+			_mm256_store_ps(tcas, tca);
+			u32 lane = 0;
+			while (mask_bits) {
+				if ((mask_bits & 1) && !report(j + lane, d2s[lane], tcas[lane]))
+					return false;
+				++lane;
+				mask_bits >>= 1;
+			}
+		}
+
+		// Scalar fallback
+		for (; j < r.last; ++j) {
+			VEC3 o = pos.get(j) - src;
+			float tca = o.dot(dir);
+			float d2 = (o - dir * tca).lengthSquared();
+			if (d2 > r2)
+				continue;
+			float thc = sqrtf(r2 - d2);
+			if (tca + thc < 0.0f || tca - thc > max_dist)
+				continue;
+			if (!report(j, d2, tca))
+				return false;
+		}
+		return true;
+	}
+
+	int rayRing(float radius, float margin) const {
+		return (int)ceilf((radius + margin) * grid_scale);
+	}
+
+	// Calls fn(idx, t, dist_to_ray) for all the particles hit by the ray in [0, max_dist].
+	// Hits are grouped by cell, in roughly increasing t. fn returns false to stop
+	template< typename Fn >
+	void raycast(const ParticlesVec& pos, VEC3 src, VEC3 dir, float max_dist, float radius, float margin, Fn fn) const {
+		onEachRangeAlongRay(src, dir, max_dist + radius, rayRing(radius, margin), [&](const Range& r, float t_enter) {
+			return raycastRange(pos, r, src, dir, max_dist, radius, fn);
+			});
+	}
+
+	// Closest particle hit by the ray. The traversal stops once the cells can not contain a closer hit
+	bool raycastNearest(const ParticlesVec& pos, VEC3 src, VEC3 dir, float max_dist, float radius, float margin, RayHit& hit) const {
+		hit = RayHit();
+		int ring = rayRing(radius, margin);
+		// Particles in the window of a ray cell can be this far behind the entry of the cell
+		const float max_behind = (ring + 1) * 1.7321f / grid_scale + radius;
+		onEachRangeAlongRay(src, dir, max_dist + radius, ring, [&](const Range& r, float t_enter) {
+			if (t_enter - max_behind > hit.t)
+				return false;
+			return raycastRange(pos, r, src, dir, max_dist, radius, [&](u32 idx, float t, float dist_to_ray) {
+				if (t < hit.t) {
+					hit.t = t;
+					hit.idx = idx;
+				}
+				return true;
+				});
+			});
+		return hit.isValid();
+	}
+
+	// All the hits, sorted by distance
+	void raycastAll(const ParticlesVec& pos, VEC3 src, VEC3 dir, float max_dist, float radius, float margin, std::vector<RayHit>& out_hits) const {
+		out_hits.clear();
+		raycast(pos, src, dir, max_dist, radius, margin, [&](u32 idx, float t, float dist_to_ray) {
+			out_hits.push_back({ t, idx });
+			return true;
+			});
+		std::sort(out_hits.begin(), out_hits.end(), [](const RayHit& a, const RayHit& b) { return a.t < b.t; });
+	}
+
+	// Sum of the kernel weights (1 - d/radius)^2 of the particles closer than radius to the ray.
+	// Similar to the density used by the relaxation, accumulated along the ray
+	float raycastDensity(const ParticlesVec& pos, VEC3 src, VEC3 dir, float max_dist, float radius, float margin) const {
+		float density = 0.0f;
+		float inv_radius = 1.0f / radius;
+		raycast(pos, src, dir, max_dist, radius, margin, [&](u32 idx, float t, float dist_to_ray) {
+			float closeness = 1.0f - dist_to_ray * inv_radius;
+			density += closeness * closeness;
+			return true;
+			});
+		return density;
+	}
+
+	template< typename Shape >
+	void queryIndices(const Shape& shape, const ParticlesVec& pos, float margin, std::vector<int>& out_ids) const {
+		query(shape, pos, margin, [&](u32 idx) {
+			out_ids.push_back((int)idx);
+			});
+	}
+
 	template< typename Fn >
 	void onEachParticleInCell( const CellRange& range, Fn fn ) {
 		//PROFILE_SCOPED_NAMED("Cell");
@@ -173,9 +602,11 @@ struct CPUSpatialSubdivision {
 
 	u32 num_collisions = 0;
 
-private:
-	u32 current_tag = 0;
+	// Bounds of the cells used in this frame, in grid coords
+	Int3 cells_min = Int3(0, 0, 0);
+	Int3 cells_max = Int3(-1, -1, -1);
 
+	// The steps of setPoints, public to measure them separately in tools/bench.cpp
 	void assignCells(AssignedCell* __restrict assigned_cells, u32 num_vtxs) {
 		PROFILE_SCOPED_NAMED("assignCells");
 
@@ -220,10 +651,16 @@ private:
 	void findRanges() {
 		PROFILE_SCOPED_NAMED("findRanges");
 		u32 acc = 0;
+		cells_min = Int3(INT_MAX, INT_MAX, INT_MAX);
+		cells_max = Int3(INT_MIN, INT_MIN, INT_MIN);
 		for( CellRange& range : cells_ranges ) {
 			CellInfo& cell_info = cells_info[ range.cell_id ];
 			assert( cell_info.tag == current_tag );
 			assert( cell_info.num_particles > 0 );
+			// Keep the bounds of the used cells
+			const Int3& c = cell_info.coords;
+			cells_min = Int3(std::min(cells_min.x, c.x), std::min(cells_min.y, c.y), std::min(cells_min.z, c.z));
+			cells_max = Int3(std::max(cells_max.x, c.x), std::max(cells_max.y, c.y), std::max(cells_max.z, c.z));
 			// Save the acc into the cell_info
 			cell_info.first = acc;
 			range.range.first = acc;
@@ -232,6 +669,9 @@ private:
 		}
 	}
 
+private:
+	u32 current_tag = 0;
+
 	void reserve(u32 in_num_points) {
 		num_points = in_num_points;
 		cells_per_vertex.resize(num_points);
@@ -257,6 +697,7 @@ private:
 		return x | (y << 1) | (z << 2);
 	}
 
+public:
   void sortCells() {
     PROFILE_SCOPED_NAMED("sortCells");
     std::sort(cells_ranges.begin(), cells_ranges.end(), [&](const CellRange& a, const CellRange& b) {
@@ -1,7 +1,13 @@
 #include "platform.h"
 #include <cctype>     // isalpha / isdigit
+#include <vector>
 #include "json.h"
 
+#if defined(__AVX2__) || (defined(_MSC_VER) && defined(_M_X64))
+#include <immintrin.h>
+#define JSON_SIMD_SCAN 1
+#endif
+
 #define dbg_printf if( 0 ) printf
 
 enum class JObjType {
@@ -11,6 +17,12 @@ enum class JObjType {
 	, OBJ_INVALID
 };
 
+// State of the structural scan carried between the blocks of the in situ parse
+struct TJsonScanState {
+	uint64_t in_string = 0;     // All ones when the last block ended inside a string
+	bool     escaped = false;   // The last block ended with a backslash inside a string
+};
+
 class JsonParser {
 
 public:
@@ -21,6 +33,7 @@ public:
 	const char* getErrorText() const { return error_text; }
 
 	json parse(const char* buf, size_t nbytes);
+	json parseInSitu(char* buf, size_t nbytes);
 
 private:
 
@@ -43,6 +56,7 @@ private:
 	};
 
 	TOpCode  scanOpCode();
+	TOpCode  scanIndexedOpCode();
 	bool     checkKeyword(const char* word, size_t word_length);
 	JObjType parseObj(JObj* obj);
 	JObjType parseMap(JObj* obj);
@@ -57,6 +71,30 @@ private:
 	// Used while parsing
 	const char* last_str;
 
+	// The children of the maps and arrays being parsed, shared by all the levels
+	std::vector<const char*> pending_keys;
+	std::vector<JObj*>       pending_objs;
+
+	// -----------------------------------------
+	// In situ parse. The offsets of the structural chars and of the quotes of the strings, found
+	// one window of the input at a time, so the index stays in cache, and consumed in order by
+	// scanIndexedOpCode
+	static const size_t   index_window_size = 64 * 1024;
+	char*                 in_situ = nullptr;
+	std::vector<uint32_t> structurals;
+	size_t                num_structurals = 0;
+	size_t                next_structural = 0;
+	size_t                indexed_bytes = 0;
+	TJsonScanState        scan_state;
+	char                  number_end_structural = 0;    // Overwritten by the terminator of the number before it
+	bool indexNextWindow();
+	bool nextStructural(const char** pos) {
+		if (next_structural == num_structurals && !indexNextWindow())
+			return false;
+		*pos = start + structurals[next_structural];
+		return true;
+	}
+
 	// -----------------------------------------
 	// Error 
 	char error_text[256];
@@ -70,7 +108,7 @@ private:
 	u8* out_top = nullptr;
 	size_t num_chunks_required = 0;
 	size_t chunck_size = 0;
-	static const int max_children_per_node = 256;
+	std::vector<u8*> large_blocks;
 	size_t getUsedBytes() const { return (out_top - out_base); }
 	void* allocData(size_t nbytes);
 	JObj* allocObj();
@@ -137,8 +175,8 @@ struct JObj {
   friend class json;
 };
 
-JsonParser* allocJsonParser() {
-    return new JsonParser;
+JsonParser* allocJsonParser(size_t chunk_size) {
+    return new JsonParser(chunk_size);
 }
 
 void freeJsonParser(JsonParser* p) {
@@ -149,6 +187,10 @@ json parseJson(JsonParser* p, const char* buf, size_t nbytes) {
     return p->parse(buf, nbytes );
 }
 
+json parseJsonInSitu(JsonParser* p, char* buf, size_t nbytes) {
+    return p->parseInSitu(buf, nbytes);
+}
+
 const char* getParseErrorText(JsonParser* p) {
   assert( p );
   return p->getErrorText();
@@ -213,6 +255,8 @@ void JsonParser::setErrorText(const char *new_error) {
 }
 
 JsonParser::TOpCode JsonParser::scanOpCode() {
+  if (in_situ)
+    return scanIndexedOpCode();
   while (top != end) {
     char c = *top++;
 
@@ -273,6 +317,210 @@ JsonParser::TOpCode JsonParser::scanOpCode() {
   return END_OF_STREAM;
 }
 
+// ------------------------------------------------------------------
+static inline int lowestBit(uint64_t mask) {
+#if defined(_MSC_VER)
+  unsigned long idx;
+  _BitScanForward64(&idx, mask);
+  return (int)idx;
+#else
+  return __builtin_ctzll(mask);
+#endif
+}
+
+static inline bool isStructuralChar(char c) {
+  return c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',';
+}
+
+#if JSON_SIMD_SCAN
+static inline uint64_t charMask(__m256i lo, __m256i hi, char c) {
+  __m256i vc = _mm256_set1_epi8(c);
+  uint64_t mlo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vc));
+  uint64_t mhi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vc));
+  return mlo | (mhi << 32);
+}
+
+// Bit i is the xor of the bits 0..i, so the chars from an opening quote up to the closing one are set
+static inline uint64_t prefixXor(uint64_t m) {
+  m ^= m << 1;
+  m ^= m << 2;
+  m ^= m << 4;
+  m ^= m << 8;
+  m ^= m << 16;
+  m ^= m << 32;
+  return m;
+}
+#endif
+
+// Saves in out the offsets of the chars {}[]:, outside of the strings, and of both quotes of each
+// string, of the bytes [begin..end), with begin a multiple of 64. out must have room for one
+// offset per byte, and the number of offsets is returned.
+// The input is scanned in blocks of 64 bytes, with the masks of each char class from two AVX2
+// compares, and the prefix xor of the quotes removes the chars inside the strings. The blocks
+// with a backslash, rare in our files, resolve the escapes one char at a time.
+static size_t indexStructurals(const char* buf, size_t begin, size_t end, TJsonScanState& state, uint32_t* out) {
+  size_t n_out = 0;
+  for (size_t base = begin; base < end; base += 64) {
+    const char* p = buf + base;
+
+    // The last block is padded with spaces
+    char tail[64];
+    size_t n = end - base;
+    if (n < 64) {
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, p, n);
+      p = tail;
+    }
+
+    uint64_t structural = 0;
+#if JSON_SIMD_SCAN
+    __m256i lo = _mm256_loadu_si256((const __m256i*)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+    if (!state.escaped && charMask(lo, hi, '\\') == 0) {
+      uint64_t quotes = charMask(lo, hi, '"');
+      uint64_t inside = prefixXor(quotes) ^ state.in_string;
+      uint64_t ops = charMask(lo, hi, '{') | charMask(lo, hi, '}')
+                   | charMask(lo, hi, '[') | charMask(lo, hi, ']')
+                   | charMask(lo, hi, ':') | charMask(lo, hi, ',');
+      structural = (ops & ~inside) | quotes;
+      state.in_string = (uint64_t)((int64_t)inside >> 63);
+    }
+    else
+#endif
+    {
+      for (int i = 0; i < 64; ++i) {
+        char c = p[i];
+        if (state.in_string) {
+          if (state.escaped)
+            state.escaped = false;
+          else if (c == '\\')
+            state.escaped = true;
+          else if (c == '"') {
+            state.in_string = 0;
+            structural |= 1ULL << i;
+          }
+        }
+        else if (c == '"') {
+          state.in_string = ~0ULL;
+          structural |= 1ULL << i;
+        }
+        else if (isStructuralChar(c))
+          structural |= 1ULL << i;
+      }
+    }
+
+    while (structural) {
+      out[n_out++] = (uint32_t)(base + lowestBit(structural));
+      structural &= structural - 1;
+    }
+  }
+  return n_out;
+}
+
+static inline bool isBlank(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// Indexes the next windows of the input, until one has some structural char
+bool JsonParser::indexNextWindow() {
+  size_t nbytes = end - start;
+  next_structural = 0;
+  num_structurals = 0;
+  while (num_structurals == 0) {
+    if (indexed_bytes == nbytes)
+      return false;
+    size_t window_end = std::min(indexed_bytes + index_window_size, nbytes);
+    num_structurals = indexStructurals(start, indexed_bytes, window_end, scan_state, structurals.data());
+    indexed_bytes = window_end;
+  }
+  return true;
+}
+
+// Same opcodes as scanOpCode, from the offsets of indexStructurals. The strings are terminated
+// in place, replacing the closing quote, and so are the numbers, replacing the char after them.
+// The literals between two structural chars, or between the last one and the end of the buffer,
+// are the only text scanned here.
+JsonParser::TOpCode JsonParser::scanIndexedOpCode() {
+  const char* next = nullptr;
+  bool has_structural = nextStructural(&next);
+  if (!has_structural)
+    next = end;
+
+  // A number, true, false or null before the next structural char
+  while (top < next && isBlank(*top))
+    ++top;
+  if (top < next) {
+    const char* text = top;
+    const char* text_end = next;
+    while (isBlank(text_end[-1]))
+      --text_end;
+    size_t len = text_end - text;
+    top = next;
+    last_str = text;
+    char c = *text;
+    if (len == 4 && strncmp(text, "null", 4) == 0)
+      return NULL_VALUE;
+    if (len == 4 && strncmp(text, "true", 4) == 0)
+      return BOOL_TRUE_VALUE;
+    if (len == 5 && strncmp(text, "false", 5) == 0)
+      return BOOL_FALSE_VALUE;
+    size_t n = 0;
+    if (isdigit((unsigned char)c) || c == '-' || c == '+') {
+      // Same chars accepted by scanOpCode
+      n = 1;
+      while (n < len && (isdigit((unsigned char)text[n]) || text[n] == '.'))
+        ++n;
+      if (n == len) {
+        if (text_end == end)
+          last_str = allocStr(text, len);
+        else {
+          if (text_end == next)
+            number_end_structural = *next;
+          in_situ[text_end - start] = 0x00;
+        }
+        return NUMERIC_VALUE;
+      }
+    }
+    top = text + n + 1;
+    return INVALID_OPCODE;
+  }
+
+  if (!has_structural) {
+    top = end;
+    return END_OF_STREAM;
+  }
+
+  ++next_structural;
+  top = next + 1;
+  char c = *next ? *next : number_end_structural;
+  switch (c) {
+  case '{': return MAP_OPEN;
+  case ':': return MAP_KEY_SEPARATOR;
+  case '}': return MAP_CLOSE;
+  case '[': return ARRAY_OPEN;
+  case ',': return COMMA_SEPARATOR;
+  case ']': return ARRAY_CLOSE;
+  case '"': {
+    const char* closing = nullptr;
+    if (!nextStructural(&closing)) {
+      setErrorText("Unexpected end of stream parsing string.");
+      top = end;
+      return END_OF_STREAM;
+    }
+    ++next_structural;
+    char* text = in_situ + (top - start);
+    size_t len = closing - top;
+    if (memchr(text, '\\', len))
+      len = unscapeUnicodes((unsigned char*)text, len);
+    text[len] = 0x00;
+    last_str = text;
+    top = closing + 1;
+    return STRING_VALUE;
+  }
+  }
+  return INVALID_OPCODE;
+}
+
 // ------------------------------------------------------------------
 // { key1:obj, key2:obj, .. }
 JObjType JsonParser::parseMap(JObj *obj) {
@@ -282,10 +530,10 @@ JObjType JsonParser::parseMap(JObj *obj) {
   obj->object.values = NULL;
   obj->object.keys = NULL;
 
-  // Reserve some space
+  // The children are kept in the pending stacks until the map is closed
   size_t      nobjs = 0;
-  const char *keys[max_children_per_node];
-  JObj *      objs[max_children_per_node];
+  size_t      first = pending_objs.size();
+  size_t      first_key = pending_keys.size();
 
   dbg_printf("map {\n");
 
@@ -309,7 +557,7 @@ JObjType JsonParser::parseMap(JObj *obj) {
       return JObjType::OBJ_INVALID;
     }
 
-    keys[nobjs] = last_str;
+    const char* key = last_str;
     dbg_printf("Key   : (%d) %s\n", op, last_str);
 
     // Now the separator : between the key and the value
@@ -328,8 +576,9 @@ JObjType JsonParser::parseMap(JObj *obj) {
       return JObjType::OBJ_INVALID;
 
     // If all is OK, save pointer and incr # objs
-    assert(nobjs < max_children_per_node);
-    objs[nobjs++] = child;
+    pending_keys.push_back(key);
+    pending_objs.push_back(child);
+    ++nobjs;
 
     // Check if another key will come or we have reach the end of the map
     op = scanOpCode();
@@ -343,8 +592,10 @@ JObjType JsonParser::parseMap(JObj *obj) {
       obj->object.len = nobjs;
       obj->object.values = (JObj **)allocData(bytes_for_pointers);
       obj->object.keys = (const char **)allocData(bytes_for_pointers);
-      memcpy(obj->object.values, objs, bytes_for_pointers);
-      memcpy(obj->object.keys, keys, bytes_for_pointers);
+      memcpy(obj->object.values, pending_objs.data() + first, bytes_for_pointers);
+      memcpy(obj->object.keys, pending_keys.data() + first_key, bytes_for_pointers);
+      pending_objs.resize(first);
+      pending_keys.resize(first_key);
       return JObjType::MAP;
     }
 
@@ -366,16 +617,17 @@ JObjType JsonParser::parseArray(JObj *obj) {
   obj->array.values = NULL;
 
   size_t nobjs = 0;
-  JObj *objs[max_children_per_node];
-
-  // Check if the array is empty, else, restore the scan point
-  const char *prev_top = top;
-  TOpCode nop = scanOpCode();
-  if (nop == ARRAY_CLOSE) {
+  size_t first = pending_objs.size();
+
+  // Check if the array is empty
+  const char *next = top;
+  while (next != end && isBlank(*next))
+    ++next;
+  if (next != end && *next == ']') {
+    scanOpCode();
     dbg_printf("empty array []\n");
     return JObjType::ARRAY;
   }
-  top = prev_top;
 
   dbg_printf("array [\n");
   TOpCode op = INVALID_OPCODE;
@@ -388,8 +640,8 @@ JObjType JsonParser::parseArray(JObj *obj) {
     if (otype == JObjType::OBJ_INVALID)
       return JObjType::OBJ_INVALID;
 
-    assert(nobjs < max_children_per_node);
-    objs[nobjs++] = child;
+    pending_objs.push_back(child);
+    ++nobjs;
 
     // Check if another array member will come or we have reach the end of the array
     op = scanOpCode();
@@ -400,7 +652,8 @@ JObjType JsonParser::parseArray(JObj *obj) {
       size_t bytes_for_pointers = nobjs * sizeof(JObj *);
       obj->array.len = nobjs;
       obj->array.values = (JObj **)allocData(bytes_for_pointers );
-      memcpy(obj->array.values, objs, bytes_for_pointers);
+      memcpy(obj->array.values, pending_objs.data() + first, bytes_for_pointers);
+      pending_objs.resize(first);
 
       return JObjType::ARRAY;
     }
@@ -468,6 +721,8 @@ json JsonParser::parse(const char *buf, size_t nbytes) {
   end = buf + nbytes;
   top = buf;
   last_str = NULL;
+  pending_keys.clear();
+  pending_objs.clear();
 
   // Reset error msgs
   error_text[0] = 0x00;
@@ -482,6 +737,24 @@ json JsonParser::parse(const char *buf, size_t nbytes) {
   return j;
 }
 
+// The strings are terminated in place, so the buffer must be writable and alive while the json
+// is used
+json JsonParser::parseInSitu(char* buf, size_t nbytes) {
+  if (nbytes >= UINT32_MAX) {
+    snprintf(error_text, sizeof(error_text) - 1, "In situ parse is limited to 4GB, found %lld bytes", (long long)nbytes);
+    return json();
+  }
+  in_situ = buf;
+  structurals.resize(index_window_size);
+  num_structurals = 0;
+  next_structural = 0;
+  indexed_bytes = 0;
+  scan_state = TJsonScanState();
+  json j = parse(buf, nbytes);
+  in_situ = nullptr;
+  return j;
+}
+
 // ------------------------------------------------------------------------------
 JsonParser::JsonParser( size_t in_chunck_size) {
   chunck_size = in_chunck_size;
@@ -496,6 +769,8 @@ JsonParser::~JsonParser() {
     delete[] chunk;
     chunk = next_chunk;
   }
+  for (u8* block : large_blocks)
+    delete[] block;
 }
 
 // ------------------------------------------------------------------------------
@@ -513,7 +788,13 @@ JObj *JsonParser::allocObj( ) {
 
 void *JsonParser::allocData(size_t nbytes) {
   nbytes = (nbytes + 3) & (~3);   // Keep data aligned to 4 bytes
-  assert( nbytes <= chunck_size );
+
+  // The children of the large maps and arrays don't fit in a chunk
+  if (nbytes > chunck_size - sizeof(void*)) {
+    u8* block = new u8[nbytes];
+    large_blocks.push_back(block);
+    return block;
+  }
 
   if( getUsedBytes() + nbytes > chunck_size )
     allocChunk();
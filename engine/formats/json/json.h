@@ -126,11 +126,18 @@ void load(json j, std::vector <T>& v) {
 }
 
 class JsonParser;
-JsonParser* allocJsonParser();
+JsonParser* allocJsonParser(size_t chunk_size = 1024);
 void freeJsonParser(JsonParser* p);
 json parseJson(JsonParser* p, const char* buf, size_t nbytes);
+// Fast mode for the large files, like the ones of JsonMappedFile. The strings are not copied,
+// they are terminated in place, and the numbers are converted when they are read, so buf must
+// be writable and alive while the json is used
+json parseJsonInSitu(JsonParser* p, char* buf, size_t nbytes);
 const char* getParseErrorText(JsonParser* p);
 
+// Converts the \uXXXX sequences to utf8 in place. Returns the new size
+size_t unscapeUnicodes(unsigned char* data, size_t data_size);
+
 /*
 // Accepts:
 // std::unordered_map< std::string, VEC3 > anchors;
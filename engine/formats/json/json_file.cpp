@@ -65,7 +65,7 @@ template <> void load(json j, QUAT& v) {
   assert(n == 4);
 }
 
-void unscapeUnicodes(unsigned char* data, size_t data_size) {
+size_t unscapeUnicodes(unsigned char* data, size_t data_size) {
 
   size_t spos = 0;
   unsigned char* dst = data;
@@ -112,6 +112,7 @@ void unscapeUnicodes(unsigned char* data, size_t data_size) {
       ++spos;
     }
   }
+  return dst - data;
 }
 
 JsonFile::~JsonFile() { freeJsonParser(parser); }
@@ -142,3 +143,25 @@ JsonFile::JsonFile(TBuffer& external_buf) {
   if (!j) 
     fatal("Invalid json read from buffer of %ld bytes: %s\n", external_buf.size(), getParseErrorText(parser));
 }
+
+JsonMappedFile::~JsonMappedFile() {
+  if (parser)
+    freeJsonParser(parser);
+}
+
+bool JsonMappedFile::open(const char* filename) {
+  j = json();
+  if (!file.open(filename, true)) {
+    dbg("Failed to map json file %s\n", filename);
+    return false;
+  }
+  // Larger chunks, as the large files have millions of nodes
+  if (!parser)
+    parser = allocJsonParser(1 << 20);
+  j = parseJsonInSitu(parser, (char*)file.data, file.size);
+  if (!j) {
+    dbg("Invalid json read from file %s: %s\n", filename, getParseErrorText(parser));
+    return false;
+  }
+  return true;
+}
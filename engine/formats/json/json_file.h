@@ -2,6 +2,7 @@
 
 #include "json.h"
 #include "memory/buffer.h"
+#include "memory/mapped_file.h"
 
 struct JsonFile {
 
@@ -16,3 +17,19 @@ struct JsonFile {
   operator json() const { return j; }
 };
 
+
+// For the large files. The file is mapped copy on write and parsed with parseJsonInSitu, so
+// the pages are read by the OS on demand and only the ones with strings are copied.
+// Returns false when the file is missing or invalid, and the json is valid while the
+// JsonMappedFile is alive
+struct JsonMappedFile {
+
+  TMappedFile file;
+  JsonParser* parser = nullptr;
+  json        j;
+
+  bool open(const char* filename);
+  ~JsonMappedFile();
+
+  operator json() const { return j; }
+};
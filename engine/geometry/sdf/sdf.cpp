@@ -1,6 +1,7 @@
 #include "platform.h"
 #include "sdf.h"
 #include "render/render.h"
+#include "memory/buffer.h"
 
 namespace SDF {
 
@@ -153,6 +154,55 @@ namespace SDF {
     return n;
   }
 
+  // --------------------------------------------------------------------------
+  struct TPrimitiveData {
+    uint32_t prim_type = 0;
+    uint32_t enabled = 0;
+    float    color[4];
+    float    position[3];
+    float    rotation[4];
+    float    scale[3];
+    float    softness = 0.0f;
+    float    multiplier = 1.0f;
+  };
+
+  void sdFunc::save(TBuffer& buf) const {
+    for (auto& p : prims) {
+      TPrimitiveData d;
+      d.prim_type = (uint32_t)p.prim_type;
+      d.enabled = p.enabled ? 1 : 0;
+      d.color[0] = p.color.x; d.color[1] = p.color.y; d.color[2] = p.color.z; d.color[3] = p.color.w;
+      d.position[0] = p.transform.position.x; d.position[1] = p.transform.position.y; d.position[2] = p.transform.position.z;
+      d.rotation[0] = p.transform.rotation.x; d.rotation[1] = p.transform.rotation.y; d.rotation[2] = p.transform.rotation.z; d.rotation[3] = p.transform.rotation.w;
+      d.scale[0] = p.transform.scale.x; d.scale[1] = p.transform.scale.y; d.scale[2] = p.transform.scale.z;
+      d.softness = p.softness;
+      d.multiplier = p.multiplier;
+      buf.write(d);
+    }
+  }
+
+  bool sdFunc::load(const void* data, size_t nbytes) {
+    if (nbytes % sizeof(TPrimitiveData))
+      return false;
+    const TPrimitiveData* d = (const TPrimitiveData*)data;
+    size_t num_prims = nbytes / sizeof(TPrimitiveData);
+    prims.clear();
+    for (size_t i = 0; i < num_prims; ++i, ++d) {
+      Primitive p;
+      p.prim_type = (Primitive::eType)d->prim_type;
+      p.enabled = d->enabled != 0;
+      p.color = VEC4(d->color[0], d->color[1], d->color[2], d->color[3]);
+      p.transform.position = VEC3(d->position[0], d->position[1], d->position[2]);
+      p.transform.rotation = QUAT(d->rotation[0], d->rotation[1], d->rotation[2], d->rotation[3]);
+      p.transform.scale = VEC3(d->scale[0], d->scale[1], d->scale[2]);
+      p.softness = d->softness;
+      p.multiplier = d->multiplier;
+      p.transformHasChanged();
+      prims.push_back(p);
+    }
+    return true;
+  }
+
   void sdFunc::generateCompactStructs() {
     planes.clear();
     onEachPrimitive(SDF::Primitive::eType::PLANE, [&](const SDF::Primitive& p) {
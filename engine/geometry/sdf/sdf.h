@@ -1,5 +1,7 @@
 #pragma once
 
+struct TBuffer;
+
 namespace SDF {
 
   float sdSphere(VEC3 p, float s);
@@ -89,6 +91,10 @@ namespace SDF {
     void generateCompactStructs();
     float evalCompact(VEC3 p) const;
     VEC3  evalGradCompact(VEC3 p) const;
+
+    // Binary copy of the primitives, used by the snapshots and the replays
+    void save(TBuffer& buf) const;
+    bool load(const void* data, size_t nbytes);
     
     bool renderInMenu();
   };
@@ -0,0 +1,78 @@
+#include "platform.h"
+#include "mapped_file.h"
+
+#if IN_PLATFORM_WINDOWS
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+bool TMappedFile::open(const char* filename, bool copy_on_write) {
+  close();
+
+#if IN_PLATFORM_WINDOWS
+  HANDLE hfile = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (hfile == INVALID_HANDLE_VALUE)
+    return false;
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(hfile, &file_size) || file_size.QuadPart == 0) {
+    CloseHandle(hfile);
+    return false;
+  }
+  HANDLE hmapping = CreateFileMappingA(hfile, nullptr, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+  if (!hmapping) {
+    CloseHandle(hfile);
+    return false;
+  }
+  void* addr = MapViewOfFile(hmapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+  if (!addr) {
+    CloseHandle(hmapping);
+    CloseHandle(hfile);
+    return false;
+  }
+  file_handle = hfile;
+  mapping_handle = hmapping;
+  data = (const uint8_t*)addr;
+  size = (size_t)file_size.QuadPart;
+
+#else
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+  void* addr = mmap(nullptr, (size_t)st.st_size, copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file alive
+  ::close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+  // The whole file is going to be read
+  madvise(addr, (size_t)st.st_size, MADV_WILLNEED);
+  data = (const uint8_t*)addr;
+  size = (size_t)st.st_size;
+#endif
+
+  return true;
+}
+
+void TMappedFile::close() {
+  if (!data)
+    return;
+#if IN_PLATFORM_WINDOWS
+  UnmapViewOfFile(data);
+  CloseHandle((HANDLE)mapping_handle);
+  CloseHandle((HANDLE)file_handle);
+  mapping_handle = nullptr;
+  file_handle = nullptr;
+#else
+  munmap((void*)data, size);
+#endif
+  data = nullptr;
+  size = 0;
+}
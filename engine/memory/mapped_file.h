@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include "memory_data_provider.h"
+
+// Read only view of a whole file mapped in memory. The pages are loaded by the OS when
+// they are first accessed, so opening a large file costs the same as opening a small one
+struct TMappedFile {
+
+  const uint8_t* data = nullptr;
+  size_t         size = 0;
+
+  TMappedFile() = default;
+  TMappedFile(const TMappedFile&) = delete;
+  TMappedFile& operator=(const TMappedFile&) = delete;
+  ~TMappedFile() {
+    close();
+  }
+
+  // With copy_on_write the pages can be modified, and the changes stay in memory without
+  // reaching the file, as the in situ json parse does
+  bool open(const char* filename, bool copy_on_write = false);
+  void close();
+  bool isValid() const { return data != nullptr; }
+
+  CMemoryDataProvider getNewMemoryDataProvider() const {
+    return CMemoryDataProvider(data, (uint32_t)size);
+  }
+
+private:
+#if IN_PLATFORM_WINDOWS
+  void* file_handle = nullptr;
+  void* mapping_handle = nullptr;
+#endif
+};
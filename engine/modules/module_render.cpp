@@ -44,6 +44,16 @@ void ModuleRender::load() {
 void ModuleRender::renderInMenu() {
   if (ImGui::SmallButton("Profile Capture"))
     PROFILE_START_CAPTURING(5);
+#if defined(ENABLE_PROFILING)
+  ImGui::SameLine();
+  if (!Profiling::isCapturing()) {
+    if (ImGui::SmallButton("Stream Capture"))
+      Profiling::startStreaming("capture_stream.bin");
+  }
+  else if (ImGui::SmallButton("Stop Capture")) {
+    Profiling::stop();
+  }
+#endif
 }
 
 void ModuleRender::unload() {
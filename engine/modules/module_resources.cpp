@@ -38,7 +38,8 @@ struct ModuleResources : public Module {
 
   void load() override {
    
-    // Pipelines are created from this file
+    // Pipelines are created from this file. The entries are created in parallel by the workers of
+    // the resources manager, and the ones using others, like the pso and its buffers, wait for them
     JsonFile jfile("data/resources.json");
     json jpso = jfile;
     onEachArr(jpso, [](json j, size_t idx) {
@@ -48,31 +49,28 @@ struct ModuleResources : public Module {
       std::string in_name(j.value("name", ""));
 
       std::string res_name = in_name + "." + jtype;
-      IResource* res = nullptr;
-
-      if (jtype == "pso") {
-        Render::PipelineState* pso = new Render::PipelineState;
-        pso->create(j);
-        res = pso;
-      }
-      else if (jtype == "buffer") {
-        Render::Buffer* buffer = new Render::Buffer;
-        buffer->create(j);
-        res = buffer;
-      }
-      else if (jtype == "mesh") {
-        res = createMesh(res_name);
-
-      }
-      else {
+      if (jtype != "pso" && jtype != "buffer" && jtype != "mesh") {
         fatal("Invalid resource type %s\n", jtype.c_str());
         return;
       }
 
-      res->setName(res_name.c_str());
-      addResource(res);
+      addResourceAsync(res_name.c_str(), [j, jtype, res_name]() -> IResource* {
+        if (jtype == "pso") {
+          Render::PipelineState* pso = new Render::PipelineState;
+          pso->create(j);
+          return pso;
+        }
+        else if (jtype == "buffer") {
+          Render::Buffer* buffer = new Render::Buffer;
+          buffer->create(j);
+          return buffer;
+        }
+        return createMesh(res_name);
+        });
       });
 
+    // The json of the entries is used until all of them have been created
+    waitForResources();
   }
 
   void unload() override {
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Log-linear histogram of durations in ns, in the spirit of the HDR histograms.
+// Each power of two is split in 32 sub buckets, so the reported values are within ~3%
+// of the recorded ones, from 1ns to 2^(max_exponent+1) ns, ~36 minutes, in 4.7Kb.
+// record can be called from any thread, the buckets are updated with relaxed atomics
+struct THistogram {
+
+  static constexpr uint32_t sub_bits = 5;
+  static constexpr uint32_t sub_count = 1 << sub_bits;
+  static constexpr uint32_t max_exponent = 40;
+  static constexpr uint32_t num_buckets = (max_exponent - sub_bits + 2) * sub_count;
+
+  std::atomic<uint32_t> counts[num_buckets];
+  std::atomic<uint64_t> total_count;
+  std::atomic<uint64_t> total_ns;
+  std::atomic<uint64_t> max_ns;
+
+  struct TSummary {
+    uint64_t count = 0;
+    double   mean_ns = 0.0;
+    uint64_t p50_ns = 0;
+    uint64_t p95_ns = 0;
+    uint64_t p99_ns = 0;
+    uint64_t max_ns = 0;
+  };
+
+  THistogram() {
+    reset();
+  }
+
+  static uint32_t floorLog2(uint64_t v) {
+    uint32_t r = 0;
+    for (uint32_t shift = 32; shift > 0; shift >>= 1) {
+      if (v >= (1ULL << shift)) {
+        v >>= shift;
+        r += shift;
+      }
+    }
+    return r;
+  }
+
+  static uint32_t bucketOf(uint64_t v) {
+    if (v < sub_count)
+      return (uint32_t)v;
+    uint32_t e = floorLog2(v);
+    if (e > max_exponent)
+      return num_buckets - 1;
+    uint32_t sub = (uint32_t)(v >> (e - sub_bits)) - sub_count;
+    return (e - sub_bits + 1) * sub_count + sub;
+  }
+
+  // Middle value of the bucket
+  static uint64_t bucketValue(uint32_t idx) {
+    if (idx < 2 * sub_count)
+      return idx;
+    uint32_t e = idx / sub_count - 1 + sub_bits;
+    uint32_t sub = idx % sub_count;
+    uint64_t width = 1ULL << (e - sub_bits);
+    return (uint64_t)(sub_count + sub) * width + width / 2;
+  }
+
+  void record(uint64_t ns) {
+    counts[bucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+    total_count.fetch_add(1, std::memory_order_relaxed);
+    total_ns.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t prev_max = max_ns.load(std::memory_order_relaxed);
+    while (ns > prev_max && !max_ns.compare_exchange_weak(prev_max, ns, std::memory_order_relaxed)) {}
+  }
+
+  void recordSeconds(double seconds) {
+    record((uint64_t)(seconds * 1e9));
+  }
+
+  // p in [0..1]
+  uint64_t percentile(double p) const {
+    uint64_t n = total_count.load(std::memory_order_relaxed);
+    if (!n)
+      return 0;
+    uint64_t target = (uint64_t)(p * n + 0.5);
+    if (target < 1)
+      target = 1;
+    uint64_t acc = 0;
+    for (uint32_t i = 0; i < num_buckets; ++i) {
+      acc += counts[i].load(std::memory_order_relaxed);
+      if (acc >= target) {
+        uint64_t v = bucketValue(i);
+        uint64_t vmax = max_ns.load(std::memory_order_relaxed);
+        return v < vmax ? v : vmax;
+      }
+    }
+    return max_ns.load(std::memory_order_relaxed);
+  }
+
+  TSummary summary() const {
+    TSummary s;
+    s.count = total_count.load(std::memory_order_relaxed);
+    if (!s.count)
+      return s;
+    s.mean_ns = (double)total_ns.load(std::memory_order_relaxed) / (double)s.count;
+    s.p50_ns = percentile(0.50);
+    s.p95_ns = percentile(0.95);
+    s.p99_ns = percentile(0.99);
+    s.max_ns = max_ns.load(std::memory_order_relaxed);
+    return s;
+  }
+
+  // Not atomic with the concurrent records, a few samples can be lost
+  void reset() {
+    for (auto& c : counts)
+      c.store(0, std::memory_order_relaxed);
+    total_count.store(0, std::memory_order_relaxed);
+    total_ns.store(0, std::memory_order_relaxed);
+    max_ns.store(0, std::memory_order_relaxed);
+  }
+
+};
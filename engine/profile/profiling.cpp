@@ -1,12 +1,32 @@
 #include "platform.h"
 #include <atomic>
 #include <mutex>
+#include <thread>
 #include "profiling.h"
-#include "time/timer.h"
 #include <unordered_map>
 
 #if IN_PLATFORM_WINDOWS
 #include <windows.h>
+#include <intrin.h>
+#else
+#include <time.h>
+#include <pthread.h>
+#endif
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#define PROFILING_HAS_PERF_COUNTERS 1
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define PROFILING_HAS_TSC 1
+#if !IN_PLATFORM_WINDOWS
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
 #endif
 
 namespace Profiling {
@@ -19,13 +39,39 @@ namespace Profiling {
 		bool isBegin() const { return (time_stamp & 1) == 0; }
 	};
 
+	static std::atomic< bool > counters_enabled = false;
+
+	// Hardware counters of a single thread, read as a group so all the values
+	// correspond to the same interval. Only available on linux via perf_event_open
+	struct TCounterGroup {
+		int      fds[NumCounters] = { -1, -1, -1, -1 };
+		int      slots[NumCounters] = { -1, -1, -1, -1 };    // Position of each counter in the group read
+		uint32_t num_open = 0;
+		bool isOpen() const { return fds[Cycles] >= 0; }
+		bool open(uint32_t tid);
+		void close();
+		void read(uint64_t* out_values) const;
+	};
+
+	// The entries of each thread are stored in a ring buffer with a single producer, the
+	// owner thread, and a single consumer, the writer thread which streams them to disk.
+	// When the ring is full the new scopes are dropped and counted, but we always keep room
+	// for the exit of the open scopes, so the begin/end pairs are never broken.
 	struct TContainer {
-		TEntry* entries;
-		uint32_t  used;
+		TEntry*   entries;
+		std::atomic<uint32_t> head;             // Written by the owner thread
+		std::atomic<uint32_t> tail;             // Written by the writer
+		std::atomic<uint32_t> dropped;
+		uint32_t  open_scopes;
+		uint64_t* entry_counters;              // NumCounters per entry when the counters are enabled
+		TCounterGroup counters;
 		uint32_t  max_entries;
 		uint32_t  thread_id;
 		char      thread_name[32];
 		uint32_t  index;
+		// Writer side
+		uint32_t  written_dropped;
+		char      written_thread_name[32];
 		std::unordered_map<uint32_t, uint32_t> label_ids;
 		std::vector<char*> labels;
 		TContainer();
@@ -33,30 +79,294 @@ namespace Profiling {
 		uint32_t enter(const char* txt);
 		void exit(uint32_t n);
 		uint32_t enterHash(const std::string& txt);
-		void reset();
 		void allocEntries();
 		void freeEntries();
+		void readEntryCounters(uint32_t slot) {
+			if (!entry_counters)
+				return;
+			uint64_t* values = entry_counters + (size_t)slot * NumCounters;
+			if (counters_enabled.load(std::memory_order_relaxed))
+				counters.read(values);
+			else
+				memset(values, 0x00, sizeof(uint64_t) * NumCounters);
+		}
 	};
 
   thread_local TContainer data_container;
 
   static std::vector<TContainer*> data_containers;
   static std::atomic< uint32_t > num_data_containers = 0;
-  static bool is_capturing = false;
+  static std::atomic< bool > is_capturing = false;
   static uint32_t nframes_to_capture = 0;
+  static bool convert_on_stop = false;
+  static TCounters exited_threads_counters;     // Totals of the threads which finished
+
+  // -----------------------------------------------------------------------
+  // Time source. When the cpu has an invariant TSC, the entries store rdtsc ticks,
+  // which are cheap and synchronized between cores, and we calibrate them against a
+  // monotonic clock not affected by ntp. Otherwise the entries store the clock in ns.
+  struct TClockSample {
+    uint64_t ticks = 0;
+    uint64_t ns = 0;
+  };
+
+  static std::atomic<bool> use_tsc = false;
+  static double   ns_per_tick = 1.0;
+  static TClockSample capture_start;
+  static TClockSample capture_end;
+
+  static uint64_t clockNs() {
+#if IN_PLATFORM_WINDOWS
+    static LARGE_INTEGER freq = []() { LARGE_INTEGER f; QueryPerformanceFrequency(&f); return f; }();
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+  }
 
-  static double elapsed_time = 0.0f;
-  static TTimer tm;
-  static uint64_t ts_start_capture = 0;
-  static uint64_t ts_end_capture = 0;
+  static inline uint64_t readTicks() {
+#if PROFILING_HAS_TSC
+    if (use_tsc.load(std::memory_order_relaxed))
+      return __rdtsc();
+#endif
+    return clockNs();
+  }
+
+  static bool hasInvariantTSC() {
+#if PROFILING_HAS_TSC
+    // CPUID.80000007H:EDX[8]
+#if IN_PLATFORM_WINDOWS
+    int regs[4];
+    __cpuid(regs, 0x80000000);
+    if ((unsigned)regs[0] < 0x80000007u)
+      return false;
+    __cpuid(regs, 0x80000007);
+    return (regs[3] & (1 << 8)) != 0;
+#else
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+      return false;
+    return (edx & (1 << 8)) != 0;
+#endif
+#else
+    return false;
+#endif
+  }
+
+  // Read the ticks and the clock at the same time. The clock read is bracketed by
+  // two tick reads, and we keep the tightest of a few tries
+  static TClockSample sampleClocks() {
+    TClockSample best;
+    uint64_t best_window = ~0ULL;
+    for (int i = 0; i < 8; ++i) {
+      uint64_t t0 = readTicks();
+      uint64_t ns = clockNs();
+      uint64_t t1 = readTicks();
+      if (t1 - t0 < best_window) {
+        best_window = t1 - t0;
+        best.ticks = t0 + (t1 - t0) / 2;
+        best.ns = ns;
+      }
+    }
+    return best;
+  }
+
+  static double nsPerTick(const TClockSample& a, const TClockSample& b) {
+    if (!use_tsc || b.ticks <= a.ticks || b.ns <= a.ns)
+      return 1.0;
+    return (double)(b.ns - a.ns) / (double)(b.ticks - a.ticks);
+  }
+
+  // Initial estimate of the tick rate, refined with the start and end of each capture.
+  // The first call busy waits 20ms, so don't hold mutex_containers while calling it
+  static void calibrate() {
+    static bool calibrated = []() {
+      if (!hasInvariantTSC())
+        return true;
+      use_tsc = true;
+      TClockSample a = sampleClocks();
+      uint64_t ns_end = a.ns + 20 * 1000000ULL;
+      while (clockNs() < ns_end) {}
+      TClockSample b = sampleClocks();
+      ns_per_tick = nsPerTick(a, b);
+      return true;
+    }();
+    (void)calibrated;
+  }
 
   std::mutex mutex_containers;
 
+  // -----------------------------------------------------------------------
+  // Binary capture format. A header followed by chunks { TChunkHeader, payload }.
+  // Names are sent once, the first time they are found, before the events using them.
+  // A clock chunk is written at the start and refined at the end of the capture, so
+  // the file of an interrupted capture can still be converted
+  static constexpr uint32_t capture_magic = 0x46525056;     // 'VPRF'
+  static constexpr uint32_t capture_version = 1;
+
+  enum eChunkType : uint32_t {
+    CHUNK_THREAD = 1,
+    CHUNK_NAME,
+    CHUNK_EVENTS,
+    CHUNK_DROPPED,
+    CHUNK_CLOCK,
+    CHUNK_COUNTERS,             // TEventsChunk followed by NumCounters u64 per event
+  };
+
+#pragma pack(push, 1)
+  struct TCaptureHeader {
+    uint32_t magic;
+    uint32_t version;
+  };
+  struct TChunkHeader {
+    uint32_t type;
+    uint32_t nbytes;
+  };
+  struct TThreadChunk {
+    uint32_t thread_idx;
+    uint32_t thread_id;
+    char     name[32];
+  };
+  struct TEventsChunk {
+    uint32_t thread_idx;
+    uint32_t count;
+  };
+  struct TCapturedEvent {
+    uint64_t time_stamp;        // Lower bit set for the exit events
+    uint32_t name_id;
+  };
+  struct TDroppedChunk {
+    uint32_t thread_idx;
+    uint32_t total_dropped;
+  };
+  struct TClockChunk {
+    uint64_t start_ticks;
+    uint64_t start_ns;
+    double   ns_per_tick;
+  };
+#pragma pack(pop)
+
+  struct TStreamWriter {
+    FILE*       f = nullptr;
+    std::thread thread;
+    std::atomic<bool> running = false;
+    std::unordered_map<const char*, uint32_t> name_ids;
+    std::vector<TCapturedEvent> events;
+    std::vector<uint64_t> counter_values;
+    TBuffer     buf;                      // Protected by mutex_containers
+    uint64_t    bytes_written = 0;
+
+    void writeChunk(uint32_t type, const void* payload, uint32_t nbytes, const void* extra = nullptr, uint32_t extra_bytes = 0) {
+      buf.write(TChunkHeader{ type, nbytes + extra_bytes });
+      buf.writeBytes(payload, nbytes);
+      if (extra_bytes)
+        buf.writeBytes(extra, extra_bytes);
+    }
+
+    uint32_t nameId(const char* name) {
+      auto it = name_ids.find(name);
+      if (it != name_ids.end())
+        return it->second;
+      uint32_t id = (uint32_t)name_ids.size() + 1;
+      name_ids[name] = id;
+      writeChunk(CHUNK_NAME, &id, sizeof(id), name, (uint32_t)strlen(name) + 1);
+      return id;
+    }
+
+    void writeClock(double new_ns_per_tick) {
+      TClockChunk clk{ capture_start.ticks, capture_start.ns, new_ns_per_tick };
+      writeChunk(CHUNK_CLOCK, &clk, sizeof(clk));
+    }
+
+    // Moves the pending entries of the container to buf. Requires mutex_containers
+    void drain(TContainer* dc) {
+      if (strcmp(dc->thread_name, dc->written_thread_name) != 0) {
+        TThreadChunk tc{ dc->index, dc->thread_id };
+        snprintf(tc.name, sizeof(tc.name), "%s", dc->thread_name);
+        strcpy(dc->written_thread_name, tc.name);
+        writeChunk(CHUNK_THREAD, &tc, sizeof(tc));
+      }
+
+      uint32_t head = dc->head.load(std::memory_order_acquire);
+      uint32_t tail = dc->tail.load(std::memory_order_relaxed);
+      if (head != tail) {
+        uint32_t count = head - tail;
+        events.resize(count);
+        for (uint32_t i = 0; i < count; ++i) {
+          const TEntry& e = dc->entries[(tail + i) & (dc->max_entries - 1)];
+          events[i].time_stamp = e.time_stamp;
+          events[i].name_id = e.isBegin() ? nameId(e.name) : 0;
+        }
+        TEventsChunk ec{ dc->index, count };
+        writeChunk(CHUNK_EVENTS, &ec, sizeof(ec), events.data(), count * (uint32_t)sizeof(TCapturedEvent));
+        // The counters of the same entries, in the same order
+        if (dc->entry_counters) {
+          counter_values.resize((size_t)count * NumCounters);
+          for (uint32_t i = 0; i < count; ++i) {
+            const uint64_t* src = dc->entry_counters + (size_t)((tail + i) & (dc->max_entries - 1)) * NumCounters;
+            memcpy(counter_values.data() + (size_t)i * NumCounters, src, sizeof(uint64_t) * NumCounters);
+          }
+          writeChunk(CHUNK_COUNTERS, &ec, sizeof(ec), counter_values.data(), count * NumCounters * (uint32_t)sizeof(uint64_t));
+        }
+        dc->tail.store(head, std::memory_order_release);
+      }
+
+      uint32_t dropped = dc->dropped.load(std::memory_order_relaxed);
+      if (dropped != dc->written_dropped) {
+        dc->written_dropped = dropped;
+        TDroppedChunk dc_chunk{ dc->index, dropped };
+        writeChunk(CHUNK_DROPPED, &dc_chunk, sizeof(dc_chunk));
+      }
+    }
+
+    void drainAll() {
+      for (uint32_t i = 0; i < num_data_containers; ++i) {
+        auto dc = data_containers[i];
+        if (dc && dc->entries)
+          drain(dc);
+      }
+    }
+
+    // The disk write happens outside of the mutex, so new threads are not blocked
+    void flush(FILE* out_file, TBuffer& pending) {
+      if (pending.empty())
+        return;
+      fwrite(pending.data(), 1, pending.size(), out_file);
+      bytes_written += pending.size();
+      pending.clear();
+    }
+
+    void run() {
+      TBuffer pending;
+      while (running.load(std::memory_order_acquire)) {
+        {
+          std::unique_lock<std::mutex> lk(mutex_containers);
+          drainAll();
+          std::swap(pending, buf);
+        }
+        flush(f, pending);
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      }
+    }
+  };
+
+  static TStreamWriter writer;
+
   TContainer::TContainer()
-    : used(0)
-    , max_entries(1 << 20)
+    : head(0)
+    , tail(0)
+    , dropped(0)
+    , open_scopes(0)
+    , entry_counters(nullptr)
+    , max_entries(1 << 16)
+    , written_dropped(0)
   {
     entries = nullptr;
+    written_thread_name[0] = 0;
     std::unique_lock<std::mutex> lk(mutex_containers);
     index = num_data_containers++;
     data_containers.resize(index+1);
@@ -64,13 +374,18 @@ namespace Profiling {
 
 #if IN_PLATFORM_WINDOWS
     thread_id = GetCurrentThreadId();
+#elif defined(__linux__)
+    thread_id = (uint32_t)syscall(SYS_gettid);
 #else
     uint64_t tid;
     pthread_threadid_np(NULL, &tid);
-    thread_id = tid;
+    thread_id = (uint32_t)tid;
 #endif
 
     strcpy( thread_name, "main" );
+
+    if (counters_enabled && counters.open(thread_id))
+      entry_counters = new uint64_t[(size_t)max_entries * NumCounters]();
   }
 
   TContainer::~TContainer() {
@@ -78,38 +393,74 @@ namespace Profiling {
   }
 
   void TContainer::freeEntries() {
+    std::unique_lock<std::mutex> lk(mutex_containers);
+    // Keep the entries of the threads which finish during the capture
+    if (entries && writer.f)
+      writer.drain(this);
     if (entries)
       delete[] entries;
     entries = nullptr;
     if (index)
       data_containers[index] = nullptr;
 
+    if (counters.isOpen()) {
+      uint64_t values[NumCounters];
+      counters.read(values);
+      for (int k = 0; k < NumCounters; ++k)
+        exited_threads_counters.values[k] += values[k];
+      counters.close();
+    }
+    if (entry_counters)
+      delete[] entry_counters;
+    entry_counters = nullptr;
+
     for (char* p : labels)
       free(p);
     labels.clear();
     label_ids.clear();
   }
 
+  // The writer reads entries under mutex_containers, so the ring is published with it
   void TContainer::allocEntries() {
-    entries = new TEntry[max_entries];
+    TEntry* new_entries = new TEntry[max_entries];
+    std::unique_lock<std::mutex> lk(mutex_containers);
+    entries = new_entries;
   }
 
   uint32_t TContainer::enter(const char* txt) {
-	  if (!entries)
-		  allocEntries();
-	  TEntry* e = entries + used;
-	  e->name = txt;
-	  e->time_stamp = __rdtsc() & (~1ULL);
-	  uint32_t n = used;
-	  used = (used + 1) & (max_entries - 1);
-	  return n;
+    if (!is_capturing.load(std::memory_order_acquire))
+      return 0;
+    if (!entries)
+      allocEntries();
+    uint32_t h = head.load(std::memory_order_relaxed);
+    uint32_t t = tail.load(std::memory_order_acquire);
+    // Room for this entry, and the exits of this scope and all the open ones
+    if (max_entries - (h - t) < open_scopes + 2) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return 0;
+    }
+    uint32_t slot = h & (max_entries - 1);
+    TEntry* e = entries + slot;
+    e->name = txt;
+    e->time_stamp = readTicks() & (~1ULL);
+    readEntryCounters(slot);
+    head.store(h + 1, std::memory_order_release);
+    ++open_scopes;
+    return 1;
   }
 
+  // n is 0 when the enter was not recorded
   void TContainer::exit(uint32_t n) {
-	  TEntry* e = entries + used;
-	  e->name = entries[n].name;
-	  e->time_stamp = __rdtsc() | (1ULL);
-	  used = (used + 1) & (max_entries - 1);
+    if (!n)
+      return;
+    --open_scopes;
+    uint32_t h = head.load(std::memory_order_relaxed);
+    uint32_t slot = h & (max_entries - 1);
+    readEntryCounters(slot);
+    TEntry* e = entries + slot;
+    e->name = nullptr;
+    e->time_stamp = readTicks() | (1ULL);
+    head.store(h + 1, std::memory_order_release);
   }
 
   TContainer& getDataContainer() {
@@ -128,67 +479,176 @@ namespace Profiling {
     strcpy( data_container.thread_name, new_name);
   }
 
-  void TContainer::reset() {
-    used = 0;
+  // -----------------------------------------------------------------------
+  // Hardware counters
+#if PROFILING_HAS_PERF_COUNTERS
+  bool TCounterGroup::open(uint32_t tid) {
+    struct TConfig { uint32_t type; uint64_t config; };
+    static const TConfig configs[NumCounters] = {
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+      { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+      { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+      { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    };
+    num_open = 0;
+    for (int k = 0; k < NumCounters; ++k) {
+      perf_event_attr attr;
+      memset(&attr, 0x00, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = configs[k].type;
+      attr.config = configs[k].config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      int fd = (int)syscall(SYS_perf_event_open, &attr, (pid_t)tid, -1, k == Cycles ? -1 : fds[Cycles], 0);
+      if (fd < 0) {
+        // Without the leader there is no group. The other counters might not exist in this cpu
+        if (k == Cycles)
+          return false;
+        continue;
+      }
+      fds[k] = fd;
+      slots[k] = num_open++;
+    }
+    return true;
   }
 
-  void saveAll(const char* ofilename) {
-    FILE* f = fopen(ofilename, "wb");
-    if (!f)
+  void TCounterGroup::close() {
+    for (int k = NumCounters - 1; k >= 0; --k) {
+      if (fds[k] >= 0)
+        ::close(fds[k]);
+      fds[k] = -1;
+      slots[k] = -1;
+    }
+    num_open = 0;
+  }
+
+  void TCounterGroup::read(uint64_t* out_values) const {
+    memset(out_values, 0x00, sizeof(uint64_t) * NumCounters);
+    struct {
+      uint64_t nr;
+      uint64_t time_enabled;
+      uint64_t time_running;
+      uint64_t values[NumCounters];
+    } data;
+    if (!isOpen() || ::read(fds[Cycles], &data, sizeof(data)) <= 0)
       return;
-	std::unique_lock<std::mutex> lk(mutex_containers);
+    // The kernel multiplexes the groups when there are not enough counters
+    double scale = 1.0;
+    if (data.time_running && data.time_running < data.time_enabled)
+      scale = (double)data.time_enabled / (double)data.time_running;
+    for (int k = 0; k < NumCounters; ++k) {
+      if (slots[k] >= 0 && (uint64_t)slots[k] < data.nr)
+        out_values[k] = (uint64_t)(data.values[slots[k]] * scale);
+    }
+  }
+#else
+  bool TCounterGroup::open(uint32_t tid) { return false; }
+  void TCounterGroup::close() { }
+  void TCounterGroup::read(uint64_t* out_values) const {
+    memset(out_values, 0x00, sizeof(uint64_t) * NumCounters);
+  }
+#endif
 
-    // Query the freq to convert cycles to seconds
-    uint64_t elapsed_ticks = ts_end_capture - ts_start_capture;
+  // The counters are opened for all the threads, including the ones created later.
+  // Must be called while not capturing
+  bool enableCounters(bool how) {
+    if (is_capturing)
+      return false;
+    // Registers the calling thread, so there is at least one container to test
+    getDataContainer();
+    std::unique_lock<std::mutex> lk(mutex_containers);
+    if (!how) {
+      // Keep the groups open, the threads might be reading them
+      counters_enabled = false;
+      return true;
+    }
+    bool any_open = false;
+    for (uint32_t i = 0; i < num_data_containers; ++i) {
+      auto dc = data_containers[i];
+      if (!dc)
+        continue;
+      if (!dc->counters.isOpen() && !dc->counters.open(dc->thread_id))
+        continue;
+      if (!dc->entry_counters)
+        dc->entry_counters = new uint64_t[(size_t)dc->max_entries * NumCounters]();
+      any_open = true;
+    }
+    counters_enabled = any_open;
+    if (!any_open)
+      printf("Profiling: hardware counters are not available\n");
+    return any_open;
+  }
 
-    fprintf(f, "{\"traceEvents\": [");
+  bool countersEnabled() {
+    return counters_enabled;
+  }
 
-    uint32_t pid = 1234;
-    int n = 0;
-    for (uint32_t j = 0; j < num_data_containers; ++j) {
-      auto dc = data_containers[j];
-      if (!dc)
+  // Sum of the counters of all the threads, including the finished ones. The sim reads them in
+  // each section, so it does not take the lock when they are disabled
+  bool readCounters(TCounters& out) {
+    if (!counters_enabled) {
+      out = TCounters();
+      return false;
+    }
+    std::unique_lock<std::mutex> lk(mutex_containers);
+    out = exited_threads_counters;
+    for (uint32_t i = 0; i < num_data_containers; ++i) {
+      auto dc = data_containers[i];
+      if (!dc || !dc->counters.isOpen())
         continue;
-      for (uint32_t i = 0; i < dc->used; ++i, ++n) {
-        const TEntry* e = dc->entries + i;
-        if (n)
-          fprintf(f, ",");
-
-        // Convert cycles to s
-        assert(e->time_stamp >= ts_start_capture);
-        uint64_t ts = e->time_stamp - ts_start_capture;
-        double event_time = 1000000000.0 * ts / elapsed_ticks;
-        event_time *= elapsed_time;
-        uint64_t event_ticks = (uint64_t)event_time;
-
-        if (e->isBegin()) {
-          fprintf(f, "{\"name\":\"%s\", \"cat\":\"c++\"", e->name);
-          fprintf(f, ",\"ph\":\"B\",\"ts\": %lld, \"pid\":%d, \"tid\" : %d }\n", event_ticks, pid, dc->thread_id);
-        }
-        else {
-          fprintf(f, "{\"ph\":\"E\",\"ts\": %lld, \"pid\":%d, \"tid\" : %d }\n", event_ticks, pid, dc->thread_id);
-        }
-      }
-      if (dc->used)
-        fprintf(f, ",{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\":\"%s\" }}\n"
-          , pid, dc->thread_id, dc->thread_name);
+      uint64_t values[NumCounters];
+      dc->counters.read(values);
+      for (int k = 0; k < NumCounters; ++k)
+        out.values[k] += values[k];
     }
-    fprintf(f, "]}");
+    return true;
+  }
 
+  const char* counterName(eCounter counter) {
+    static const char* names[NumCounters] = { "cycles", "instructions", "llc_misses", "dtlb_misses" };
+    return names[counter];
+  }
 
-    fclose(f);
+  void startStreaming(const char* ofilename) {
+    if (is_capturing)
+      return;
+    FILE* f = fopen(ofilename, "wb");
+    if (!f)
+      return;
+
+    calibrate();
+    {
+      std::unique_lock<std::mutex> lk(mutex_containers);
+      capture_start = sampleClocks();
+      writer.f = f;
+      writer.bytes_written = 0;
+      writer.name_ids.clear();
+      writer.buf.clear();
+      writer.buf.write(TCaptureHeader{ capture_magic, capture_version });
+      writer.writeClock(ns_per_tick);
+      // Skip the entries left from a previous capture
+      for (uint32_t i = 0; i < num_data_containers; ++i) {
+        auto dc = data_containers[i];
+        if (!dc)
+          continue;
+        dc->tail.store(dc->head.load(std::memory_order_acquire), std::memory_order_release);
+        dc->written_dropped = dc->dropped.load(std::memory_order_relaxed);
+        dc->written_thread_name[0] = 0;
+      }
+      is_capturing.store(true, std::memory_order_release);
+    }
+
+    writer.running = true;
+    writer.thread = std::thread([]() {
+      setCurrentThreadName("ProfileWriter");
+      writer.run();
+      });
   }
 
   void start() {
-	std::unique_lock<std::mutex> lk(mutex_containers);
-    tm.reset();
-    ts_start_capture = __rdtsc();
-	for (uint32_t i = 0; i < num_data_containers; ++i) {
-      auto dc = data_containers[i];
-      if (dc)
-        dc->reset();
-    }
-    is_capturing = true;
+    convert_on_stop = true;
+    startStreaming("capture.bin");
   }
 
   bool isCapturing() {
@@ -196,10 +656,231 @@ namespace Profiling {
   }
 
   void stop() {
-    elapsed_time = tm.elapsed();
-    ts_end_capture = __rdtsc();
-    is_capturing = false;
-    saveAll("capture.json");
+    if (!is_capturing)
+      return;
+    is_capturing.store(false, std::memory_order_release);
+    writer.running = false;
+    writer.thread.join();
+
+    TBuffer pending;
+    FILE* f = nullptr;
+    uint32_t total_dropped = 0;
+    {
+      std::unique_lock<std::mutex> lk(mutex_containers);
+      writer.drainAll();
+      // Ticks to ns, using the whole capture as calibration interval
+      capture_end = sampleClocks();
+      double capture_ns_per_tick = ns_per_tick;
+      if (use_tsc && capture_end.ns - capture_start.ns >= 20 * 1000000ULL)
+        capture_ns_per_tick = nsPerTick(capture_start, capture_end);
+      writer.writeClock(capture_ns_per_tick);
+      std::swap(pending, writer.buf);
+      f = writer.f;
+      writer.f = nullptr;
+      for (uint32_t i = 0; i < num_data_containers; ++i) {
+        auto dc = data_containers[i];
+        if (dc)
+          total_dropped += dc->written_dropped;
+      }
+    }
+    writer.flush(f, pending);
+    fclose(f);
+    if (total_dropped)
+      printf("Profiling: %u scopes dropped because the ring buffers were full\n", total_dropped);
+
+    if (convert_on_stop) {
+      convert_on_stop = false;
+      convertCapture("capture.bin", "capture.json");
+    }
+  }
+
+  // -----------------------------------------------------------------------
+  // Offline conversion to the Chrome trace format, which can also be opened by Perfetto
+  struct TCapturedThread {
+    uint32_t    thread_id = 0;
+    std::string name;
+    uint32_t    dropped = 0;
+    std::vector<TCapturedEvent> events;
+    std::vector<uint64_t> counters;      // NumCounters per event, when captured
+  };
+
+  static std::string escapeJson(const char* txt) {
+    std::string out;
+    for (const char* p = txt; *p; ++p) {
+      if (*p == '"' || *p == '\\')
+        out.push_back('\\');
+      out.push_back(*p);
+    }
+    return out;
+  }
+
+  bool convertCapture(const char* capture_filename, const char* json_filename) {
+    TBuffer buf;
+    if (!buf.load(capture_filename))
+      return false;
+    CMemoryDataProvider dp = buf.getNewMemoryDataProvider();
+    if (dp.remainingBytes() < sizeof(TCaptureHeader))
+      return false;
+    TCaptureHeader header;
+    dp.read(header);
+    if (header.magic != capture_magic || header.version != capture_version) {
+      printf("%s is not a profiling capture of version %d\n", capture_filename, capture_version);
+      return false;
+    }
+
+    std::vector<std::string> names(1);
+    std::map<uint32_t, TCapturedThread> threads;
+    TClockChunk clk{};
+    bool truncated = false;
+
+    while (dp.remainingBytes() >= sizeof(TChunkHeader)) {
+      TChunkHeader ch;
+      dp.read(ch);
+      if (dp.remainingBytes() < ch.nbytes) {
+        truncated = true;
+        break;
+      }
+      const uint8_t* payload = (const uint8_t*)dp.consumeBytes(ch.nbytes);
+      switch (ch.type) {
+      case CHUNK_THREAD: {
+        TThreadChunk tc;
+        memcpy(&tc, payload, sizeof(tc));
+        tc.name[sizeof(tc.name) - 1] = 0;
+        TCapturedThread& th = threads[tc.thread_idx];
+        th.thread_id = tc.thread_id;
+        th.name = tc.name;
+        break; }
+      case CHUNK_NAME: {
+        uint32_t id;
+        memcpy(&id, payload, sizeof(id));
+        if (id >= names.size())
+          names.resize(id + 1);
+        names[id] = escapeJson((const char*)payload + sizeof(id));
+        break; }
+      case CHUNK_EVENTS: {
+        TEventsChunk ec;
+        memcpy(&ec, payload, sizeof(ec));
+        auto& evs = threads[ec.thread_idx].events;
+        size_t prev = evs.size();
+        evs.resize(prev + ec.count);
+        memcpy(evs.data() + prev, payload + sizeof(ec), ec.count * sizeof(TCapturedEvent));
+        break; }
+      case CHUNK_COUNTERS: {
+        TEventsChunk ec;
+        memcpy(&ec, payload, sizeof(ec));
+        auto& th = threads[ec.thread_idx];
+        // Events without counters get zeros, so both arrays stay aligned
+        th.counters.resize((th.events.size() - ec.count) * NumCounters);
+        size_t prev = th.counters.size();
+        th.counters.resize(prev + (size_t)ec.count * NumCounters);
+        memcpy(th.counters.data() + prev, payload + sizeof(ec), (size_t)ec.count * NumCounters * sizeof(uint64_t));
+        break; }
+      case CHUNK_DROPPED: {
+        TDroppedChunk dc;
+        memcpy(&dc, payload, sizeof(dc));
+        threads[dc.thread_idx].dropped = dc.total_dropped;
+        break; }
+      case CHUNK_CLOCK:
+        memcpy(&clk, payload, sizeof(clk));
+        break;
+      default:
+        break;
+      }
+    }
+    if (truncated)
+      printf("%s is truncated, converting the complete chunks\n", capture_filename);
+
+    FILE* f = fopen(json_filename, "wb");
+    if (!f)
+      return false;
+
+    // Chrome expects the timestamps in microseconds
+    auto toUs = [&](uint64_t time_stamp) {
+      return (double)(int64_t)(time_stamp - clk.start_ticks) * clk.ns_per_tick * 0.001;
+    };
+
+    std::string out;
+    out.reserve(1 << 20);
+    char line[512];
+    auto append = [&](const char* fmt, ...) {
+      va_list ap;
+      va_start(ap, fmt);
+      int n = vsnprintf(line, sizeof(line), fmt, ap);
+      va_end(ap);
+      out.append(line, std::min(n, (int)sizeof(line) - 1));
+      if (out.size() > (1 << 20) - 1024) {
+        fwrite(out.data(), 1, out.size(), f);
+        out.clear();
+      }
+    };
+
+    const uint32_t pid = 1234;
+    append("{\"traceEvents\": [\n");
+    bool first = true;
+    std::vector<const uint64_t*> open_counters;
+    for (auto& it : threads) {
+      TCapturedThread& th = it.second;
+      bool has_counters = !th.counters.empty();
+      if (has_counters)
+        th.counters.resize(th.events.size() * NumCounters);
+      uint32_t depth = 0;
+      uint64_t last_ts = clk.start_ticks;
+      open_counters.clear();
+      for (size_t ei = 0; ei < th.events.size(); ++ei) {
+        const TCapturedEvent& e = th.events[ei];
+        bool is_begin = (e.time_stamp & 1) == 0;
+        // Exits of scopes opened before the capture started
+        if (!is_begin && depth == 0)
+          continue;
+        const char* sep = first ? "" : ",";
+        first = false;
+        if (is_begin) {
+          const char* name = e.name_id < names.size() ? names[e.name_id].c_str() : "";
+          append("%s{\"name\":\"%s\", \"cat\":\"c++\",\"ph\":\"B\",\"ts\": %.3f, \"pid\":%u, \"tid\" : %u }\n", sep, name, toUs(e.time_stamp), pid, th.thread_id);
+          if (has_counters)
+            open_counters.push_back(th.counters.data() + ei * NumCounters);
+          ++depth;
+        }
+        else {
+          // The counters of the scope are added as args of the exit, chrome merges them with the begin
+          const uint64_t* c0 = has_counters ? open_counters.back() : nullptr;
+          const uint64_t* c1 = has_counters ? th.counters.data() + ei * NumCounters : nullptr;
+          if (c0 && c0[Cycles] && c1[Cycles] >= c0[Cycles]) {
+            uint64_t delta[NumCounters];
+            for (int k = 0; k < NumCounters; ++k)
+              delta[k] = c1[k] >= c0[k] ? c1[k] - c0[k] : 0;
+            double ipc = delta[Cycles] ? (double)delta[Instructions] / (double)delta[Cycles] : 0.0;
+            append("%s{\"ph\":\"E\",\"ts\": %.3f, \"pid\":%u, \"tid\" : %u, \"args\":{\"cycles\":%llu, \"instructions\":%llu, \"ipc\":%.3f, \"llc_misses\":%llu, \"dtlb_misses\":%llu} }\n"
+              , sep, toUs(e.time_stamp), pid, th.thread_id
+              , (unsigned long long)delta[Cycles], (unsigned long long)delta[Instructions], ipc
+              , (unsigned long long)delta[LLCMisses], (unsigned long long)delta[DTLBMisses]);
+          }
+          else {
+            append("%s{\"ph\":\"E\",\"ts\": %.3f, \"pid\":%u, \"tid\" : %u }\n", sep, toUs(e.time_stamp), pid, th.thread_id);
+          }
+          if (has_counters)
+            open_counters.pop_back();
+          --depth;
+        }
+        last_ts = e.time_stamp;
+      }
+      // Scopes still open when the capture stopped
+      for (; depth > 0; --depth)
+        append(",{\"ph\":\"E\",\"ts\": %.3f, \"pid\":%u, \"tid\" : %u }\n", toUs(last_ts), pid, th.thread_id);
+      if (th.dropped) {
+        append("%s{\"name\":\"%u scopes dropped\", \"ph\":\"i\", \"s\":\"t\", \"ts\": %.3f, \"pid\":%u, \"tid\" : %u }\n", first ? "" : ",", th.dropped, toUs(last_ts), pid, th.thread_id);
+        first = false;
+      }
+      if (!th.name.empty()) {
+        append("%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %u, \"tid\": %u, \"args\": {\"name\":\"%s\" }}\n"
+          , first ? "" : ",", pid, th.thread_id, escapeJson(th.name.c_str()).c_str());
+        first = false;
+      }
+    }
+    append("]}");
+    fwrite(out.data(), 1, out.size(), f);
+    fclose(f);
+    return true;
   }
 
   void triggerCapture(uint32_t nframes) {
@@ -1,5 +1,29 @@
 #pragma once
 
+namespace Profiling {
+
+  // Hardware counters sampled per thread
+  enum eCounter {
+    Cycles,
+    Instructions,
+    LLCMisses,
+    DTLBMisses,
+    NumCounters
+  };
+
+  struct TCounters {
+    uint64_t values[NumCounters] = { 0 };
+    uint64_t operator[](eCounter counter) const { return values[counter]; }
+    TCounters operator-(const TCounters& other) const {
+      TCounters r;
+      for (int k = 0; k < NumCounters; ++k)
+        r.values[k] = values[k] - other.values[k];
+      return r;
+    }
+  };
+
+}
+
 #if defined(ENABLE_PROFILING)
 
 namespace Profiling {
@@ -9,6 +33,17 @@ namespace Profiling {
 
   void start();
   void stop();
+  // Streams the scopes of all the threads to a binary file until stop is called
+  void startStreaming(const char* ofilename);
+  // Converts a binary capture to the Chrome trace json format
+  bool convertCapture(const char* capture_filename, const char* json_filename);
+
+  // Hardware counters of all the threads, linux only. When enabled, the counters of
+  // each scope are also saved in the captures
+  bool enableCounters(bool how);
+  bool countersEnabled();
+  bool readCounters(TCounters& out);
+  const char* counterName(eCounter counter);
   bool isCapturing();
   void triggerCapture(uint32_t nframes);
   void frameBegins();
@@ -49,5 +84,11 @@ namespace Profiling {
 #define PROFILE_END_SECTION(n)
 #define PROFILE_BEGIN_FRAME()
 
+namespace Profiling {
+  inline bool enableCounters(bool how) { return false; }
+  inline bool countersEnabled() { return false; }
+  inline bool readCounters(TCounters& out) { return false; }
+}
+
 #endif
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <functional>
+
 struct IResource {
 	char name[64] = { 0x00 };
 	virtual ~IResource() { }
@@ -30,3 +32,38 @@ template< typename T >
 const T* Resource(const char* res_name) {
 	return getResource(res_name)->template as<T>();
 }
+
+// Asynchronous creation. The resources are created in the workers of the resources manager, and
+// getResource of a resource not ready yet waits for it, or creates it when no worker has started it.
+// The slots are valid until destroyAllResources
+struct ResourceSlot;
+using ResourceCreateFn = std::function<IResource* ()>;
+
+// Creates the resource with the factory of its type
+const ResourceSlot* prefetchResource(const char* name);
+const ResourceSlot* addResourceAsync(const char* name, ResourceCreateFn fn);
+// Null until the resource is ready. Never blocks
+const IResource* getResourceIfReady(const ResourceSlot* slot);
+void waitForResources();
+
+// Returns the placeholder until the resource is ready, and then the resource
+template< typename T >
+struct ResourceHandle {
+	const ResourceSlot* slot = nullptr;
+	const T*            placeholder = nullptr;
+
+	bool isReady() const {
+		return slot && getResourceIfReady(slot);
+	}
+	const T* get() const {
+		const IResource* res = slot ? getResourceIfReady(slot) : nullptr;
+		return res ? res->template as<T>() : placeholder;
+	}
+	operator const T* () const { return get(); }
+	const T* operator->() const { return get(); }
+};
+
+template< typename T >
+ResourceHandle<T> PrefetchResource(const char* res_name, const T* placeholder = nullptr) {
+	return ResourceHandle<T>{ prefetchResource(res_name), placeholder };
+}
@@ -1,19 +1,49 @@
 #include "platform.h"
 #include "resource.h"
+#include "thread_pool.h"
 #include <unordered_map>
 
+#if IN_PLATFORM_APPLE
+#include "Foundation/Foundation.hpp"
+#endif
+
+// A resource created in the workers. The slot keeps its address while the manager lives, so the
+// handles can point to it, and the resource is stored once it's ready
+struct ResourceSlot {
+	enum class eState { Queued, Loading, Ready, Failed };
+	std::atomic<const IResource*> res{ nullptr };
+	std::atomic<eState>           state{ eState::Queued };
+	std::string                   name;
+	ResourceCreateFn              create;
+};
+
 class ResourcesManager {
 
 	using KeyType = std::string;
 
 	std::unordered_map< KeyType, IResource* > resources;
 	std::unordered_map< KeyType, ResourceFactoryFn >  factories;
+	std::unordered_map< KeyType, ResourceSlot* > slots;
+
+	// The workers add the resources they create, and request the ones they depend on,
+	// like the pso its buffers
+	std::mutex                  mutex;
+	std::condition_variable     slot_done;
+	std::unique_ptr<ThreadPool> workers;
+	int                         num_pending = 0;
+
+	IResource* createFromFactory(const char* name);
+	ResourceSlot* newSlot(const KeyType& name_id, ResourceCreateFn fn);
+	void runSlot(ResourceSlot* slot);
 
 public:
 
 	const IResource* get(const char* name);
 	void addResource(IResource* res);
 	void addFactory(const char* res_typename, ResourceFactoryFn fn);
+	const ResourceSlot* addAsync(const char* name, ResourceCreateFn fn);
+	const ResourceSlot* prefetch(const char* name);
+	void waitAll();
 	void destroyAll();
 
 	template< typename Fn>
@@ -26,40 +56,145 @@ public:
 
 const IResource* ResourcesManager::get(const char* name) {
 	KeyType name_id(name);
-	auto it = resources.find(name_id);
-	if (it != resources.end())
-		return it->second;
+	ResourceSlot* slot = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = resources.find(name_id);
+		if (it != resources.end())
+			return it->second;
+		// The workers also request the dependencies they share, so the first request registers
+		// a slot, and the others wait for the thread creating it
+		auto sit = slots.find(name_id);
+		if (sit != slots.end())
+			slot = sit->second;
+		else
+			slot = newSlot(name_id, [this, name_id]() { return createFromFactory(name_id.c_str()); });
+	}
+
+	// Requested before a worker got to it, or while another thread creates it
+	runSlot(slot);
+	std::unique_lock<std::mutex> lock(mutex);
+	slot_done.wait(lock, [slot] { return slot->state == ResourceSlot::eState::Ready || slot->state == ResourceSlot::eState::Failed; });
+	return slot->res.load();
+}
 
+IResource* ResourcesManager::createFromFactory(const char* name) {
 	const char* ext = strrchr(name, '.');		// .mesh
 	if (!ext) {
 		fatal("Failed to identify extension in resource: '%s'\n", name);
 		return nullptr;
 	}
 
-	KeyType res_typeid(ext + 1);
-	auto fn = factories.find(res_typeid);
-	if (fn == factories.end()) {
+	ResourceFactoryFn factory = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto fn = factories.find(KeyType(ext + 1));
+		if (fn != factories.end())
+			factory = fn->second;
+	}
+	if (!factory) {
 		fatal("Failed to find a factory for resources of type %s, resource name %s\n", ext, name);
 		return nullptr;
 	}
-	assert(fn != factories.end());
 
-	IResource* new_res = (*fn->second)(name);
+	IResource* new_res = (*factory)(name);
 	if (!new_res) {
 		fatal("Failed to create resource '%s' using factory of type %s\n", name, ext);
 		return nullptr;
 	}
-
-	new_res->setName(name);
-	dbg("Adding resource %s\n", name);
-	addResource(new_res);
 	return new_res;
 }
 
+// With the mutex locked
+ResourceSlot* ResourcesManager::newSlot(const KeyType& name_id, ResourceCreateFn fn) {
+	ResourceSlot* slot = new ResourceSlot;
+	slot->name = name_id;
+	slots[name_id] = slot;
+	slot->create = std::move(fn);
+	++num_pending;
+	return slot;
+}
+
+// Only one thread creates each resource: a worker, or the first one requesting it with get
+void ResourcesManager::runSlot(ResourceSlot* slot) {
+	ResourceSlot::eState expected = ResourceSlot::eState::Queued;
+	if (!slot->state.compare_exchange_strong(expected, ResourceSlot::eState::Loading))
+		return;
+
+	IResource* new_res = slot->create();
+	if (new_res)
+		new_res->setName(slot->name.c_str());
+	else
+		fatal("Failed to create resource '%s'\n", slot->name.c_str());
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (new_res) {
+			dbg("Adding resource %s\n", slot->name.c_str());
+			resources[slot->name] = new_res;
+			slot->res.store(new_res);
+		}
+		slot->state = new_res ? ResourceSlot::eState::Ready : ResourceSlot::eState::Failed;
+		--num_pending;
+	}
+	slot_done.notify_all();
+}
+
+const ResourceSlot* ResourcesManager::addAsync(const char* name, ResourceCreateFn fn) {
+	assert(name && fn);
+	KeyType name_id(name);
+	ResourceSlot* slot = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto sit = slots.find(name_id);
+		if (sit != slots.end())
+			return sit->second;
+
+		// Already created with addResource
+		auto it = resources.find(name_id);
+		if (it != resources.end()) {
+			slot = new ResourceSlot;
+			slot->name = name_id;
+			slots[name_id] = slot;
+			slot->res.store(it->second);
+			slot->state = ResourceSlot::eState::Ready;
+			return slot;
+		}
+
+		slot = newSlot(name_id, std::move(fn));
+		if (!workers) {
+			// The main thread keeps rendering while the workers create the resources
+			int num_workers = std::clamp((int)std::thread::hardware_concurrency() - 1, 1, 8);
+			workers = std::make_unique<ThreadPool>(num_workers);
+		}
+	}
+	workers->enqueue([this, slot]() {
+#if IN_PLATFORM_APPLE
+		// The metal objects autoreleased by the factories are released after each resource
+		NS::AutoreleasePool* pool = NS::AutoreleasePool::alloc()->init();
+#endif
+		runSlot(slot);
+#if IN_PLATFORM_APPLE
+		pool->release();
+#endif
+		});
+	return slot;
+}
+
+const ResourceSlot* ResourcesManager::prefetch(const char* name) {
+	return addAsync(name, [this, name_id = KeyType(name)]() { return createFromFactory(name_id.c_str()); });
+}
+
+void ResourcesManager::waitAll() {
+	std::unique_lock<std::mutex> lock(mutex);
+	slot_done.wait(lock, [this] { return num_pending == 0; });
+}
+
 void ResourcesManager::addResource(IResource* res) {
 	assert(res);
 	assert(strlen(res->getName()) > 0);
 	std::string name_id(res->getName());
+	std::lock_guard<std::mutex> lock(mutex);
 	resources[name_id] = res;
 }
 
@@ -67,15 +202,21 @@ void ResourcesManager::addFactory(const char* res_typename, ResourceFactoryFn fn
 	assert(res_typename);
 	assert(fn);
 	std::string res_typeid(res_typename);
+	std::lock_guard<std::mutex> lock(mutex);
 	factories[res_typeid] = fn;
 }
 
 void ResourcesManager::destroyAll() {
+	waitAll();
+	workers.reset();
 	for (auto it : resources) {
 		it.second->destroy();
 		delete it.second;
 	}
 	resources.clear();
+	for (auto it : slots)
+		delete it.second;
+	slots.clear();
 }
 
 // ------------------------------------------------------------------------------------------------------
@@ -95,4 +236,21 @@ void addResource(IResource* res) {
 
 void destroyAllResources() {
 	resources_manager.destroyAll();
-}
\ No newline at end of file
+}
+
+const ResourceSlot* prefetchResource(const char* name) {
+	return resources_manager.prefetch(name);
+}
+
+const ResourceSlot* addResourceAsync(const char* name, ResourceCreateFn fn) {
+	return resources_manager.addAsync(name, std::move(fn));
+}
+
+const IResource* getResourceIfReady(const ResourceSlot* slot) {
+	assert(slot);
+	return slot->res.load();
+}
+
+void waitForResources() {
+	resources_manager.waitAll();
+}
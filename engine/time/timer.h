@@ -9,7 +9,7 @@ struct TTimer {
   TTimeStamp start_ticks;
 
   static TTimeStamp timeStamp() {
-    return std::chrono::high_resolution_clock::now();
+    return std::chrono::steady_clock::now();
   }
   TTimer() : start_ticks(timeStamp()) {
   }
@@ -41,6 +41,11 @@ inline uint32_t Get3dNoiseUInt(uint32_t posX, uint32_t posY, uint32_t posZ, uint
   return Get1dNoiseUInt(posX + (posY * PRIME1) + (posZ * PRIME2), seed);
 }
 
+// In the range [0..1), the same value for the same position and seed, from any thread
+inline float Get2dNoiseZeroToOne(uint32_t posX, uint32_t posY, uint32_t seed = 0) {
+  return (float)(Get2dNoiseUInt(posX, posY, seed) >> 8) * (1.0f / 16777216.0f);
+}
+
 inline float unitRandom() {
   return rand() / static_cast<float>(RAND_MAX);
 }
@@ -0,0 +1,490 @@
+#include "platform.h"
+#include "frame_recorder.h"
+#include "viscoelastic_sim.h"
+
+namespace {
+
+  constexpr uint32_t file_magic = 0x4D524656;     // VFRM
+  constexpr uint32_t file_version = 1;
+  constexpr uint32_t frame_magic = 0x4D415246;    // FRAM
+
+  struct TFileHeader {
+    uint32_t magic = file_magic;
+    uint32_t version = file_version;
+    int32_t  cell_bits = 0;
+    float    vel_quantum = 0.0f;
+  };
+
+  struct TFrameHeader {
+    uint32_t magic = frame_magic;
+    uint32_t frame_id = 0;
+    uint32_t num_particles = 0;
+    uint32_t num_uids = 0;          // Size of the alive bitmap
+    float    grid_scale = 1.0f;
+    float    dt = 1.0f;
+    uint32_t is_keyframe = 0;
+    uint32_t nbytes = 0;            // Of the streams following the header
+  };
+
+  // ---------------------------------------------------------------------
+  // rANS with byte renormalization, order 0
+  constexpr uint32_t rans_scale_bits = 12;
+  constexpr uint32_t rans_scale = 1 << rans_scale_bits;
+  constexpr uint32_t rans_low = 1u << 23;
+
+  struct TStreamHeader {
+    uint32_t raw_size = 0;
+    uint32_t coded_size = 0;
+  };
+
+  // Frequencies summing rans_scale, at least 1 for each symbol used
+  void normalizeFreqs(const uint32_t* counts, uint32_t total, uint16_t* freqs) {
+    int sum = 0;
+    int max_sym = 0;
+    for (int s = 0; s < 256; ++s) {
+      freqs[s] = counts[s] ? (uint16_t)std::max<uint64_t>(1, (uint64_t)counts[s] * rans_scale / total) : 0;
+      sum += freqs[s];
+      if (counts[s] > counts[max_sym])
+        max_sym = s;
+    }
+    int diff = (int)rans_scale - sum;
+    if (diff > 0) {
+      freqs[max_sym] += diff;
+      return;
+    }
+    for (int s = max_sym; diff < 0; s = (s + 1) % 256) {
+      int take = std::min((int)freqs[s] - 1, -diff);
+      if (take > 0) {
+        freqs[s] -= take;
+        diff += take;
+      }
+    }
+  }
+
+  void writeStream(std::vector<uint8_t>& out, const std::vector<uint8_t>& raw) {
+    TStreamHeader header;
+    header.raw_size = (uint32_t)raw.size();
+    size_t header_offset = out.size();
+    out.resize(out.size() + sizeof(TStreamHeader));
+    if (raw.empty()) {
+      memcpy(out.data() + header_offset, &header, sizeof(header));
+      return;
+    }
+
+    uint32_t counts[256] = { 0 };
+    for (uint8_t b : raw)
+      counts[b]++;
+    uint16_t freqs[256];
+    normalizeFreqs(counts, (uint32_t)raw.size(), freqs);
+    uint16_t starts[256];
+    uint32_t acc = 0;
+    for (int s = 0; s < 256; ++s) {
+      starts[s] = (uint16_t)acc;
+      acc += freqs[s];
+    }
+    const uint8_t* p = (const uint8_t*)freqs;
+    out.insert(out.end(), p, p + sizeof(freqs));
+
+    // The symbols are encoded in reverse order, writing backwards, so the decoder reads forward
+    size_t capacity = raw.size() * 2 + 8;
+    size_t coded_offset = out.size();
+    out.resize(coded_offset + capacity);
+    uint8_t* end = out.data() + coded_offset + capacity;
+    uint8_t* ptr = end;
+    uint32_t x = rans_low;
+    for (size_t i = raw.size(); i-- > 0; ) {
+      uint8_t s = raw[i];
+      uint32_t freq = freqs[s];
+      uint32_t x_max = ((rans_low >> rans_scale_bits) << 8) * freq;
+      while (x >= x_max) {
+        *--ptr = (uint8_t)(x & 0xff);
+        x >>= 8;
+      }
+      x = ((x / freq) << rans_scale_bits) + (x % freq) + starts[s];
+    }
+    ptr -= 4;
+    ptr[0] = (uint8_t)(x >> 0);
+    ptr[1] = (uint8_t)(x >> 8);
+    ptr[2] = (uint8_t)(x >> 16);
+    ptr[3] = (uint8_t)(x >> 24);
+
+    header.coded_size = (uint32_t)(end - ptr);
+    memmove(out.data() + coded_offset, ptr, header.coded_size);
+    out.resize(coded_offset + header.coded_size);
+    memcpy(out.data() + header_offset, &header, sizeof(header));
+  }
+
+  // Returns false when the data is not valid
+  bool readStream(const uint8_t*& p, const uint8_t* end, std::vector<uint8_t>& raw) {
+    TStreamHeader header;
+    if (end - p < (ptrdiff_t)sizeof(header))
+      return false;
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+    raw.resize(header.raw_size);
+    if (!header.raw_size)
+      return true;
+
+    uint16_t freqs[256];
+    if (end - p < (ptrdiff_t)(sizeof(freqs) + header.coded_size) || header.coded_size < 4)
+      return false;
+    memcpy(freqs, p, sizeof(freqs));
+    p += sizeof(freqs);
+
+    uint16_t starts[256];
+    uint8_t symbols[rans_scale];
+    uint32_t acc = 0;
+    for (int s = 0; s < 256; ++s) {
+      starts[s] = (uint16_t)acc;
+      if (acc + freqs[s] > rans_scale)
+        return false;
+      memset(symbols + acc, s, freqs[s]);
+      acc += freqs[s];
+    }
+    if (acc != rans_scale)
+      return false;
+
+    const uint8_t* src = p;
+    const uint8_t* src_end = p + header.coded_size;
+    p = src_end;
+    uint32_t x = (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+    src += 4;
+    const uint32_t mask = rans_scale - 1;
+    for (uint32_t i = 0; i < header.raw_size; ++i) {
+      uint32_t slot = x & mask;
+      uint8_t s = symbols[slot];
+      raw[i] = s;
+      x = freqs[s] * (x >> rans_scale_bits) + slot - starts[s];
+      while (x < rans_low) {
+        if (src == src_end)
+          return false;
+        x = (x << 8) | *src++;
+      }
+    }
+    return true;
+  }
+
+  // ---------------------------------------------------------------------
+  void putVarint(std::vector<uint8_t>& s, int32_t v) {
+    uint32_t z = ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+    while (z >= 0x80) {
+      s.push_back((uint8_t)(z | 0x80));
+      z >>= 7;
+    }
+    s.push_back((uint8_t)z);
+  }
+
+  bool getVarint(const uint8_t*& p, const uint8_t* end, int32_t& v) {
+    uint32_t z = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      if (p == end)
+        return false;
+      uint8_t b = *p++;
+      z |= (uint32_t)(b & 0x7f) << shift;
+      if (!(b & 0x80)) {
+        v = (int32_t)((z >> 1) ^ (~(z & 1) + 1));
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The position is predicted from the previous one and the velocity of the frame
+  float positionStepsPerVelocityStep(float vel_quantum, const TFrameHeader& header, int cell_bits) {
+    return vel_quantum * header.dt * header.grid_scale * (float)(1 << cell_bits);
+  }
+
+}
+
+// ---------------------------------------------------------------------
+bool FrameRecorder::start(const char* filename) {
+  stop();
+  file = fopen(filename, "wb");
+  if (!file)
+    return false;
+  TFileHeader header;
+  header.cell_bits = cell_bits;
+  header.vel_quantum = vel_quantum;
+  fwrite(&header, 1, sizeof(header), file);
+
+  for (auto& q : prev_q)
+    q.clear();
+  prev_alive.clear();
+  prev_grid_scale = 0.0f;
+  next_frame_id = 0;
+  frames_written = 0;
+  frames_dropped = 0;
+  raw_bytes = 0;
+  bytes_written = sizeof(header);
+  stopping = false;
+  states[0] = states[1] = Free;
+  writer = std::thread([this]() { writerLoop(); });
+  return true;
+}
+
+void FrameRecorder::stop() {
+  if (!file)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cond.notify_all();
+  writer.join();
+  fclose(file);
+  file = nullptr;
+}
+
+bool FrameRecorder::submit(const ViscoelasticSim& sim, float dt) {
+  if (!file)
+    return false;
+  int idx = -1;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < 2; ++i) {
+      if (states[i] == Free) {
+        idx = i;
+        break;
+      }
+    }
+    if (idx < 0) {
+      frames_dropped++;
+      return false;
+    }
+    states[idx] = Filling;
+  }
+
+  PROFILE_SCOPED_NAMED("FrameRecorder.submit");
+  TFrame& frame = buffers[idx];
+  int n = sim.num_particles;
+  frame.frame_id = next_frame_id++;
+  frame.num_particles = n;
+  frame.grid_scale = sim.spatial_hash.grid_scale;
+  frame.dt = dt;
+  frame.uids.assign(sim.particles_uid, sim.particles_uid + n);
+  const ParticlesVec* vecs[2] = { &sim.particles_pos, &sim.particles_vels };
+  for (int v = 0; v < 2; ++v) {
+    frame.channels[v * 3 + 0].assign(vecs[v]->x, vecs[v]->x + n);
+    frame.channels[v * 3 + 1].assign(vecs[v]->y, vecs[v]->y + n);
+    frame.channels[v * 3 + 2].assign(vecs[v]->z, vecs[v]->z + n);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    states[idx] = Pending;
+  }
+  cond.notify_one();
+  return true;
+}
+
+void FrameRecorder::writerLoop() {
+  for (;;) {
+    int idx = -1;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [this]() { return stopping || states[0] == Pending || states[1] == Pending; });
+      // The oldest first. The pending frames are written before stopping
+      for (int i = 0; i < 2; ++i) {
+        if (states[i] == Pending && (idx < 0 || buffers[i].frame_id < buffers[idx].frame_id))
+          idx = i;
+      }
+      if (idx < 0)
+        return;
+      states[idx] = Encoding;
+    }
+    encodeFrame(buffers[idx]);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      states[idx] = Free;
+    }
+  }
+}
+
+void FrameRecorder::encodeFrame(const TFrame& frame) {
+  PROFILE_SCOPED_NAMED("FrameRecorder.encode");
+  int n = frame.num_particles;
+  uint32_t num_uids = (uint32_t)prev_alive.size();
+  for (int i = 0; i < n; ++i)
+    num_uids = std::max(num_uids, frame.uids[i] + 1);
+
+  TFrameHeader header;
+  header.frame_id = frame.frame_id;
+  header.num_particles = n;
+  header.num_uids = num_uids;
+  header.grid_scale = frame.grid_scale;
+  header.dt = frame.dt;
+  header.is_keyframe = (frame.frame_id % keyframe_period == 0 || frame.grid_scale != prev_grid_scale) ? 1 : 0;
+  prev_grid_scale = frame.grid_scale;
+
+  if (header.is_keyframe)
+    prev_alive.clear();
+  prev_alive.resize(num_uids, 0);
+  cur_alive.assign(num_uids, 0);
+  for (int c = 0; c < NumChannels; ++c) {
+    prev_q[c].resize(num_uids, 0);
+    cur_q[c].resize(num_uids);
+  }
+
+  // Quantise, by uid. The position is the cell coord x 2^cell_bits plus the offset inside the cell
+  const int32_t cell_steps = 1 << cell_bits;
+  const float inv_vel_quantum = 1.0f / vel_quantum;
+  for (int i = 0; i < n; ++i) {
+    uint32_t uid = frame.uids[i];
+    cur_alive[uid] = 1;
+    for (int c = 0; c < 3; ++c) {
+      float s = frame.channels[c][i] * frame.grid_scale;
+      float cell = floorf(s);
+      cur_q[c][uid] = (int32_t)cell * cell_steps + (int32_t)((s - cell) * cell_steps + 0.5f);
+    }
+    for (int c = 3; c < NumChannels; ++c)
+      cur_q[c][uid] = (int32_t)lrintf(frame.channels[c][i] * inv_vel_quantum);
+  }
+
+  // Changes in the set of uids alive
+  std::vector<uint8_t>& alive_stream = streams[NumChannels];
+  alive_stream.assign((num_uids + 7) / 8, 0);
+  for (uint32_t uid = 0; uid < num_uids; ++uid) {
+    if (cur_alive[uid] != prev_alive[uid])
+      alive_stream[uid >> 3] |= 1 << (uid & 7);
+  }
+
+  // Differences with the prediction, the new particles are predicted as 0
+  float pos_per_vel = positionStepsPerVelocityStep(vel_quantum, header, cell_bits);
+  for (int c = 0; c < NumChannels; ++c) {
+    std::vector<uint8_t>& s = streams[c];
+    s.clear();
+    const int32_t* q = cur_q[c].data();
+    const int32_t* pq = prev_q[c].data();
+    const int32_t* vq = c < 3 ? cur_q[c + 3].data() : nullptr;
+    for (uint32_t uid = 0; uid < num_uids; ++uid) {
+      if (!cur_alive[uid])
+        continue;
+      int32_t pred = 0;
+      if (prev_alive[uid])
+        pred = vq ? pq[uid] + (int32_t)lrintf(vq[uid] * pos_per_vel) : pq[uid];
+      putVarint(s, q[uid] - pred);
+    }
+  }
+
+  out.clear();
+  out.resize(sizeof(TFrameHeader));
+  writeStream(out, streams[NumChannels]);
+  for (int c = 0; c < NumChannels; ++c)
+    writeStream(out, streams[c]);
+  header.nbytes = (uint32_t)(out.size() - sizeof(TFrameHeader));
+  memcpy(out.data(), &header, sizeof(header));
+  fwrite(out.data(), 1, out.size(), file);
+
+  for (int c = 0; c < NumChannels; ++c)
+    std::swap(prev_q[c], cur_q[c]);
+  std::swap(prev_alive, cur_alive);
+
+  frames_written++;
+  raw_bytes += (uint64_t)n * NumChannels * sizeof(float);
+  bytes_written += out.size();
+}
+
+// ---------------------------------------------------------------------
+bool FrameReader::open(const char* filename) {
+  close();
+  file = fopen(filename, "rb");
+  if (!file)
+    return false;
+  TFileHeader header;
+  if (fread(&header, 1, sizeof(header), file) != sizeof(header) || header.magic != file_magic || header.version != file_version) {
+    close();
+    return false;
+  }
+  cell_bits = header.cell_bits;
+  vel_quantum = header.vel_quantum;
+  for (auto& q : prev_q)
+    q.clear();
+  prev_alive.clear();
+  return true;
+}
+
+void FrameReader::close() {
+  if (file)
+    fclose(file);
+  file = nullptr;
+}
+
+bool FrameReader::readFrame(FrameRecorder::TFrame& frame) {
+  if (!file)
+    return false;
+  TFrameHeader header;
+  if (fread(&header, 1, sizeof(header), file) != sizeof(header) || header.magic != frame_magic)
+    return false;
+  in.resize(header.nbytes);
+  if (fread(in.data(), 1, header.nbytes, file) != header.nbytes)
+    return false;
+
+  const uint8_t* p = in.data();
+  const uint8_t* end = p + in.size();
+  for (int c = 0; c <= FrameRecorder::NumChannels; ++c) {
+    int idx = (c + FrameRecorder::NumChannels) % (FrameRecorder::NumChannels + 1);
+    if (!readStream(p, end, streams[idx]))
+      return false;
+  }
+
+  uint32_t num_uids = header.num_uids;
+  if (header.is_keyframe)
+    prev_alive.clear();
+  if (streams[FrameRecorder::NumChannels].size() != (num_uids + 7) / 8 || prev_alive.size() > num_uids)
+    return false;
+  prev_alive.resize(num_uids, 0);
+  for (auto& q : prev_q)
+    q.resize(num_uids, 0);
+
+  // The uids alive in the frame
+  const uint8_t* changes = streams[FrameRecorder::NumChannels].data();
+  frame.uids.clear();
+  for (uint32_t uid = 0; uid < num_uids; ++uid) {
+    if (changes[uid >> 3] & (1 << (uid & 7)))
+      prev_alive[uid] ^= 1;
+    if (prev_alive[uid])
+      frame.uids.push_back(uid);
+  }
+  int n = (int)frame.uids.size();
+  if (n != (int)header.num_particles)
+    return false;
+
+  // The particles alive now that have changed are new, and are predicted as 0
+  for (uint32_t uid : frame.uids) {
+    if (changes[uid >> 3] & (1 << (uid & 7))) {
+      for (auto& q : prev_q)
+        q[uid] = 0;
+    }
+  }
+
+  // Velocities first, as they predict the positions
+  float pos_per_vel = positionStepsPerVelocityStep(vel_quantum, header, cell_bits);
+  const int order[FrameRecorder::NumChannels] = { 3, 4, 5, 0, 1, 2 };
+  for (int c : order) {
+    const uint8_t* s = streams[c].data();
+    const uint8_t* s_end = s + streams[c].size();
+    int32_t* q = prev_q[c].data();
+    const int32_t* vq = c < 3 ? prev_q[c + 3].data() : nullptr;
+    for (uint32_t uid : frame.uids) {
+      int32_t delta;
+      if (!getVarint(s, s_end, delta))
+        return false;
+      bool is_new = (changes[uid >> 3] & (1 << (uid & 7))) != 0;
+      int32_t pred = (vq && !is_new) ? q[uid] + (int32_t)lrintf(vq[uid] * pos_per_vel) : q[uid];
+      q[uid] = pred + delta;
+    }
+  }
+
+  frame.frame_id = header.frame_id;
+  frame.num_particles = n;
+  frame.grid_scale = header.grid_scale;
+  frame.dt = header.dt;
+  const float pos_scale = 1.0f / (header.grid_scale * (float)(1 << cell_bits));
+  for (int c = 0; c < FrameRecorder::NumChannels; ++c) {
+    frame.channels[c].resize(n);
+    const float scale = c < 3 ? pos_scale : vel_quantum;
+    for (int i = 0; i < n; ++i)
+      frame.channels[c][i] = prev_q[c][frame.uids[i]] * scale;
+  }
+  return true;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+struct ViscoelasticSim;
+
+// Records the positions and velocities of the particles in each frame for offline use.
+// The main thread only copies the state to one of two buffers, a background thread encodes
+// and writes them. When both buffers are still pending the frame is dropped instead of waiting.
+// Each channel is quantised, the positions in steps of 1/2^cell_bits of the cells of the
+// spatial hash, and coded as the difference with the previous frame of the same particle uid.
+// The positions are predicted with the velocity of the frame. The differences are written as
+// zigzag varints and compressed with a rANS order 0 coder
+struct FrameRecorder {
+
+  static constexpr int NumChannels = 6;       // pos x,y,z and vel x,y,z
+
+  struct TFrame {
+    uint32_t              frame_id = 0;
+    int                   num_particles = 0;
+    float                 grid_scale = 1.0f;  // Inverse of the cell size
+    float                 dt = 1.0f;
+    std::vector<uint32_t> uids;
+    std::vector<float>    channels[NumChannels];
+  };
+
+  int                   cell_bits = 10;
+  float                 vel_quantum = 1.0f / 256.0f;
+  int                   keyframe_period = 64;   // Frames coded without the previous one, to allow seeking
+
+  std::atomic<uint64_t> frames_written{ 0 };
+  std::atomic<uint64_t> frames_dropped{ 0 };
+  std::atomic<uint64_t> raw_bytes{ 0 };         // Of the floats recorded
+  std::atomic<uint64_t> bytes_written{ 0 };
+
+  ~FrameRecorder() {
+    stop();
+  }
+
+  bool start(const char* filename);
+  // Writes the pending frames and closes the file
+  void stop();
+  bool isRecording() const { return file != nullptr; }
+  bool submit(const ViscoelasticSim& sim, float dt);
+
+private:
+
+  enum eBufferState { Free, Filling, Pending, Encoding };
+
+  FILE*                   file = nullptr;
+  std::thread             writer;
+  std::mutex              mutex;
+  std::condition_variable cond;
+  bool                    stopping = false;
+  TFrame                  buffers[2];
+  eBufferState            states[2] = { Free, Free };
+  uint32_t                next_frame_id = 0;
+
+  // Quantised state of the last frame written and the current one, indexed by uid
+  std::vector<int32_t>    prev_q[NumChannels];
+  std::vector<uint8_t>    prev_alive;
+  std::vector<int32_t>    cur_q[NumChannels];
+  std::vector<uint8_t>    cur_alive;
+  float                   prev_grid_scale = 0.0f;
+  std::vector<uint8_t>    streams[NumChannels + 1];
+  std::vector<uint8_t>    out;
+
+  void writerLoop();
+  void encodeFrame(const TFrame& frame);
+};
+
+// Decodes the files written by the FrameRecorder. The particles of each frame are sorted by uid
+struct FrameReader {
+
+  bool open(const char* filename);
+  void close();
+  bool readFrame(FrameRecorder::TFrame& frame);
+
+  ~FrameReader() {
+    close();
+  }
+
+private:
+  FILE*                   file = nullptr;
+  int                     cell_bits = 10;
+  float                   vel_quantum = 1.0f;
+  std::vector<int32_t>    prev_q[FrameRecorder::NumChannels];
+  std::vector<uint8_t>    prev_alive;
+  std::vector<uint8_t>    in;
+  std::vector<uint8_t>    streams[FrameRecorder::NumChannels + 1];
+};
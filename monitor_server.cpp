@@ -0,0 +1,834 @@
+#include "platform.h"
+#include "monitor_server.h"
+#include "viscoelastic_sim.h"
+#include <chrono>
+
+#if IN_PLATFORM_WINDOWS
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#endif
+
+using namespace MonitorProtocol;
+
+namespace {
+
+#if IN_PLATFORM_WINDOWS
+  typedef SOCKET TSocket;
+  typedef WSAPOLLFD TPollFd;
+  const TSocket invalid_socket = INVALID_SOCKET;
+  void closeSocket(TSocket s) { closesocket(s); }
+  bool wouldBlock() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+  int  pollSockets(TPollFd* fds, size_t n, int timeout_ms) { return WSAPoll(fds, (ULONG)n, timeout_ms); }
+  bool setNonBlocking(TSocket s) {
+    u_long non_blocking = 1;
+    return ioctlsocket(s, FIONBIO, &non_blocking) == 0;
+  }
+#else
+  typedef int TSocket;
+  typedef struct pollfd TPollFd;
+  const TSocket invalid_socket = -1;
+  void closeSocket(TSocket s) { ::close(s); }
+  bool wouldBlock() { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR; }
+  int  pollSockets(TPollFd* fds, size_t n, int timeout_ms) { return ::poll(fds, (nfds_t)n, timeout_ms); }
+  bool setNonBlocking(TSocket s) {
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+  }
+#endif
+
+  bool startSockets() {
+#if IN_PLATFORM_WINDOWS
+    static bool wsa_started = false;
+    if (!wsa_started) {
+      WSADATA wsa_data;
+      if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+        return false;
+      wsa_started = true;
+    }
+#endif
+    return true;
+  }
+
+#if defined(MSG_NOSIGNAL)
+  const int send_flags = MSG_NOSIGNAL;
+#else
+  const int send_flags = 0;
+#endif
+
+  uint64_t nowNs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // ---------------------------------------------------------------------
+  template< typename T >
+  void put(std::vector<uint8_t>& s, T v) {
+    size_t offset = s.size();
+    s.resize(offset + sizeof(T));
+    memcpy(s.data() + offset, &v, sizeof(T));
+  }
+
+  void putVarint(std::vector<uint8_t>& s, int32_t v) {
+    uint32_t z = ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+    while (z >= 0x80) {
+      s.push_back((uint8_t)(z | 0x80));
+      z >>= 7;
+    }
+    s.push_back((uint8_t)z);
+  }
+
+  struct TReader {
+    const uint8_t* p = nullptr;
+    const uint8_t* end = nullptr;
+    bool           ok = true;
+
+    template< typename T >
+    T get() {
+      T v = T();
+      if (ok && (size_t)(end - p) >= sizeof(T)) {
+        memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+      }
+      else
+        ok = false;
+      return v;
+    }
+
+    int32_t getVarint() {
+      uint32_t z = 0;
+      for (int shift = 0; ok && shift < 35; shift += 7) {
+        if (p == end)
+          break;
+        uint8_t b = *p++;
+        z |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+          return (int32_t)((z >> 1) ^ (~(z & 1) + 1));
+      }
+      ok = false;
+      return 0;
+    }
+  };
+
+  void putHeader(std::vector<uint8_t>& s, eMessageType type) {
+    put<uint32_t>(s, magic);
+    put<uint16_t>(s, version);
+    put<uint16_t>(s, type);
+  }
+
+  // ---------------------------------------------------------------------
+  // For the Sec-WebSocket-Accept of the handshake
+  void sha1(const uint8_t* data, size_t nbytes, uint8_t out[20]) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    std::vector<uint8_t> msg(data, data + nbytes);
+    msg.push_back(0x80);
+    while (msg.size() % 64 != 56)
+      msg.push_back(0);
+    uint64_t nbits = (uint64_t)nbytes * 8;
+    for (int i = 7; i >= 0; --i)
+      msg.push_back((uint8_t)(nbits >> (i * 8)));
+
+    auto rol = [](uint32_t v, int n) { return (v << n) | (v >> (32 - n)); };
+    for (size_t block = 0; block < msg.size(); block += 64) {
+      uint32_t w[80];
+      for (int i = 0; i < 16; ++i) {
+        const uint8_t* b = &msg[block + i * 4];
+        w[i] = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+      }
+      for (int i = 16; i < 80; ++i)
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+      uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+      for (int i = 0; i < 80; ++i) {
+        uint32_t f, k;
+        if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+        else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+        else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+        else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+        uint32_t tmp = rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = tmp;
+      }
+      h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+    for (int i = 0; i < 20; ++i)
+      out[i] = (uint8_t)(h[i / 4] >> (24 - (i % 4) * 8));
+  }
+
+  std::string base64(const uint8_t* data, size_t nbytes) {
+    static const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string s;
+    for (size_t i = 0; i < nbytes; i += 3) {
+      uint32_t v = (uint32_t)data[i] << 16;
+      if (i + 1 < nbytes) v |= (uint32_t)data[i + 1] << 8;
+      if (i + 2 < nbytes) v |= data[i + 2];
+      s += chars[(v >> 18) & 63];
+      s += chars[(v >> 12) & 63];
+      s += i + 1 < nbytes ? chars[(v >> 6) & 63] : '=';
+      s += i + 2 < nbytes ? chars[v & 63] : '=';
+    }
+    return s;
+  }
+
+  std::string webSocketAccept(const std::string& key) {
+    std::string s = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    uint8_t digest[20];
+    sha1((const uint8_t*)s.data(), s.size(), digest);
+    return base64(digest, sizeof(digest));
+  }
+
+  // The value of a header of the http request, or empty
+  std::string httpHeader(const std::string& request, const char* name) {
+    std::string lower = request;
+    for (char& ch : lower)
+      ch = (char)tolower((unsigned char)ch);
+    std::string key = std::string("\r\n") + name + ":";
+    size_t pos = lower.find(key);
+    if (pos == std::string::npos)
+      return std::string();
+    size_t begin = request.find_first_not_of(" \t", pos + key.size());
+    size_t end = request.find("\r\n", pos + key.size());
+    if (begin == std::string::npos || end == std::string::npos || begin > end)
+      return std::string();
+    while (end > begin && (request[end - 1] == ' ' || request[end - 1] == '\t'))
+      --end;
+    return request.substr(begin, end - begin);
+  }
+
+}
+
+// ---------------------------------------------------------------------
+struct MonitorServer::TClient {
+  enum eProtocol { Greeting, Raw, WebSocket };
+  TSocket              socket = invalid_socket;
+  eProtocol            protocol = Greeting;
+  std::vector<uint8_t> in;
+  std::vector<uint8_t> out;
+  size_t               out_offset = 0;
+  double               tokens = 0.0;            // Bytes which can be sent
+  uint64_t             last_refill_ns = 0;
+  bool                 failed = false;          // Closed in the next iteration of the server
+};
+
+bool MonitorServer::start(int port, bool local_only) {
+  stop();
+
+  if (!startSockets())
+    return false;
+  TSocket s = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (s == invalid_socket)
+    return false;
+  int reuse = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)port);
+  addr.sin_addr.s_addr = htonl(local_only ? INADDR_LOOPBACK : INADDR_ANY);
+  if (::bind(s, (const sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(s, 8) != 0 || !setNonBlocking(s)) {
+    dbg("MonitorServer failed to listen in port %d\n", port);
+    closeSocket(s);
+    return false;
+  }
+  // The port 0 takes any free one
+  socklen_t addr_len = sizeof(addr);
+  if (getsockname(s, (sockaddr*)&addr, &addr_len) == 0)
+    port = ntohs(addr.sin_port);
+  listen_socket = (intptr_t)s;
+  listen_port = port;
+
+  hello.clear();
+  putHeader(hello, Hello);
+  put<uint16_t>(hello, (uint16_t)ViscoelasticSim::eSection::NumSections);
+  for (int i = 0; i < ViscoelasticSim::eSection::NumSections; ++i) {
+    const char* name = ViscoelasticSim::sectionName((ViscoelasticSim::eSection)i);
+    size_t len = std::min(strlen(name), (size_t)255);
+    hello.push_back((uint8_t)len);
+    hello.insert(hello.end(), name, name + len);
+  }
+
+  for (int i = 0; i < 2; ++i)
+    states[i] = Free;
+  next_submit_ns = 0;
+  stopping = false;
+  running = true;
+  server = std::thread(&MonitorServer::serverLoop, this);
+  dbg("MonitorServer listening in %s:%d\n", local_only ? "127.0.0.1" : "*", port);
+  return true;
+}
+
+void MonitorServer::stop() {
+  if (!running)
+    return;
+  stopping = true;
+  server.join();
+  for (TClient* c : clients)
+    closeClient(c);
+  clients.clear();
+  num_clients = 0;
+  closeSocket((TSocket)listen_socket);
+  listen_socket = -1;
+  listen_port = 0;
+  running = false;
+}
+
+bool MonitorServer::submit(const ViscoelasticSim& sim, float dt) {
+  // Nothing to copy until a client finishes its handshake
+  if (!running || num_clients.load(std::memory_order_relaxed) == 0)
+    return false;
+  uint64_t now = nowNs();
+  if (now < next_submit_ns)
+    return false;
+  next_submit_ns = now + (uint64_t)(1e9 / std::max(send_rate, 0.01f));
+
+  int idx = -1;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < 2; ++i) {
+      if (states[i] == Free) {
+        idx = i;
+        break;
+      }
+    }
+    if (idx < 0) {
+      snapshots_dropped++;
+      return false;
+    }
+    states[idx] = Filling;
+  }
+
+  PROFILE_SCOPED_NAMED("MonitorServer.submit");
+  TSnapshot& s = buffers[idx];
+  uint32_t n = (uint32_t)sim.num_particles;
+  s.frame_id = next_frame_id++;
+  s.dt = dt;
+  s.num_particles = n;
+  s.max_particles = (uint32_t)sim.max_particles;
+  s.cells_used = (uint32_t)sim.spatial_hash.cells_ranges.size();
+  s.hash_cells = (uint32_t)CPUSpatialSubdivision::num_cells;
+  s.num_collisions = sim.spatial_hash.num_collisions;
+  s.times_ms.resize(ViscoelasticSim::eSection::NumSections);
+  for (int i = 0; i < ViscoelasticSim::eSection::NumSections; ++i)
+    s.times_ms[i] = (float)(sim.times[i] * 1e3);
+
+  uint32_t limit = (uint32_t)std::max(max_points, 1);
+  s.stride = std::max((n + limit - 1) / limit, 1u);
+  uint32_t num_points = (n + s.stride - 1) / s.stride;
+  const float* src[3] = { sim.particles_pos.x, sim.particles_pos.y, sim.particles_pos.z };
+  for (int a = 0; a < 3; ++a) {
+    s.pos[a].resize(num_points);
+    for (uint32_t k = 0; k < num_points; ++k)
+      s.pos[a][k] = src[a][k * s.stride];
+  }
+  s.types.resize(num_points);
+  for (uint32_t k = 0; k < num_points; ++k)
+    s.types[k] = sim.particles_type[k * s.stride];
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    states[idx] = Pending;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------
+void MonitorServer::encodeSnapshot(const TSnapshot& s) {
+  message.clear();
+  putHeader(message, Stats);
+  put<uint32_t>(message, s.frame_id);
+  put<float>(message, s.dt);
+  put<uint32_t>(message, s.num_particles);
+  put<uint32_t>(message, s.max_particles);
+  put<uint32_t>(message, s.cells_used);
+  put<uint32_t>(message, s.hash_cells);
+  put<uint32_t>(message, s.num_collisions);
+  put<uint16_t>(message, (uint16_t)s.times_ms.size());
+  for (float t : s.times_ms)
+    put<float>(message, t);
+
+  uint32_t num_points = (uint32_t)s.types.size();
+  put<uint32_t>(message, num_points);
+  put<uint32_t>(message, s.stride);
+  float bmin[3] = { 0.0f, 0.0f, 0.0f };
+  float bmax[3] = { 0.0f, 0.0f, 0.0f };
+  for (int a = 0; a < 3; ++a) {
+    if (num_points) {
+      auto mm = std::minmax_element(s.pos[a].begin(), s.pos[a].end());
+      bmin[a] = *mm.first;
+      bmax[a] = *mm.second;
+    }
+    put<float>(message, bmin[a]);
+  }
+  for (int a = 0; a < 3; ++a)
+    put<float>(message, bmax[a]);
+  message.insert(message.end(), s.types.begin(), s.types.end());
+
+  float scale[3];
+  for (int a = 0; a < 3; ++a)
+    scale[a] = bmax[a] > bmin[a] ? 65535.0f / (bmax[a] - bmin[a]) : 0.0f;
+  int32_t prev[3] = { 0, 0, 0 };
+  for (uint32_t k = 0; k < num_points; ++k) {
+    for (int a = 0; a < 3; ++a) {
+      int32_t q = (int32_t)((s.pos[a][k] - bmin[a]) * scale[a] + 0.5f);
+      q = std::min(std::max(q, 0), 65535);
+      putVarint(message, q - prev[a]);
+      prev[a] = q;
+    }
+  }
+}
+
+bool MonitorMessage::decode(const uint8_t* data, size_t nbytes) {
+  TReader r;
+  r.p = data;
+  r.end = data + nbytes;
+  if (r.get<uint32_t>() != magic || r.get<uint16_t>() != version)
+    return false;
+  type = (eMessageType)r.get<uint16_t>();
+
+  if (type == Hello) {
+    uint16_t num_sections = r.get<uint16_t>();
+    section_names.clear();
+    for (uint16_t i = 0; r.ok && i < num_sections; ++i) {
+      uint8_t len = r.get<uint8_t>();
+      if ((size_t)(r.end - r.p) < len)
+        return false;
+      section_names.emplace_back((const char*)r.p, (size_t)len);
+      r.p += len;
+    }
+    return r.ok;
+  }
+  if (type != Stats)
+    return false;
+
+  frame_id = r.get<uint32_t>();
+  dt = r.get<float>();
+  num_particles = r.get<uint32_t>();
+  max_particles = r.get<uint32_t>();
+  cells_used = r.get<uint32_t>();
+  hash_cells = r.get<uint32_t>();
+  num_collisions = r.get<uint32_t>();
+  times_ms.resize(r.get<uint16_t>());
+  for (float& t : times_ms)
+    t = r.get<float>();
+  uint32_t num_points = r.get<uint32_t>();
+  stride = r.get<uint32_t>();
+  for (int a = 0; a < 3; ++a)
+    bounds_min[a] = r.get<float>();
+  for (int a = 0; a < 3; ++a)
+    bounds_max[a] = r.get<float>();
+  if (!r.ok || (size_t)(r.end - r.p) < num_points)
+    return false;
+  types.assign(r.p, r.p + num_points);
+  r.p += num_points;
+
+  float step[3];
+  for (int a = 0; a < 3; ++a) {
+    step[a] = (bounds_max[a] - bounds_min[a]) / 65535.0f;
+    pos[a].resize(num_points);
+  }
+  int32_t q[3] = { 0, 0, 0 };
+  for (uint32_t k = 0; r.ok && k < num_points; ++k) {
+    for (int a = 0; a < 3; ++a) {
+      q[a] += r.getVarint();
+      pos[a][k] = bounds_min[a] + q[a] * step[a];
+    }
+  }
+  return r.ok;
+}
+
+// ---------------------------------------------------------------------
+void MonitorServer::acceptClients() {
+  for (;;) {
+    TSocket s = ::accept((TSocket)listen_socket, nullptr, nullptr);
+    if (s == invalid_socket)
+      return;
+    if ((int)clients.size() >= max_clients || !setNonBlocking(s)) {
+      closeSocket(s);
+      continue;
+    }
+    int no_delay = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay, sizeof(no_delay));
+    // A small buffer in the kernel, so a slow client skips snapshots instead of receiving old ones
+    int send_buffer = 64 * 1024;
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char*)&send_buffer, sizeof(send_buffer));
+#if defined(SO_NOSIGPIPE)
+    int no_sigpipe = 1;
+    setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+#endif
+    TClient* c = new TClient;
+    c->socket = s;
+    c->last_refill_ns = nowNs();
+    clients.push_back(c);
+  }
+}
+
+// Reads the greeting or the handshake, and the frames sent by the WebSocket clients.
+// False when the client has to be closed
+bool MonitorServer::readClient(TClient* c) {
+  uint8_t buf[4096];
+  for (;;) {
+    int n = (int)::recv(c->socket, (char*)buf, sizeof(buf), 0);
+    if (n == 0)
+      return false;
+    if (n < 0) {
+      if (wouldBlock())
+        break;
+      return false;
+    }
+    // The raw clients do not send anything after the greeting
+    if (c->protocol != TClient::Raw)
+      c->in.insert(c->in.end(), buf, buf + n);
+    if (c->in.size() > 64 * 1024)
+      return false;
+  }
+
+  if (c->protocol == TClient::Greeting) {
+    if (c->in.size() < 4)
+      return true;
+    if (memcmp(c->in.data(), "VMON", 4) == 0) {
+      c->protocol = TClient::Raw;
+      c->in.clear();
+    }
+    else if (memcmp(c->in.data(), "GET ", 4) == 0) {
+      std::string request((const char*)c->in.data(), c->in.size());
+      size_t end = request.find("\r\n\r\n");
+      if (end == std::string::npos)
+        return true;
+      std::string key = httpHeader(request, "sec-websocket-key");
+      if (key.empty())
+        return false;
+      char response[256];
+      int len = snprintf(response, sizeof(response),
+        "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n"
+        , webSocketAccept(key).c_str());
+      c->out.insert(c->out.end(), response, response + len);
+      c->protocol = TClient::WebSocket;
+      c->in.erase(c->in.begin(), c->in.begin() + end + 4);
+    }
+    else
+      return false;
+    num_clients++;
+    sendMessage(c, hello, false);
+  }
+
+  // Only the close frames of the client are relevant, the rest is discarded
+  while (c->protocol == TClient::WebSocket && c->in.size() >= 2) {
+    const uint8_t* p = c->in.data();
+    uint8_t opcode = p[0] & 0x0f;
+    uint64_t len = p[1] & 0x7f;
+    size_t header = 2;
+    if (len == 126) {
+      if (c->in.size() < 4)
+        break;
+      len = ((uint64_t)p[2] << 8) | p[3];
+      header = 4;
+    }
+    else if (len == 127) {
+      if (c->in.size() < 10)
+        break;
+      len = 0;
+      for (int i = 0; i < 8; ++i)
+        len = (len << 8) | p[2 + i];
+      header = 10;
+    }
+    if (p[1] & 0x80)
+      header += 4;
+    if (opcode == 0x8)
+      return false;
+    if (c->in.size() < header + len)
+      break;
+    c->in.erase(c->in.begin(), c->in.begin() + (size_t)(header + len));
+  }
+  return true;
+}
+
+// Queues a message in the output of a client. The stats are skipped while the previous
+// message is still being sent, or when the client is over its bandwidth
+void MonitorServer::sendMessage(TClient* c, const std::vector<uint8_t>& msg, bool is_stats) {
+  size_t nbytes = msg.size() + 10;
+  if (is_stats) {
+    uint64_t now = nowNs();
+    double burst = max_bytes_per_second * 0.25;
+    c->tokens = std::min(c->tokens + max_bytes_per_second * (now - c->last_refill_ns) * 1e-9, burst);
+    c->last_refill_ns = now;
+    // A message larger than the burst is sent with the bucket full, and the next ones wait for the debt
+    if (c->out_offset < c->out.size() || c->tokens < std::min((double)nbytes, burst)) {
+      messages_skipped++;
+      return;
+    }
+    c->tokens -= (double)nbytes;
+  }
+
+  if (c->protocol == TClient::Raw) {
+    put<uint32_t>(c->out, (uint32_t)msg.size());
+  }
+  else {
+    c->out.push_back(0x82);     // Final binary frame
+    if (msg.size() < 126)
+      c->out.push_back((uint8_t)msg.size());
+    else if (msg.size() < 65536) {
+      c->out.push_back(126);
+      c->out.push_back((uint8_t)(msg.size() >> 8));
+      c->out.push_back((uint8_t)msg.size());
+    }
+    else {
+      c->out.push_back(127);
+      for (int i = 7; i >= 0; --i)
+        c->out.push_back((uint8_t)((uint64_t)msg.size() >> (i * 8)));
+    }
+  }
+  c->out.insert(c->out.end(), msg.begin(), msg.end());
+}
+
+bool MonitorServer::flushClient(TClient* c) {
+  while (c->out_offset < c->out.size()) {
+    int n = (int)::send(c->socket, (const char*)c->out.data() + c->out_offset, (int)(c->out.size() - c->out_offset), send_flags);
+    if (n < 0) {
+      if (wouldBlock())
+        return true;
+      return false;
+    }
+    c->out_offset += n;
+    bytes_sent += n;
+  }
+  c->out.clear();
+  c->out_offset = 0;
+  return true;
+}
+
+void MonitorServer::closeClient(TClient* c) {
+  if (c->protocol != TClient::Greeting)
+    num_clients--;
+  closeSocket(c->socket);
+  delete c;
+}
+
+void MonitorServer::serverLoop() {
+  std::vector<TPollFd> fds;
+  while (!stopping) {
+    fds.resize(clients.size() + 1);
+    fds[0].fd = (TSocket)listen_socket;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    for (size_t i = 0; i < clients.size(); ++i) {
+      TClient* c = clients[i];
+      fds[i + 1].fd = c->socket;
+      fds[i + 1].events = POLLIN | (c->out_offset < c->out.size() ? POLLOUT : 0);
+      fds[i + 1].revents = 0;
+    }
+    // The timeout bounds the latency of the snapshots and of stop
+    pollSockets(fds.data(), fds.size(), 5);
+
+    // The clients accepted now are polled in the next iteration
+    size_t num_polled = clients.size();
+    if (fds[0].revents & POLLIN)
+      acceptClients();
+    for (size_t i = 0; i < num_polled; ++i) {
+      TClient* c = clients[i];
+      short revents = fds[i + 1].revents;
+      bool alive = !c->failed;
+      if (alive && (revents & (POLLIN | POLLHUP | POLLERR)))
+        alive = readClient(c);
+      if (alive)
+        alive = flushClient(c);
+      if (!alive) {
+        closeClient(c);
+        clients[i] = nullptr;
+      }
+    }
+    clients.erase(std::remove(clients.begin(), clients.end(), nullptr), clients.end());
+
+    int idx = -1;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      // Only the latest snapshot is relevant to monitor
+      for (int i = 0; i < 2; ++i) {
+        if (states[i] == Pending && (idx < 0 || buffers[i].frame_id > buffers[idx].frame_id))
+          idx = i;
+      }
+      if (idx >= 0) {
+        states[idx] = Encoding;
+        if (states[1 - idx] == Pending) {
+          states[1 - idx] = Free;
+          snapshots_dropped++;
+        }
+      }
+    }
+    if (idx < 0)
+      continue;
+    encodeSnapshot(buffers[idx]);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      states[idx] = Free;
+    }
+    bool sent = false;
+    for (TClient* c : clients) {
+      if (c->protocol == TClient::Greeting)
+        continue;
+      size_t queued = c->out.size();
+      sendMessage(c, message, true);
+      if (c->out.size() != queued) {
+        sent = true;
+        c->failed = !flushClient(c);
+      }
+    }
+    if (sent)
+      snapshots_sent++;
+  }
+}
+
+// ---------------------------------------------------------------------
+bool MonitorClient::connect(const char* host, int port, bool use_websocket) {
+  close();
+  if (!startSockets())
+    return false;
+  TSocket s = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (s == invalid_socket)
+    return false;
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)port);
+  if (inet_pton(AF_INET, host, &addr.sin_addr) != 1 || ::connect(s, (const sockaddr*)&addr, sizeof(addr)) != 0) {
+    closeSocket(s);
+    return false;
+  }
+#if defined(SO_NOSIGPIPE)
+  int no_sigpipe = 1;
+  setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+#endif
+
+  // The handshake is blocking, the messages are received with a timeout
+  std::string greeting = "VMON";
+  const char* key = "dGhlIHNhbXBsZSBub25jZQ==";
+  if (use_websocket) {
+    char request[256];
+    snprintf(request, sizeof(request), "GET / HTTP/1.1\r\nHost: %s:%d\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n", host, port, key);
+    greeting = request;
+  }
+  if ((int)::send(s, greeting.data(), (int)greeting.size(), send_flags) != (int)greeting.size()) {
+    closeSocket(s);
+    return false;
+  }
+  in.clear();
+  if (use_websocket) {
+    std::string response;
+    size_t end = std::string::npos;
+    char buf[512];
+    while (end == std::string::npos && response.size() < 4096) {
+      int n = (int)::recv(s, buf, sizeof(buf), 0);
+      if (n <= 0)
+        break;
+      response.append(buf, n);
+      end = response.find("\r\n\r\n");
+    }
+    if (end == std::string::npos || response.compare(0, 12, "HTTP/1.1 101") != 0
+      || httpHeader(response, "sec-websocket-accept") != webSocketAccept(key)) {
+      closeSocket(s);
+      return false;
+    }
+    // The first messages may arrive with the response
+    in.assign(response.begin() + end + 4, response.end());
+  }
+  if (!setNonBlocking(s)) {
+    closeSocket(s);
+    return false;
+  }
+  socket = (intptr_t)s;
+  websocket = use_websocket;
+  return true;
+}
+
+void MonitorClient::close() {
+  if (socket == -1)
+    return;
+  closeSocket((TSocket)socket);
+  socket = -1;
+  in.clear();
+}
+
+bool MonitorClient::nextMessage(size_t& header, size_t& payload) const {
+  const uint8_t* p = in.data();
+  if (!websocket) {
+    if (in.size() < 4)
+      return false;
+    uint32_t size;
+    memcpy(&size, p, sizeof(size));
+    header = 4;
+    payload = size;
+  }
+  else {
+    // The server sends a final binary frame for each message, without mask
+    if (in.size() < 2)
+      return false;
+    uint64_t len = p[1] & 0x7f;
+    header = 2;
+    if (len == 126) {
+      if (in.size() < 4)
+        return false;
+      len = ((uint64_t)p[2] << 8) | p[3];
+      header = 4;
+    }
+    else if (len == 127) {
+      if (in.size() < 10)
+        return false;
+      len = 0;
+      for (int i = 0; i < 8; ++i)
+        len = (len << 8) | p[2 + i];
+      header = 10;
+    }
+    payload = (size_t)std::min(len, (uint64_t)max_message_bytes + 1);
+  }
+  return true;
+}
+
+bool MonitorClient::receive(MonitorMessage& msg, int timeout_ms) {
+  uint64_t deadline = nowNs() + (uint64_t)timeout_ms * 1000000;
+  while (socket != -1) {
+    size_t header = 0, payload = 0;
+    if (nextMessage(header, payload)) {
+      if (payload > max_message_bytes) {
+        close();
+        return false;
+      }
+      if (in.size() >= header + payload) {
+        bool ok = msg.decode(in.data() + header, payload);
+        in.erase(in.begin(), in.begin() + header + payload);
+        if (!ok)
+          close();
+        return ok;
+      }
+    }
+
+    uint64_t now = nowNs();
+    if (now >= deadline)
+      return false;
+    TPollFd fd;
+    fd.fd = (TSocket)socket;
+    fd.events = POLLIN;
+    fd.revents = 0;
+    if (pollSockets(&fd, 1, (int)((deadline - now + 999999) / 1000000)) <= 0)
+      continue;
+    uint8_t buf[16384];
+    for (;;) {
+      int n = (int)::recv((TSocket)socket, (char*)buf, sizeof(buf), 0);
+      if (n > 0) {
+        in.insert(in.end(), buf, buf + n);
+        bytes_received += n;
+        continue;
+      }
+      if (n == 0 || !wouldBlock())
+        close();
+      break;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+struct ViscoelasticSim;
+
+// Streams the state of the sim to the clients connected to a local TCP port, for the
+// headless nodes where the menu of the app is not available. A background thread owns the
+// sockets, which are non-blocking. The main thread only copies a small snapshot to one of two
+// buffers, at most send_rate times per second, and drops it when both are still pending, like
+// the FrameRecorder, so a slow client never stalls the sim.
+// Each snapshot has the times of each section of the sim, the number of particles, the cells
+// and collisions of the spatial hash, and up to max_points particles, one every stride. The
+// positions are quantised to 16 bits in the bounds of the points sent, and coded as zigzag
+// varints of the difference with the previous point. The particles are sorted by cell so the
+// differences are small, and each message can be decoded alone.
+// The sends to each client are limited to max_bytes_per_second. A client which has not
+// received the previous message yet, or has no budget left, skips the snapshot.
+// The clients choose the protocol with their first bytes:
+//   "VMON"             Raw TCP, each message is prefixed by its size as an u32
+//   "GET ... Upgrade"  WebSocket, each message is a binary frame
+// The messages are decoded with MonitorMessage::decode, as tools/monitor.cpp does.
+namespace MonitorProtocol {
+
+  constexpr uint32_t magic = 0x4E4F4D56;      // VMON
+  constexpr uint16_t version = 1;
+  constexpr uint32_t max_message_bytes = 16 * 1024 * 1024;
+
+  enum eMessageType : uint16_t {
+    Hello = 0,          // Names of the sections
+    Stats = 1,          // Times, counts and points of a snapshot
+  };
+}
+
+struct MonitorMessage {
+  MonitorProtocol::eMessageType type = MonitorProtocol::Hello;
+
+  // Hello
+  std::vector<std::string> section_names;
+
+  // Stats
+  uint32_t              frame_id = 0;
+  float                 dt = 0.0f;
+  uint32_t              num_particles = 0;
+  uint32_t              max_particles = 0;
+  uint32_t              cells_used = 0;
+  uint32_t              hash_cells = 0;
+  uint32_t              num_collisions = 0;
+  std::vector<float>    times_ms;             // One per section
+  uint32_t              stride = 1;           // Of the particles sent
+  float                 bounds_min[3] = { 0.0f, 0.0f, 0.0f };
+  float                 bounds_max[3] = { 0.0f, 0.0f, 0.0f };
+  std::vector<float>    pos[3];               // Dequantised, in sim units
+  std::vector<uint8_t>  types;
+
+  // False when the message is truncated or of another version
+  bool decode(const uint8_t* data, size_t nbytes);
+};
+
+struct MonitorServer {
+
+  int                   max_points = 8192;
+  float                 send_rate = 20.0f;                  // Snapshots per second
+  uint32_t              max_bytes_per_second = 1 << 20;     // For each client
+  int                   max_clients = 8;
+
+  std::atomic<uint64_t> snapshots_sent{ 0 };                // Encoded by the server, sent to at least one client
+  std::atomic<uint64_t> snapshots_dropped{ 0 };             // Both buffers were pending, or replaced by a newer one
+  std::atomic<uint64_t> messages_skipped{ 0 };              // Of a client, busy or over its budget
+  std::atomic<uint64_t> bytes_sent{ 0 };
+  std::atomic<int>      num_clients{ 0 };
+
+  ~MonitorServer() {
+    stop();
+  }
+
+  // Only listens in 127.0.0.1 unless local_only is false
+  bool start(int port, bool local_only = true);
+  void stop();
+  bool isRunning() const { return running; }
+  int  port() const { return listen_port; }
+  // From the main thread after the update of the sim
+  bool submit(const ViscoelasticSim& sim, float dt);
+
+private:
+
+  enum eBufferState { Free, Filling, Pending, Encoding };
+
+  struct TSnapshot {
+    uint32_t              frame_id = 0;
+    float                 dt = 0.0f;
+    uint32_t              num_particles = 0;
+    uint32_t              max_particles = 0;
+    uint32_t              cells_used = 0;
+    uint32_t              hash_cells = 0;
+    uint32_t              num_collisions = 0;
+    std::vector<float>    times_ms;
+    uint32_t              stride = 1;
+    std::vector<float>    pos[3];
+    std::vector<uint8_t>  types;
+  };
+
+  struct TClient;
+
+  bool                    running = false;
+  int                     listen_port = 0;
+  intptr_t                listen_socket = -1;
+  std::thread             server;
+  std::mutex              mutex;
+  std::atomic<bool>       stopping{ false };
+  TSnapshot               buffers[2];
+  eBufferState            states[2] = { Free, Free };
+  uint32_t                next_frame_id = 0;
+  uint64_t                next_submit_ns = 0;
+
+  std::vector<TClient*>   clients;
+  std::vector<uint8_t>    hello;
+  std::vector<uint8_t>    message;
+
+  void serverLoop();
+  void acceptClients();
+  void encodeSnapshot(const TSnapshot& s);
+  void sendMessage(TClient* c, const std::vector<uint8_t>& msg, bool is_stats);
+  bool readClient(TClient* c);
+  bool flushClient(TClient* c);
+  void closeClient(TClient* c);
+};
+
+// Connects to a MonitorServer as a raw TCP or a WebSocket client, and receives its messages
+struct MonitorClient {
+
+  uint64_t bytes_received = 0;
+
+  ~MonitorClient() {
+    close();
+  }
+
+  bool connect(const char* host, int port, bool use_websocket = false);
+  void close();
+  bool isConnected() const { return socket != -1; }
+  // Waits up to timeout_ms for the next message. False on timeout, or when the server closed
+  // the connection or sent an invalid message, then isConnected is false
+  bool receive(MonitorMessage& msg, int timeout_ms);
+
+private:
+  intptr_t             socket = -1;
+  bool                 websocket = false;
+  std::vector<uint8_t> in;
+
+  // The size of the header and of the payload of the first message in the input
+  bool nextMessage(size_t& header, size_t& payload) const;
+};
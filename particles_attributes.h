@@ -0,0 +1,220 @@
+#pragma once
+
+#include <memory>
+#include "particles_vec.h"
+
+// Registry of the per-particle channels owned by the simulation.
+// Each channel has a current and an aux buffer. When the spatial hash
+// reorders the particles, all the channels are swapped and gathered
+// together in a single pass, so a new attribute only needs to be registered.
+struct ParticlesAttributes {
+
+  using u32 = uint32_t;
+
+  struct Channel {
+    std::string          name;
+    u32                  bytes_per_elem = 0;
+    u32                  num_planes = 1;               // 3 for ParticlesVec channels
+
+    // When num_planes == 3, the current and aux ParticlesVec
+    ParticlesVec*        vecs[2] = { nullptr, nullptr };
+    // When num_planes == 1, the address of the current and aux pointers, so we can swap them
+    uint8_t**            ptrs[2] = { nullptr, nullptr };
+
+    // Storage used by the channels created by the registry
+    bool                 owned = false;
+    ParticlesVec         owned_vecs[2];
+    std::vector<uint8_t> owned_bufs[2];
+    uint8_t*             owned_ptrs[2] = { nullptr, nullptr };
+
+    uint8_t* plane(int buffer_idx, int plane_idx) const {
+      if (num_planes == 3) {
+        const ParticlesVec* v = vecs[buffer_idx];
+        return (uint8_t*)(plane_idx == 0 ? v->x : (plane_idx == 1 ? v->y : v->z));
+      }
+      return *ptrs[buffer_idx];
+    }
+
+    void swap() {
+      if (num_planes == 3)
+        vecs[0]->swap(*vecs[1]);
+      else
+        std::swap(*ptrs[0], *ptrs[1]);
+    }
+
+    void resize(size_t new_size) {
+      if (!owned)
+        return;
+      for (int b = 0; b < 2; ++b) {
+        if (num_planes == 3) {
+          owned_vecs[b].resize(new_size);
+        }
+        else {
+          owned_bufs[b].resize(new_size * bytes_per_elem);
+          owned_ptrs[b] = owned_bufs[b].data();
+        }
+      }
+    }
+  };
+
+  // Channels are stored by pointer so the addresses registered in ptrs remain valid
+  std::vector< std::unique_ptr<Channel> > channels;
+  size_t                                  capacity = 0;
+
+  Channel* find(const char* name) const {
+    for (auto& ch : channels) {
+      if (ch->name == name)
+        return ch.get();
+    }
+    return nullptr;
+  }
+
+  // Register a ParticlesVec pair owned by the host
+  Channel* bindVec(const char* name, ParticlesVec* curr, ParticlesVec* aux) {
+    Channel* ch = find(name);
+    if (!ch)
+      ch = newChannel(name, sizeof(float), 3);
+    ch->vecs[0] = curr;
+    ch->vecs[1] = aux;
+    return ch;
+  }
+
+  // Register a pair of scalar arrays owned by the host
+  template< typename T >
+  Channel* bind(const char* name, T** curr, T** aux) {
+    Channel* ch = find(name);
+    if (!ch)
+      ch = newChannel(name, sizeof(T), 1);
+    ch->ptrs[0] = reinterpret_cast<uint8_t**>(curr);
+    ch->ptrs[1] = reinterpret_cast<uint8_t**>(aux);
+    return ch;
+  }
+
+  // Create a scalar channel stored in the registry. Returns the existing one if already created
+  template< typename T >
+  Channel* create(const char* name) {
+    if (Channel* ch = find(name)) {
+      assert(ch->owned && ch->bytes_per_elem == sizeof(T) && ch->num_planes == 1);
+      return ch;
+    }
+    Channel* ch = newChannel(name, sizeof(T), 1);
+    ch->owned = true;
+    ch->ptrs[0] = &ch->owned_ptrs[0];
+    ch->ptrs[1] = &ch->owned_ptrs[1];
+    ch->resize(capacity);
+    return ch;
+  }
+
+  // Create a VEC3 channel stored in the registry, as 3 planes of floats
+  Channel* createVec(const char* name) {
+    if (Channel* ch = find(name)) {
+      assert(ch->owned && ch->num_planes == 3);
+      return ch;
+    }
+    Channel* ch = newChannel(name, sizeof(float), 3);
+    ch->owned = true;
+    ch->vecs[0] = &ch->owned_vecs[0];
+    ch->vecs[1] = &ch->owned_vecs[1];
+    ch->resize(capacity);
+    return ch;
+  }
+
+  // The pointer is only valid until the next reorder of the particles
+  template< typename T >
+  T* data(const char* name) const {
+    Channel* ch = find(name);
+    if (!ch)
+      return nullptr;
+    assert(ch->bytes_per_elem == sizeof(T) && ch->num_planes == 1);
+    return reinterpret_cast<T*>(ch->plane(0, 0));
+  }
+
+  ParticlesVec* vec(const char* name) const {
+    Channel* ch = find(name);
+    if (!ch)
+      return nullptr;
+    assert(ch->num_planes == 3);
+    return ch->vecs[0];
+  }
+
+  // Resize the channels owned by the registry. The host resizes its own buffers
+  void resize(size_t new_capacity) {
+    capacity = new_capacity;
+    for (auto& ch : channels)
+      ch->resize(capacity);
+  }
+
+  // Zero the owned channels, used when new particles are appended
+  void clearOwned(u32 first, u32 count) {
+    for (auto& ch : channels) {
+      if (!ch->owned)
+        continue;
+      for (u32 p = 0; p < ch->num_planes; ++p)
+        memset(ch->plane(0, p) + (size_t)first * ch->bytes_per_elem, 0x00, (size_t)count * ch->bytes_per_elem);
+    }
+  }
+
+  // Copy the element at src into dst in all the channels of the current buffers
+  void copyElem(u32 dst, u32 src) {
+    for (auto& ch : channels) {
+      u32 sz = ch->bytes_per_elem;
+      for (u32 p = 0; p < ch->num_planes; ++p) {
+        uint8_t* base = ch->plane(0, p);
+        memcpy(base + (size_t)dst * sz, base + (size_t)src * sz, sz);
+      }
+    }
+  }
+
+  // Move the current buffers to the aux buffers, before gathering in the new order
+  void swapAll() {
+    for (auto& ch : channels)
+      ch->swap();
+  }
+
+  // For each output slot in [first,last), copy the element from the aux buffer at new_to_old[slot]
+  // The range is processed in blocks, so the indices of the block remain in L1 while
+  // we iterate over all the planes of all the channels
+  void gather(const u32* __restrict new_to_old, u32 first, u32 last) const {
+    constexpr u32 block_size = 2048;
+    for (u32 block_first = first; block_first < last; block_first += block_size) {
+      u32 block_last = std::min(block_first + block_size, last);
+      for (auto& ch : channels) {
+        for (u32 p = 0; p < ch->num_planes; ++p) {
+          const uint8_t* src = ch->plane(1, p);
+          uint8_t* dst = ch->plane(0, p);
+          switch (ch->bytes_per_elem) {
+          case 1: gatherBlock<uint8_t>(dst, src, new_to_old, block_first, block_last); break;
+          case 2: gatherBlock<uint16_t>(dst, src, new_to_old, block_first, block_last); break;
+          case 4: gatherBlock<uint32_t>(dst, src, new_to_old, block_first, block_last); break;
+          case 8: gatherBlock<uint64_t>(dst, src, new_to_old, block_first, block_last); break;
+          default: {
+            u32 sz = ch->bytes_per_elem;
+            for (u32 i = block_first; i < block_last; ++i)
+              memcpy(dst + (size_t)i * sz, src + (size_t)new_to_old[i] * sz, sz);
+          }
+          }
+        }
+      }
+    }
+  }
+
+private:
+
+  Channel* newChannel(const char* name, u32 bytes_per_elem, u32 num_planes) {
+    channels.emplace_back(std::make_unique<Channel>());
+    Channel* ch = channels.back().get();
+    ch->name = name;
+    ch->bytes_per_elem = bytes_per_elem;
+    ch->num_planes = num_planes;
+    return ch;
+  }
+
+  template< typename T >
+  static void gatherBlock(uint8_t* dst_bytes, const uint8_t* src_bytes, const u32* __restrict new_to_old, u32 first, u32 last) {
+    T* __restrict dst = reinterpret_cast<T*>(dst_bytes);
+    const T* __restrict src = reinterpret_cast<const T*>(src_bytes);
+    for (u32 i = first; i < last; ++i)
+      dst[i] = src[new_to_old[i]];
+  }
+
+};
@@ -0,0 +1,342 @@
+#include "platform.h"
+#include "particles_feed.h"
+#include "viscoelastic_sim.h"
+#include <chrono>
+
+#if IN_PLATFORM_WINDOWS
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace ParticlesFeedLayout;
+
+namespace {
+
+  uint8_t* slotAddr(const THeader* header, uint32_t slot) {
+    return (uint8_t*)header + header_bytes + (size_t)slot * header->slot_bytes;
+  }
+
+  // Creates or opens the shared memory segment. nbytes is 0 to open an existing one
+  void* mapSegment(const char* name, size_t nbytes, size_t* mapped_bytes, void** handle) {
+    bool creating = nbytes != 0;
+#if IN_PLATFORM_WINDOWS
+    HANDLE hmapping = nullptr;
+    if (creating) {
+      hmapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)nbytes >> 32), (DWORD)nbytes, name);
+      // A reader still has the previous segment, which keeps its size
+      if (hmapping && GetLastError() == ERROR_ALREADY_EXISTS) {
+        CloseHandle(hmapping);
+        return nullptr;
+      }
+    }
+    else
+      hmapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+    if (!hmapping)
+      return nullptr;
+    void* addr = MapViewOfFile(hmapping, creating ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, 0);
+    if (!addr) {
+      CloseHandle(hmapping);
+      return nullptr;
+    }
+    if (!creating) {
+      MEMORY_BASIC_INFORMATION info;
+      VirtualQuery(addr, &info, sizeof(info));
+      nbytes = info.RegionSize;
+    }
+    *handle = hmapping;
+#else
+    (void)handle;
+    int fd = creating ? shm_open(name, O_CREAT | O_RDWR, 0644) : shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+      return nullptr;
+    if (creating) {
+      if (ftruncate(fd, (off_t)nbytes) != 0) {
+        ::close(fd);
+        return nullptr;
+      }
+    }
+    else {
+      struct stat st;
+      if (fstat(fd, &st) != 0 || (size_t)st.st_size < header_bytes) {
+        ::close(fd);
+        return nullptr;
+      }
+      nbytes = (size_t)st.st_size;
+    }
+    void* addr = mmap(nullptr, nbytes, creating ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED)
+      return nullptr;
+#endif
+    *mapped_bytes = nbytes;
+    return addr;
+  }
+
+  // The first segment is name, the next ones name.generation
+  void segmentName(char* out, size_t out_size, const char* name, uint32_t generation) {
+    if (generation)
+      snprintf(out, out_size, "%s.%u", name, generation);
+    else
+      snprintf(out, out_size, "%s", name);
+  }
+
+  // The readers still mapping the segment keep it alive. In windows it's released with the last handle
+  void unlinkSegment(const char* name, uint32_t generation) {
+#if IN_PLATFORM_WINDOWS
+    (void)name;
+    (void)generation;
+#else
+    char segment[80];
+    segmentName(segment, sizeof(segment), name, generation);
+    shm_unlink(segment);
+#endif
+  }
+
+  void unmapSegment(const void* addr, size_t nbytes, void* handle) {
+#if IN_PLATFORM_WINDOWS
+    (void)nbytes;
+    UnmapViewOfFile(addr);
+    CloseHandle((HANDLE)handle);
+#else
+    (void)handle;
+    munmap((void*)addr, nbytes);
+#endif
+  }
+
+  uint64_t nowNs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+}
+
+// ---------------------------------------------------------------------
+bool ParticlesFeed::start(const char* new_name, int capacity) {
+  stop();
+  snprintf(name, sizeof(name), "%s", new_name);
+  next_frame_id = 0;
+  frames_published = 0;
+  generation = 0;
+  if (!create((uint32_t)std::max(capacity, 1)))
+    return false;
+  first_header = header;
+  first_mapped_bytes = mapped_bytes;
+  first_handle = handle;
+  return true;
+}
+
+// Maps the segment of the current generation as the one in use. The previous one is kept on failure
+bool ParticlesFeed::create(uint32_t capacity) {
+  // Keep the arrays of each slot aligned to the cache lines
+  capacity = (capacity + 15) & ~15u;
+  size_t slot_bytes = slotBytes(capacity);
+  size_t nbytes = header_bytes + num_slots * slot_bytes;
+  char segment[80];
+  segmentName(segment, sizeof(segment), name, generation);
+  unlinkSegment(name, generation);
+  void* handle_out = nullptr;
+  size_t nbytes_out = 0;
+  void* addr = mapSegment(segment, nbytes, &nbytes_out, &handle_out);
+  if (!addr) {
+    dbg("Failed to create the shared memory %s of %zu bytes\n", segment, nbytes);
+    return false;
+  }
+  handle = handle_out;
+  mapped_bytes = nbytes_out;
+  header = new (addr) THeader;
+  header->magic = magic;
+  header->version = version;
+  header->capacity = capacity;
+  header->slot_bytes = (uint32_t)slot_bytes;
+#if IN_PLATFORM_WINDOWS
+  header->publisher_pid = (uint32_t)GetCurrentProcessId();
+#else
+  header->publisher_pid = (uint32_t)getpid();
+#endif
+  header->latest.store(no_slot);
+  header->closed.store(0);
+  header->generation.store(generation);
+  for (uint32_t s = 0; s < num_slots; ++s)
+    new (slotAddr(header, s)) TSlot;
+  dbg("Publishing particles in %s, %u particles, %zu bytes\n", segment, capacity, nbytes);
+  return true;
+}
+
+// The readers find their segment closed, and open the new one from the generation of the first segment
+bool ParticlesFeed::grow(uint32_t capacity) {
+  THeader* old_header = header;
+  size_t old_mapped_bytes = mapped_bytes;
+  void* old_handle = handle;
+  // A new name for each try, as a reader may still map a segment with the previous one
+  generation++;
+  if (!create(capacity))
+    return false;
+  first_header->generation.store(generation, std::memory_order_release);
+  old_header->closed.store(1, std::memory_order_release);
+  if (old_header != first_header) {
+    unlinkSegment(name, old_header->generation.load());
+    unmapSegment(old_header, old_mapped_bytes, old_handle);
+  }
+  return true;
+}
+
+void ParticlesFeed::close() {
+  if (!header)
+    return;
+  if (header != first_header) {
+    header->closed.store(1);
+    unlinkSegment(name, header->generation.load());
+    unmapSegment(header, mapped_bytes, handle);
+  }
+  first_header->closed.store(1);
+  unmapSegment(first_header, first_mapped_bytes, first_handle);
+  header = first_header = nullptr;
+  handle = first_handle = nullptr;
+  mapped_bytes = first_mapped_bytes = 0;
+}
+
+void ParticlesFeed::stop() {
+  close();
+  if (name[0])
+    unlinkSegment(name, 0);
+  name[0] = 0x00;
+}
+
+bool ParticlesFeed::publish(ViscoelasticSim& sim, float dt) {
+  if (!header)
+    return false;
+  PROFILE_SCOPED_NAMED("ParticlesFeed.publish");
+  TTimer tm;
+
+  uint32_t n = (uint32_t)sim.num_particles;
+  // Without a larger segment, the particles which fit are still published
+  if (n > header->capacity && !grow(std::max(n, (uint32_t)sim.max_particles)))
+    n = header->capacity;
+  header->world_scale = sim.world_scale;
+
+  uint32_t latest = header->latest.load(std::memory_order_relaxed);
+  uint32_t slot_idx = latest == no_slot ? 0 : (latest + 1) % num_slots;
+  uint8_t* base = slotAddr(header, slot_idx);
+  TSlot* slot = (TSlot*)base;
+
+  // Odd while the arrays are written
+  uint32_t seq = slot->sequence.load(std::memory_order_relaxed);
+  slot->sequence.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot->frame_id = next_frame_id++;
+  slot->num_particles = n;
+  slot->dt = dt;
+  slot->time_ns = nowNs();
+  uint32_t capacity = header->capacity;
+  float* dst[6];
+  for (int a = 0; a < 6; ++a)
+    dst[a] = (float*)(base + arrayOffset(a, capacity));
+  uint8_t* dst_type = base + arrayOffset(6, capacity);
+  const float* src[6] = {
+    sim.particles_pos.x, sim.particles_pos.y, sim.particles_pos.z,
+    sim.particles_vels.x, sim.particles_vels.y, sim.particles_vels.z
+  };
+  auto copyRange = [&](int begin, int end, int) {
+    size_t count = (size_t)(end - begin);
+    for (int a = 0; a < 6; ++a)
+      memcpy(dst[a] + begin, src[a] + begin, count * sizeof(float));
+    memcpy(dst_type + begin, sim.particles_type + begin, count);
+  };
+  // The copy is limited by the memory bandwidth, the workers of the sim share it
+  if (n < 16384 || !sim.using_parallel)
+    copyRange(0, (int)n, 0);
+  else
+    sim.runInParallel((int)n, std::max(sim.num_threads, 1), copyRange, "feed");
+
+  slot->sequence.store(seq + 2, std::memory_order_release);
+  header->latest.store(slot_idx, std::memory_order_release);
+  frames_published++;
+  last_publish_ms = tm.elapsed() * 1e3;
+  return true;
+}
+
+// ---------------------------------------------------------------------
+bool ParticlesFeedReader::open(const char* name) {
+  close();
+  // The first segment has the generation of the one in use
+  if (!openSegment(name))
+    return false;
+  uint32_t generation = header->generation.load(std::memory_order_acquire);
+  if (generation == 0)
+    return true;
+  close();
+  char segment[80];
+  segmentName(segment, sizeof(segment), name, generation);
+  return openSegment(segment);
+}
+
+bool ParticlesFeedReader::openSegment(const char* segment_name) {
+  void* handle_out = nullptr;
+  const void* addr = mapSegment(segment_name, 0, &mapped_bytes, &handle_out);
+  if (!addr)
+    return false;
+  handle = handle_out;
+  const THeader* h = (const THeader*)addr;
+  if (h->magic != magic || h->version != version || mapped_bytes < header_bytes + num_slots * (size_t)h->slot_bytes) {
+    unmapSegment(addr, mapped_bytes, handle);
+    handle = nullptr;
+    return false;
+  }
+  header = h;
+  return true;
+}
+
+void ParticlesFeedReader::close() {
+  if (!header)
+    return;
+  unmapSegment(header, mapped_bytes, handle);
+  header = nullptr;
+  handle = nullptr;
+  mapped_bytes = 0;
+}
+
+bool ParticlesFeedReader::isClosed() const {
+  return !header || header->closed.load(std::memory_order_acquire) != 0;
+}
+
+float ParticlesFeedReader::worldScale() const {
+  return header ? header->world_scale : 1.0f;
+}
+
+bool ParticlesFeedReader::acquire(TFrameView& view) const {
+  if (!header)
+    return false;
+  uint32_t slot_idx = header->latest.load(std::memory_order_acquire);
+  if (slot_idx >= num_slots)
+    return false;
+  const uint8_t* base = slotAddr(header, slot_idx);
+  const TSlot* slot = (const TSlot*)base;
+  uint32_t seq = slot->sequence.load(std::memory_order_acquire);
+  if (seq & 1)
+    return false;
+  view.slot = slot_idx;
+  view.sequence = seq;
+  view.frame_id = slot->frame_id;
+  view.num_particles = std::min(slot->num_particles, header->capacity);
+  view.dt = slot->dt;
+  view.time_ns = slot->time_ns;
+  uint32_t capacity = header->capacity;
+  for (int a = 0; a < 3; ++a) {
+    view.pos[a] = (const float*)(base + arrayOffset(a, capacity));
+    view.vel[a] = (const float*)(base + arrayOffset(3 + a, capacity));
+  }
+  view.type = base + arrayOffset(6, capacity);
+  return isValid(view);
+}
+
+bool ParticlesFeedReader::isValid(const TFrameView& view) const {
+  if (!header || view.slot >= num_slots)
+    return false;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  const TSlot* slot = (const TSlot*)slotAddr(header, view.slot);
+  return slot->sequence.load(std::memory_order_relaxed) == view.sequence;
+}
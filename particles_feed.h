@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+struct ViscoelasticSim;
+
+// Publishes the positions, velocities and types of the particles of each frame in a shared memory
+// segment, so other processes of the same host can read them without copies, like the
+// ParticlesFeedReader of tools/feed.cpp.
+// The segment has a header and 3 slots. Each frame is written to the slot after the latest one,
+// so the latest frame is never overwritten while being read, and a reader has two frames of time
+// before its slot is reused. Each slot has a seqlock: the sequence is odd while the publisher
+// writes it, and the readers check it has not changed after using the data.
+// The segment is replaced by a larger one when the sim has more particles than its capacity.
+// Each one is named after the first, with the generation as suffix, like name.1, as a reader
+// may still map the previous one. The publisher keeps the first segment, which has the
+// generation in use, so the readers find the current one when their segment is closed.
+namespace ParticlesFeedLayout {
+
+  constexpr uint32_t magic = 0x44454546;     // FEED
+  constexpr uint32_t version = 2;
+  constexpr uint32_t num_slots = 3;
+  constexpr uint32_t no_slot = ~0u;
+  constexpr size_t   header_bytes = 4096;
+
+  struct THeader {
+    uint32_t              magic = 0;
+    uint32_t              version = 0;
+    uint32_t              capacity = 0;      // Max particles of each slot
+    uint32_t              slot_bytes = 0;
+    float                 world_scale = 1.0f;
+    uint32_t              publisher_pid = 0;
+    std::atomic<uint32_t> latest;            // Slot of the last frame published, or no_slot
+    std::atomic<uint32_t> closed;            // The publisher stopped or replaced the segment
+    std::atomic<uint32_t> generation;        // Of the segment, in the first one the generation in use
+  };
+
+  // Followed by the arrays pos x,y,z, vel x,y,z of capacity floats and the types of capacity bytes
+  struct TSlot {
+    std::atomic<uint32_t> sequence;
+    uint32_t              frame_id = 0;
+    uint32_t              num_particles = 0;
+    float                 dt = 0.0f;
+    uint64_t              time_ns = 0;       // steady clock when it was published
+  };
+  constexpr size_t slot_header_bytes = 64;
+
+  inline size_t arrayOffset(int array_idx, uint32_t capacity) {
+    return slot_header_bytes + (size_t)array_idx * capacity * sizeof(float);
+  }
+  inline size_t slotBytes(uint32_t capacity) {
+    size_t nbytes = arrayOffset(6, capacity) + capacity;
+    return (nbytes + 4095) & ~(size_t)4095;
+  }
+}
+
+struct ParticlesFeed {
+
+  std::atomic<uint64_t> frames_published{ 0 };
+  double                last_publish_ms = 0.0;
+
+  ~ParticlesFeed() {
+    stop();
+  }
+
+  // The name of the shared memory segment, like "/viscoelastic_particles"
+  bool start(const char* name, int capacity);
+  void stop();
+  bool isPublishing() const { return header != nullptr; }
+  // From the main thread, after the update of the sim, as the arrays are copied in parallel by the workers of the sim
+  bool publish(ViscoelasticSim& sim, float dt);
+
+private:
+  char                         name[64] = { 0 };
+  ParticlesFeedLayout::THeader* header = nullptr;           // The segment in use
+  size_t                       mapped_bytes = 0;
+  uint32_t                     next_frame_id = 0;
+  void*                        handle = nullptr;
+  ParticlesFeedLayout::THeader* first_header = nullptr;     // Kept mapped for the readers which open the feed
+  size_t                       first_mapped_bytes = 0;
+  void*                        first_handle = nullptr;
+  uint32_t                     generation = 0;
+
+  bool create(uint32_t capacity);
+  bool grow(uint32_t capacity);
+  void close();
+};
+
+// Maps the segment of a ParticlesFeed. The frames are read in place:
+//   ParticlesFeedReader::TFrameView view;
+//   if (reader.acquire(view)) {
+//     use view.pos[0][i] ...
+//     if (!reader.isValid(view))   // The publisher reused the slot, discard what was read
+//   }
+struct ParticlesFeedReader {
+
+  struct TFrameView {
+    uint32_t       slot = ParticlesFeedLayout::no_slot;
+    uint32_t       sequence = 0;
+    uint32_t       frame_id = 0;
+    uint32_t       num_particles = 0;
+    float          dt = 0.0f;
+    uint64_t       time_ns = 0;
+    const float*   pos[3] = {};
+    const float*   vel[3] = {};
+    const uint8_t* type = nullptr;
+  };
+
+  bool open(const char* name);
+  void close();
+  bool isOpen() const { return header != nullptr; }
+  // True when the publisher stopped or moved to a larger segment, and the reader should open it again
+  bool isClosed() const;
+  float worldScale() const;
+  // The latest frame, false when there is none yet or the publisher is writing it
+  bool acquire(TFrameView& view) const;
+  bool isValid(const TFrameView& view) const;
+
+  ~ParticlesFeedReader() {
+    close();
+  }
+
+private:
+  const ParticlesFeedLayout::THeader* header = nullptr;
+  size_t                              mapped_bytes = 0;
+  void*                               handle = nullptr;
+
+  bool openSegment(const char* segment_name);
+};
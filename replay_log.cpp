@@ -0,0 +1,300 @@
+#include "platform.h"
+#include "replay_log.h"
+
+namespace ReplayLog {
+
+  uint64_t checksum(const ViscoelasticSim& sim) {
+    PROFILE_SCOPED_NAMED("replayChecksum");
+    // fnv-1a of the words of each plane
+    uint64_t h = 0xcbf29ce484222325ULL;
+    auto hashPlane = [&](const float* v) {
+      const uint32_t* words = (const uint32_t*)v;
+      for (int i = 0; i < sim.num_particles; ++i)
+        h = (h ^ words[i]) * 0x100000001b3ULL;
+    };
+    hashPlane(sim.particles_pos.x);
+    hashPlane(sim.particles_pos.y);
+    hashPlane(sim.particles_pos.z);
+    return h;
+  }
+
+  static TParams getParams(const ViscoelasticSim& sim) {
+    TParams p;
+    memset(&p, 0x00, sizeof(p));
+    p.gravity[0] = sim.mat.gravity.x;
+    p.gravity[1] = sim.mat.gravity.y;
+    p.gravity[2] = sim.mat.gravity.z;
+    p.rest_density = sim.mat.rest_density;
+    p.stiffness = sim.mat.stiffness;
+    p.near_stiffness = sim.mat.near_stiffness;
+    p.kernel_radius = sim.mat.kernel_radius;
+    p.friction = sim.friction;
+    p.max_speed = sim.max_speed;
+    p.world_scale = sim.world_scale;
+    for (int i = 0; i < 4; ++i)
+      p.masses[i] = sim.masses[i];
+    p.num_substeps = sim.num_substeps;
+    p.in_2d = sim.in_2d ? 1 : 0;
+    p.attract = sim.attract ? 1 : 0;
+    p.repel = sim.repel ? 1 : 0;
+    p.using_parallel = sim.using_parallel ? 1 : 0;
+    p.interact_point[0] = sim.interact_point.x;
+    p.interact_point[1] = sim.interact_point.y;
+    p.interact_point[2] = sim.interact_point.z;
+    p.interact_dir[0] = sim.interact_dir.x;
+    p.interact_dir[1] = sim.interact_dir.y;
+    p.interact_dir[2] = sim.interact_dir.z;
+    p.interact_rad = sim.interact_rad;
+    return p;
+  }
+
+  static void setParams(ViscoelasticSim& sim, const TParams& p) {
+    sim.mat.gravity = VEC3(p.gravity[0], p.gravity[1], p.gravity[2]);
+    sim.mat.rest_density = p.rest_density;
+    sim.mat.stiffness = p.stiffness;
+    sim.mat.near_stiffness = p.near_stiffness;
+    sim.mat.kernel_radius = p.kernel_radius;
+    sim.friction = p.friction;
+    sim.max_speed = p.max_speed;
+    sim.world_scale = p.world_scale;
+    for (int i = 0; i < 4; ++i)
+      sim.masses[i] = p.masses[i];
+    sim.num_substeps = p.num_substeps;
+    sim.in_2d = p.in_2d != 0;
+    sim.attract = p.attract != 0;
+    sim.repel = p.repel != 0;
+    sim.using_parallel = p.using_parallel != 0;
+    sim.interact_point = VEC3(p.interact_point[0], p.interact_point[1], p.interact_point[2]);
+    sim.interact_dir = VEC3(p.interact_dir[0], p.interact_dir[1], p.interact_dir[2]);
+    sim.interact_rad = p.interact_rad;
+  }
+
+}
+
+using namespace ReplayLog;
+
+// ---------------------------------------------------------------------
+bool ReplayRecorder::start(const char* filename, const ViscoelasticSim& sim, const TBuffer* host_chunks) {
+  stop();
+
+  // The snapshot is aligned as the header is 32 bytes
+  static_assert(sizeof(THeader) == 32, "THeader size");
+  buf.clear();
+  THeader header;
+  header.max_particles = sim.max_particles;
+  buf.write(header);
+  if (!sim.saveSnapshot(buf, host_chunks))
+    return false;
+  snapshot_bytes = buf.size() - sizeof(THeader);
+  ((THeader*)buf.data())->snapshot_bytes = snapshot_bytes;
+  max_particles = sim.max_particles;
+
+  file = fopen(filename, "wb");
+  if (!file) {
+    dbg("Failed to create replay %s\n", filename);
+    return false;
+  }
+  fwrite(buf.data(), 1, buf.size(), file);
+  bytes_written = buf.size();
+  buf.clear();
+
+  num_frames = 0;
+  has_params = false;
+  prev_sdf.clear();
+  sim.sdf.save(prev_sdf);
+  return true;
+}
+
+void ReplayRecorder::stop() {
+  if (!file)
+    return;
+  if (!buf.empty()) {
+    fwrite(buf.data(), 1, buf.size(), file);
+    bytes_written += buf.size();
+    buf.clear();
+  }
+  THeader header;
+  header.num_frames = num_frames;
+  header.max_particles = max_particles;
+  header.snapshot_bytes = snapshot_bytes;
+  header.commands_bytes = bytes_written - sizeof(THeader) - snapshot_bytes;
+  fseek(file, 0, SEEK_SET);
+  fwrite(&header, 1, sizeof(header), file);
+  fclose(file);
+  file = nullptr;
+}
+
+void ReplayRecorder::writeCmd(eCmd cmd, const void* payload, size_t nbytes) {
+  TCmd c;
+  c.cmd = (uint8_t)cmd;
+  c.nbytes = (uint32_t)nbytes;
+  buf.write(c);
+  if (nbytes)
+    buf.writeBytes(payload, (uint32_t)nbytes);
+}
+
+void ReplayRecorder::recordUpdate(const ViscoelasticSim& sim, float dt) {
+  if (!file)
+    return;
+  TParams params = getParams(sim);
+  if (!has_params || memcmp(&params, &prev_params, sizeof(params)) != 0) {
+    writeCmd(eCmd::Params, &params, sizeof(params));
+    prev_params = params;
+    has_params = true;
+  }
+  new_sdf.clear();
+  sim.sdf.save(new_sdf);
+  if (new_sdf != prev_sdf) {
+    writeCmd(eCmd::Sdf, new_sdf.data(), new_sdf.size());
+    std::swap(prev_sdf, new_sdf);
+  }
+  writeCmd(eCmd::Update, &dt, sizeof(dt));
+}
+
+void ReplayRecorder::recordSpawns(const ViscoelasticSim& sim, int first_index) {
+  if (!file || first_index >= sim.num_particles)
+    return;
+  int n = sim.num_particles - first_index;
+  TCmd c;
+  c.cmd = (uint8_t)eCmd::Spawn;
+  c.nbytes = (uint32_t)(n * sizeof(TSpawn));
+  buf.write(c);
+  for (int i = first_index; i < sim.num_particles; ++i) {
+    VEC3 pos = sim.particles_pos.get(i);
+    VEC3 vel = sim.particles_vels.get(i);
+    TSpawn s = { { pos.x, pos.y, pos.z }, { vel.x, vel.y, vel.z }, sim.particles_type[i] };
+    buf.write(s);
+  }
+}
+
+void ReplayRecorder::recordDrain(const ViscoelasticSim& sim, const std::vector<int>& ids) {
+  if (!file || ids.empty())
+    return;
+  TCmd c;
+  c.cmd = (uint8_t)eCmd::Drain;
+  c.nbytes = (uint32_t)(ids.size() * sizeof(uint32_t));
+  buf.write(c);
+  for (int id : ids)
+    buf.write(sim.particles_uid[id]);
+}
+
+void ReplayRecorder::endFrame(const ViscoelasticSim& sim) {
+  if (!file)
+    return;
+  TEndFrame end;
+  end.num_particles = sim.num_particles;
+  end.checksum = checksum(sim);
+  writeCmd(eCmd::EndFrame, &end, sizeof(end));
+  fwrite(buf.data(), 1, buf.size(), file);
+  bytes_written += buf.size();
+  buf.clear();
+  ++num_frames;
+}
+
+// ---------------------------------------------------------------------
+bool ReplayPlayer::open(const char* filename, ViscoelasticSim& sim, ViscoelasticSim::OnSnapshotChunk on_host_chunk) {
+  close();
+  if (!file.open(filename))
+    return false;
+  const THeader* header = (const THeader*)file.data;
+  if (file.size < sizeof(THeader) || header->magic != ReplayLog::magic || header->version > ReplayLog::version
+    || header->snapshot_bytes > file.size - sizeof(THeader)) {
+    dbg("Replay %s has an invalid header\n", filename);
+    close();
+    return false;
+  }
+  if (sim.max_particles < (int)header->max_particles) {
+    sim.max_particles = (int)header->max_particles;
+    sim.init();
+  }
+  if (!sim.loadSnapshot(file.data + sizeof(THeader), (size_t)header->snapshot_bytes, on_host_chunk)) {
+    dbg("Replay %s has an invalid snapshot\n", filename);
+    close();
+    return false;
+  }
+  offset = sizeof(THeader) + (size_t)header->snapshot_bytes;
+  end_offset = file.size;
+  num_frames = header->num_frames;
+  // The header is only updated when the recording is stopped
+  if (header->commands_bytes && header->commands_bytes <= file.size - offset)
+    end_offset = offset + (size_t)header->commands_bytes;
+  frame = 0;
+  first_divergent_frame = -1;
+  return true;
+}
+
+void ReplayPlayer::close() {
+  file.close();
+  offset = 0;
+  end_offset = 0;
+}
+
+bool ReplayPlayer::playFrame(ViscoelasticSim& sim) {
+  while (offset + sizeof(TCmd) <= end_offset) {
+    TCmd c;
+    memcpy(&c, file.data + offset, sizeof(c));
+    offset += sizeof(TCmd);
+    if (c.nbytes > end_offset - offset)
+      break;
+    const uint8_t* payload = file.data + offset;
+    offset += c.nbytes;
+
+    switch ((eCmd)c.cmd) {
+
+    case eCmd::Params: {
+      if (c.nbytes != sizeof(TParams))
+        break;
+      TParams params;
+      memcpy(&params, payload, sizeof(params));
+      setParams(sim, params);
+      if (force_parallel >= 0)
+        sim.using_parallel = force_parallel != 0;
+      break; }
+
+    case eCmd::Sdf:
+      sim.sdf.load(payload, c.nbytes);
+      break;
+
+    case eCmd::Update: {
+      float dt = 1.0f;
+      memcpy(&dt, payload, sizeof(dt));
+      sim.update(dt);
+      break; }
+
+    case eCmd::Spawn: {
+      int n = c.nbytes / sizeof(TSpawn);
+      for (int i = 0; i < n; ++i) {
+        TSpawn s;
+        memcpy(&s, payload + i * sizeof(TSpawn), sizeof(s));
+        sim.addParticle(VEC3(s.pos[0], s.pos[1], s.pos[2]), VEC3(s.vel[0], s.vel[1], s.vel[2]), (uint8_t)s.particle_type);
+      }
+      break; }
+
+    case eCmd::Drain: {
+      int n = c.nbytes / sizeof(uint32_t);
+      ids.clear();
+      for (int i = 0; i < n; ++i) {
+        uint32_t uid;
+        memcpy(&uid, payload + i * sizeof(uint32_t), sizeof(uid));
+        if (uid < sim.uid_to_index.size() && sim.uid_to_index[uid] != ViscoelasticSim::invalid_uid)
+          ids.push_back(sim.uid_to_index[uid]);
+      }
+      sim.removeParticles(ids);
+      break; }
+
+    case eCmd::EndFrame: {
+      if (c.nbytes != sizeof(TEndFrame))
+        break;
+      TEndFrame end;
+      memcpy(&end, payload, sizeof(end));
+      if (first_divergent_frame < 0 && (end.num_particles != (uint32_t)sim.num_particles || end.checksum != checksum(sim)))
+        first_divergent_frame = frame;
+      ++frame;
+      return true; }
+
+    default:
+      break;
+    }
+  }
+  return false;
+}
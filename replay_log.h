@@ -0,0 +1,134 @@
+#pragma once
+
+#include "viscoelastic_sim.h"
+#include "memory/mapped_file.h"
+
+// Log of everything that changes the sim from outside during a run, to reproduce it without the app.
+// The file starts with a snapshot of the sim and the chunks of the host, followed by the commands of
+// each frame. The params and the sdf are only written when they change. The spawned particles are
+// stored with their final position and velocity, so the emitters are not needed to replay them.
+// Each frame ends with a checksum of the positions to find the first frame where a replay diverges.
+// Only the sequential relaxation is deterministic, the parallel one adds the displacements of the
+// neighbours from several threads in any order.
+namespace ReplayLog {
+
+  static constexpr uint32_t magic = 0x4C505256;     // 'VRPL'
+  static constexpr uint32_t version = 1;
+
+  enum class eCmd : uint8_t {
+    Params,
+    Sdf,
+    Update,
+    Spawn,          // Array of TSpawn
+    Drain,          // Array of the uids removed
+    EndFrame
+  };
+
+  struct THeader {
+    uint32_t magic = ReplayLog::magic;
+    uint32_t version = ReplayLog::version;
+    uint32_t num_frames = 0;
+    uint32_t max_particles = 0;     // Of the sim recorded, so the same spawns fit in the replay
+    uint64_t snapshot_bytes = 0;
+    uint64_t commands_bytes = 0;
+  };
+
+  // Followed by nbytes of payload. Unknown commands are skipped
+  struct TCmd {
+    uint8_t  cmd = 0;
+    uint8_t  reserved[3] = { 0, 0, 0 };
+    uint32_t nbytes = 0;
+  };
+
+  struct TParams {
+    float    gravity[3];
+    float    rest_density;
+    float    stiffness;
+    float    near_stiffness;
+    float    kernel_radius;
+    float    friction;
+    float    max_speed;
+    float    world_scale;
+    float    masses[4];
+    int32_t  num_substeps;
+    uint32_t in_2d;
+    uint32_t attract;
+    uint32_t repel;
+    uint32_t using_parallel;
+    float    interact_point[3];
+    float    interact_dir[3];
+    float    interact_rad;
+  };
+
+  struct TSpawn {
+    float    pos[3];
+    float    vel[3];
+    uint32_t particle_type;
+  };
+
+  struct TEndFrame {
+    uint32_t num_particles = 0;
+    uint32_t reserved = 0;
+    uint64_t checksum = 0;
+  };
+
+  // Of the bits of the positions, in the order of the particles
+  uint64_t checksum(const ViscoelasticSim& sim);
+}
+
+struct ReplayRecorder {
+
+  uint32_t num_frames = 0;
+  uint64_t bytes_written = 0;
+
+  ~ReplayRecorder() {
+    stop();
+  }
+
+  bool start(const char* filename, const ViscoelasticSim& sim, const TBuffer* host_chunks = nullptr);
+  // Updates the header and closes the file
+  void stop();
+  bool isRecording() const { return file != nullptr; }
+
+  // Just before sim.update
+  void recordUpdate(const ViscoelasticSim& sim, float dt);
+  // Particles added with addParticle since first_index, which are appended at the end
+  void recordSpawns(const ViscoelasticSim& sim, int first_index);
+  // Before removing the particles ids
+  void recordDrain(const ViscoelasticSim& sim, const std::vector<int>& ids);
+  // Writes the commands of the frame to the file
+  void endFrame(const ViscoelasticSim& sim);
+
+private:
+  FILE*              file = nullptr;
+  uint64_t           snapshot_bytes = 0;
+  int                max_particles = 0;
+  TBuffer            buf;
+  ReplayLog::TParams prev_params;
+  bool               has_params = false;
+  TBuffer            prev_sdf;
+  TBuffer            new_sdf;
+
+  void writeCmd(ReplayLog::eCmd cmd, const void* payload, size_t nbytes);
+};
+
+struct ReplayPlayer {
+
+  uint32_t num_frames = 0;
+  uint32_t frame = 0;
+  int      first_divergent_frame = -1;
+  // -1 uses the value recorded, 0/1 forces the sequential/parallel relaxation
+  int      force_parallel = -1;
+
+  // Loads the initial snapshot in the sim
+  bool open(const char* filename, ViscoelasticSim& sim, ViscoelasticSim::OnSnapshotChunk on_host_chunk = nullptr);
+  void close();
+  // Applies the commands of the next frame. Returns false at the end of the log
+  bool playFrame(ViscoelasticSim& sim);
+
+private:
+  TMappedFile            file;
+  size_t                 offset = 0;
+  size_t                 end_offset = 0;
+  std::vector<int>       ids;
+};
@@ -0,0 +1,171 @@
+#include "platform.h"
+#include "scenario.h"
+
+namespace Scenario {
+
+  bool TFile::load(const char* filename) {
+    j = json();
+    if (!file.open(filename))
+      return false;
+    if (!file.j.isObject()) {
+      dbg("Invalid scenario %s: the root must be an object\n", filename);
+      return false;
+    }
+    j = file.j;
+    return true;
+  }
+
+  static ThreadAffinity::ePolicy policyFromName(const char* name, ThreadAffinity::ePolicy default_policy) {
+    for (int i = 0; i < (int)ThreadAffinity::ePolicy::NumPolicies; ++i) {
+      if (strcmp(name, ThreadAffinity::policyName((ThreadAffinity::ePolicy)i)) == 0)
+        return (ThreadAffinity::ePolicy)i;
+    }
+    return default_policy;
+  }
+
+  void applySdf(SDF::sdFunc& sdf, json jprims) {
+    sdf.prims.clear();
+    onEachArr(jprims, [&](json jp, size_t) {
+      const char* prim_type = jp.value("type", "plane");
+      VEC3 position = jp.value("position", VEC3::zero);
+      SDF::Primitive prim;
+      if (strcmp(prim_type, "sphere") == 0)
+        prim = SDF::Primitive::makeSphere(position, jp.value("radius", 1.0f));
+      else if (strcmp(prim_type, "box") == 0)
+        prim = SDF::Primitive::makeBox(position, jp.value("size", VEC3::ones));
+      else
+        prim = SDF::Primitive::makePlane(position, jp.value("normal", VEC3::axis_y));
+      // As the QUAT of the json files: "yaw pitch roll" in degrees or "x y z w"
+      if (jp.count("rotation"))
+        prim.transform.setRotation(jp.value("rotation", QUAT()));
+      prim.multiplier = jp.value("multiplier", prim.multiplier);
+      prim.softness = jp.value("softness", prim.softness);
+      prim.enabled = jp.value("enabled", prim.enabled);
+      prim.color = jp.value("color", prim.color);
+      prim.transformHasChanged();
+      sdf.prims.push_back(prim);
+      });
+  }
+
+  // The shape of the block in the units of the sim, and its number of particles
+  static ViscoelasticSim::BulkShape blockShape(json jblock, float world_scale, bool in_2d, int* count) {
+    ViscoelasticSim::BulkShape shape;
+    const char* shape_type = jblock.value("shape", "box");
+    if (strcmp(shape_type, "sphere") == 0)
+      shape.type = ViscoelasticSim::BulkShape::eType::Sphere;
+    else if (strcmp(shape_type, "lattice") == 0)
+      shape.type = ViscoelasticSim::BulkShape::eType::Lattice;
+    else if (strcmp(shape_type, "sdf") == 0)
+      shape.type = ViscoelasticSim::BulkShape::eType::Sdf;
+    shape.vmin = jblock.value("min", VEC3::zero) * world_scale;
+    shape.vmax = jblock.value("max", VEC3::ones) * world_scale;
+    shape.center = jblock.value("center", VEC3::zero) * world_scale;
+    shape.radius = jblock.value("radius", 1.0f) * world_scale;
+    shape.spacing = std::max(jblock.value("spacing", 0.08f), 1e-3f) * world_scale;
+    shape.jitter = jblock.value("jitter", 0.0f);
+    shape.velocity = jblock.value("velocity", VEC3::zero);
+    shape.velocity_jitter = jblock.value("velocity_jitter", 0.0f);
+    int first_type = std::clamp(jblock.value("type", 0), 0, 3);
+    shape.particle_type = (uint8_t)first_type;
+    shape.num_types = std::clamp(jblock.value("num_types", 1), 1, 4 - first_type);
+    shape.seed = (uint32_t)jblock.value("seed", 54123);
+    *count = shape.type == ViscoelasticSim::BulkShape::eType::Lattice ? shape.latticeCount(in_2d) : std::max(jblock.value("count", 0), 0);
+    return shape;
+  }
+
+  int blockCount(const ViscoelasticSim& sim, json jblock) {
+    int count = 0;
+    blockShape(jblock, sim.world_scale, sim.in_2d, &count);
+    return count;
+  }
+
+  void generateBlock(ViscoelasticSim& sim, json jblock, int count) {
+    PROFILE_SCOPED_NAMED("generateBlock");
+    int block_count = 0;
+    ViscoelasticSim::BulkShape shape = blockShape(jblock, sim.world_scale, sim.in_2d, &block_count);
+    if (count < 0)
+      count = block_count;
+    // The primitives of the block, or "sim" for the free space of the sim
+    SDF::sdFunc sdf;
+    if (shape.type == ViscoelasticSim::BulkShape::eType::Sdf) {
+      json jsdf = jblock["sdf"];
+      if (jsdf.isArray()) {
+        applySdf(sdf, jsdf);
+        shape.sdf = &sdf;
+      }
+      else {
+        shape.sdf = &sim.sdf;
+        shape.sdf_inside = false;
+      }
+    }
+    sim.addParticlesBulk(count, shape);
+  }
+
+  void apply(ViscoelasticSim& sim, json j) {
+    PROFILE_SCOPED_NAMED("applyScenario");
+    json jsim = j["sim"];
+    json jblocks = j["blocks"];
+
+    // The buffers are reallocated when the blocks need more particles
+    int max_particles = jsim.value("max_particles", sim.max_particles);
+    bool in_2d = jsim.value("in_2d", sim.in_2d);
+    int total = 0;
+    float world_scale = jsim.value("world_scale", sim.world_scale);
+    onEachArr(jblocks, [&](json jb, size_t) {
+      int count = 0;
+      blockShape(jb, world_scale, in_2d, &count);
+      total += count;
+      });
+    max_particles = std::max(max_particles, total);
+
+    json jthreads = j["threads"];
+    if (jthreads.isObject()) {
+      sim.num_threads = std::max(jthreads.value("num_threads", sim.num_threads), 1);
+      sim.using_parallel = jthreads.value("using_parallel", sim.using_parallel);
+      sim.auto_tune = jthreads.value("auto_tune", sim.auto_tune);
+      sim.relaxation_balanced = jthreads.value("balanced", sim.relaxation_balanced);
+      sim.pinning = policyFromName(jthreads.value("pinning", ""), sim.pinning);
+    }
+
+    if (max_particles != sim.max_particles) {
+      sim.max_particles = max_particles;
+      sim.init();
+    }
+    else if (jthreads.isObject()) {
+      sim.setNumThreads(sim.num_threads);
+    }
+
+    json jmat = j["material"];
+    if (jmat.isObject()) {
+      sim.mat.rest_density = jmat.value("rest_density", sim.mat.rest_density);
+      sim.mat.stiffness = jmat.value("stiffness", sim.mat.stiffness);
+      sim.mat.near_stiffness = jmat.value("near_stiffness", sim.mat.near_stiffness);
+      sim.mat.kernel_radius = jmat.value("kernel_radius", sim.mat.kernel_radius);
+      sim.mat.gravity = jmat.value("gravity", sim.mat.gravity);
+    }
+
+    if (jsim.isObject()) {
+      sim.in_2d = in_2d;
+      sim.max_speed = jsim.value("max_speed", sim.max_speed);
+      sim.friction = jsim.value("friction", sim.friction);
+      sim.num_substeps = std::max(jsim.value("num_substeps", sim.num_substeps), 1);
+      sim.world_scale = world_scale;
+      json jmasses = jsim["masses"];
+      if (jmasses.isArray()) {
+        for (size_t i = 0; i < 4 && i < jmasses.size(); ++i)
+          sim.masses[i] = jmasses[i];
+      }
+    }
+
+    if (j["sdf"].isArray())
+      applySdf(sim.sdf, j["sdf"]);
+
+    if (jblocks.isArray()) {
+      sim.removeAllParticles();
+      onEachArr(jblocks, [&](json jb, size_t) {
+        generateBlock(sim, jb);
+        });
+    }
+  }
+
+}
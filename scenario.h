@@ -0,0 +1,42 @@
+#pragma once
+
+#include "viscoelastic_sim.h"
+#include "formats/json/json_file.h"
+
+// Setups of the simulation defined in json, like the files of data/scenarios. Each section is optional,
+// and only the values given change the sim:
+//   material : rest_density, stiffness, near_stiffness, kernel_radius, gravity
+//   sim      : in_2d, max_speed, friction, num_substeps, world_scale, max_particles, masses
+//   threads  : num_threads, using_parallel, auto_tune, balanced, pinning
+//   sdf      : the primitives, which replace the current ones
+//   blocks   : the initial particles, which replace the current ones
+//   emitters : not used by the sim, read by the host
+// The positions of the sdf, the blocks and the emitters are in world units, like the ones of the editor.
+namespace Scenario {
+
+  // Returns false when the file is missing or is not a json object. The scenarios with large
+  // blocks of particles can be big, so the file is parsed in place by JsonMappedFile.
+  // The json is valid while the TFile is alive
+  struct TFile {
+    JsonMappedFile file;
+    json           j;
+    bool load(const char* filename);
+  };
+
+  void apply(ViscoelasticSim& sim, json j);
+  void applySdf(SDF::sdFunc& sdf, json jprims);
+
+  // Adds the particles of the block with ViscoelasticSim::addParticlesBulk
+  //   shape    : "box" in [min..max], "sphere" with center and radius, "lattice" in [min..max] with
+  //              the spacing and jitter, or "sdf" in [min..max] inside the primitives of "sdf", or in
+  //              the free space of the sim when "sdf" is not an array
+  //   count    : particles of the shapes other than the lattice
+  //   type     : the particles type, or the first type when num_types > 1, in consecutive ranges
+  //   velocity : initial velocity in the units of the sim, plus a random velocity_jitter
+  //   seed     : of the random values
+  // count replaces the particles of the block when it's not negative, like the sweeps do
+  void generateBlock(ViscoelasticSim& sim, json jblock, int count = -1);
+  // The particles generateBlock adds for the block
+  int blockCount(const ViscoelasticSim& sim, json jblock);
+
+}
@@ -0,0 +1,375 @@
+#pragma once
+
+#include <immintrin.h>
+#include <algorithm>
+#include "particles_vec.h"
+
+// The simd kernels of the steps of ViscoelasticSim, in a header so tools/bench.cpp can measure
+// them in isolation
+
+// for (int i = 0; i < num_particles; ++i)
+//  pos.add(i, vel.get(i) * dt);
+inline void simd_update_positions(
+  ParticlesVec& pos, 
+  const ParticlesVec& vel, 
+  float dt, 
+  int num_particles
+) {
+  const int simd_width = 8;
+  const int simd_end = num_particles & ~(simd_width - 1); // round down to nearest multiple of 8
+
+  __m256 dt_vec = _mm256_set1_ps(dt);
+
+  for (int i = 0; i < simd_end; i += simd_width) {
+    // Load position and velocity components
+    __m256 px = _mm256_loadu_ps(&pos.x[i]);
+    __m256 py = _mm256_loadu_ps(&pos.y[i]);
+    __m256 pz = _mm256_loadu_ps(&pos.z[i]);
+
+    __m256 vx = _mm256_loadu_ps(&vel.x[i]);
+    __m256 vy = _mm256_loadu_ps(&vel.y[i]);
+    __m256 vz = _mm256_loadu_ps(&vel.z[i]);
+
+    // Multiply velocity by dt
+    vx = _mm256_mul_ps(vx, dt_vec);
+    vy = _mm256_mul_ps(vy, dt_vec);
+    vz = _mm256_mul_ps(vz, dt_vec);
+
+    // Add to positions
+    px = _mm256_add_ps(px, vx);
+    py = _mm256_add_ps(py, vy);
+    pz = _mm256_add_ps(pz, vz);
+
+    // Store back
+    _mm256_storeu_ps(&pos.x[i], px);
+    _mm256_storeu_ps(&pos.y[i], py);
+    _mm256_storeu_ps(&pos.z[i], pz);
+  }
+
+  // Fallback scalar for remainder
+  for (int i = simd_end; i < num_particles; ++i)
+    pos.add(i, vel.get(i) * dt);
+}
+
+// 0.171ms -> 0.026ms
+//for (int i = 0; i < num_particles; ++i) {
+//  particles_vels.set(i, (particles_pos.get(i) - particles_prev_pos.get(i)) * inv_dt);
+//  if (particles_vels.get(i).Length() > max_speed)
+//    particles_vels.set(i, particles_vels.get(i).Normalized() * max_speed);
+//}
+// Returns the largest squared distance between pos and prev, before the clamp
+inline float simd_update_velocities_clamped(
+  ParticlesVec& vel,
+  const ParticlesVec& pos,
+  const ParticlesVec& prev,
+  float inv_dt,
+  float max_speed,
+  int start,
+  int end
+) {
+  constexpr int simd_width = 8;
+
+  __m256 inv_dt_vec = _mm256_set1_ps(inv_dt);
+  __m256 max_speed_vec = _mm256_set1_ps(max_speed);
+  __m256 max_speed_sq = _mm256_mul_ps(max_speed_vec, max_speed_vec);
+  __m256 max_len_sq_vec = _mm256_setzero_ps();
+
+  int i = start;
+  for (; i + simd_width <= end; i += simd_width) {
+    // Compute vel = (pos - prev) * inv_dt
+    __m256 px = _mm256_loadu_ps(&pos.x[i]);
+    __m256 py = _mm256_loadu_ps(&pos.y[i]);
+    __m256 pz = _mm256_loadu_ps(&pos.z[i]);
+
+    __m256 qx = _mm256_loadu_ps(&prev.x[i]);
+    __m256 qy = _mm256_loadu_ps(&prev.y[i]);
+    __m256 qz = _mm256_loadu_ps(&prev.z[i]);
+
+    __m256 vx = _mm256_sub_ps(px, qx);
+    __m256 vy = _mm256_sub_ps(py, qy);
+    __m256 vz = _mm256_sub_ps(pz, qz);
+
+    vx = _mm256_mul_ps(vx, inv_dt_vec);
+    vy = _mm256_mul_ps(vy, inv_dt_vec);
+    vz = _mm256_mul_ps(vz, inv_dt_vec);
+
+    // Compute length squared
+    __m256 len_sq = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(vx, vx), _mm256_mul_ps(vy, vy)),
+      _mm256_mul_ps(vz, vz));
+    max_len_sq_vec = _mm256_max_ps(max_len_sq_vec, len_sq);
+
+    // Clamp velocities
+    __m256 too_fast_mask = _mm256_cmp_ps(len_sq, max_speed_sq, _CMP_GT_OQ);
+
+    // Avoid divide-by-zero: set inv_length to 1 when length == 0
+    __m256 length = _mm256_sqrt_ps(len_sq);
+    __m256 inv_length = _mm256_blendv_ps(_mm256_rcp_ps(length), _mm256_set1_ps(1.0f), _mm256_cmp_ps(length, _mm256_set1_ps(0.0f), _CMP_EQ_OQ));
+    __m256 scale = _mm256_min_ps(_mm256_mul_ps(inv_length, max_speed_vec), _mm256_set1_ps(1.0f));
+    scale = _mm256_blendv_ps(_mm256_set1_ps(1.0f), scale, too_fast_mask);
+
+    vx = _mm256_mul_ps(vx, scale);
+    vy = _mm256_mul_ps(vy, scale);
+    vz = _mm256_mul_ps(vz, scale);
+
+    // Store
+    _mm256_storeu_ps(&vel.x[i], vx);
+    _mm256_storeu_ps(&vel.y[i], vy);
+    _mm256_storeu_ps(&vel.z[i], vz);
+  }
+
+  float lanes[simd_width];
+  _mm256_storeu_ps(lanes, max_len_sq_vec);
+  float max_len_sq = 0.0f;
+  for (float len_sq : lanes)
+    max_len_sq = std::max(max_len_sq, len_sq);
+
+  // Scalar fallback
+  for (; i < end; ++i) {
+    VEC3 v = (pos.get(i) - prev.get(i)) * inv_dt;
+    float len = v.length();
+    max_len_sq = std::max(max_len_sq, len * len);
+    if (len > max_speed)
+      v = v.normalized() * max_speed;
+    vel.set(i, v);
+  }
+  return max_len_sq / (inv_dt * inv_dt);
+}
+
+
+inline float hsum256_ps(__m256 v) {
+  __m128 vlow = _mm256_castps256_ps128(v);
+  __m128 vhigh = _mm256_extractf128_ps(v, 1);
+  __m128 sum1 = _mm_add_ps(vlow, vhigh);
+  __m128 shuf = _mm_movehdup_ps(sum1);
+  __m128 sum2 = _mm_add_ps(sum1, shuf);
+  shuf = _mm_movehl_ps(shuf, sum2);
+  __m128 sum3 = _mm_add_ss(sum2, shuf);
+  return _mm_cvtss_f32(sum3);
+}
+
+inline void apply_displacements_simd(
+  float pressure,
+  float near_pressure,
+  const int* nears_ids,
+  const float* nears_closeness,
+  const float* nears_dirs_x,
+  const float* nears_dirs_y,
+  const float* nears_dirs_z,
+  int num_nears,
+  int idx,
+  ParticlesVec* deltas
+) {
+  const int step = 8;
+  int i = 0;
+
+  __m256 p = _mm256_set1_ps(pressure);
+  __m256 np = _mm256_set1_ps(near_pressure);
+  __m256 half = _mm256_set1_ps(0.5f);
+
+  __m256 accum_dx = _mm256_setzero_ps();
+  __m256 accum_dy = _mm256_setzero_ps();
+  __m256 accum_dz = _mm256_setzero_ps();
+
+  for (; i + step <= num_nears; i += step) {
+    __m256 c = _mm256_loadu_ps(&nears_closeness[i]);
+    __m256 amt = _mm256_add_ps(p, _mm256_mul_ps(np, c));
+    amt = _mm256_mul_ps(amt, c);
+    amt = _mm256_mul_ps(amt, half);
+
+    __m256 vx = _mm256_loadu_ps(&nears_dirs_x[i]);
+    __m256 vy = _mm256_loadu_ps(&nears_dirs_y[i]);
+    __m256 vz = _mm256_loadu_ps(&nears_dirs_z[i]);
+
+    __m256 dx_final = _mm256_mul_ps(vx, amt);
+    __m256 dy_final = _mm256_mul_ps(vy, amt);
+    __m256 dz_final = _mm256_mul_ps(vz, amt);
+
+    accum_dx = _mm256_add_ps(accum_dx, dx_final);
+    accum_dy = _mm256_add_ps(accum_dy, dy_final);
+    accum_dz = _mm256_add_ps(accum_dz, dz_final);
+
+    alignas(32) float tx[8], ty[8], tz[8];
+    _mm256_store_ps(tx, dx_final);
+    _mm256_store_ps(ty, dy_final);
+    _mm256_store_ps(tz, dz_final);
+
+    for (int k = 0; k < 8; ++k)
+      deltas->add(nears_ids[i + k], tx[k], ty[k], tz[k]);
+  }
+
+  float acc_x = -hsum256_ps(accum_dx);
+  float acc_y = -hsum256_ps(accum_dy);
+  float acc_z = -hsum256_ps(accum_dz);
+
+  // Scalar fallback
+  for (; i < num_nears; ++i) {
+    float closeness = nears_closeness[i];
+    float amount = (pressure + near_pressure * closeness) * closeness * 0.5f;
+    float dx = nears_dirs_x[i] * amount;
+    float dy = nears_dirs_y[i] * amount;
+    float dz = nears_dirs_z[i] * amount;
+    acc_x -= dx;
+    acc_y -= dy;
+    acc_z -= dz;
+    deltas->add(nears_ids[i], dx, dy, dz);
+  }
+
+  deltas->add(idx, acc_x, acc_y, acc_z);
+}
+
+
+// for (int i = 0; i < num_particles; ++i)
+//   particles_vels.add(i, delta_velocity * masses[particles_type[i]]);
+inline void simd_add_velocity_scaled_by_type(
+  ParticlesVec& vels,
+  const uint8_t* types,
+  const float* masses,         // Assumed size = 4
+  const VEC3& delta_velocity,
+  int num_particles
+) {
+  const int step = 8;
+  int i = 0;
+
+  // Broadcast delta_velocity components
+  __m256 dx = _mm256_set1_ps(delta_velocity.x);
+  __m256 dy = _mm256_set1_ps(delta_velocity.y);
+  __m256 dz = _mm256_set1_ps(delta_velocity.z);
+
+  // Load masses into 256-bit register (assumes only 4 types)
+  alignas(32) float mass_lut[8] = {
+    masses[0], masses[1], masses[2], masses[3],
+    masses[0], masses[1], masses[2], masses[3]  // repeated for safety
+  };
+
+  for (; i + step <= num_particles; i += step) {
+    // Load 8 types
+    __m128i t8 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&types[i])); // 8 bytes
+    __m256i indices = _mm256_cvtepu8_epi32(t8);  // Convert 8x u8 to 8x i32
+
+    // Gather mass values using indices
+    __m256 m = _mm256_i32gather_ps(mass_lut, indices, 4);
+
+    // Compute scaled delta
+    __m256 vx = _mm256_mul_ps(dx, m);
+    __m256 vy = _mm256_mul_ps(dy, m);
+    __m256 vz = _mm256_mul_ps(dz, m);
+
+    // Load current velocity
+    __m256 v_old_x = _mm256_loadu_ps(&vels.x[i]);
+    __m256 v_old_y = _mm256_loadu_ps(&vels.y[i]);
+    __m256 v_old_z = _mm256_loadu_ps(&vels.z[i]);
+
+    // Add delta
+    v_old_x = _mm256_add_ps(v_old_x, vx);
+    v_old_y = _mm256_add_ps(v_old_y, vy);
+    v_old_z = _mm256_add_ps(v_old_z, vz);
+
+    // Store back
+    _mm256_storeu_ps(&vels.x[i], v_old_x);
+    _mm256_storeu_ps(&vels.y[i], v_old_y);
+    _mm256_storeu_ps(&vels.z[i], v_old_z);
+  }
+
+  // Scalar fallback for tail
+  for (; i < num_particles; ++i) {
+    float m = masses[types[i]];
+    vels.x[i] += delta_velocity.x * m;
+    vels.y[i] += delta_velocity.y * m;
+    vels.z[i] += delta_velocity.z * m;
+  }
+}
+
+
+inline void collect_neighbors_block(
+  const ParticlesVec& pos,
+  float kernel_radius,
+  float kernel_radius_inv,
+  float* density_acc,
+  float* near_density_acc,
+  int*   nears_ids,
+  float* nears_closeness,
+  float* nears_dirs_x,
+  float* nears_dirs_y,
+  float* nears_dirs_z,
+  int& num_nears,
+  int max_nears,
+  int i,            // current particle i
+  int j_start,      // start of neighbor block
+  int mask_range
+) {
+  __m256 pi_x = _mm256_set1_ps(pos.x[i]);
+  __m256 pi_y = _mm256_set1_ps(pos.y[i]);
+  __m256 pi_z = _mm256_set1_ps(pos.z[i]);
+
+  __m256 px = _mm256_loadu_ps(&pos.x[j_start]);
+  __m256 py = _mm256_loadu_ps(&pos.y[j_start]);
+  __m256 pz = _mm256_loadu_ps(&pos.z[j_start]);
+
+  __m256 dx = _mm256_sub_ps(px, pi_x);
+  __m256 dy = _mm256_sub_ps(py, pi_y);
+  __m256 dz = _mm256_sub_ps(pz, pi_z);
+
+  __m256 d2 = _mm256_add_ps(
+    _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+    _mm256_mul_ps(dz, dz)
+  );
+
+  __m256 length = _mm256_sqrt_ps(d2);
+
+  __m256 mask_valid = _mm256_and_ps(
+    _mm256_cmp_ps(length, _mm256_set1_ps(kernel_radius), _CMP_LT_OQ),
+    _mm256_cmp_ps(length, _mm256_set1_ps(1e-3f), _CMP_GT_OQ)
+  );
+
+  // Exclude self-particle
+  __m256i indices = _mm256_add_epi32(_mm256_set1_epi32(j_start), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+  __m256i i_vec = _mm256_set1_epi32(i);
+  __m256 mask_self = _mm256_castsi256_ps(_mm256_cmpeq_epi32(indices, i_vec));
+
+  __m256 mask = _mm256_andnot_ps(mask_self, mask_valid);
+  int mask_bits = _mm256_movemask_ps(mask) & mask_range;
+
+  // Load inverse r and normalize
+  __m256 r = _mm256_add_ps(length, _mm256_set1_ps(1e-5f));
+  __m256 inv_r = _mm256_div_ps(_mm256_set1_ps(1.0f), r);
+  dx = _mm256_mul_ps(dx, inv_r);
+  dy = _mm256_mul_ps(dy, inv_r);
+  dz = _mm256_mul_ps(dz, inv_r);
+
+  // Closeness
+  __m256 q = _mm256_mul_ps(r, _mm256_set1_ps(kernel_radius_inv));
+  __m256 closeness = _mm256_sub_ps(_mm256_set1_ps(1.0f), q);
+
+  const float* c_ptr = reinterpret_cast<const float*>(&closeness);
+  const float* dx_ptr = reinterpret_cast<const float*>(&dx);
+  const float* dy_ptr = reinterpret_cast<const float*>(&dy);
+  const float* dz_ptr = reinterpret_cast<const float*>(&dz);
+
+  // Iterate over the 8 lanes
+  // Skip if the mask is 0, means does not apply to this range or is too far
+  int lane = 0;
+  while (mask_bits) {
+    if (mask_bits & 1) {
+      float c = c_ptr[lane];
+      float c_sq = c * c;
+      float c_cu = c_sq * c;
+
+      *density_acc += c_sq;
+      *near_density_acc += c_cu;
+
+      int j = j_start + lane;
+      nears_ids[num_nears] = j;
+      nears_closeness[num_nears] = c;
+      nears_dirs_x[num_nears] = dx_ptr[lane];
+      nears_dirs_y[num_nears] = dy_ptr[lane];
+      nears_dirs_z[num_nears] = dz_ptr[lane];
+      ++num_nears;
+      if (num_nears >= max_nears)
+        break;
+    }
+
+    ++lane;
+    mask_bits >>= 1;
+  }
+}
@@ -0,0 +1,253 @@
+#include "platform.h"
+#include "thread_affinity.h"
+#include <algorithm>
+#include <thread>
+#include <map>
+
+#if IN_PLATFORM_WINDOWS
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace ThreadAffinity {
+
+  static int readIntFile(const char* filename, int default_value) {
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+      return default_value;
+    int value = default_value;
+    if (fscanf(f, "%d", &value) != 1)
+      value = default_value;
+    fclose(f);
+    return value;
+  }
+
+  std::vector<int> parseCpuList(const char* text) {
+    std::vector<int> cpus;
+    const char* p = text;
+    while (p && *p) {
+      char* next = nullptr;
+      long first = strtol(p, &next, 10);
+      if (next == p) {
+        ++p;
+        continue;
+      }
+      long last = first;
+      p = next;
+      if (*p == '-') {
+        last = strtol(p + 1, &next, 10);
+        p = next;
+      }
+      for (long cpu = first; cpu <= last && cpu >= 0; ++cpu)
+        cpus.push_back((int)cpu);
+    }
+    return cpus;
+  }
+
+  // Unique ids of the cores and the smt index of each logical cpu, once core/package/node are known
+  static void finishTopology(TTopology& t) {
+    std::sort(t.cpus.begin(), t.cpus.end(), [](const TCpu& a, const TCpu& b) { return a.id < b.id; });
+    std::map<std::pair<int, int>, int> cores;
+    std::map<int, int> packages;
+    std::map<int, int> nodes;
+    std::map<int, int> siblings;
+    for (auto& cpu : t.cpus) {
+      auto it = cores.find({ cpu.package, cpu.core });
+      int core_id = (it != cores.end()) ? it->second : (int)cores.size();
+      cores[{ cpu.package, cpu.core }] = core_id;
+      cpu.core = core_id;
+      cpu.smt_index = siblings[core_id]++;
+      packages[cpu.package] = 1;
+      nodes[cpu.node] = 1;
+    }
+    t.num_cores = (int)cores.size();
+    t.num_packages = (int)packages.size();
+    t.num_nodes = (int)nodes.size();
+  }
+
+  static void detectTopology(TTopology& t) {
+
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+      for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (!CPU_ISSET(i, &allowed))
+          continue;
+        char filename[256];
+        TCpu cpu;
+        cpu.id = i;
+        snprintf(filename, sizeof(filename), "/sys/devices/system/cpu/cpu%d/topology/core_id", i);
+        cpu.core = readIntFile(filename, i);
+        snprintf(filename, sizeof(filename), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", i);
+        cpu.package = std::max(readIntFile(filename, 0), 0);
+        t.cpus.push_back(cpu);
+      }
+
+      // The nodes list their cpus
+      for (int node = 0; node < 1024; ++node) {
+        char filename[256];
+        snprintf(filename, sizeof(filename), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* f = fopen(filename, "rb");
+        if (!f)
+          break;
+        char text[4096] = { 0 };
+        size_t n = fread(text, 1, sizeof(text) - 1, f);
+        text[n] = 0;
+        fclose(f);
+        for (int id : parseCpuList(text)) {
+          for (auto& cpu : t.cpus) {
+            if (cpu.id == id)
+              cpu.node = node;
+          }
+        }
+      }
+    }
+
+#elif IN_PLATFORM_WINDOWS
+    DWORD nbytes = 0;
+    GetLogicalProcessorInformation(nullptr, &nbytes);
+    std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> infos(nbytes / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+    if (!infos.empty() && GetLogicalProcessorInformation(infos.data(), &nbytes)) {
+      int num_cpus = 0;
+      for (auto& info : infos) {
+        if (info.Relationship == RelationProcessorCore) {
+          for (int i = 0; i < 64; ++i) {
+            if (info.ProcessorMask & (1ULL << i)) {
+              TCpu cpu;
+              cpu.id = i;
+              cpu.core = num_cpus;
+              t.cpus.push_back(cpu);
+            }
+          }
+          ++num_cpus;
+        }
+      }
+      for (auto& info : infos) {
+        if (info.Relationship != RelationNumaNode && info.Relationship != RelationProcessorPackage)
+          continue;
+        for (auto& cpu : t.cpus) {
+          if (!(info.ProcessorMask & (1ULL << cpu.id)))
+            continue;
+          if (info.Relationship == RelationNumaNode)
+            cpu.node = (int)info.NumaNode.NodeNumber;
+          else
+            cpu.package = (int)(&info - infos.data());
+        }
+      }
+    }
+#endif
+
+    // Unknown topology, one core per logical cpu
+    if (t.cpus.empty()) {
+      int num_cpus = std::max((int)std::thread::hardware_concurrency(), 1);
+      for (int i = 0; i < num_cpus; ++i) {
+        TCpu cpu;
+        cpu.id = i;
+        cpu.core = i;
+        t.cpus.push_back(cpu);
+      }
+    }
+
+    finishTopology(t);
+  }
+
+  const TTopology& topology() {
+    static TTopology t;
+    static bool detected = false;
+    if (!detected) {
+      detectTopology(t);
+      detected = true;
+    }
+    return t;
+  }
+
+  const char* policyName(ePolicy policy) {
+    static const char* names[(int)ePolicy::NumPolicies] = { "None", "Compact", "Scatter", "One Per Core", "Explicit" };
+    return names[(int)policy];
+  }
+
+  std::vector<int> cpusForWorkers(ePolicy policy, int num_workers, const std::vector<int>& explicit_cpus) {
+    std::vector<int> cpus_of_workers;
+    if (policy == ePolicy::None || num_workers <= 0)
+      return cpus_of_workers;
+
+    const TTopology& t = topology();
+    std::vector<TCpu> order;
+
+    if (policy == ePolicy::Explicit) {
+      for (int id : explicit_cpus)
+        order.push_back(TCpu{ id });
+    }
+    else {
+      order = t.cpus;
+      if (policy == ePolicy::OnePerCore) {
+        order.erase(std::remove_if(order.begin(), order.end(), [](const TCpu& cpu) { return cpu.smt_index != 0; }), order.end());
+      }
+
+      if (policy == ePolicy::Scatter) {
+        // Rank of each core inside its (node, package), so the first core of each domain goes
+        // before the second core of any of them
+        std::map<std::pair<int, int>, int> cores_in_domain;
+        std::map<int, int> rank_of_core;
+        for (auto& cpu : t.cpus) {
+          if (cpu.smt_index == 0)
+            rank_of_core[cpu.core] = cores_in_domain[{ cpu.node, cpu.package }]++;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](const TCpu& a, const TCpu& b) {
+          if (a.smt_index != b.smt_index)
+            return a.smt_index < b.smt_index;
+          int rank_a = rank_of_core[a.core];
+          int rank_b = rank_of_core[b.core];
+          if (rank_a != rank_b)
+            return rank_a < rank_b;
+          if (a.node != b.node)
+            return a.node < b.node;
+          return a.package < b.package;
+          });
+      }
+      else {
+        std::stable_sort(order.begin(), order.end(), [](const TCpu& a, const TCpu& b) {
+          if (a.node != b.node)
+            return a.node < b.node;
+          if (a.package != b.package)
+            return a.package < b.package;
+          if (a.core != b.core)
+            return a.core < b.core;
+          return a.smt_index < b.smt_index;
+          });
+      }
+    }
+
+    if (order.empty())
+      return cpus_of_workers;
+
+    // With more workers than cpus, the extra workers share the cpus in the same order
+    for (int i = 0; i < num_workers; ++i)
+      cpus_of_workers.push_back(order[i % order.size()].id);
+    return cpus_of_workers;
+  }
+
+  bool pinCurrentThread(int cpu) {
+    if (cpu < 0)
+      return false;
+#if defined(__linux__)
+    if (cpu >= CPU_SETSIZE)
+      return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif IN_PLATFORM_WINDOWS
+    if (cpu >= 64)
+      return false;
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#else
+    // No affinity api in osx
+    return false;
+#endif
+  }
+
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+
+// Placement of the workers of the ThreadPool in the logical cpus of the machine
+namespace ThreadAffinity {
+
+  enum class ePolicy {
+    None,           // Let the OS move the threads
+    Compact,        // Fill the SMT siblings of a core, then the next core of the same node
+    Scatter,        // Spread over the nodes and cores, SMT siblings are used last
+    OnePerCore,     // One worker per physical core, SMT siblings are not used
+    Explicit,       // Worker i runs in explicit_cpus[i % size]
+    NumPolicies
+  };
+
+  struct TCpu {
+    int id = 0;           // Logical cpu, as used by the OS
+    int core = 0;         // Physical core, unique in the machine
+    int package = 0;
+    int node = 0;         // NUMA node
+    int smt_index = 0;    // 0 for the first logical cpu of each core
+  };
+
+  // Logical cpus where the process is allowed to run
+  struct TTopology {
+    std::vector<TCpu> cpus;
+    int num_cores = 0;
+    int num_packages = 0;
+    int num_nodes = 0;
+  };
+
+  const TTopology& topology();
+  const char* policyName(ePolicy policy);
+
+  // Logical cpu of each worker, empty when the policy is None
+  std::vector<int> cpusForWorkers(ePolicy policy, int num_workers, const std::vector<int>& explicit_cpus = {});
+
+  // Restricts the calling thread to a single logical cpu
+  bool pinCurrentThread(int cpu);
+
+  // Parses "0,2,4-7" into the list of cpus
+  std::vector<int> parseCpuList(const char* text);
+
+}
@@ -9,13 +9,16 @@
 #include <future>
 #include <functional>
 #include <stdexcept>
+#include "thread_affinity.h"
 
 class ThreadPool {
 public:
-  ThreadPool(size_t);
+  // Worker i is pinned to cpus[i] when the list is not empty
+  ThreadPool(size_t, const std::vector<int>& cpus = {});
   template<class F, class... Args>
   auto enqueue(F&& f, Args&&... args)
     -> std::future<typename std::result_of<F(Args...)>::type>;
+  size_t size() const { return workers.size(); }
   ~ThreadPool();
 private:
   // need to keep track of threads so we can join them
@@ -30,13 +33,15 @@ private:
 };
 
 // the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(size_t threads)
+inline ThreadPool::ThreadPool(size_t threads, const std::vector<int>& cpus)
   : stop(false)
 {
   for (size_t i = 0; i < threads; ++i)
     workers.emplace_back(
-      [this]
+      [this, cpu = i < cpus.size() ? cpus[i] : -1]
       {
+        if (cpu >= 0)
+          ThreadAffinity::pinCurrentThread(cpu);
         for (;;)
         {
           std::function<void()> task;
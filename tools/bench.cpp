@@ -0,0 +1,321 @@
+#include "platform.h"
+#include "viscoelastic_sim.h"
+#include "sim_kernels.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Microbenchmarks of the hot routines of the sim, each one in isolation over all the particles.
+// The particles are a uniform random distribution, or the ones of a snapshot saved by the app.
+// Each benchmark is repeated until it runs for min_time, and the median of the repetitions is
+// reported as ns per particle, GB/s of the bytes each routine reads and writes, and instructions
+// per particle when the performance counters are available (linux)
+namespace {
+
+  // Instructions retired by this thread, in user mode
+  struct TPerfCounter {
+    int fd = -1;
+
+    bool open() {
+#if defined(__linux__)
+      perf_event_attr attr;
+      memset(&attr, 0x00, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+      return fd >= 0;
+    }
+
+    void close() {
+#if defined(__linux__)
+      if (fd >= 0)
+        ::close(fd);
+#endif
+      fd = -1;
+    }
+
+    void start() {
+#if defined(__linux__)
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+#endif
+    }
+
+    uint64_t stop() {
+      uint64_t count = 0;
+#if defined(__linux__)
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+          count = 0;
+      }
+#endif
+      return count;
+    }
+  };
+
+  struct TBenchmark {
+    const char*           name;
+    double                bytes_per_run = 0.0;
+    std::function<void()> run;
+  };
+
+  struct TResult {
+    double ns_per_run = 0.0;
+    double instructions_per_run = 0.0;
+  };
+
+  // Keeps the results of the routines without side effects
+  volatile float sink = 0.0f;
+
+  TResult measure(const TBenchmark& b, double min_time, int num_reps, TPerfCounter& counter) {
+    // Warm up and estimate the iterations of each repetition
+    b.run();
+    TTimer tm;
+    int num_iters = 0;
+    do {
+      b.run();
+      ++num_iters;
+    } while (tm.elapsedSinceStart() < min_time / num_reps);
+
+    std::vector<double> times;
+    uint64_t instructions = 0;
+    for (int rep = 0; rep < num_reps; ++rep) {
+      counter.start();
+      tm.reset();
+      for (int i = 0; i < num_iters; ++i)
+        b.run();
+      times.push_back(tm.elapsedSinceStart() / num_iters);
+      instructions += counter.stop();
+    }
+    std::sort(times.begin(), times.end());
+    TResult r;
+    r.ns_per_run = times[times.size() / 2] * 1e9;
+    r.instructions_per_run = (double)instructions / ((double)num_iters * num_reps);
+    return r;
+  }
+
+  // The same setup of the relaxation, with the 64 nears at most of each particle
+  struct TNears {
+    static constexpr int max_nears = 64;
+    std::vector<int>   first;       // Per particle, num_particles + 1
+    std::vector<int>   ids;
+    std::vector<float> closeness;
+    std::vector<float> dirs_x;
+    std::vector<float> dirs_y;
+    std::vector<float> dirs_z;
+    std::vector<float> pressure;
+    std::vector<float> near_pressure;
+  };
+
+}
+
+int main(int argc, char** argv) {
+  int num_particles = 65536;
+  double min_time = 0.5;
+  const char* snapshot = nullptr;
+  const char* filter = nullptr;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-n") == 0)
+      num_particles = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "-time") == 0)
+      min_time = atof(argv[i + 1]);
+    else if (strcmp(argv[i], "-snapshot") == 0)
+      snapshot = argv[i + 1];
+    else if (strcmp(argv[i], "-filter") == 0)
+      filter = argv[i + 1];
+    else {
+      printf("Usage: %s [-n num_particles] [-time min_seconds] [-snapshot snapshot.bin] [-filter name]\n", argv[0]);
+      return -1;
+    }
+  }
+
+  // The routines are called directly, the sim only holds the particles and the sdf
+  ViscoelasticSim sim;
+  sim.num_threads = 1;
+  if (snapshot) {
+    sim.max_particles = 1;
+    sim.init();
+    if (!sim.loadSnapshot(snapshot, [](const ViscoelasticSim::TSnapshotChunk&, const void*) { return true; })) {
+      printf("Failed to load %s\n", snapshot);
+      return -1;
+    }
+    num_particles = sim.num_particles;
+  }
+  else {
+    sim.max_particles = num_particles;
+    sim.init();
+    // Around 20 neighbours per particle
+    float kernel_radius = sim.mat.kernel_radius;
+    float volume = num_particles / 20.0f * (4.0f / 3.0f) * (float)M_PI * kernel_radius * kernel_radius * kernel_radius;
+    float side = cbrtf(volume);
+    TRandomSequence rseq(1234);
+    for (int i = 0; i < num_particles; ++i) {
+      VEC3 p(rseq.between(0.0f, side), rseq.between(0.0f, side), rseq.between(0.0f, side));
+      VEC3 v(rseq.between(-1.0f, 1.0f), rseq.between(-1.0f, 1.0f), rseq.between(-1.0f, 1.0f));
+      sim.addParticle(p, v, (uint8_t)(i & 3));
+    }
+    float scaled = side / sim.world_scale;
+    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3::zero, VEC3::axis_y));
+    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(0, 0, scaled), -VEC3::axis_z));
+    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(0, 0, 0), VEC3::axis_z));
+    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(scaled, 0, 0), -VEC3::axis_x));
+    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(0, 0, 0), VEC3::axis_x));
+    sim.sdf.prims.push_back(SDF::Primitive::makeBox(VEC3(scaled, scaled, scaled) * 0.5f, VEC3::ones * scaled * 0.1f));
+  }
+  int n = num_particles;
+
+  // Sorts the particles in cells, as the sim does before the relaxation
+  sim.updateSpatialHash();
+  sim.sdf.generateCompactStructs();
+  sim.particles_prev_pos.copyFrom(sim.particles_pos, n);
+  sim.particles_frozen_pos.copyFrom(sim.particles_pos, n);
+  CPUSpatialSubdivision& hash = sim.spatial_hash;
+  std::vector<CPUSpatialSubdivision::AssignedCell> assigned(sim.assigned_cells.begin(), sim.assigned_cells.begin() + n);
+  for (int i = 0; i < n; ++i) {
+    CPUSpatialSubdivision::Int3 ipos = hash.gridCoords(sim.particles_pos.get(i));
+    assigned[i] = { ipos, hash.gridHash(ipos) };
+  }
+
+  float kernel_radius = sim.mat.kernel_radius;
+  float kernel_radius_inv = 1.0f / kernel_radius;
+  const ParticlesVec& ppos = sim.particles_frozen_pos;
+
+  // Visits the candidates of each particle like processRange, calling collect_neighbors_block
+  int num_candidates = 0;
+  auto collectAll = [&](TNears* out) {
+    int   nears_ids[TNears::max_nears];
+    float nears_closeness[TNears::max_nears];
+    alignas(32) float nears_dirs_x[TNears::max_nears];
+    alignas(32) float nears_dirs_y[TNears::max_nears];
+    alignas(32) float nears_dirs_z[TNears::max_nears];
+    float acc = 0.0f;
+    for (auto& range : hash.cells_ranges) {
+      hash.onEachParticleInCell(range, [&](int i, const CPUSpatialSubdivision::NearRanges& near_ranges) {
+        float density = 0.0f;
+        float near_density = 0.0f;
+        int num_nears = 0;
+        for (uint32_t r = 0; r < near_ranges.n && num_nears < TNears::max_nears; ++r) {
+          uint32_t first = near_ranges.ranges[r].first;
+          uint32_t last = near_ranges.ranges[r].last;
+          for (uint32_t j = first; j < last && num_nears < TNears::max_nears; j += 8) {
+            int mask_range = (1 << std::min(8, (int)(last - j))) - 1;
+            collect_neighbors_block(ppos, kernel_radius, kernel_radius_inv, &density, &near_density,
+              nears_ids, nears_closeness, nears_dirs_x, nears_dirs_y, nears_dirs_z,
+              num_nears, TNears::max_nears, i, j, mask_range);
+            if (!out)
+              continue;
+            num_candidates += std::min(8, (int)(last - j));
+          }
+        }
+        acc += density + near_density;
+        if (!out)
+          return;
+        float stiffness = sim.mat.stiffness;
+        out->pressure[i] = std::min(1.0f, stiffness * (density - sim.mat.rest_density));
+        out->near_pressure[i] = std::min(1.0f, stiffness * std::max(0.0f, near_density));
+        out->first[i] = (int)out->ids.size();
+        out->ids.insert(out->ids.end(), nears_ids, nears_ids + num_nears);
+        out->closeness.insert(out->closeness.end(), nears_closeness, nears_closeness + num_nears);
+        out->dirs_x.insert(out->dirs_x.end(), nears_dirs_x, nears_dirs_x + num_nears);
+        out->dirs_y.insert(out->dirs_y.end(), nears_dirs_y, nears_dirs_y + num_nears);
+        out->dirs_z.insert(out->dirs_z.end(), nears_dirs_z, nears_dirs_z + num_nears);
+        });
+    }
+    sink += acc;
+  };
+
+  // The particles of each cell are continuous, so the nears of particle i end where the ones of i+1 start
+  TNears nears;
+  nears.first.resize(n + 1);
+  nears.pressure.resize(n);
+  nears.near_pressure.resize(n);
+  collectAll(&nears);
+  nears.first[n] = (int)nears.ids.size();
+  int num_nears = (int)nears.ids.size();
+
+  ParticlesVec deltas;
+  deltas.resize(n);
+
+  std::vector<CPUSpatialSubdivision::CellRange> unsorted_cells;
+
+  const VEC3 delta_velocity(0.0f, -1e-6f, 0.0f);
+  const float inv_world_scale = 1.0f / sim.world_scale;
+  std::vector<TBenchmark> benchmarks = {
+    { "simd_update_positions", n * 9.0 * sizeof(float), [&]() {
+      simd_update_positions(sim.particles_pos, sim.particles_vels, 1e-6f, n);
+      } },
+    { "simd_update_velocities_clamped", n * 9.0 * sizeof(float), [&]() {
+      simd_update_velocities_clamped(sim.particles_vels, sim.particles_pos, sim.particles_prev_pos, 1.0f, sim.max_speed, 0, n);
+      } },
+    { "simd_add_velocity_scaled_by_type", n * (6.0 * sizeof(float) + 1.0), [&]() {
+      simd_add_velocity_scaled_by_type(sim.particles_vels, sim.particles_type, sim.masses, delta_velocity, n);
+      } },
+    // The position of each candidate and the nears written
+    { "collect_neighbors_block", num_candidates * 3.0 * sizeof(float) + num_nears * 5.0 * sizeof(float), [&]() {
+      collectAll(nullptr);
+      } },
+    // The nears read and the deltas of each near and the particle updated
+    { "apply_displacements_simd", num_nears * (5.0 * sizeof(float) + 6.0 * sizeof(float)) + n * 6.0 * sizeof(float), [&]() {
+      for (int i = 0; i < n; ++i) {
+        int first = nears.first[i];
+        apply_displacements_simd(nears.pressure[i], nears.near_pressure[i], &nears.ids[first], &nears.closeness[first],
+          &nears.dirs_x[first], &nears.dirs_y[first], &nears.dirs_z[first], nears.first[i + 1] - first, i, &deltas);
+      }
+      } },
+    { "assignCells", n * (sizeof(CPUSpatialSubdivision::AssignedCell) + 2.0 * sizeof(uint32_t)), [&]() {
+      hash.assignCells(assigned.data(), n);
+      } },
+    // Includes restoring the order of the cells found by assignCells
+    { "sortCells", hash.cells_ranges.size() * (2.0 * sizeof(CPUSpatialSubdivision::CellRange)), [&]() {
+      memcpy(hash.cells_ranges.data(), unsorted_cells.data(), unsorted_cells.size() * sizeof(CPUSpatialSubdivision::CellRange));
+      hash.sortCells();
+      } },
+    { "findRanges", (double)(hash.cells_ranges.size() * (sizeof(CPUSpatialSubdivision::CellRange) + sizeof(CPUSpatialSubdivision::CellInfo))), [&]() {
+      hash.findRanges();
+      } },
+    { "sdFunc::evalCompact", n * 3.0 * sizeof(float), [&]() {
+      float acc = 0.0f;
+      for (int i = 0; i < n; ++i)
+        acc += sim.sdf.evalCompact(sim.particles_pos.get(i) * inv_world_scale);
+      sink += acc;
+      } },
+  };
+
+  TPerfCounter counter;
+  bool has_counters = counter.open();
+  printf("%d particles (%s), %d cells, %1.1f nears per particle%s\n", n, snapshot ? snapshot : "uniform", (int)hash.cells_ranges.size()
+    , (double)num_nears / std::max(n, 1), has_counters ? "" : ", no performance counters");
+  printf("%-34s %10s %10s %10s %12s\n", "benchmark", "ms/run", "ns/part", "GB/s", "instr/part");
+  for (auto& b : benchmarks) {
+    if (filter && !strstr(b.name, filter))
+      continue;
+    // sortCells starts from the cells in the order of assignCells
+    hash.assignCells(assigned.data(), n);
+    unsorted_cells = hash.cells_ranges;
+    if (strcmp(b.name, "sortCells") != 0 && strcmp(b.name, "assignCells") != 0)
+      hash.sortCells();
+    hash.findRanges();
+
+    TResult r = measure(b, min_time, 5, counter);
+    printf("%-34s %10.4f %10.3f %10.2f", b.name, r.ns_per_run * 1e-6, r.ns_per_run / n, b.bytes_per_run / r.ns_per_run);
+    if (has_counters)
+      printf(" %12.1f", r.instructions_per_run / n);
+    else
+      printf(" %12s", "-");
+    printf("\n");
+  }
+  counter.close();
+  return 0;
+}
@@ -0,0 +1,124 @@
+#include "platform.h"
+#include "viscoelastic_sim.h"
+#include "particles_feed.h"
+#include "scenario.h"
+#include <chrono>
+#include <thread>
+
+// Reads the frames published by a ParticlesFeed in the shared memory, and prints each second:
+//   frames  : new frames read, and the ones skipped because the reader was slower than the sim
+//   retries : frames discarded because the publisher reused the slot while being read
+//   latency : from the publish to the end of the read
+//   center  : mean position of the particles, in world units
+// With -publish the sim of a scenario runs here and publishes its frames, as the demo does
+// with Publish Feed, so the reader can be tested in another process without the app
+namespace {
+
+  uint64_t nowNs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  int publish(const char* name, const char* scenario, double seconds) {
+    ViscoelasticSim sim;
+    sim.init();
+    Scenario::TFile file;
+    if (!file.load(scenario))
+      return -1;
+    Scenario::apply(sim, file.j);
+    float dt = file.j["sim"].value("delta_time", 1.0f);
+
+    ParticlesFeed feed;
+    if (!feed.start(name, sim.max_particles))
+      return -1;
+    TTimer tm;
+    double publish_ms = 0.0;
+    while (tm.elapsedSinceStart() < seconds) {
+      sim.update(dt);
+      feed.publish(sim, dt);
+      publish_ms += feed.last_publish_ms;
+    }
+    uint64_t frames = feed.frames_published;
+    printf("Published %llu frames of %d particles, %1.3f ms per publish\n", (unsigned long long)frames, sim.num_particles, frames ? publish_ms / frames : 0.0);
+    return 0;
+  }
+
+}
+
+int main(int argc, char** argv) {
+  const char* name = "/viscoelastic_particles";
+  const char* scenario = nullptr;
+  double seconds = 10.0;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-name") == 0)
+      name = argv[i + 1];
+    else if (strcmp(argv[i], "-time") == 0)
+      seconds = atof(argv[i + 1]);
+    else if (strcmp(argv[i], "-publish") == 0)
+      scenario = argv[i + 1];
+    else {
+      printf("Usage: %s [-name /shm_name] [-time seconds] [-publish scenario.json]\n", argv[0]);
+      return -1;
+    }
+  }
+
+  if (scenario)
+    return publish(name, scenario, seconds);
+
+  ParticlesFeedReader reader;
+  TTimer tm;
+  double next_report = 1.0;
+  uint32_t last_frame_id = 0;
+  bool has_frame = false;
+  uint64_t frames = 0, skipped = 0, retries = 0, latency_ns = 0;
+  VEC3 center = VEC3::zero;
+  uint32_t num_particles = 0;
+  while (tm.elapsedSinceStart() < seconds) {
+    if (reader.isClosed()) {
+      // Not started yet, stopped, or replaced by a larger segment
+      if (!reader.open(name)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        continue;
+      }
+      has_frame = false;
+    }
+
+    ParticlesFeedReader::TFrameView view;
+    if (!reader.acquire(view) || (has_frame && view.frame_id == last_frame_id)) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    // Read in place, and discard it when the slot has been reused meanwhile
+    double sum[3] = { 0.0, 0.0, 0.0 };
+    for (uint32_t i = 0; i < view.num_particles; ++i) {
+      sum[0] += view.pos[0][i];
+      sum[1] += view.pos[1][i];
+      sum[2] += view.pos[2][i];
+    }
+    if (!reader.isValid(view)) {
+      retries++;
+      continue;
+    }
+
+    if (has_frame && view.frame_id > last_frame_id + 1)
+      skipped += view.frame_id - last_frame_id - 1;
+    last_frame_id = view.frame_id;
+    has_frame = true;
+    frames++;
+    latency_ns += nowNs() - view.time_ns;
+    num_particles = view.num_particles;
+    if (view.num_particles) {
+      float inv = 1.0f / (view.num_particles * reader.worldScale());
+      center = VEC3((float)sum[0], (float)sum[1], (float)sum[2]) * inv;
+    }
+
+    if (tm.elapsedSinceStart() >= next_report) {
+      next_report += 1.0;
+      printf("frame %6u : %6llu frames, %4llu skipped, %4llu retries, latency %1.3f ms, %u particles, center %6.3f %6.3f %6.3f\n"
+        , last_frame_id, (unsigned long long)frames, (unsigned long long)skipped, (unsigned long long)retries
+        , frames ? latency_ns * 1e-6 / frames : 0.0, num_particles, center.x, center.y, center.z);
+      frames = skipped = retries = latency_ns = 0;
+    }
+  }
+  return 0;
+}
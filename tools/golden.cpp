@@ -0,0 +1,269 @@
+#include "platform.h"
+#include "viscoelastic_sim.h"
+
+// Runs fixed scenarios with the scalar reference kernels (ViscoelasticSim::use_reference) and
+// with the optimised ones, sequential and parallel, and compares the final states:
+//   pos       : max and mean distance between the particles with the same uid, in kernel radius units
+//   density   : L1 distance between the normalized histograms of the density of the particles
+//   energy    : drift of the kinetic + potential energy since the first frame, and its difference
+//               with the drift of the reference
+// The sim is chaotic, the rounding differences between the kernels double every few frames, so the
+// positions only match for a short run. Longer runs (-f) need larger position tolerances, while the
+// density and energy metrics remain meaningful.
+// The reference state can be saved as a golden snapshot, to check later versions against it.
+// Exits with 1 when any metric is out of tolerance
+namespace {
+
+  struct TScenario {
+    const char* name;
+    void (*setup)(ViscoelasticSim& sim);
+  };
+
+  void addCage(ViscoelasticSim& sim, float size_x, float size_z) {
+    sim.sdf.prims.clear();
+    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3::zero, VEC3::axis_y));
+    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(0, 0, -size_z), VEC3::axis_z));
+    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(0, 0, size_z), -VEC3::axis_z));
+    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(0, 0, 0), VEC3::axis_x));
+    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(size_x, 0, 0), -VEC3::axis_x));
+  }
+
+  void addBlock(ViscoelasticSim& sim, VEC3 corner, int nx, int ny, int nz, float spacing, VEC3 vel) {
+    TRandomSequence rseq(1234);
+    for (int z = 0; z < nz; ++z) {
+      for (int y = 0; y < ny; ++y) {
+        for (int x = 0; x < nx; ++x) {
+          // Small jitter, so the particles are not in perfect lattice
+          VEC3 jitter(rseq.between(-0.5f, 0.5f), rseq.between(-0.5f, 0.5f), rseq.between(-0.5f, 0.5f));
+          VEC3 p = corner + VEC3((float)x, (float)y, (float)z) * spacing + jitter;
+          sim.addParticle(p, vel, (uint8_t)((x + y + z) & 3));
+        }
+      }
+    }
+  }
+
+  void setupDamBreak(ViscoelasticSim& sim) {
+    addCage(sim, 2.5f, 2.5f);
+    addBlock(sim, VEC3(20.0f, 20.0f, -220.0f), 16, 16, 16, 8.0f, VEC3::zero);
+  }
+
+  void setupDrop2D(ViscoelasticSim& sim) {
+    sim.in_2d = true;
+    addCage(sim, 2.5f, 2.5f);
+    addBlock(sim, VEC3(0.01f, 40.0f, -100.0f), 1, 48, 48, 6.0f, VEC3(0.0f, -2.0f, 1.0f));
+  }
+
+  void setupAttract(ViscoelasticSim& sim) {
+    addCage(sim, 2.5f, 2.5f);
+    addBlock(sim, VEC3(20.0f, 10.0f, -200.0f), 24, 8, 24, 8.0f, VEC3::zero);
+    sim.attract = true;
+    sim.interact_point = VEC3(120.0f, 40.0f, -100.0f);
+    sim.interact_rad = 80.0f;
+  }
+
+  const TScenario scenarios[] = {
+    { "dam_break", setupDamBreak },
+    { "drop_2d", setupDrop2D },
+    { "attract", setupAttract },
+  };
+
+  struct TTolerances {
+    float max_pos = 1.0f;
+    float mean_pos = 0.05f;
+    float density = 0.05f;
+    float energy = 0.02f;
+  };
+
+  struct TMetrics {
+    float max_pos = 0.0f;
+    float mean_pos = 0.0f;
+    float density = 0.0f;
+    float energy_drift = 0.0f;
+    float energy = 0.0f;      // Difference with the drift of the reference
+    int   num_missing = 0;    // Particles of the reference not found by uid
+  };
+
+  // Per unit of mass. The gravity accelerates each particle type with a different factor
+  double energy(const ViscoelasticSim& sim) {
+    double e = 0.0;
+    VEC3 g = 0.02f * sim.mat.kernel_radius * sim.mat.gravity;
+    for (int i = 0; i < sim.num_particles; ++i) {
+      VEC3 v = sim.particles_vels.get(i);
+      VEC3 p = sim.particles_pos.get(i);
+      e += 0.5 * v.dot(v) - (double)g.dot(p) * sim.masses[sim.particles_type[i]];
+    }
+    return e;
+  }
+
+  constexpr int num_density_bins = 16;
+
+  void densityHistogram(const ViscoelasticSim& sim, double* bins) {
+    float kernel_radius = sim.mat.kernel_radius;
+    float max_density = 4.0f * sim.mat.rest_density;
+    for (int b = 0; b < num_density_bins; ++b)
+      bins[b] = 0.0;
+    for (int i = 0; i < sim.num_particles; ++i) {
+      VEC3 pi = sim.particles_pos.get(i);
+      float density = 0.0f;
+      CPUSpatialSubdivision::QuerySphere sphere = { pi, kernel_radius };
+      sim.queryParticles(sphere, [&](int j) {
+        float r = (sim.particles_pos.get(j) - pi).length();
+        if (j == i || r >= kernel_radius)
+          return;
+        float closeness = 1.0f - r / kernel_radius;
+        density += closeness * closeness;
+        });
+      int b = std::min((int)(density / max_density * num_density_bins), num_density_bins - 1);
+      bins[b] += 1.0;
+    }
+    for (int b = 0; b < num_density_bins; ++b)
+      bins[b] /= std::max(sim.num_particles, 1);
+  }
+
+  TMetrics compare(const ViscoelasticSim& ref, double ref_drift, const ViscoelasticSim& sim, double drift) {
+    TMetrics m;
+    double sum = 0.0;
+    int num_found = 0;
+    float inv_kernel_radius = 1.0f / ref.mat.kernel_radius;
+    for (int i = 0; i < ref.num_particles; ++i) {
+      int j = sim.indexOfUID(ref.particles_uid[i]);
+      if (j < 0) {
+        ++m.num_missing;
+        continue;
+      }
+      float d = (ref.particles_pos.get(i) - sim.particles_pos.get(j)).length() * inv_kernel_radius;
+      m.max_pos = std::max(m.max_pos, d);
+      sum += d;
+      ++num_found;
+    }
+    m.mean_pos = num_found ? (float)(sum / num_found) : 0.0f;
+
+    double ref_bins[num_density_bins];
+    double bins[num_density_bins];
+    densityHistogram(ref, ref_bins);
+    densityHistogram(sim, bins);
+    for (int b = 0; b < num_density_bins; ++b)
+      m.density += (float)fabs(ref_bins[b] - bins[b]);
+
+    m.energy_drift = (float)drift;
+    m.energy = (float)fabs(drift - ref_drift);
+    return m;
+  }
+
+  // Returns the energy drift
+  double run(ViscoelasticSim& sim, const TScenario& scenario, int num_frames) {
+    sim.max_particles = 1 << 14;
+    sim.init();
+    scenario.setup(sim);
+    sim.update(1.0f);
+    double e0 = energy(sim);
+    for (int f = 1; f < num_frames; ++f)
+      sim.update(1.0f);
+    double e1 = energy(sim);
+    return (e1 - e0) / std::max(fabs(e0), 1e-6);
+  }
+
+}
+
+int main(int argc, char** argv) {
+  int num_frames = 16;
+  int num_threads = std::max((int)std::thread::hardware_concurrency(), 2);
+  const char* save_dir = nullptr;
+  const char* check_dir = nullptr;
+  TTolerances tol;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-f") == 0)
+      num_frames = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "-t") == 0)
+      num_threads = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "-save") == 0)
+      save_dir = argv[i + 1];
+    else if (strcmp(argv[i], "-check") == 0)
+      check_dir = argv[i + 1];
+    else if (strcmp(argv[i], "-max_pos") == 0)
+      tol.max_pos = (float)atof(argv[i + 1]);
+    else if (strcmp(argv[i], "-mean_pos") == 0)
+      tol.mean_pos = (float)atof(argv[i + 1]);
+    else if (strcmp(argv[i], "-density") == 0)
+      tol.density = (float)atof(argv[i + 1]);
+    else if (strcmp(argv[i], "-energy") == 0)
+      tol.energy = (float)atof(argv[i + 1]);
+    else {
+      printf("Usage: %s [-f frames] [-t threads] [-save dir | -check dir] [-max_pos r] [-mean_pos r] [-density l1] [-energy drift]\n", argv[0]);
+      return -1;
+    }
+  }
+
+  struct TPath {
+    const char* name;
+    bool        using_parallel;
+  };
+  const TPath paths[] = {
+    { "simd", false },
+    { "parallel", true },
+  };
+
+  bool all_ok = true;
+  printf("%-10s %-9s %8s %8s %8s %9s %9s %s\n", "scenario", "path", "max_pos", "mean_pos", "density", "drift", "d_drift", "result");
+  for (const TScenario& scenario : scenarios) {
+    char golden_name[512];
+    snprintf(golden_name, sizeof(golden_name), "%s/%s.snap", save_dir ? save_dir : (check_dir ? check_dir : "."), scenario.name);
+
+    ViscoelasticSim ref;
+    ref.num_threads = 1;
+    ref.use_reference = true;
+    double ref_drift = run(ref, scenario, num_frames);
+    printf("%-10s %-9s %8s %8s %8s %9.5f %9s %d particles\n", scenario.name, "reference", "", "", "", ref_drift, "", ref.num_particles);
+
+    if (save_dir) {
+      // The drift is stored in a chunk of the snapshot
+      TBuffer host_chunks;
+      ViscoelasticSim::writeSnapshotChunk(host_chunks, ViscoelasticSim::makeSnapshotTag('D', 'R', 'F', 'T'), 1, &ref_drift, sizeof(ref_drift));
+      if (!ref.saveSnapshot(golden_name, &host_chunks)) {
+        printf("Failed to save %s\n", golden_name);
+        all_ok = false;
+      }
+    }
+
+    ViscoelasticSim golden;
+    double golden_drift = 0.0;
+    if (check_dir) {
+      golden.max_particles = 1 << 14;
+      golden.init();
+      bool ok = golden.loadSnapshot(golden_name, [&](const ViscoelasticSim::TSnapshotChunk& chunk, const void* payload) {
+        if (chunk.nbytes != sizeof(double))
+          return false;
+        memcpy(&golden_drift, payload, sizeof(double));
+        return true;
+        });
+      if (!ok) {
+        printf("Failed to load %s\n", golden_name);
+        all_ok = false;
+        continue;
+      }
+    }
+
+    auto report = [&](const char* path_name, const ViscoelasticSim& expected, double expected_drift, const ViscoelasticSim& sim, double drift) {
+      TMetrics m = compare(expected, expected_drift, sim, drift);
+      bool ok = m.num_missing == 0 && m.max_pos <= tol.max_pos && m.mean_pos <= tol.mean_pos && m.density <= tol.density && m.energy <= tol.energy;
+      printf("%-10s %-9s %8.4f %8.5f %8.4f %9.5f %9.5f %s", scenario.name, path_name, m.max_pos, m.mean_pos, m.density, m.energy_drift, m.energy, ok ? "ok" : "FAILED");
+      if (m.num_missing)
+        printf(" (%d particles missing)", m.num_missing);
+      printf("\n");
+      all_ok &= ok;
+    };
+
+    if (check_dir)
+      report("golden", golden, golden_drift, ref, ref_drift);
+
+    for (const TPath& path : paths) {
+      ViscoelasticSim sim;
+      sim.num_threads = path.using_parallel ? num_threads : 1;
+      sim.using_parallel = path.using_parallel;
+      double drift = run(sim, scenario, num_frames);
+      report(path.name, ref, ref_drift, sim, drift);
+    }
+  }
+  printf("%s\n", all_ok ? "All scenarios within tolerance" : "Some scenarios are out of tolerance");
+  return all_ok ? 0 : 1;
+}
@@ -0,0 +1,145 @@
+#include "platform.h"
+#include "viscoelastic_sim.h"
+#include "monitor_server.h"
+#include "scenario.h"
+#include <chrono>
+#include <thread>
+
+// Connects to the MonitorServer of the demo, or of a headless sim, and prints each second:
+//   msgs    : messages received, and the snapshots not received, skipped by the server
+//   kb/s    : bandwidth received
+//   update  : time of the update of the sim, in ms
+//   points  : positions received of the total particles, the center of their bounds
+//   hash    : cells used and collisions of the spatial hash
+// With -ws the client connects with the WebSocket handshake, as a browser does.
+// With -slow the client sleeps between reads, to check the sim does not wait for it.
+// With -serve the sim of a scenario runs here headless with the server, as the demo does
+// with Start Monitor, and reports the time of the updates and of the submits.
+namespace {
+
+  int serve(int port, const char* scenario, double seconds, uint32_t max_bytes_per_second) {
+    ViscoelasticSim sim;
+    sim.init();
+    Scenario::TFile file;
+    if (!file.load(scenario))
+      return -1;
+    Scenario::apply(sim, file.j);
+    float dt = file.j["sim"].value("delta_time", 1.0f);
+
+    MonitorServer monitor;
+    monitor.max_bytes_per_second = max_bytes_per_second;
+    if (!monitor.start(port))
+      return -1;
+    TTimer tm;
+    uint64_t frames = 0;
+    double submit_ms = 0.0, max_submit_ms = 0.0;
+    while (tm.elapsedSinceStart() < seconds) {
+      sim.update(dt);
+      TTimer tm_submit;
+      monitor.submit(sim, dt);
+      double ms = tm_submit.elapsed() * 1e3;
+      submit_ms += ms;
+      max_submit_ms = std::max(max_submit_ms, ms);
+      frames++;
+    }
+    printf("%llu frames of %d particles, update %1.3f ms, submit %1.4f ms (max %1.3f)\n", (unsigned long long)frames, sim.num_particles
+      , sim.times[ViscoelasticSim::eSection::Update] * 1e3, frames ? submit_ms / frames : 0.0, max_submit_ms);
+    printf("%llu snapshots sent, %llu dropped, %llu skipped by the clients, %1.1f Kb sent\n", (unsigned long long)monitor.snapshots_sent.load()
+      , (unsigned long long)monitor.snapshots_dropped.load(), (unsigned long long)monitor.messages_skipped.load(), monitor.bytes_sent.load() / 1024.0);
+    return 0;
+  }
+
+}
+
+int main(int argc, char** argv) {
+  const char* host = "127.0.0.1";
+  int port = 9300;
+  const char* scenario = nullptr;
+  double seconds = 10.0;
+  int slow_ms = 0;
+  bool websocket = false;
+  uint32_t max_bytes_per_second = 1 << 20;
+  for (int i = 1; i < argc; ++i) {
+    bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "-ws") == 0)
+      websocket = true;
+    else if (strcmp(argv[i], "-host") == 0 && has_value)
+      host = argv[++i];
+    else if (strcmp(argv[i], "-port") == 0 && has_value)
+      port = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-time") == 0 && has_value)
+      seconds = atof(argv[++i]);
+    else if (strcmp(argv[i], "-slow") == 0 && has_value)
+      slow_ms = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-bw") == 0 && has_value)
+      max_bytes_per_second = (uint32_t)(atof(argv[++i]) * 1024);
+    else if (strcmp(argv[i], "-serve") == 0 && has_value)
+      scenario = argv[++i];
+    else {
+      printf("Usage: %s [-host 127.0.0.1] [-port 9300] [-time seconds] [-ws] [-slow ms] [-serve scenario.json [-bw Kb/s]]\n", argv[0]);
+      return -1;
+    }
+  }
+
+  if (scenario)
+    return serve(port, scenario, seconds, max_bytes_per_second);
+
+  MonitorClient client;
+  MonitorMessage msg;
+  std::vector<std::string> section_names;
+  TTimer tm;
+  double next_report = 1.0;
+  uint32_t last_frame_id = 0;
+  bool has_frame = false;
+  uint64_t msgs = 0, skipped = 0, errors = 0, last_bytes = 0;
+  while (tm.elapsedSinceStart() < seconds) {
+    if (!client.isConnected()) {
+      if (!client.connect(host, port, websocket)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        continue;
+      }
+      has_frame = false;
+      last_bytes = client.bytes_received;
+    }
+    if (!client.receive(msg, 100))
+      continue;
+
+    if (msg.type == MonitorProtocol::Hello) {
+      section_names = msg.section_names;
+      continue;
+    }
+
+    // Each message has a point every stride particles, in their bounds
+    bool valid = msg.types.size() == (msg.num_particles + msg.stride - 1) / msg.stride;
+    for (size_t k = 0; valid && k < msg.types.size(); ++k) {
+      for (int a = 0; a < 3; ++a)
+        valid &= msg.pos[a][k] >= msg.bounds_min[a] - 1e-3f && msg.pos[a][k] <= msg.bounds_max[a] + 1e-3f;
+    }
+    if (!valid)
+      errors++;
+    if (has_frame && msg.frame_id > last_frame_id + 1)
+      skipped += msg.frame_id - last_frame_id - 1;
+    last_frame_id = msg.frame_id;
+    has_frame = true;
+    msgs++;
+    if (slow_ms)
+      std::this_thread::sleep_for(std::chrono::milliseconds(slow_ms));
+
+    if (tm.elapsedSinceStart() >= next_report) {
+      next_report += 1.0;
+      float update_ms = 0.0f;
+      for (size_t i = 0; i < section_names.size() && i < msg.times_ms.size(); ++i) {
+        if (section_names[i] == "update")
+          update_ms = msg.times_ms[i];
+      }
+      printf("frame %6u : %3llu msgs, %3llu skipped, %3llu errors, %7.1f kb/s, update %7.3f ms, %5zu points of %7u, center %6.3f %6.3f %6.3f, hash %5u cells %5u collisions\n"
+        , last_frame_id, (unsigned long long)msgs, (unsigned long long)skipped, (unsigned long long)errors, (client.bytes_received - last_bytes) / 1024.0, update_ms
+        , msg.types.size(), msg.num_particles
+        , (msg.bounds_min[0] + msg.bounds_max[0]) * 0.5f, (msg.bounds_min[1] + msg.bounds_max[1]) * 0.5f, (msg.bounds_min[2] + msg.bounds_max[2]) * 0.5f
+        , msg.cells_used, msg.num_collisions);
+      msgs = skipped = errors = 0;
+      last_bytes = client.bytes_received;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,27 @@
+#include "platform.h"
+
+// Converts a binary capture saved with Profiling::startStreaming to the Chrome trace
+// json format, which can be opened in chrome://tracing or ui.perfetto.dev
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("Usage: %s capture.bin [capture.json]\n", argv[0]);
+    return -1;
+  }
+  std::string ofilename;
+  if (argc > 2) {
+    ofilename = argv[2];
+  }
+  else {
+    ofilename = argv[1];
+    auto dot = ofilename.find_last_of('.');
+    if (dot != std::string::npos)
+      ofilename.resize(dot);
+    ofilename += ".json";
+  }
+  if (!Profiling::convertCapture(argv[1], ofilename.c_str())) {
+    printf("Failed to convert %s\n", argv[1]);
+    return -1;
+  }
+  printf("Saved %s\n", ofilename.c_str());
+  return 0;
+}
@@ -0,0 +1,65 @@
+#include "platform.h"
+#include "replay_log.h"
+
+// Plays a log saved with ReplayRecorder without the app, as a repeatable workload for the sim.
+// Reports the time of each frame and the first frame where the positions differ from the recording
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("Usage: %s replay.bin [-t num_threads] [-l loops] [-p 0|1]\n", argv[0]);
+    printf("  -p forces the sequential (0) or parallel (1) relaxation. Only the sequential one is deterministic\n");
+    return -1;
+  }
+  const char* filename = argv[1];
+  int num_threads = (int)std::thread::hardware_concurrency();
+  int num_loops = 1;
+  int force_parallel = -1;
+  for (int i = 2; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-t") == 0)
+      num_threads = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "-l") == 0)
+      num_loops = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "-p") == 0)
+      force_parallel = atoi(argv[i + 1]);
+  }
+
+  ViscoelasticSim sim;
+  sim.num_threads = std::max(num_threads, 1);
+  // The player grows the particles to the ones of the recording
+  sim.max_particles = 1;
+  sim.init();
+
+  THistogram frame_times;
+  bool diverged = false;
+  for (int loop = 0; loop < num_loops; ++loop) {
+    ReplayPlayer player;
+    player.force_parallel = force_parallel;
+    // The chunks of the host, like the emitter, are not needed to replay
+    if (!player.open(filename, sim, [](const ViscoelasticSim::TSnapshotChunk&, const void*) { return true; })) {
+      printf("Failed to open %s\n", filename);
+      return -1;
+    }
+    sim.resetLatencies();
+    TTimer tm;
+    TTimer tm_frame;
+    while (player.playFrame(sim))
+      frame_times.recordSeconds(tm_frame.reset());
+    printf("Loop %d: %u frames in %1.3f s, %d particles at the end\n", loop, player.frame, tm.elapsed(), sim.num_particles);
+    if (player.first_divergent_frame >= 0) {
+      printf("  Diverged from the recording at frame %d\n", player.first_divergent_frame);
+      diverged = true;
+    }
+  }
+
+  auto printSummary = [](const char* name, const THistogram& h) {
+    THistogram::TSummary s = h.summary();
+    if (!s.count)
+      return;
+    printf("%-28s %8llu  mean %8.3f  p50 %8.3f  p95 %8.3f  p99 %8.3f  max %8.3f ms\n", name, (unsigned long long)s.count
+      , s.mean_ns * 1e-6, s.p50_ns * 1e-6, s.p95_ns * 1e-6, s.p99_ns * 1e-6, s.max_ns * 1e-6);
+  };
+  printSummary("frame", frame_times);
+  // Of the last loop
+  for (int i = 0; i < ViscoelasticSim::eSection::NumSections; ++i)
+    printSummary(ViscoelasticSim::sectionName((ViscoelasticSim::eSection)i), sim.latencies[i]);
+  return diverged ? 1 : 0;
+}
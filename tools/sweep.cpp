@@ -0,0 +1,404 @@
+#include "platform.h"
+#include "viscoelastic_sim.h"
+#include "scenario.h"
+#include "formats/json/json_file.h"
+
+// Runs the sweeps declared in a json file, like data/sweeps/readme_tables.json, and saves for each sweep:
+//   name.csv  : the mean time of each section, in ms, of each combination of the axes
+//   name.svg  : the plotted sections against the x axis, one line per combination of the other axes
+//   name.md   : the same values as the tables of the README
+// Each sweep runs a scenario file, like data/scenarios/config_3d_32k.json, applied with Scenario::apply,
+// and defines the values of the axes (threads, particles, kernel_radius, substeps) which override the ones
+// of the scenario. The axes not given keep the value of the scenario, and the particles of its blocks are
+// scaled to the particles axis. Every combination runs the scenario for warmup_frames + frames, repetitions
+// times. The value reported is the median of the repetitions of the mean of the measured frames.
+// The auto tuner is disabled unless the sweep enables it, so each thread count uses all its threads.
+namespace {
+
+  // 0 keeps the value of the scenario
+  struct TAxes {
+    int   num_threads = 1;
+    int   num_particles = 0;
+    float kernel_radius = 0.0f;
+    int   num_substeps = 0;
+
+    // The value of the axis as the x of the plot
+    double get(const char* axis) const {
+      if (strcmp(axis, "threads") == 0)
+        return num_threads;
+      if (strcmp(axis, "particles") == 0)
+        return num_particles;
+      if (strcmp(axis, "kernel_radius") == 0)
+        return kernel_radius;
+      return num_substeps;
+    }
+  };
+
+  struct TSweep {
+    std::string              name;
+    std::string              scenario = "data/scenarios/config_3d_32k.json";
+    std::vector<int>         threads;
+    std::vector<int>         particles;
+    std::vector<float>       kernel_radius;
+    std::vector<int>         substeps;
+    int                      warmup_frames = 30;
+    int                      frames = 100;
+    int                      repetitions = 3;
+    bool                     auto_tune = false;
+    std::string              x_axis = "threads";
+    std::vector<std::string> plot;
+
+    void load(const json& j) {
+      name = j.value("name", "sweep");
+      scenario = j.value("scenario", scenario.c_str());
+      // The axes not given use a single default value
+      auto loadAxis = [&](const char* key, auto& values) {
+        if (j[key].isArray())
+          tryLoad(j[key], values);
+      };
+      loadAxis("threads", threads);
+      loadAxis("particles", particles);
+      loadAxis("kernel_radius", kernel_radius);
+      loadAxis("substeps", substeps);
+      if (threads.empty())
+        threads.push_back(std::max((int)std::thread::hardware_concurrency(), 1));
+      if (particles.empty())
+        particles.push_back(0);
+      if (kernel_radius.empty())
+        kernel_radius.push_back(0.0f);
+      if (substeps.empty())
+        substeps.push_back(0);
+      warmup_frames = j.value("warmup_frames", warmup_frames);
+      frames = std::max(j.value("frames", frames), 1);
+      repetitions = std::max(j.value("repetitions", repetitions), 1);
+      auto_tune = j.value("auto_tune", auto_tune);
+      x_axis = j.value("x", x_axis.c_str());
+      onEachArr(j["plot"], [&](json jp, size_t) {
+        plot.push_back((const char*)jp);
+        });
+      if (plot.empty())
+        plot.push_back("relaxation");
+    }
+  };
+
+  // The sections measured by the sweeps. Render is not part of the sim
+  constexpr ViscoelasticSim::eSection sections[] = {
+    ViscoelasticSim::eSection::SpatialHash,
+    ViscoelasticSim::eSection::VelocitiesUpdate,
+    ViscoelasticSim::eSection::PredictPositions,
+    ViscoelasticSim::eSection::Relaxation,
+    ViscoelasticSim::eSection::Collisions,
+    ViscoelasticSim::eSection::VelocitiesFromPositions,
+    ViscoelasticSim::eSection::Update,
+  };
+  constexpr int num_sections = sizeof(sections) / sizeof(sections[0]);
+
+  struct TResult {
+    TAxes  axes;
+    double mean_ms[num_sections] = { 0.0 };
+    double update_p95_ms = 0.0;
+  };
+
+  void setupScenario(ViscoelasticSim& sim, json jscenario, const TSweep& sweep, const TAxes& axes) {
+    Scenario::apply(sim, jscenario);
+    if (axes.kernel_radius > 0.0f)
+      sim.mat.kernel_radius = axes.kernel_radius;
+    if (axes.num_substeps > 0)
+      sim.num_substeps = axes.num_substeps;
+    if (sim.num_threads != axes.num_threads)
+      sim.setNumThreads(axes.num_threads);
+    sim.auto_tune = sweep.auto_tune;
+    sim.using_parallel = true;
+
+    // The blocks again, with their particles in the same proportions as in the scenario
+    json jblocks = jscenario["blocks"];
+    if (axes.num_particles <= 0 || axes.num_particles == sim.num_particles || !jblocks.isArray())
+      return;
+    std::vector<int> counts;
+    int total = 0;
+    onEachArr(jblocks, [&](json jb, size_t) {
+      counts.push_back(Scenario::blockCount(sim, jb));
+      total += counts.back();
+      });
+    sim.removeAllParticles();
+    int added = 0;
+    onEachArr(jblocks, [&](json jb, size_t i) {
+      int count = (i + 1 == counts.size()) ? axes.num_particles - added : (int)((int64_t)axes.num_particles * counts[i] / std::max(total, 1));
+      Scenario::generateBlock(sim, jb, count);
+      added += count;
+      });
+  }
+
+  TResult runCombination(const TSweep& sweep, json jscenario, const TAxes& axes) {
+    std::vector<TResult> reps(sweep.repetitions);
+    for (auto& r : reps) {
+      ViscoelasticSim sim;
+      sim.max_particles = std::max(axes.num_particles, 1);
+      sim.num_threads = axes.num_threads;
+      sim.auto_tune = sweep.auto_tune;
+      sim.init();
+      setupScenario(sim, jscenario, sweep, axes);
+      for (int f = 0; f < sweep.warmup_frames; ++f)
+        sim.update(1.0f);
+      sim.resetLatencies();
+      for (int f = 0; f < sweep.frames; ++f)
+        sim.update(1.0f);
+      // The values used, including the ones of the scenario
+      r.axes = { sim.num_threads, sim.num_particles, sim.mat.kernel_radius, sim.num_substeps };
+      for (int s = 0; s < num_sections; ++s)
+        r.mean_ms[s] = sim.latencies[sections[s]].summary().mean_ns * 1e-6;
+      r.update_p95_ms = sim.latencies[ViscoelasticSim::eSection::Update].summary().p95_ns * 1e-6;
+    }
+
+    // The median of each value independently
+    auto median = [&](auto getter) {
+      std::vector<double> values;
+      for (auto& r : reps)
+        values.push_back(getter(r));
+      std::sort(values.begin(), values.end());
+      return values[values.size() / 2];
+    };
+    TResult result;
+    result.axes = reps[0].axes;
+    for (int s = 0; s < num_sections; ++s)
+      result.mean_ms[s] = median([s](const TResult& r) { return r.mean_ms[s]; });
+    result.update_p95_ms = median([](const TResult& r) { return r.update_p95_ms; });
+    return result;
+  }
+
+  int sectionIndex(const std::string& name) {
+    for (int s = 0; s < num_sections; ++s) {
+      if (name == ViscoelasticSim::sectionName(sections[s]))
+        return s;
+    }
+    return -1;
+  }
+
+  // The axes with several values, other than x, split the results in different lines
+  std::string groupName(const TSweep& sweep, const TAxes& axes) {
+    char buf[256] = "";
+    char* p = buf;
+    char* end = buf + sizeof(buf);
+    auto add = [&](const char* axis, size_t num_values, const char* fmt, double v) {
+      if (num_values < 2 || sweep.x_axis == axis)
+        return;
+      p += snprintf(p, end - p, p == buf ? "%s " : ", %s ", axis);
+      p += snprintf(p, end - p, fmt, v);
+    };
+    add("threads", sweep.threads.size(), "%g", axes.num_threads);
+    add("particles", sweep.particles.size(), "%g", axes.num_particles);
+    add("kernel_radius", sweep.kernel_radius.size(), "%g", axes.kernel_radius);
+    add("substeps", sweep.substeps.size(), "%g", axes.num_substeps);
+    return buf;
+  }
+
+  bool saveCsv(const char* filename, const std::vector<TResult>& results) {
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+      return false;
+    fprintf(f, "threads,particles,kernel_radius,substeps");
+    for (auto s : sections)
+      fprintf(f, ",%s_ms", ViscoelasticSim::sectionName(s));
+    fprintf(f, ",update_p95_ms\n");
+    for (auto& r : results) {
+      fprintf(f, "%d,%d,%g,%d", r.axes.num_threads, r.axes.num_particles, r.axes.kernel_radius, r.axes.num_substeps);
+      for (int s = 0; s < num_sections; ++s)
+        fprintf(f, ",%.4f", r.mean_ms[s]);
+      fprintf(f, ",%.4f\n", r.update_p95_ms);
+    }
+    fclose(f);
+    return true;
+  }
+
+  bool saveMarkdown(const char* filename, const TSweep& sweep, const std::vector<TResult>& results) {
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+      return false;
+    std::string prev_group = "-";
+    for (auto& r : results) {
+      std::string group = groupName(sweep, r.axes);
+      if (group != prev_group) {
+        if (prev_group != "-")
+          fprintf(f, "\n");
+        if (!group.empty())
+          fprintf(f, "%s\n\n", group.c_str());
+        fprintf(f, "| %s |", sweep.x_axis.c_str());
+        for (auto& name : sweep.plot)
+          fprintf(f, " %s (msecs) |", name.c_str());
+        fprintf(f, "\n|---|");
+        for (size_t i = 0; i < sweep.plot.size(); ++i)
+          fprintf(f, "---|");
+        fprintf(f, "\n");
+        prev_group = group;
+      }
+      fprintf(f, "| %g |", r.axes.get(sweep.x_axis.c_str()));
+      for (auto& name : sweep.plot) {
+        int s = sectionIndex(name);
+        fprintf(f, " %.3f |", s >= 0 ? r.mean_ms[s] : 0.0);
+      }
+      fprintf(f, "\n");
+    }
+    fclose(f);
+    return true;
+  }
+
+  bool saveSvg(const char* filename, const TSweep& sweep, const std::vector<TResult>& results) {
+    struct TLine {
+      std::string         label;
+      std::vector<double> xs;
+      std::vector<double> ys;
+    };
+    std::vector<TLine> lines;
+    double max_x = 0.0;
+    double max_y = 0.0;
+    for (auto& name : sweep.plot) {
+      int s = sectionIndex(name);
+      if (s < 0)
+        continue;
+      for (auto& r : results) {
+        std::string label = name;
+        std::string group = groupName(sweep, r.axes);
+        if (!group.empty())
+          label += " (" + group + ")";
+        if (lines.empty() || lines.back().label != label)
+          lines.push_back({ label });
+        double x = r.axes.get(sweep.x_axis.c_str());
+        lines.back().xs.push_back(x);
+        lines.back().ys.push_back(r.mean_ms[s]);
+        max_x = std::max(max_x, x);
+        max_y = std::max(max_y, r.mean_ms[s]);
+      }
+    }
+    if (max_x <= 0.0)
+      max_x = 1.0;
+    if (max_y <= 0.0)
+      max_y = 1.0;
+
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+      return false;
+    const int w = 800, h = 500, left = 70, right = 20, top = 40, bottom = 60;
+    auto px = [&](double x) { return left + x / max_x * (w - left - right); };
+    auto py = [&](double y) { return h - bottom - y / max_y * (h - top - bottom); };
+    const char* palette[] = { "#e6194b", "#3cb44b", "#4363d8", "#f58231", "#911eb4", "#42d4f4", "#f032e6", "#469990" };
+    constexpr int num_colors = sizeof(palette) / sizeof(palette[0]);
+
+    fprintf(f, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" font-family=\"sans-serif\" font-size=\"12\">\n", w, h);
+    fprintf(f, "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+    fprintf(f, "<text x=\"%d\" y=\"20\" font-size=\"16\">%s</text>\n", left, sweep.name.c_str());
+    // Axes and ticks
+    fprintf(f, "<line x1=\"%d\" y1=\"%d\" x2=\"%d\" y2=\"%d\" stroke=\"black\"/>\n", left, h - bottom, w - right, h - bottom);
+    fprintf(f, "<line x1=\"%d\" y1=\"%d\" x2=\"%d\" y2=\"%d\" stroke=\"black\"/>\n", left, top, left, h - bottom);
+    const int num_ticks = 5;
+    for (int t = 0; t <= num_ticks; ++t) {
+      double x = max_x * t / num_ticks;
+      double y = max_y * t / num_ticks;
+      fprintf(f, "<text x=\"%.1f\" y=\"%d\" text-anchor=\"middle\">%g</text>\n", px(x), h - bottom + 16, x);
+      fprintf(f, "<text x=\"%d\" y=\"%.1f\" text-anchor=\"end\">%.2f</text>\n", left - 6, py(y) + 4, y);
+      fprintf(f, "<line x1=\"%d\" y1=\"%.1f\" x2=\"%d\" y2=\"%.1f\" stroke=\"#ddd\"/>\n", left, py(y), w - right, py(y));
+    }
+    fprintf(f, "<text x=\"%d\" y=\"%d\" text-anchor=\"middle\">%s</text>\n", (left + w - right) / 2, h - 20, sweep.x_axis.c_str());
+    fprintf(f, "<text x=\"16\" y=\"%d\" transform=\"rotate(-90 16 %d)\" text-anchor=\"middle\">msecs</text>\n", (top + h - bottom) / 2, (top + h - bottom) / 2);
+    // One polyline per line, with its label in the legend
+    for (size_t i = 0; i < lines.size(); ++i) {
+      const char* color = palette[i % num_colors];
+      fprintf(f, "<polyline fill=\"none\" stroke=\"%s\" stroke-width=\"2\" points=\"", color);
+      for (size_t k = 0; k < lines[i].xs.size(); ++k)
+        fprintf(f, "%.1f,%.1f ", px(lines[i].xs[k]), py(lines[i].ys[k]));
+      fprintf(f, "\"/>\n");
+      for (size_t k = 0; k < lines[i].xs.size(); ++k)
+        fprintf(f, "<circle cx=\"%.1f\" cy=\"%.1f\" r=\"3\" fill=\"%s\"/>\n", px(lines[i].xs[k]), py(lines[i].ys[k]), color);
+      fprintf(f, "<text x=\"%d\" y=\"%d\" fill=\"%s\">%s</text>\n", left + 10, top + 14 + (int)i * 16, color, lines[i].label.c_str());
+    }
+    fprintf(f, "</svg>\n");
+    fclose(f);
+    return true;
+  }
+
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("Usage: %s sweeps.json [-o output_dir] [-only sweep_name]\n", argv[0]);
+    return -1;
+  }
+  const char* filename = argv[1];
+  const char* output_dir = ".";
+  const char* only = nullptr;
+  for (int i = 2; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-o") == 0)
+      output_dir = argv[i + 1];
+    else if (strcmp(argv[i], "-only") == 0)
+      only = argv[i + 1];
+  }
+
+  TBuffer buf;
+  if (!buf.load(filename)) {
+    printf("Failed to read %s\n", filename);
+    return -1;
+  }
+  JsonFile jfile(buf);
+  std::vector<TSweep> sweeps;
+  onEachArr(jfile.j["sweeps"], [&](json j, size_t) {
+    TSweep sweep;
+    sweep.load(j);
+    sweeps.push_back(sweep);
+    });
+
+  for (const TSweep& sweep : sweeps) {
+    if (only && sweep.name != only)
+      continue;
+    Scenario::TFile scenario;
+    if (!scenario.load(sweep.scenario.c_str())) {
+      printf("Failed to read the scenario %s of %s\n", sweep.scenario.c_str(), sweep.name.c_str());
+      return -1;
+    }
+    printf("%s (%s)\n", sweep.name.c_str(), sweep.scenario.c_str());
+    printf("%8s %10s %8s %8s", "threads", "particles", "radius", "substeps");
+    for (auto s : sections)
+      printf(" %12.12s", ViscoelasticSim::sectionName(s));
+    printf("\n");
+
+    // The x axis changes faster, so the results of each line are continuous
+    std::vector<TResult> results;
+    auto runAll = [&](TAxes axes) {
+      TResult r = runCombination(sweep, scenario.j, axes);
+      printf("%8d %10d %8g %8d", r.axes.num_threads, r.axes.num_particles, r.axes.kernel_radius, r.axes.num_substeps);
+      for (int s = 0; s < num_sections; ++s)
+        printf(" %12.3f", r.mean_ms[s]);
+      printf("\n");
+      results.push_back(r);
+    };
+    const std::string& x = sweep.x_axis;
+    for (int t : (x == "threads" ? std::vector<int>{ 0 } : sweep.threads)) {
+      for (int n : (x == "particles" ? std::vector<int>{ 0 } : sweep.particles)) {
+        for (float kr : (x == "kernel_radius" ? std::vector<float>{ 0.0f } : sweep.kernel_radius)) {
+          for (int ns : (x == "substeps" ? std::vector<int>{ 0 } : sweep.substeps)) {
+            TAxes axes = { t, n, kr, ns };
+            if (x == "threads")
+              for (int v : sweep.threads) { axes.num_threads = v; runAll(axes); }
+            else if (x == "particles")
+              for (int v : sweep.particles) { axes.num_particles = v; runAll(axes); }
+            else if (x == "kernel_radius")
+              for (float v : sweep.kernel_radius) { axes.kernel_radius = v; runAll(axes); }
+            else
+              for (int v : sweep.substeps) { axes.num_substeps = v; runAll(axes); }
+          }
+        }
+      }
+    }
+
+    char name[512];
+    snprintf(name, sizeof(name), "%s/%s.csv", output_dir, sweep.name.c_str());
+    bool ok = saveCsv(name, results);
+    snprintf(name, sizeof(name), "%s/%s.svg", output_dir, sweep.name.c_str());
+    ok &= saveSvg(name, sweep, results);
+    snprintf(name, sizeof(name), "%s/%s.md", output_dir, sweep.name.c_str());
+    ok &= saveMarkdown(name, sweep, results);
+    if (!ok) {
+      printf("Failed to save the results of %s in %s\n", sweep.name.c_str(), output_dir);
+      return -1;
+    }
+  }
+  return 0;
+}
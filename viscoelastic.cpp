@@ -2,6 +2,11 @@
 #include "render/render.h"
 #include "render/debug_texts.h"
 #include "viscoelastic_sim.h"
+#include "frame_recorder.h"
+#include "particles_feed.h"
+#include "monitor_server.h"
+#include "replay_log.h"
+#include "scenario.h"
 
 extern VEC2 mouse_cursor;
 
@@ -21,6 +26,7 @@ struct ViscoelasticModule : public Module {
 
     int                      counter = 0;
     int                      period = 1024;
+    TRandomSequence          rseq;
 
     enum eGenerationType {
       eUniform,
@@ -62,13 +68,93 @@ struct ViscoelasticModule : public Module {
       num_pendings += n;
       enabled = true;
     }
+
+    // From the emitters of a scenario file
+    void load(const json& j) {
+      transform.setPosition(j.value("position", transform.getPosition()));
+      if (j.count("rotation"))
+        transform.setRotation(j.value("rotation", QUAT()));
+      radius = j.value("radius", radius);
+      strength = j.value("strength", strength);
+      rate = j.value("rate", rate);
+      particle_type = j.value("type", particle_type);
+      period = j.value("period", period);
+      enabled = j.value("enabled", enabled);
+      const char* generation = j.value("generation", "");
+      if (strcmp(generation, "uniform") == 0)
+        generation_type = eGenerationType::eUniform;
+      else if (strcmp(generation, "random") == 0)
+        generation_type = eGenerationType::eRandom;
+      else if (strcmp(generation, "ranges") == 0)
+        generation_type = eGenerationType::eRanges;
+      int count = j.value("count", 0);
+      if (count > 0)
+        add(count);
+    }
+
+    // Stored in the snapshots of the sim
+    static constexpr uint32_t snapshot_tag = ViscoelasticSim::makeSnapshotTag('E', 'M', 'I', 'T');
+    struct TSnapshot {
+      float    position[3];
+      float    rotation[4];
+      float    scale[3];
+      float    radius;
+      float    strength;
+      int32_t  rate;
+      int32_t  enabled;
+      int32_t  particle_type;
+      int32_t  num_pendings;
+      int32_t  counter;
+      int32_t  period;
+      int32_t  generation_type;
+      uint32_t seed;
+    };
+    void saveSnapshot(TBuffer& buf) const {
+      const TTransform& t = transform;
+      TSnapshot s = {
+        { t.position.x, t.position.y, t.position.z },
+        { t.rotation.x, t.rotation.y, t.rotation.z, t.rotation.w },
+        { t.scale.x, t.scale.y, t.scale.z },
+        radius, strength, rate, enabled ? 1 : 0, particle_type, num_pendings, counter, period, (int32_t)generation_type, rseq.getSeed()
+      };
+      ViscoelasticSim::writeSnapshotChunk(buf, snapshot_tag, 2, &s, sizeof(s));
+    }
+    bool loadSnapshot(const ViscoelasticSim::TSnapshotChunk& chunk, const void* payload) {
+      // The version 1 has no seed
+      if (chunk.tag != snapshot_tag)
+        return false;
+      if (!(chunk.version == 2 && chunk.nbytes == sizeof(TSnapshot)) && !(chunk.version == 1 && chunk.nbytes == offsetof(TSnapshot, seed)))
+        return false;
+      const TSnapshot& s = *(const TSnapshot*)payload;
+      transform.position = VEC3(s.position[0], s.position[1], s.position[2]);
+      transform.rotation = QUAT(s.rotation[0], s.rotation[1], s.rotation[2], s.rotation[3]);
+      transform.scale = VEC3(s.scale[0], s.scale[1], s.scale[2]);
+      radius = s.radius;
+      strength = s.strength;
+      rate = s.rate;
+      enabled = s.enabled != 0;
+      particle_type = s.particle_type;
+      num_pendings = s.num_pendings;
+      counter = s.counter;
+      period = s.period;
+      generation_type = (eGenerationType)s.generation_type;
+      if (chunk.version >= 2)
+        rseq.setSeed(s.seed);
+      return true;
+    }
     void emit(ViscoelasticSim& sim) {
       if (!enabled)
         return;
-      static TRandomSequence rseq;
-      for (int i = 0; i < rate; ++i) {
-        VEC3 p = transform.transformCoord(VEC3(rseq.between(-radius, radius), rseq.between(-radius, radius), rseq.between(-radius, radius))) * sim.world_scale;
-        VEC3 v = transform.transformDir(VEC3::axis_z) * strength;
+      // A box in the local space of the emitter, scaled to the units of the sim
+      ViscoelasticSim::BulkShape shape;
+      shape.vmin = -VEC3::ones * radius;
+      shape.vmax = VEC3::ones * radius;
+      shape.transform = TTransform(transform.position * sim.world_scale, transform.rotation, transform.scale * sim.world_scale);
+      shape.velocity = transform.transformDir(VEC3::axis_z) * strength;
+      shape.seed = rseq.rand();
+      int num_added = 0;
+      int first = sim.addParticlesBulk(rate, shape, &num_added);
+      for (int i = first; i < first + num_added; ++i) {
         if (generation_type == eGenerationType::eRandom)
           particle_type = rseq.between(0, 4);
         else if( generation_type == eGenerationType::eRanges ) {
@@ -78,7 +164,7 @@ struct ViscoelasticModule : public Module {
             particle_type = ( particle_type + 1 ) % 4;
           }
         }
-        sim.addParticle(p, v, particle_type);
+        sim.particles_type[i] = (uint8_t)particle_type;
       }
       if (num_pendings > 0) {
         num_pendings -= rate;
@@ -89,6 +175,10 @@ struct ViscoelasticModule : public Module {
   };
 
   Emitter                  emitter;
+  FrameRecorder            recorder;
+  ParticlesFeed            feed;
+  MonitorServer            monitor;
+  ReplayRecorder           replay;
 
   bool                     paused = false;
   bool                     auto_pause = false;
@@ -136,50 +226,54 @@ struct ViscoelasticModule : public Module {
 
   ViscoelasticModule() {
     sim.init();
-    sim.in_2d = true;
-    //sim.sdf.prims.push_back(SDF::Primitive::makeBox(VEC3(0, 1.5, 1.0), VEC3(1.0f, 2.0f, 3.0f) * 0.1f));
-    emitter.transform.setPosition(VEC3(0.0f, 3.0f, 1.0f));
-    //sdfCage();
-    //addParticles(512);
-    sdfLargeCage();
-    config3D_32K();
+    loadScenario("data/scenarios/config_3d_32k.json");
   }
 
-  void sdfCage(  ) {
-    sim.sdf.prims.clear();
-    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3::zero, VEC3::axis_y));
-    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(0, 6, 0), -VEC3::axis_y));
-    const float sz = 2.5f;
-    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(0, 0, sz), -VEC3::axis_z));
-    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(0, 0, 0), VEC3::axis_z));
-    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(sz, 0, 0), -VEC3::axis_x));
-    sim.sdf.prims.push_back(SDF::Primitive::makePlane(VEC3(0, 0, 0), VEC3::axis_x));
-  }
+  // Scenario loaded last, reloaded by Restart
+  std::string scenario_filename;
 
-  void sdfInsideCage( ) {
-    sim.sdf.prims.clear();
-    sim.sdf.prims.push_back(SDF::Primitive::makeBox(VEC3(1.0f, 4.0f, 0.0f), VEC3( 2.0f, 2.0, 4.0f )));
-    sim.sdf.prims.back().multiplier = -1.0f;
-    sim.sdf.prims.back().transformHasChanged();
-  }
-
-  void sdfLargeCage() {
-    sim.in_2d = false;
-    sdfCage();
-    sim.sdf.prims[3].transform.position.z = -5.0;
-    sim.sdf.prims[3].transformHasChanged();
-  }
+  struct TScenarioButton {
+    const char* label;
+    const char* filename;
+  };
+  static constexpr TScenarioButton particle_scenarios[] = {
+    { "Config 2D 2K Particles", "data/scenarios/config_2d_2k.json" },
+    { "Config 3D 8K Particles", "data/scenarios/config_3d_8k.json" },
+    { "Config 3D 32K Particles", "data/scenarios/config_3d_32k.json" },
+    { "Dam Break 1M Particles", "data/scenarios/dam_break_1m.json" },
+  };
+  static constexpr TScenarioButton sdf_scenarios[] = {
+    { "Box3D Large", "data/scenarios/large_cage.json" },
+    { "Platforms", "data/scenarios/platforms.json" },
+    { "Inside Box", "data/scenarios/inside_box.json" },
+  };
 
-  void sdfPlatforms() {
-    sim.in_2d = false;
-    sdfLargeCage();
-    emitter.transform.setPosition(VEC3(0.0f, 5.7f, -1.5f));
-    sim.sdf.prims.push_back(SDF::Primitive::makeBox(VEC3(1.0f, 2.5f, -2.5f), VEC3(10.0f, 2.0f, 10.0f) * 0.2f));
-    sim.sdf.prims.back().transform.setRotation(QUAT::createFromAxisAngle(VEC3::axis_x, deg2rad(20.0f)));
-    sim.sdf.prims.back().transformHasChanged();
-    sim.sdf.prims.push_back(SDF::Primitive::makeBox(VEC3(1.0f, 4.5f, 1.0f), VEC3(10.0f, 2.0f, 10.0f) * 0.2f));
-    sim.sdf.prims.back().transform.setRotation(QUAT::createFromAxisAngle(VEC3::axis_x, deg2rad(-20.0f)));
-    sim.sdf.prims.back().transformHasChanged();
+  bool loadScenario(const char* filename) {
+    Scenario::TFile file;
+    if (!file.load(filename))
+      return false;
+    // The particles of the scenario are not part of the replay
+    json j = file.j;
+    if (j["blocks"].isArray()) {
+      replay.stop();
+      scenario_filename = filename;
+    }
+    TTimer tm;
+    Scenario::apply(sim, j);
+    dbg("Scenario %s: %d particles in %1.3f ms\n", filename, sim.num_particles, tm.elapsed() * 1e3);
+
+    // The gravity of the sim is set from the direction and amount of the menu on each update
+    if (j["material"].count("gravity")) {
+      VEC3 g = sim.mat.gravity;
+      gravity_amount = g.length();
+      gravity_direction = rad2deg(getYawFromVector(VEC3(g.y, 0.0f, g.z)));
+    }
+    delta_time = j["sim"].value("delta_time", delta_time);
+    // There is a single emitter
+    json jemitters = j["emitters"];
+    if (jemitters.isArray() && jemitters.size() > 0)
+      emitter.load(jemitters[(size_t)0]);
+    return true;
   }
 
   void load() override {
@@ -187,18 +281,6 @@ struct ViscoelasticModule : public Module {
     lines = Render::VInstances( "line.mesh" );
   }
 
-  void addParticles(int num) {
-    uint8_t particle_type = 0;
-    TRandomSequence seq(54123);
-    for (int i = 0; i < num; ++i) {
-      if (sim.in_2d)
-        sim.addParticle(VEC3(0.0f, seq.between(200.0, 1000.0f), seq.between(-500.0, 500.0f)), VEC3(0, 0, 0), particle_type );
-      else
-        sim.addParticle(VEC3(seq.between(200.0, 2000.0f), seq.between(100.0, 1000.0f), seq.between(-500.0, 500.0f)), VEC3(0, 0, 0), particle_type);
-    }
-    updateParticleTypes();
-  }
-
   void drawCell(const CPUSpatialSubdivision::Int3& coords) {
     
     const float inv_world_scale = 1.0f / sim.world_scale;
@@ -220,7 +302,7 @@ struct ViscoelasticModule : public Module {
   }
 
   void onRender3D() override {
-    TTimer tm;
+    ViscoelasticSim::TSectionTimer tm;
 
     float sim_to_world_factor = 1.0f / sim.world_scale;
 
@@ -303,26 +385,6 @@ struct ViscoelasticModule : public Module {
     sim.saveTime(ViscoelasticSim::eSection::Render, tm);
   }
   
-  void config3D_32K() {
-    sim.mat.rest_density = 3.0f;
-    sim.mat.near_stiffness = 1.0f;
-    delta_time = 1.0f;
-    sim.max_speed = 5.0f;
-    sim.mat.kernel_radius = 20.0f;
-    gravity_amount = 0.1f;
-    gravity_direction = -90.0f;
-    num_particles_m0 = 8192;
-    num_particles_m1 = 8192;
-    num_particles_m2 = 8192;
-    sim.using_parallel = true;
-    sim.num_particles = 0;
-    sim.sdf.prims[3].transform.setPosition(VEC3(0, 0, -5.0));
-    sim.sdf.prims[3].transformHasChanged();
-    sim.in_2d = false;
-    addParticles(32 * 1024);
-    updateParticleTypes();
-  }
-
   void renderInMenu() override {
 
     if (paused) {
@@ -338,18 +400,106 @@ struct ViscoelasticModule : public Module {
     }
 
     if (ImGui::SmallButton("Restart")) {
-      int n = sim.num_particles;
       sim.init();
-      addParticles(n);
+      loadScenario(scenario_filename.c_str());
+    }
+    ImGui::SameLine();
+    if (ImGui::SmallButton("Save Snapshot")) {
+      TBuffer host_chunks;
+      emitter.saveSnapshot(host_chunks);
+      TTimer tm;
+      bool ok = sim.saveSnapshot("snapshot.bin", &host_chunks);
+      dbg("Save snapshot.bin %s in %1.3f ms\n", ok ? "ok" : "failed", tm.elapsed() * 1e3);
+    }
+    ImGui::SameLine();
+    if (ImGui::SmallButton("Load Snapshot")) {
+      replay.stop();
+      TTimer tm;
+      bool ok = sim.loadSnapshot("snapshot.bin", [&](const ViscoelasticSim::TSnapshotChunk& chunk, const void* payload) {
+        return emitter.loadSnapshot(chunk, payload);
+        });
+      dbg("Load snapshot.bin %s in %1.3f ms\n", ok ? "ok" : "failed", tm.elapsed() * 1e3);
+    }
+
+    if (!replay.isRecording()) {
+      if (ImGui::SmallButton("Record Replay")) {
+        TBuffer host_chunks;
+        emitter.saveSnapshot(host_chunks);
+        replay.start("replay.bin", sim, &host_chunks);
+      }
+    }
+    else {
+      if (ImGui::SmallButton("Stop Replay"))
+        replay.stop();
+      ImGui::SameLine();
+      ImGui::Text("%u frames, %1.1f Mb", replay.num_frames, replay.bytes_written / (1024.0 * 1024.0));
+    }
+
+    if (!recorder.isRecording()) {
+      if (ImGui::SmallButton("Record Frames"))
+        recorder.start("frames.bin");
+    }
+    else {
+      if (ImGui::SmallButton("Stop Recording"))
+        recorder.stop();
+      ImGui::SameLine();
+      uint64_t raw_bytes = recorder.raw_bytes;
+      uint64_t bytes_written = recorder.bytes_written;
+      ImGui::Text("%llu frames, %llu dropped, %1.1f Mb (x%1.1f)", (unsigned long long)recorder.frames_written.load(), (unsigned long long)recorder.frames_dropped.load()
+        , bytes_written / (1024.0 * 1024.0), bytes_written ? (double)raw_bytes / bytes_written : 0.0);
+    }
+
+    if (!feed.isPublishing()) {
+      if (ImGui::SmallButton("Publish Feed"))
+        feed.start("/viscoelastic_particles", sim.max_particles);
+    }
+    else {
+      if (ImGui::SmallButton("Stop Feed"))
+        feed.stop();
+      ImGui::SameLine();
+      ImGui::Text("%llu frames, %1.3f ms", (unsigned long long)feed.frames_published.load(), feed.last_publish_ms);
+    }
+
+    if (!monitor.isRunning()) {
+      if (ImGui::SmallButton("Start Monitor"))
+        monitor.start(9300);
+    }
+    else {
+      if (ImGui::SmallButton("Stop Monitor"))
+        monitor.stop();
+      ImGui::SameLine();
+      ImGui::Text("Port %d, %d clients, %llu sent, %llu skipped, %1.1f Mb", monitor.port(), monitor.num_clients.load()
+        , (unsigned long long)monitor.snapshots_sent.load(), (unsigned long long)monitor.messages_skipped.load(), monitor.bytes_sent.load() / (1024.0 * 1024.0));
     }
 
     ImGui::Text("%d Particles / %d Cells", sim.num_particles, (int)sim.spatial_hash.cells_ranges.size());
     ImGui::Checkbox("Using parallel", &sim.using_parallel);
+    ImGui::SameLine();
+    ImGui::Checkbox("Reference kernels", &sim.use_reference);
+    ImGui::Checkbox("Balanced relaxation", &sim.relaxation_balanced);
     int max_threads = std::thread::hardware_concurrency();
     int num_threads = sim.num_threads;
     if (ImGui::DragInt("Num Threads", &num_threads, 0.1f, 1, max_threads))
       sim.setNumThreads(num_threads);
 
+    if (ImGui::TreeNode("Thread Pinning...")) {
+      const ThreadAffinity::TTopology& topology = ThreadAffinity::topology();
+      ImGui::Text("%d cpus, %d cores, %d packages, %d numa nodes", (int)topology.cpus.size(), topology.num_cores, topology.num_packages, topology.num_nodes);
+      static char explicit_cpus[256] = "";
+      int policy = (int)sim.pinning;
+      bool changed = ImGui::Combo("Policy", &policy, [](void*, int idx) {
+        return ThreadAffinity::policyName((ThreadAffinity::ePolicy)idx);
+        }, nullptr, (int)ThreadAffinity::ePolicy::NumPolicies);
+      if (policy == (int)ThreadAffinity::ePolicy::Explicit)
+        changed |= ImGui::InputText("CPUs", explicit_cpus, sizeof(explicit_cpus), ImGuiInputTextFlags_EnterReturnsTrue);
+      if (changed)
+        sim.setPinning((ThreadAffinity::ePolicy)policy, ThreadAffinity::parseCpuList(explicit_cpus));
+      std::vector<int> cpus = ThreadAffinity::cpusForWorkers(sim.pinning, sim.num_threads, sim.pinning_cpus);
+      for (int i = 0; i < (int)cpus.size(); ++i)
+        ImGui::Text("Worker %2d -> cpu %d", i, cpus[i]);
+      ImGui::TreePop();
+    }
+
     if (ImGui::TreeNode("Simulation Params...")) {
       ImGui::DragFloat("Kernel Radius", &sim.mat.kernel_radius, 0.1f);
       ImGui::DragFloat("Rest Density", &sim.mat.rest_density, 0.1f);
@@ -375,6 +525,133 @@ struct ViscoelasticModule : public Module {
       ImGui::Text("%1.6lf render", sim.times[ViscoelasticSim::eSection::Render]);
       ImGui::Text("%1.6lf Total update (BW: %1.0f Mb/s)", sim.times[ViscoelasticSim::eSection::Update], ( 2.0f * buffer_size_mbs / sim.times[ViscoelasticSim::eSection::Update]));
       ImGui::Text("# Hash Collisions: %d (%1.2f%%)", sim.spatial_hash.num_collisions, (sim.spatial_hash.num_collisions * 100.0 / sim.num_particles) );
+
+      bool hw_counters = Profiling::countersEnabled();
+      if (ImGui::Checkbox("HW Counters", &hw_counters))
+        Profiling::enableCounters(hw_counters);
+      if (hw_counters) {
+        for (int i = 0; i < ViscoelasticSim::eSection::NumSections; ++i) {
+          const double* c = sim.counters[i];
+          double ipc = c[Profiling::Cycles] > 0.0 ? c[Profiling::Instructions] / c[Profiling::Cycles] : 0.0;
+          ImGui::Text("IPC %1.2lf LLC %6.1lfK dTLB %6.1lfK %s", ipc, c[Profiling::LLCMisses] * 1e-3, c[Profiling::DTLBMisses] * 1e-3, ViscoelasticSim::sectionName((ViscoelasticSim::eSection)i));
+        }
+      }
+      ImGui::TreePop();
+    }
+
+    if (ImGui::TreeNode("Latencies...")) {
+      if (ImGui::SmallButton("Reset"))
+        sim.resetLatencies();
+      ImGui::SameLine();
+      if (ImGui::SmallButton("Save"))
+        sim.saveLatencies("latencies.json");
+      if (ImGui::BeginTable("latencies", 6, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit)) {
+        ImGui::TableSetupColumn("Section (ms)");
+        ImGui::TableSetupColumn("p50");
+        ImGui::TableSetupColumn("p95");
+        ImGui::TableSetupColumn("p99");
+        ImGui::TableSetupColumn("max");
+        ImGui::TableSetupColumn("count");
+        ImGui::TableHeadersRow();
+        auto showRow = [](const char* name, const THistogram& h) {
+          THistogram::TSummary s = h.summary();
+          ImGui::TableNextRow();
+          ImGui::TableNextColumn(); ImGui::TextUnformatted(name);
+          ImGui::TableNextColumn(); ImGui::Text("%1.3lf", s.p50_ns * 1e-6);
+          ImGui::TableNextColumn(); ImGui::Text("%1.3lf", s.p95_ns * 1e-6);
+          ImGui::TableNextColumn(); ImGui::Text("%1.3lf", s.p99_ns * 1e-6);
+          ImGui::TableNextColumn(); ImGui::Text("%1.3lf", s.max_ns * 1e-6);
+          ImGui::TableNextColumn(); ImGui::Text("%llu", (unsigned long long)s.count);
+        };
+        for (int i = 0; i < ViscoelasticSim::eSection::NumSections; ++i)
+          showRow(ViscoelasticSim::sectionName((ViscoelasticSim::eSection)i), sim.latencies[i]);
+        showRow("parallel jobs", sim.jobs_latencies);
+        ImGui::EndTable();
+      }
+      ImGui::TreePop();
+    }
+
+    if (ImGui::TreeNode("Parallel Regions...")) {
+      if (ImGui::BeginTable("parallel", 7, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit)) {
+        ImGui::TableSetupColumn("Region (ms)");
+        ImGui::TableSetupColumn("wall");
+        ImGui::TableSetupColumn("mean chunk");
+        ImGui::TableSetupColumn("max chunk");
+        ImGui::TableSetupColumn("max/mean");
+        ImGui::TableSetupColumn("busy");
+        ImGui::TableSetupColumn("idle");
+        ImGui::TableHeadersRow();
+        for (auto& stats : sim.parallel_stats) {
+          ImGui::TableNextRow();
+          ImGui::TableNextColumn(); ImGui::TextUnformatted(stats.name);
+          ImGui::TableNextColumn(); ImGui::Text("%1.3lf", stats.wall_time * 1e3);
+          ImGui::TableNextColumn(); ImGui::Text("%1.3lf", stats.mean_chunk * 1e3);
+          ImGui::TableNextColumn(); ImGui::Text("%1.3lf", stats.max_chunk * 1e3);
+          ImGui::TableNextColumn(); ImGui::Text("%1.2lf", stats.imbalance);
+          ImGui::TableNextColumn(); ImGui::Text("%1.0lf%%", stats.utilisation * 100.0);
+          ImGui::TableNextColumn(); ImGui::Text("%1.3lf", (1.0 - stats.utilisation) * stats.wall_time * 1e3);
+        }
+        ImGui::EndTable();
+      }
+      // Time of each chunk and the wait at the join, in the last run
+      for (auto& stats : sim.parallel_stats) {
+        if (!ImGui::TreeNode(stats.name))
+          continue;
+        ImGui::PlotHistogram("Chunk Time", stats.chunk_time.data(), (int)stats.chunk_time.size(), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+        ImGui::PlotHistogram("Join Wait", stats.chunk_wait.data(), (int)stats.chunk_wait.size(), 0, nullptr, 0.0f, FLT_MAX, ImVec2(0, 40));
+        ImGui::TreePop();
+      }
+      ImGui::TreePop();
+    }
+
+    if (ImGui::TreeNode("Auto Tuner...")) {
+      if (ImGui::Checkbox("Enabled", &sim.auto_tune) && !sim.auto_tune)
+        sim.tuner.stop();
+      ImGui::SameLine();
+      if (ImGui::SmallButton("Retune"))
+        sim.retune();
+      if (ImGui::BeginTable("tuner", 6, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit)) {
+        ImGui::TableSetupColumn("Stage");
+        ImGui::TableSetupColumn("state");
+        ImGui::TableSetupColumn("threads");
+        ImGui::TableSetupColumn("chunks");
+        ImGui::TableSetupColumn("best ms");
+        ImGui::TableSetupColumn("pin");
+        ImGui::TableHeadersRow();
+        for (int i = 0; i < (int)sim.tuner.stages.size(); ++i) {
+          AutoTuner::Stage& s = sim.tuner.stages[i];
+          if (!s.name)
+            continue;
+          ImGui::PushID(i);
+          ImGui::TableNextRow();
+          ImGui::TableNextColumn(); ImGui::TextUnformatted(s.name);
+          ImGui::TableNextColumn(); ImGui::TextUnformatted(s.pinned ? "pinned" : (s.tuning ? "tuning" : "settled"));
+          // The pinned configurations can be edited by hand
+          ImGui::TableNextColumn();
+          ImGui::SetNextItemWidth(60);
+          if (s.pinned)
+            ImGui::DragInt("##threads", &s.current.num_threads, 0.1f, 1, sim.num_threads);
+          else
+            ImGui::Text("%d", s.current.num_threads);
+          ImGui::TableNextColumn();
+          ImGui::SetNextItemWidth(60);
+          if (s.pinned)
+            ImGui::DragInt("##chunks", &s.current.num_splits, 0.1f, 1, 256);
+          else
+            ImGui::Text("%d", s.current.num_splits);
+          ImGui::TableNextColumn();
+          if (s.best_time < DBL_MAX)
+            ImGui::Text("%1.3lf", s.best_time * 1e3);
+          else
+            ImGui::TextUnformatted("-");
+          ImGui::TableNextColumn();
+          bool pinned = s.pinned;
+          if (ImGui::Checkbox("##pin", &pinned))
+            sim.tuner.pin(i, pinned);
+          ImGui::PopID();
+        }
+        ImGui::EndTable();
+      }
       ImGui::TreePop();
     }
 
@@ -403,47 +680,15 @@ struct ViscoelasticModule : public Module {
     }
 
     if (ImGui::SmallButton("Remove All Particles"))
-      sim.num_particles = 0;
-
-    if (ImGui::SmallButton("Config 2D 2K Particles")) {
-      sim.mat.rest_density = 3.0f;
-      sim.mat.near_stiffness = 1.0f;
-      sim.friction = 1.0f;
-      delta_time = 1.0f;
-      sim.max_speed = 5.0f;
-      sim.mat.kernel_radius = 20.0f;
-      gravity_amount = 0.1f;
-      gravity_direction = -90.0f;
-      num_particles_m0 = 512;
-      num_particles_m1 = 512;
-      num_particles_m2 = 512;
-      sim.num_particles = 0;
-      sim.sdf.prims[3].transform.setPosition(VEC3(0, 0, -5.0));
-      sim.sdf.prims[3].transformHasChanged();
-      sim.in_2d = true;
-      addParticles(2048);
-      updateParticleTypes();
-    }
-
-    if (ImGui::SmallButton("Config 3D 8K Particles")) {
-      sim.mat.rest_density = 3.0f;
-      sim.mat.near_stiffness = 1.0f;
-      delta_time = 1.0f;
-      sim.max_speed = 5.0f;
-      sim.mat.kernel_radius = 20.0f;
-      gravity_amount = 0.1f;
-      gravity_direction = -90.0f;
-      num_particles_m0 = 3072;
-      num_particles_m1 = 3072;
-      num_particles_m2 = 3072;
-      sim.num_particles = 0;
-      sim.in_2d = false;
-      addParticles(8192);
-      updateParticleTypes();
-    }
-
-    if (ImGui::SmallButton("Config 3D 32K Particles"))
-      config3D_32K();
+      sim.removeAllParticles();
+
+    for (const TScenarioButton& b : particle_scenarios) {
+      if (ImGui::SmallButton(b.label))
+        loadScenario(b.filename);
+    }
+    static char scenario_file[256] = "data/scenarios/config_3d_32k.json";
+    if (ImGui::InputText("Scenario", scenario_file, sizeof(scenario_file), ImGuiInputTextFlags_EnterReturnsTrue))
+      loadScenario(scenario_file);
 
     if (ImGui::TreeNode("Colors..."))
     {
@@ -488,12 +733,10 @@ struct ViscoelasticModule : public Module {
     emitter.renderInMenu();
 
     if (ImGui::TreeNode("SDFs Config...")) {
-      if (ImGui::SmallButton("Box3D Large"))
-        sdfLargeCage();
-      if (ImGui::SmallButton("Platforms"))
-        sdfPlatforms();
-      if (ImGui::SmallButton("Inside Box"))
-        sdfInsideCage();
+      for (const TScenarioButton& b : sdf_scenarios) {
+        if (ImGui::SmallButton(b.label))
+          loadScenario(b.filename);
+      }
       ImGui::Checkbox("Auto rotate first box", &auto_rotate_first_box);
       if( auto_rotate_first_box )
         ImGui::DragFloat( "Rotation Speed", &auto_rotation_speed, 0.01f, -1.0f, 1.0f );
@@ -520,10 +763,19 @@ struct ViscoelasticModule : public Module {
     if (!paused) {
       VEC3 gdir = getVectorFromYaw(deg2rad(gravity_direction));
       sim.mat.gravity = VEC3(0, gdir.x, gdir.z) * gravity_amount;
+      replay.recordUpdate(sim, delta_time);
       sim.update(delta_time);
       debug_particle = sim.debug_particle;
-
+      if (recorder.isRecording())
+        recorder.submit(sim, delta_time);
+      if (feed.isPublishing())
+        feed.publish(sim, delta_time);
+      if (monitor.isRunning())
+        monitor.submit(sim, delta_time);
+
+      int first_spawned = sim.num_particles;
       emitter.emit(sim);
+      replay.recordSpawns(sim, first_spawned);
     }
     if (auto_pause)
       paused = true;
@@ -543,6 +795,7 @@ struct ViscoelasticModule : public Module {
     if (drain) {
       std::vector< int > ids;
       sim.getParticleIDsNear(ids, sim.interact_point, sim.interact_rad);
+      replay.recordDrain(sim, ids);
       sim.removeParticles(ids);
     }
 
@@ -556,7 +809,7 @@ struct ViscoelasticModule : public Module {
       }
     }
 
-
+    replay.endFrame(sim);
   }
 
   VEC3 findNearestIntersectionWithSDF(VEC3 ray_src, VEC3 ray_dir) const {
@@ -577,6 +830,12 @@ struct ViscoelasticModule : public Module {
     // test vs the other primitives...
     // ..
 
+    // and vs the fluid, which is in sim units
+    ViscoelasticSim::RayHit hit;
+    float max_dist = (best_t == FLT_MAX) ? 1000.0f : best_t;
+    if (sim.raycastParticles(ray_src * sim.world_scale, ray_dir, max_dist * sim.world_scale, sim.mat.point_size, hit))
+      best_t = std::min(best_t, hit.t / sim.world_scale);
+
     return ray_src + best_t * ray_dir;
   }
 
@@ -1,364 +1,13 @@
 #include "platform.h"
 #include "viscoelastic_sim.h"
-#include <immintrin.h>
-
-// for (int i = 0; i < num_particles; ++i)
-//  pos.add(i, vel.get(i) * dt);
-void simd_update_positions(
-  ParticlesVec& pos, 
-  const ParticlesVec& vel, 
-  float dt, 
-  int num_particles
-) {
-  const int simd_width = 8;
-  const int simd_end = num_particles & ~(simd_width - 1); // round down to nearest multiple of 8
-
-  __m256 dt_vec = _mm256_set1_ps(dt);
-
-  for (int i = 0; i < simd_end; i += simd_width) {
-    // Load position and velocity components
-    __m256 px = _mm256_loadu_ps(&pos.x[i]);
-    __m256 py = _mm256_loadu_ps(&pos.y[i]);
-    __m256 pz = _mm256_loadu_ps(&pos.z[i]);
-
-    __m256 vx = _mm256_loadu_ps(&vel.x[i]);
-    __m256 vy = _mm256_loadu_ps(&vel.y[i]);
-    __m256 vz = _mm256_loadu_ps(&vel.z[i]);
-
-    // Multiply velocity by dt
-    vx = _mm256_mul_ps(vx, dt_vec);
-    vy = _mm256_mul_ps(vy, dt_vec);
-    vz = _mm256_mul_ps(vz, dt_vec);
-
-    // Add to positions
-    px = _mm256_add_ps(px, vx);
-    py = _mm256_add_ps(py, vy);
-    pz = _mm256_add_ps(pz, vz);
-
-    // Store back
-    _mm256_storeu_ps(&pos.x[i], px);
-    _mm256_storeu_ps(&pos.y[i], py);
-    _mm256_storeu_ps(&pos.z[i], pz);
-  }
-
-  // Fallback scalar for remainder
-  for (int i = simd_end; i < num_particles; ++i)
-    pos.add(i, vel.get(i) * dt);
-}
-
-// 0.171ms -> 0.026ms
-//for (int i = 0; i < num_particles; ++i) {
-//  particles_vels.set(i, (particles_pos.get(i) - particles_prev_pos.get(i)) * inv_dt);
-//  if (particles_vels.get(i).Length() > max_speed)
-//    particles_vels.set(i, particles_vels.get(i).Normalized() * max_speed);
-//}
-void simd_update_velocities_clamped(
-  ParticlesVec& vel,
-  const ParticlesVec& pos,
-  const ParticlesVec& prev,
-  float inv_dt,
-  float max_speed,
-  int start,
-  int end
-) {
-  constexpr int simd_width = 8;
-
-  __m256 inv_dt_vec = _mm256_set1_ps(inv_dt);
-  __m256 max_speed_vec = _mm256_set1_ps(max_speed);
-  __m256 max_speed_sq = _mm256_mul_ps(max_speed_vec, max_speed_vec);
-
-  int i = start;
-  for (; i + simd_width <= end; i += simd_width) {
-    // Compute vel = (pos - prev) * inv_dt
-    __m256 px = _mm256_loadu_ps(&pos.x[i]);
-    __m256 py = _mm256_loadu_ps(&pos.y[i]);
-    __m256 pz = _mm256_loadu_ps(&pos.z[i]);
-
-    __m256 qx = _mm256_loadu_ps(&prev.x[i]);
-    __m256 qy = _mm256_loadu_ps(&prev.y[i]);
-    __m256 qz = _mm256_loadu_ps(&prev.z[i]);
-
-    __m256 vx = _mm256_sub_ps(px, qx);
-    __m256 vy = _mm256_sub_ps(py, qy);
-    __m256 vz = _mm256_sub_ps(pz, qz);
-
-    vx = _mm256_mul_ps(vx, inv_dt_vec);
-    vy = _mm256_mul_ps(vy, inv_dt_vec);
-    vz = _mm256_mul_ps(vz, inv_dt_vec);
-
-    // Compute length squared
-    __m256 len_sq = _mm256_add_ps(
-      _mm256_add_ps(_mm256_mul_ps(vx, vx), _mm256_mul_ps(vy, vy)),
-      _mm256_mul_ps(vz, vz));
-
-    // Clamp velocities
-    __m256 too_fast_mask = _mm256_cmp_ps(len_sq, max_speed_sq, _CMP_GT_OQ);
-
-    // Avoid divide-by-zero: set inv_length to 1 when length == 0
-    __m256 length = _mm256_sqrt_ps(len_sq);
-    __m256 inv_length = _mm256_blendv_ps(_mm256_rcp_ps(length), _mm256_set1_ps(1.0f), _mm256_cmp_ps(length, _mm256_set1_ps(0.0f), _CMP_EQ_OQ));
-    __m256 scale = _mm256_min_ps(_mm256_mul_ps(inv_length, max_speed_vec), _mm256_set1_ps(1.0f));
-    scale = _mm256_blendv_ps(_mm256_set1_ps(1.0f), scale, too_fast_mask);
-
-    vx = _mm256_mul_ps(vx, scale);
-    vy = _mm256_mul_ps(vy, scale);
-    vz = _mm256_mul_ps(vz, scale);
-
-    // Store
-    _mm256_storeu_ps(&vel.x[i], vx);
-    _mm256_storeu_ps(&vel.y[i], vy);
-    _mm256_storeu_ps(&vel.z[i], vz);
-  }
-
-  // Scalar fallback
-  for (; i < end; ++i) {
-    VEC3 v = (pos.get(i) - prev.get(i)) * inv_dt;
-    float len = v.length();
-    if (len > max_speed)
-      v = v.normalized() * max_speed;
-    vel.set(i, v);
-  }
-}
-
-
-inline float hsum256_ps(__m256 v) {
-  __m128 vlow = _mm256_castps256_ps128(v);
-  __m128 vhigh = _mm256_extractf128_ps(v, 1);
-  __m128 sum1 = _mm_add_ps(vlow, vhigh);
-  __m128 shuf = _mm_movehdup_ps(sum1);
-  __m128 sum2 = _mm_add_ps(sum1, shuf);
-  shuf = _mm_movehl_ps(shuf, sum2);
-  __m128 sum3 = _mm_add_ss(sum2, shuf);
-  return _mm_cvtss_f32(sum3);
-}
-
-inline void apply_displacements_simd(
-  float pressure,
-  float near_pressure,
-  const int* nears_ids,
-  const float* nears_closeness,
-  const float* nears_dirs_x,
-  const float* nears_dirs_y,
-  const float* nears_dirs_z,
-  int num_nears,
-  int idx,
-  ParticlesVec* deltas
-) {
-  const int step = 8;
-  int i = 0;
-
-  __m256 p = _mm256_set1_ps(pressure);
-  __m256 np = _mm256_set1_ps(near_pressure);
-  __m256 half = _mm256_set1_ps(0.5f);
-
-  __m256 accum_dx = _mm256_setzero_ps();
-  __m256 accum_dy = _mm256_setzero_ps();
-  __m256 accum_dz = _mm256_setzero_ps();
-
-  for (; i + step <= num_nears; i += step) {
-    __m256 c = _mm256_loadu_ps(&nears_closeness[i]);
-    __m256 amt = _mm256_add_ps(p, _mm256_mul_ps(np, c));
-    amt = _mm256_mul_ps(amt, c);
-    amt = _mm256_mul_ps(amt, half);
-
-    __m256 vx = _mm256_loadu_ps(&nears_dirs_x[i]);
-    __m256 vy = _mm256_loadu_ps(&nears_dirs_y[i]);
-    __m256 vz = _mm256_loadu_ps(&nears_dirs_z[i]);
-
-    __m256 dx_final = _mm256_mul_ps(vx, amt);
-    __m256 dy_final = _mm256_mul_ps(vy, amt);
-    __m256 dz_final = _mm256_mul_ps(vz, amt);
-
-    accum_dx = _mm256_add_ps(accum_dx, dx_final);
-    accum_dy = _mm256_add_ps(accum_dy, dy_final);
-    accum_dz = _mm256_add_ps(accum_dz, dz_final);
-
-    alignas(32) float tx[8], ty[8], tz[8];
-    _mm256_store_ps(tx, dx_final);
-    _mm256_store_ps(ty, dy_final);
-    _mm256_store_ps(tz, dz_final);
-
-    for (int k = 0; k < 8; ++k)
-      deltas->add(nears_ids[i + k], tx[k], ty[k], tz[k]);
-  }
-
-  float acc_x = -hsum256_ps(accum_dx);
-  float acc_y = -hsum256_ps(accum_dy);
-  float acc_z = -hsum256_ps(accum_dz);
-
-  // Scalar fallback
-  for (; i < num_nears; ++i) {
-    float closeness = nears_closeness[i];
-    float amount = (pressure + near_pressure * closeness) * closeness * 0.5f;
-    float dx = nears_dirs_x[i] * amount;
-    float dy = nears_dirs_y[i] * amount;
-    float dz = nears_dirs_z[i] * amount;
-    acc_x -= dx;
-    acc_y -= dy;
-    acc_z -= dz;
-    deltas->add(nears_ids[i], dx, dy, dz);
-  }
-
-  deltas->add(idx, acc_x, acc_y, acc_z);
-}
-
-
-// for (int i = 0; i < num_particles; ++i)
-//   particles_vels.add(i, delta_velocity * masses[particles_type[i]]);
-void simd_add_velocity_scaled_by_type(
-  ParticlesVec& vels,
-  const uint8_t* types,
-  const float* masses,         // Assumed size = 4
-  const VEC3& delta_velocity,
-  int num_particles
-) {
-  const int step = 8;
-  int i = 0;
-
-  // Broadcast delta_velocity components
-  __m256 dx = _mm256_set1_ps(delta_velocity.x);
-  __m256 dy = _mm256_set1_ps(delta_velocity.y);
-  __m256 dz = _mm256_set1_ps(delta_velocity.z);
-
-  // Load masses into 256-bit register (assumes only 4 types)
-  alignas(32) float mass_lut[8] = {
-    masses[0], masses[1], masses[2], masses[3],
-    masses[0], masses[1], masses[2], masses[3]  // repeated for safety
-  };
-
-  for (; i + step <= num_particles; i += step) {
-    // Load 8 types
-    __m128i t8 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&types[i])); // 8 bytes
-    __m256i indices = _mm256_cvtepu8_epi32(t8);  // Convert 8x u8 to 8x i32
-
-    // Gather mass values using indices
-    __m256 m = _mm256_i32gather_ps(mass_lut, indices, 4);
-
-    // Compute scaled delta
-    __m256 vx = _mm256_mul_ps(dx, m);
-    __m256 vy = _mm256_mul_ps(dy, m);
-    __m256 vz = _mm256_mul_ps(dz, m);
-
-    // Load current velocity
-    __m256 v_old_x = _mm256_loadu_ps(&vels.x[i]);
-    __m256 v_old_y = _mm256_loadu_ps(&vels.y[i]);
-    __m256 v_old_z = _mm256_loadu_ps(&vels.z[i]);
-
-    // Add delta
-    v_old_x = _mm256_add_ps(v_old_x, vx);
-    v_old_y = _mm256_add_ps(v_old_y, vy);
-    v_old_z = _mm256_add_ps(v_old_z, vz);
-
-    // Store back
-    _mm256_storeu_ps(&vels.x[i], v_old_x);
-    _mm256_storeu_ps(&vels.y[i], v_old_y);
-    _mm256_storeu_ps(&vels.z[i], v_old_z);
-  }
-
-  // Scalar fallback for tail
-  for (; i < num_particles; ++i) {
-    float m = masses[types[i]];
-    vels.x[i] += delta_velocity.x * m;
-    vels.y[i] += delta_velocity.y * m;
-    vels.z[i] += delta_velocity.z * m;
-  }
-}
-
-
-inline void collect_neighbors_block(
-  const ParticlesVec& pos,
-  float kernel_radius,
-  float kernel_radius_inv,
-  float* density_acc,
-  float* near_density_acc,
-  int*   nears_ids,
-  float* nears_closeness,
-  float* nears_dirs_x,
-  float* nears_dirs_y,
-  float* nears_dirs_z,
-  int& num_nears,
-  int max_nears,
-  int i,            // current particle i
-  int j_start,      // start of neighbor block
-  int mask_range
-) {
-  __m256 pi_x = _mm256_set1_ps(pos.x[i]);
-  __m256 pi_y = _mm256_set1_ps(pos.y[i]);
-  __m256 pi_z = _mm256_set1_ps(pos.z[i]);
-
-  __m256 px = _mm256_loadu_ps(&pos.x[j_start]);
-  __m256 py = _mm256_loadu_ps(&pos.y[j_start]);
-  __m256 pz = _mm256_loadu_ps(&pos.z[j_start]);
-
-  __m256 dx = _mm256_sub_ps(px, pi_x);
-  __m256 dy = _mm256_sub_ps(py, pi_y);
-  __m256 dz = _mm256_sub_ps(pz, pi_z);
-
-  __m256 d2 = _mm256_add_ps(
-    _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
-    _mm256_mul_ps(dz, dz)
-  );
-
-  __m256 length = _mm256_sqrt_ps(d2);
-
-  __m256 mask_valid = _mm256_and_ps(
-    _mm256_cmp_ps(length, _mm256_set1_ps(kernel_radius), _CMP_LT_OQ),
-    _mm256_cmp_ps(length, _mm256_set1_ps(1e-3f), _CMP_GT_OQ)
-  );
-
-  // Exclude self-particle
-  __m256i indices = _mm256_add_epi32(_mm256_set1_epi32(j_start), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
-  __m256i i_vec = _mm256_set1_epi32(i);
-  __m256 mask_self = _mm256_castsi256_ps(_mm256_cmpeq_epi32(indices, i_vec));
-
-  __m256 mask = _mm256_andnot_ps(mask_self, mask_valid);
-  int mask_bits = _mm256_movemask_ps(mask) & mask_range;
-
-  // Load inverse r and normalize
-  __m256 r = _mm256_add_ps(length, _mm256_set1_ps(1e-5f));
-  __m256 inv_r = _mm256_div_ps(_mm256_set1_ps(1.0f), r);
-  dx = _mm256_mul_ps(dx, inv_r);
-  dy = _mm256_mul_ps(dy, inv_r);
-  dz = _mm256_mul_ps(dz, inv_r);
-
-  // Closeness
-  __m256 q = _mm256_mul_ps(r, _mm256_set1_ps(kernel_radius_inv));
-  __m256 closeness = _mm256_sub_ps(_mm256_set1_ps(1.0f), q);
-
-  const float* c_ptr = reinterpret_cast<const float*>(&closeness);
-  const float* dx_ptr = reinterpret_cast<const float*>(&dx);
-  const float* dy_ptr = reinterpret_cast<const float*>(&dy);
-  const float* dz_ptr = reinterpret_cast<const float*>(&dz);
-
-  // Iterate over the 8 lanes
-  // Skip if the mask is 0, means does not apply to this range or is too far
-  int lane = 0;
-  while (mask_bits) {
-    if (mask_bits & 1) {
-      float c = c_ptr[lane];
-      float c_sq = c * c;
-      float c_cu = c_sq * c;
-
-      *density_acc += c_sq;
-      *near_density_acc += c_cu;
-
-      int j = j_start + lane;
-      nears_ids[num_nears] = j;
-      nears_closeness[num_nears] = c;
-      nears_dirs_x[num_nears] = dx_ptr[lane];
-      nears_dirs_y[num_nears] = dy_ptr[lane];
-      nears_dirs_z[num_nears] = dz_ptr[lane];
-      ++num_nears;
-      if (num_nears >= max_nears)
-        break;
-    }
-
-    ++lane;
-    mask_bits >>= 1;
-  }
-}
+#include "memory/mapped_file.h"
+#include "sim_kernels.h"
 
 void ViscoelasticSim::init() {
+  tuner.addStage(eSection::SpatialHash, "spatial_hash", 1);
+  tuner.addStage(eSection::Relaxation, "relaxation", 3);
+  tuner.addStage(eSection::Collisions, "collisions", 3);
+  tuner.addStage(eSection::VelocitiesFromPositions, "velocities_from_positions", 1);
   setNumThreads(num_threads);
 
   assigned_cells.resize(max_particles);
@@ -368,23 +17,208 @@ void ViscoelasticSim::init() {
   particles_prev_pos.resize(max_particles);
   particles_vels.resize(max_particles);
   particles_frozen_pos.resize(max_particles);
-  particles_type = new u8[max_particles];
-
   aux_particles_pos.resize(max_particles);
   aux_particles_prev_pos.resize(max_particles);
   aux_particles_vels.resize(max_particles);
+  particles_type = new u8[max_particles];
   aux_particles_type = new u8[max_particles];
+
+  particles_new_index.resize(max_particles);
+  particles_old_index.resize(max_particles);
+
+  delete[] particles_uid;
+  delete[] aux_particles_uid;
+  particles_uid = new uint32_t[max_particles];
+  aux_particles_uid = new uint32_t[max_particles];
+  uid_to_index.assign(max_particles, invalid_uid);
+  free_uids.clear();
+  next_uid = 0;
+
+  // Custom channels registered before a restart are preserved
+  attributes.bindVec("pos", &particles_pos, &aux_particles_pos);
+  attributes.bindVec("vel", &particles_vels, &aux_particles_vels);
+  attributes.bindVec("prev_pos", &particles_prev_pos, &aux_particles_prev_pos);
+  attributes.bind<u8>("type", &particles_type, &aux_particles_type);
+  attributes.bind<uint32_t>("uid", &particles_uid, &aux_particles_uid);
+  attributes.resize(max_particles);
+}
+
+// The caller checks there is room for one more particle, so there is a new or a free uid
+uint32_t ViscoelasticSim::allocUID() {
+  bool has_new_uids = next_uid < (uint32_t)uid_to_index.size();
+  if (!free_uids.empty() && (free_uids.size() > uid_reuse_delay || !has_new_uids)) {
+    uint32_t uid = free_uids.front();
+    free_uids.pop_front();
+    return uid;
+  }
+  assert(has_new_uids);
+  return next_uid++;
 }
 
-void ViscoelasticSim::addParticle(VEC3 pos, VEC3 vel, uint8_t particle_type) {
+uint32_t ViscoelasticSim::addParticle(VEC3 pos, VEC3 vel, uint8_t particle_type) {
   if (num_particles >= max_particles)
-    return;
+    return invalid_uid;
   assert(particles_pos.buf.size() > 0);
+  uint32_t uid = allocUID();
   particles_pos.set(num_particles, pos);
   particles_prev_pos.set(num_particles, pos);
   particles_vels.set(num_particles, vel);
   particles_type[num_particles] = particle_type;
+  particles_uid[num_particles] = uid;
+  uid_to_index[uid] = num_particles;
+  attributes.clearOwned(num_particles, 1);
   ++num_particles;
+  spatial_hash_valid = false;
+  return uid;
+}
+
+int ViscoelasticSim::reserveParticles(int n, int* num_reserved) {
+  int first = num_particles;
+  n = std::max(std::min(n, max_particles - num_particles), 0);
+  for (int i = first; i < first + n; ++i) {
+    uint32_t uid = allocUID();
+    particles_uid[i] = uid;
+    uid_to_index[uid] = i;
+  }
+  if (n > 0) {
+    attributes.clearOwned(first, n);
+    num_particles += n;
+    spatial_hash_valid = false;
+  }
+  if (num_reserved)
+    *num_reserved = n;
+  return first;
+}
+
+int ViscoelasticSim::BulkShape::latticeCount(bool in_2d, int* nx, int* ny, int* nz) const {
+  VEC3 sizes = vmax - vmin;
+  float s = std::max(spacing, 1e-3f);
+  int n[3] = {
+    in_2d ? 1 : std::max((int)(sizes.x / s), 1),
+    std::max((int)(sizes.y / s), 1),
+    std::max((int)(sizes.z / s), 1),
+  };
+  if (nx) {
+    *nx = n[0];
+    *ny = n[1];
+    *nz = n[2];
+  }
+  return n[0] * n[1] * n[2];
+}
+
+void ViscoelasticSim::fillParticlesBulk(int first, int begin, int end, int count, const BulkShape& shape) {
+  PROFILE_SCOPED_NAMED("fillParticlesBulk");
+  MAT44 to_world = shape.transform.asMatrix();
+  int nx = 1, ny = 1, nz = 1;
+  if (shape.type == BulkShape::eType::Lattice)
+    shape.latticeCount(in_2d, &nx, &ny, &nz);
+  const float inv_world_scale = 1.0f / world_scale;
+  const int max_attempts = 256;
+  for (int k = begin; k < end; ++k) {
+    // Each random value of the particle uses its own channel of the noise
+    uint32_t channel = 0;
+    auto random = [&]() {
+      return Get2dNoiseZeroToOne((uint32_t)k, channel++, shape.seed);
+    };
+    auto randomInBox = [&]() {
+      VEC3 u(random(), random(), random());
+      return shape.vmin + (shape.vmax - shape.vmin) * u;
+    };
+
+    VEC3 p;
+    switch (shape.type) {
+    case BulkShape::eType::Box:
+      p = randomInBox();
+      break;
+
+    case BulkShape::eType::Sphere: {
+      // Uniform in the volume, or in the area of the disc in 2d
+      float u = random();
+      float r = shape.radius * (in_2d ? sqrtf(u) : cbrtf(u));
+      float angle = random() * 2.0f * (float)M_PI;
+      if (in_2d) {
+        p = shape.center + VEC3(0.0f, cosf(angle), sinf(angle)) * r;
+      }
+      else {
+        float cos_theta = 2.0f * random() - 1.0f;
+        float sin_theta = sqrtf(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+        p = shape.center + VEC3(sin_theta * cosf(angle), cos_theta, sin_theta * sinf(angle)) * r;
+      }
+      break; }
+
+    case BulkShape::eType::Lattice: {
+      int x = k % nx;
+      int y = (k / nx) % ny;
+      int z = k / (nx * ny);
+      VEC3 jitter = VEC3(random(), random(), random()) * 2.0f - VEC3::ones;
+      p = shape.vmin + (VEC3((float)x, (float)y, (float)z) + jitter * shape.jitter) * shape.spacing;
+      break; }
+
+    case BulkShape::eType::Sdf: {
+      // Rejection sampling of the region. When all the attempts fail, the sample nearest to the
+      // surface is used
+      float best = FLT_MAX;
+      for (int attempt = 0; attempt < max_attempts; ++attempt) {
+        VEC3 q = randomInBox();
+        float d = shape.sdf ? shape.sdf->eval(to_world.transformCoord(q) * inv_world_scale) : 0.0f;
+        if (!shape.sdf_inside)
+          d = -d;
+        if (d < best) {
+          best = d;
+          p = q;
+        }
+        if (d < 0.0f)
+          break;
+      }
+      break; }
+    }
+
+    p = to_world.transformCoord(p);
+    if (in_2d)
+      p.x = 0.01f;
+    VEC3 v = shape.velocity;
+    if (shape.velocity_jitter > 0.0f)
+      v += (VEC3(random(), random(), random()) * 2.0f - VEC3::ones) * shape.velocity_jitter;
+
+    int idx = first + k;
+    particles_pos.set(idx, p);
+    particles_prev_pos.set(idx, p);
+    particles_vels.set(idx, v);
+    particles_type[idx] = (uint8_t)std::min(shape.particle_type + (int)((int64_t)k * shape.num_types / count), 3);
+  }
+}
+
+int ViscoelasticSim::addParticlesBulk(int n, const BulkShape& shape, int* num_added) {
+  PROFILE_SCOPED_NAMED("addParticlesBulk");
+  if (n < 0)
+    n = shape.type == BulkShape::eType::Lattice ? shape.latticeCount(in_2d) : 0;
+  int count = 0;
+  int first = reserveParticles(n, &count);
+  if (num_added)
+    *num_added = count;
+  if (count <= 0)
+    return first;
+
+  // The few particles of the emitters are not worth waking up the pool
+  constexpr int min_parallel = 4096;
+  if (count < min_parallel) {
+    fillParticlesBulk(first, 0, count, count, shape);
+    return first;
+  }
+  runInParallel(count, std::max(num_threads * 4, 1), [&](int begin, int end, int) {
+    fillParticlesBulk(first, begin, end, count, shape);
+    }, "addParticlesBulk");
+  return first;
+}
+
+void ViscoelasticSim::removeAllParticles() {
+  // The uids are released as in removeParticles, not reset, so the old ones are not reused at once
+  for (int i = 0; i < num_particles; ++i) {
+    uid_to_index[particles_uid[i]] = invalid_uid;
+    free_uids.push_back(particles_uid[i]);
+  }
+  num_particles = 0;
+  spatial_hash_valid = false;
 }
 
 void ViscoelasticSim::resolveCollisions(float dt, int start, int end) {
@@ -474,50 +308,167 @@ void ViscoelasticSim::updateSpatialHash() {
 
   // We are going to reorder the particles, by moving the
   // from the old order to the new order
-  particles_pos.swap(aux_particles_pos);
-  particles_vels.swap(aux_particles_vels);
-  particles_prev_pos.swap(aux_particles_prev_pos);
-  std::swap(particles_type, aux_particles_type);
+  attributes.swapAll();
   {
     // Precompute for each particle it's icoords and cell_id
     PROFILE_SCOPED_NAMED("assignedCells");
-    runInParallel(num_particles, num_threads, [&](int start, int end, int job_id) {
+    const AutoTuner::Config& cfg = tuner.config(eSection::SpatialHash);
+    runInParallel(num_particles, cfg.num_splits, [&](int start, int end, int job_id) {
       for (int i = start; i < end; ++i) {
         VEC3 pos = aux_particles_pos.get(i);
         CPUSpatialSubdivision::Int3 ipos = spatial_hash.gridCoords(pos);
         uint32_t cell_id = spatial_hash.gridHash(ipos);
         assigned_cells[i] = { ipos, cell_id };
       }
-      });
+      }, "assign_cells", cfg.num_threads);
   }
 
   spatial_hash.setPoints(assigned_cells.data(), num_particles);
 
-  runInParallel(num_particles, num_threads, [&](int start, int end, int job_id) {
-    PROFILE_SCOPED_NAMED("sortParticles");
-    bool debug_particle_changed = false;
+  reorderParticles();
+  spatial_hash_valid = true;
+  spatial_hash_margin = 0.0f;
+}
+
+void ViscoelasticSim::reorderParticles() {
+
+  // Find the new slot of each particle, and the inverse permutation
+  const AutoTuner::Config& cfg = tuner.config(eSection::SpatialHash);
+  runInParallel(num_particles, cfg.num_splits, [&](int start, int end, int job_id) {
     spatial_hash.sortParticles(start, end, [&](int j, int i) {
-      if (!debug_particle_changed && j == debug_particle) {
-        debug_particle_changed = true;
-        debug_particle = i;
-      }
       assert(i >= 0 && i < max_particles);
       assert(j >= 0 && j < max_particles);
-      particles_pos.set(i, aux_particles_pos.get(j));
-      particles_vels.set(i, aux_particles_vels.get(j));
-      particles_prev_pos.set(i, aux_particles_prev_pos.get(j));
-      particles_type[i] = aux_particles_type[j];
+      particles_new_index[j] = i;
+      particles_old_index[i] = j;
       });
-    });
+    }, "sort_particles", cfg.num_threads);
+
+  gatherParticles(num_particles);
+}
+
+// The aux buffers hold the previous state. Gather all the channels following particles_old_index.
+// Each job writes a continuous range of the outputs and updates the uid -> index map of the 
+// particles we have moved
+void ViscoelasticSim::gatherParticles(int new_num_particles) {
+  const AutoTuner::Config& cfg = tuner.config(eSection::SpatialHash);
+  runInParallel(new_num_particles, cfg.num_splits, [&](int start, int end, int job_id) {
+    PROFILE_SCOPED_NAMED("gatherParticles");
+    attributes.gather(particles_old_index.data(), start, end);
+    for (int i = start; i < end; ++i)
+      uid_to_index[particles_uid[i]] = i;
+    }, "gather_particles", cfg.num_threads);
 
+  if (debug_particle >= 0 && debug_particle < num_particles) {
+    uint32_t new_idx = particles_new_index[debug_particle];
+    debug_particle = (new_idx == invalid_uid) ? -1 : (int)new_idx;
+  }
+  num_particles = new_num_particles;
 }
 
 void ViscoelasticSim::doubleDensityRelaxationPara(float dt, ThreadPool& pool) {
   int num_jobs = (int)spatial_hash.cells_ranges.size();
-  runInParallel(num_jobs, num_threads * 3, [&](int start, int end, int job_id) {
+  const AutoTuner::Config& cfg = tuner.config(eSection::Relaxation);
+  int num_splits = cfg.num_splits;
+  if (!relaxation_balanced) {
+    runInParallel(num_jobs, num_splits, [&](int start, int end, int job_id) {
+      for (int i = start; i < end; ++i)
+        processRange(dt, spatial_hash.cells_ranges[i], particles_frozen_pos, &particles_pos);
+      }, "relaxation", cfg.num_threads);
+    return;
+  }
+
+  updateRelaxationBounds(num_splits);
+  runInParallelChunks(relaxation_bounds.data(), num_splits, [&](int start, int end, int job_id) {
     for (int i = start; i < end; ++i)
       processRange(dt, spatial_hash.cells_ranges[i], particles_frozen_pos, &particles_pos);
-    });
+    }, "relaxation", cfg.num_threads);
+  updateRelaxationCorrection(num_splits);
+}
+
+// Each particle is compared with all the particles in the 27 cells around its cell, so
+// the cost of a cell grows with its particles x the particles of the neighbour cells.
+// Looking up the 27 cells would cost a large part of the relaxation, so we only use the
+// previous and next cells in memory when they are neighbours in z, and assume the same
+// density in the other directions. The correction takes care of the rest
+void ViscoelasticSim::updateRelaxationBounds(int num_splits) {
+  PROFILE_SCOPED_NAMED("relaxationBounds");
+  const auto& cells_ranges = spatial_hash.cells_ranges;
+  const auto& cells_info = spatial_hash.cells_info;
+  int num_cells = (int)cells_ranges.size();
+  relaxation_cost.resize(num_cells + 1);
+  relaxation_correction.resize(cells_info.size());
+
+  auto cellSize = [&](int i) {
+    return (float)(cells_ranges[i].range.last - cells_ranges[i].range.first);
+  };
+  auto isNeighbourInZ = [&](int i, int j) {
+    CPUSpatialSubdivision::Int3 a = cells_info[cells_ranges[i].cell_id].coords;
+    CPUSpatialSubdivision::Int3 b = cells_info[cells_ranges[j].cell_id].coords;
+    return a.x == b.x && a.y == b.y && abs(a.z - b.z) == 1;
+  };
+
+  runInParallel(num_cells, num_threads, [&](int start, int end, int job_id) {
+    for (int i = start; i < end; ++i) {
+      float num_in_cell = cellSize(i);
+      float column = num_in_cell;
+      if (i > 0 && isNeighbourInZ(i, i - 1))
+        column += cellSize(i - 1);
+      if (i + 1 < num_cells && isNeighbourInZ(i, i + 1))
+        column += cellSize(i + 1);
+      float cost = 16.0f + num_in_cell * (4.0f + 9.0f * column);
+      // The slot was used by another cell, or by none, in the previous frames
+      TCellCorrection& correction = relaxation_correction[cells_ranges[i].cell_id];
+      const CPUSpatialSubdivision::Int3& coords = cells_info[cells_ranges[i].cell_id].coords;
+      if (!(correction.coords == coords)) {
+        correction.coords = coords;
+        correction.factor = 1.0f;
+      }
+      relaxation_cost[i + 1] = cost * correction.factor;
+    }
+    }, "relaxation_cost");
+
+  relaxation_cost[0] = 0.0;
+  for (int i = 0; i < num_cells; ++i)
+    relaxation_cost[i + 1] += relaxation_cost[i];
+
+  // Chunk k starts at the first cell where the accumulated cost reaches k/num_splits of the total
+  double total_cost = relaxation_cost[num_cells];
+  relaxation_bounds.resize(num_splits + 1);
+  relaxation_bounds[0] = 0;
+  for (int k = 1; k < num_splits; ++k) {
+    double target = total_cost * k / num_splits;
+    auto it = std::lower_bound(relaxation_cost.begin(), relaxation_cost.end(), target);
+    int cell = (int)(it - relaxation_cost.begin());
+    relaxation_bounds[k] = std::max(relaxation_bounds[k - 1], std::min(cell, num_cells));
+  }
+  relaxation_bounds[num_splits] = num_cells;
+}
+
+// Cells in chunks slower than estimated get more expensive in the next frames
+void ViscoelasticSim::updateRelaxationCorrection(int num_splits) {
+  const TParallelStats& stats = parallelStats("relaxation");
+  const auto& cells_ranges = spatial_hash.cells_ranges;
+  double total_cost = relaxation_cost.back();
+  double total_time = 0.0;
+  for (int k = 0; k < num_splits; ++k)
+    total_time += stats.chunk_time[k];
+  if (total_cost <= 0.0 || total_time <= 0.0)
+    return;
+
+  for (int k = 0; k < num_splits; ++k) {
+    int first = relaxation_bounds[k];
+    int last = relaxation_bounds[k + 1];
+    double chunk_cost = relaxation_cost[last] - relaxation_cost[first];
+    if (first == last || chunk_cost <= 0.0)
+      continue;
+    // Ratio between the measured and the estimated share of the total. Damped to avoid oscillations
+    double ratio = (stats.chunk_time[k] / total_time) / (chunk_cost / total_cost);
+    float factor = (float)sqrt(std::min(std::max(ratio, 0.25), 4.0));
+    for (int i = first; i < last; ++i) {
+      TCellCorrection& correction = relaxation_correction[cells_ranges[i].cell_id];
+      correction.factor = std::min(std::max(correction.factor * factor, 0.1f), 10.0f);
+    }
+  }
 }
 
 void ViscoelasticSim::doubleDensityRelaxation(float dt) {
@@ -526,48 +477,158 @@ void ViscoelasticSim::doubleDensityRelaxation(float dt) {
 }
 
 void ViscoelasticSim::removeParticle(int id) {
-  auto swapInContainer = [](ParticlesVec& container, int a, int b) {
-    VEC3 pa = container.get(a);
-    VEC3 pb = container.get(b);
-    container.set(b, pa);
-    container.set(a, pb);
-    };
+  assert(id >= 0 && id < num_particles);
+  int last = num_particles - 1;
+  uint32_t uid = particles_uid[id];
+
+  // Move the last particle to the slot of the removed one, in all the channels
+  attributes.copyElem(id, last);
+  uid_to_index[particles_uid[id]] = id;
 
-  swapInContainer(particles_pos, num_particles - 1, id);
-  swapInContainer(particles_vels, num_particles - 1, id);
-  std::swap(particles_type[num_particles - 1], particles_type[id]);
+  // The uid of the removed one can be reused
+  uid_to_index[uid] = invalid_uid;
+  free_uids.push_back(uid);
   num_particles -= 1;
+  spatial_hash_valid = false;
 }
 
 void ViscoelasticSim::removeParticles(std::vector<int>& particles_to_remove) {
-  std::sort(particles_to_remove.begin(), particles_to_remove.end(), [](int a, int b) { return a > b; });
-  for (auto id : particles_to_remove)
-    removeParticle(id);
+  if (particles_to_remove.empty())
+    return;
+  remove_mask.resize(max_particles);
+  memset(remove_mask.data(), 0x00, num_particles);
+  for (auto id : particles_to_remove) {
+    assert(id >= 0 && id < num_particles);
+    remove_mask[id] = 1;
+  }
+  removeParticles(remove_mask.data());
   particles_to_remove.clear();
 }
 
+// Stream compaction of the particles not masked. The relative order of the particles
+// is preserved, so the particles of each cell remain close in memory.
+void ViscoelasticSim::removeParticles(const uint8_t* mask) {
+  PROFILE_SCOPED_NAMED("removeParticles");
+
+  // Count how many particles we keep in each chunk
+  const int num_splits = num_threads;
+  std::vector<int> kept_per_job(num_splits + 1, 0);
+  runInParallel(num_particles, num_splits, [&](int start, int end, int job_id) {
+    int n = 0;
+    for (int i = start; i < end; ++i)
+      n += mask[i] ? 0 : 1;
+    kept_per_job[job_id] = n;
+    }, "remove_count");
+
+  // Exclusive prefix sum to find where each chunk writes
+  std::vector<int> kept_base(num_splits + 1, 0);
+  for (int j = 0; j < num_splits; ++j)
+    kept_base[j + 1] = kept_base[j] + kept_per_job[j];
+  int new_num_particles = kept_base[num_splits];
+  if (new_num_particles == num_particles)
+    return;
+
+  // Build the permutation and the list of uids released.
+  // The removed particles of each chunk are stored after the kept ones
+  removed_uids.resize(num_particles - new_num_particles);
+  runInParallel(num_particles, num_splits, [&](int start, int end, int job_id) {
+    int out_kept = kept_base[job_id];
+    int out_removed = start - kept_base[job_id];
+    for (int i = start; i < end; ++i) {
+      if (mask[i]) {
+        particles_new_index[i] = invalid_uid;
+        uint32_t uid = particles_uid[i];
+        uid_to_index[uid] = invalid_uid;
+        removed_uids[out_removed++] = uid;
+      }
+      else {
+        particles_new_index[i] = out_kept;
+        particles_old_index[out_kept] = i;
+        ++out_kept;
+      }
+    }
+    }, "remove_scatter");
+
+  free_uids.insert(free_uids.end(), removed_uids.begin(), removed_uids.end());
+
+  attributes.swapAll();
+  gatherParticles(new_num_particles);
+  spatial_hash_valid = false;
+}
+
 void ViscoelasticSim::getParticleIDsNear(std::vector<int>& out_ids, VEC3 ref_point, float rad) const {
-  float interact_rad_sqr = rad * rad;
-  for (int i = 0; i < num_particles; ++i) {
+  CPUSpatialSubdivision::QuerySphere sphere = { ref_point, rad };
+  queryParticles(sphere, [&](int i) {
     VEC3 delta = particles_pos.get(i) - ref_point;
-    float dist_sq = delta.lengthSquared();
-    if (dist_sq > interact_rad_sqr || dist_sq < 0.1f)
-      continue;
-    out_ids.push_back(i);
+    if (delta.lengthSquared() >= 0.1f)
+      out_ids.push_back(i);
+    });
+}
+
+bool ViscoelasticSim::raycastParticles(VEC3 src, VEC3 dir, float max_dist, float particle_radius, RayHit& hit) const {
+  if (spatial_hash_valid)
+    return spatial_hash.raycastNearest(particles_pos, src, dir, max_dist, particle_radius, spatial_hash_margin, hit);
+  hit = RayHit();
+  CPUSpatialSubdivision::Range all = { 0, (uint32_t)num_particles };
+  CPUSpatialSubdivision::raycastRange(particles_pos, all, src, dir, max_dist, particle_radius, [&](uint32_t idx, float t, float dist_to_ray) {
+    if (t < hit.t) {
+      hit.t = t;
+      hit.idx = idx;
+    }
+    return true;
+    });
+  return hit.isValid();
+}
+
+void ViscoelasticSim::raycastAllParticles(VEC3 src, VEC3 dir, float max_dist, float particle_radius, std::vector<RayHit>& out_hits) const {
+  if (spatial_hash_valid) {
+    spatial_hash.raycastAll(particles_pos, src, dir, max_dist, particle_radius, spatial_hash_margin, out_hits);
+    return;
   }
+  out_hits.clear();
+  CPUSpatialSubdivision::Range all = { 0, (uint32_t)num_particles };
+  CPUSpatialSubdivision::raycastRange(particles_pos, all, src, dir, max_dist, particle_radius, [&](uint32_t idx, float t, float dist_to_ray) {
+    out_hits.push_back({ t, idx });
+    return true;
+    });
+  std::sort(out_hits.begin(), out_hits.end(), [](const RayHit& a, const RayHit& b) { return a.t < b.t; });
+}
+
+// Accumulated density using the kernel radius of the material
+float ViscoelasticSim::raycastDensity(VEC3 src, VEC3 dir, float max_dist) const {
+  float radius = mat.kernel_radius;
+  if (spatial_hash_valid)
+    return spatial_hash.raycastDensity(particles_pos, src, dir, max_dist, radius, spatial_hash_margin);
+  float density = 0.0f;
+  CPUSpatialSubdivision::Range all = { 0, (uint32_t)num_particles };
+  CPUSpatialSubdivision::raycastRange(particles_pos, all, src, dir, max_dist, radius, [&](uint32_t idx, float t, float dist_to_ray) {
+    float closeness = 1.0f - dist_to_ray / radius;
+    density += closeness * closeness;
+    return true;
+    });
+  return density;
+}
+
+// Nearest hit of each ray, running the rays in parallel
+void ViscoelasticSim::raycastParticles(const VEC3* srcs, const VEC3* dirs, int num_rays, float max_dist, float particle_radius, RayHit* out_hits) {
+  PROFILE_SCOPED_NAMED("raycastParticles");
+  runInParallel(num_rays, num_threads, [&](int start, int end, int job_id) {
+    for (int i = start; i < end; ++i)
+      raycastParticles(srcs[i], dirs[i], max_dist, particle_radius, out_hits[i]);
+    }, "raycast");
 }
 
 void ViscoelasticSim::updateStep(float dt) {
 
   {
-    TTimer tm;
+    TSectionTimer tm;
     updateSpatialHash();
     saveTime(eSection::SpatialHash, tm);
   }
 
   // Apply external forces
   {
-    TTimer tm;
+    TSectionTimer tm;
     PROFILE_SCOPED_NAMED("velocities");
     VEC3 delta_velocity = 0.02f * mat.kernel_radius * mat.gravity * dt;
     simd_add_velocity_scaled_by_type(particles_vels, particles_type, masses, delta_velocity, num_particles);
@@ -580,23 +641,22 @@ void ViscoelasticSim::updateStep(float dt) {
     attrack_repel -= repel ? 0.01f * mat.kernel_radius : 0.0f;
     bool attrack_repel_active = attrack_repel != 0.0f;
     if (attrack_repel_active) {
-      float interact_rad_sqr = interact_rad * interact_rad;
-
-      for (int i = 0; i < num_particles; ++i) {
+      CPUSpatialSubdivision::QuerySphere sphere = { interact_point, interact_rad };
+      queryParticles(sphere, [&](int i) {
         VEC3 delta = particles_pos.get(i) - interact_point;
         float dist_sq = delta.lengthSquared();
-        if (dist_sq > interact_rad_sqr || dist_sq < 0.1f)
-          continue;
+        if (dist_sq < 0.1f)
+          return;
         const float dist = sqrtf(dist_sq);
         const float inv_dist = 1.0f / dist;
         delta *= inv_dist;
         particles_vels.add(i, attrack_repel * (-delta));
-      }
+        });
     }
   }
 
   {
-    TTimer tm;
+    TSectionTimer tm;
     PROFILE_SCOPED_NAMED("predict position");
     particles_prev_pos.copyFrom(particles_pos, num_particles);
     simd_update_positions(particles_pos, particles_vels, dt, num_particles);
@@ -616,7 +676,7 @@ void ViscoelasticSim::updateStep(float dt) {
   }
 
   {
-    TTimer tm;
+    TSectionTimer tm;
     PROFILE_SCOPED_NAMED("relaxation");
     if (using_parallel)
       doubleDensityRelaxationPara(dt, *pool);
@@ -626,38 +686,534 @@ void ViscoelasticSim::updateStep(float dt) {
   }
 
   {
-    TTimer tm;
+    TSectionTimer tm;
     PROFILE_SCOPED_NAMED("collisions");
-    runInParallel(num_particles, num_threads * 3, [&](int start, int end, int job_id) {
+    const AutoTuner::Config& cfg = tuner.config(eSection::Collisions);
+    runInParallel(num_particles, cfg.num_splits, [&](int start, int end, int job_id) {
       resolveCollisions(dt, start, end);
-      });
+      }, "collisions", cfg.num_threads);
     saveTime(eSection::Collisions, tm);
   }
 
   {
-    TTimer tm;
+    TSectionTimer tm;
     PROFILE_SCOPED_NAMED("velocities_from_positions");
     float inv_dt = 1.0f / dt;
-    runInParallel(num_particles, 4, [&](int start, int end, int job_id) {
-      simd_update_velocities_clamped(particles_vels, particles_pos, particles_prev_pos, inv_dt, max_speed, start, end);
-      });
+    const AutoTuner::Config& cfg = tuner.config(eSection::VelocitiesFromPositions);
+    std::vector<float> max_dist_sq_per_job(cfg.num_splits, 0.0f);
+    runInParallel(num_particles, cfg.num_splits, [&](int start, int end, int job_id) {
+      max_dist_sq_per_job[job_id] = simd_update_velocities_clamped(particles_vels, particles_pos, particles_prev_pos, inv_dt, max_speed, start, end);
+      }, "velocities_from_positions", cfg.num_threads);
+    // prev_pos are the positions when the spatial hash was built, so the margin of the
+    // queries is the largest distance moved since then by predict, relaxation and collisions
+    float max_dist_sq = 0.0f;
+    for (float dist_sq : max_dist_sq_per_job)
+      max_dist_sq = std::max(max_dist_sq, dist_sq);
+    spatial_hash_margin = sqrtf(max_dist_sq);
     saveTime(eSection::VelocitiesFromPositions, tm);
   }
 
 }
 
+// Same steps as updateStep, written as plain loops. Any change in the math of updateStep
+// must be done here too
+void ViscoelasticSim::updateStepReference(float dt) {
+  PROFILE_SCOPED_NAMED("updateStepReference");
+  updateSpatialHash();
+
+  VEC3 delta_velocity = 0.02f * mat.kernel_radius * mat.gravity * dt;
+  for (int i = 0; i < num_particles; ++i)
+    particles_vels.add(i, delta_velocity * masses[particles_type[i]]);
+
+  float attrack_repel = attract ? 0.01f * mat.kernel_radius : 0.0f;
+  attrack_repel -= repel ? 0.01f * mat.kernel_radius : 0.0f;
+  if (attrack_repel != 0.0f) {
+    for (int i = 0; i < num_particles; ++i) {
+      VEC3 delta = particles_pos.get(i) - interact_point;
+      float dist_sq = delta.lengthSquared();
+      if (dist_sq < 0.1f || dist_sq > interact_rad * interact_rad)
+        continue;
+      particles_vels.add(i, attrack_repel * (-delta * (1.0f / sqrtf(dist_sq))));
+    }
+  }
+
+  particles_prev_pos.copyFrom(particles_pos, num_particles);
+  for (int i = 0; i < num_particles; ++i)
+    particles_pos.add(i, particles_vels.get(i) * dt);
+  particles_frozen_pos.copyFrom(particles_pos, num_particles);
+
+  if (in_2d) {
+    for (int i = 0; i < num_particles; ++i) {
+      particles_pos.x[i] = 0.01f;
+      particles_vels.x[i] = 0.0f;
+    }
+  }
+
+  for (auto& range : spatial_hash.cells_ranges)
+    processRangeReference(dt, range, particles_frozen_pos, &particles_pos);
+
+  resolveCollisions(dt, 0, num_particles);
+
+  float inv_dt = 1.0f / dt;
+  float max_dist_sq = 0.0f;
+  for (int i = 0; i < num_particles; ++i) {
+    VEC3 delta = particles_pos.get(i) - particles_prev_pos.get(i);
+    max_dist_sq = std::max(max_dist_sq, delta.lengthSquared());
+    VEC3 v = delta * inv_dt;
+    if (v.length() > max_speed)
+      v = v.normalized() * max_speed;
+    particles_vels.set(i, v);
+  }
+  spatial_hash_margin = sqrtf(max_dist_sq);
+}
+
+// processRange without simd. The neighbours are visited in the same order, and at most max_nears are used
+void ViscoelasticSim::processRangeReference(float dt, const CPUSpatialSubdivision::CellRange& range, const ParticlesVec& ppos, ParticlesVec* deltas) {
+  float kernel_radius = mat.kernel_radius;
+  float stiffness = mat.stiffness * dt * dt;
+  float near_stiffness = mat.near_stiffness * dt * dt;
+
+  constexpr static int max_nears = 64;
+  int   nears_ids[max_nears];
+  float nears_closeness[max_nears];
+  VEC3  nears_dirs[max_nears];
+
+  spatial_hash.onEachParticleInCell(range, [&](int i, const CPUSpatialSubdivision::NearRanges& near_ranges) {
+    float density = 0.0f;
+    float near_density = 0.0f;
+    int num_nears = 0;
+    VEC3 pi = ppos.get(i);
+    for (uint32_t r = 0; r < near_ranges.n && num_nears < max_nears; ++r) {
+      for (uint32_t j = near_ranges.ranges[r].first; j < near_ranges.ranges[r].last && num_nears < max_nears; ++j) {
+        if (j == (uint32_t)i)
+          continue;
+        VEC3 delta = ppos.get(j) - pi;
+        float length = delta.length();
+        if (length >= kernel_radius || length <= 1e-3f)
+          continue;
+        float r_ij = length + 1e-5f;
+        float closeness = 1.0f - r_ij / kernel_radius;
+        density += closeness * closeness;
+        near_density += closeness * closeness * closeness;
+        nears_ids[num_nears] = j;
+        nears_closeness[num_nears] = closeness;
+        nears_dirs[num_nears] = delta * (1.0f / r_ij);
+        ++num_nears;
+      }
+    }
+
+    float pressure = std::min(1.0f, stiffness * (density - mat.rest_density));
+    float near_pressure = std::min(1.0f, near_stiffness * std::max(0.0f, near_density));
+
+    VEC3 acc = VEC3::zero;
+    for (int k = 0; k < num_nears; ++k) {
+      float closeness = nears_closeness[k];
+      VEC3 d = nears_dirs[k] * ((pressure + near_pressure * closeness) * closeness * 0.5f);
+      deltas->add(nears_ids[k], d);
+      acc -= d;
+    }
+    deltas->add(i, acc);
+    });
+}
+
 void ViscoelasticSim::setNumThreads(int new_num_threads) {
   num_threads = new_num_threads;
   if (pool)
     delete pool;
-  pool = new ThreadPool(num_threads);
+  pool = new ThreadPool(num_threads, ThreadAffinity::cpusForWorkers(pinning, num_threads, pinning_cpus));
+  retune();
+}
+
+void ViscoelasticSim::setPinning(ThreadAffinity::ePolicy new_pinning, const std::vector<int>& explicit_cpus) {
+  pinning = new_pinning;
+  pinning_cpus = explicit_cpus;
+  setNumThreads(num_threads);
+}
+
+void ViscoelasticSim::retune() {
+  tuner.reset(num_threads, num_particles);
 }
 
 void ViscoelasticSim::update(float delta_time) {
   sdf.generateCompactStructs();
   float dt = delta_time / (float)num_substeps;
-  TTimer tm;
-  for (int i = 0; i < num_substeps; ++i)
-    updateStep(dt);
+  // The best configuration depends on the number of particles
+  if (auto_tune)
+    tuner.checkParticles(num_particles);
+  TSectionTimer tm;
+  for (int i = 0; i < num_substeps; ++i) {
+    if (use_reference)
+      updateStepReference(dt);
+    else
+      updateStep(dt);
+  }
   saveTime(eSection::Update, tm);
-}
\ No newline at end of file
+}
+const char* ViscoelasticSim::sectionName(eSection section_id) {
+  static const char* names[eSection::NumSections] = {
+    "spatial_hash", "velocities_update", "predict_position", "relaxation",
+    "velocities_from_positions", "collisions", "render", "update"
+  };
+  return names[section_id];
+}
+
+void ViscoelasticSim::resetLatencies() {
+  for (auto& h : latencies)
+    h.reset();
+  jobs_latencies.reset();
+}
+
+// Json with the percentiles of each section, in ms, for the monitoring
+bool ViscoelasticSim::saveLatencies(const char* filename) const {
+  FILE* f = fopen(filename, "wb");
+  if (!f)
+    return false;
+  auto saveSummary = [&](const char* name, const THistogram& h, bool is_last) {
+    THistogram::TSummary s = h.summary();
+    fprintf(f, "  \"%s\": { \"count\": %llu, \"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f }%s\n"
+      , name, (unsigned long long)s.count, s.mean_ns * 1e-6, s.p50_ns * 1e-6, s.p95_ns * 1e-6, s.p99_ns * 1e-6, s.max_ns * 1e-6
+      , is_last ? "" : ",");
+  };
+  fprintf(f, "{\n");
+  for (int i = 0; i < eSection::NumSections; ++i)
+    saveSummary(sectionName((eSection)i), latencies[i], false);
+  saveSummary("parallel_jobs", jobs_latencies, true);
+  fprintf(f, "}\n");
+  fclose(f);
+  return true;
+}
+
+ViscoelasticSim::TParallelStats& ViscoelasticSim::parallelStats(const char* region_name) {
+  for (auto& stats : parallel_stats) {
+    if (strcmp(stats.name, region_name) == 0)
+      return stats;
+  }
+  parallel_stats.emplace_back();
+  parallel_stats.back().name = region_name;
+  return parallel_stats.back();
+}
+
+void ViscoelasticSim::TParallelStats::update(double new_wall_time, int num_threads) {
+  int num_chunks = (int)chunk_time.size();
+  if (!num_chunks)
+    return;
+  double busy = 0.0;
+  double max_time = 0.0;
+  for (int i = 0; i < num_chunks; ++i) {
+    busy += chunk_time[i];
+    max_time = std::max(max_time, (double)chunk_time[i]);
+    chunk_wait[i] = std::max(0.0f, (float)new_wall_time - chunk_begin[i] - chunk_time[i]);
+  }
+  double mean_time = busy / num_chunks;
+  int threads_used = std::min(num_threads, num_chunks);
+  double new_imbalance = mean_time > 0.0 ? max_time / mean_time : 1.0;
+  double new_utilisation = new_wall_time > 0.0 ? busy / (new_wall_time * threads_used) : 0.0;
+
+  // The first run initializes the averages
+  double k = num_runs ? 0.1 : 1.0;
+  wall_time = wall_time * (1.0 - k) + new_wall_time * k;
+  mean_chunk = mean_chunk * (1.0 - k) + mean_time * k;
+  max_chunk = max_chunk * (1.0 - k) + max_time * k;
+  imbalance = imbalance * (1.0 - k) + new_imbalance * k;
+  utilisation = utilisation * (1.0 - k) + new_utilisation * k;
+  ++num_runs;
+}
+
+// ---------------------------------------------------------------------
+// Snapshots
+namespace {
+
+  constexpr uint32_t snapshot_alignment = 32;
+
+  struct TSnapshotHeader {
+    uint32_t magic = ViscoelasticSim::snapshot_magic;
+    uint32_t version = ViscoelasticSim::snapshot_version;
+    uint32_t num_chunks = 0;
+    uint32_t reserved[5] = { 0 };
+  };
+
+  constexpr uint32_t tag_sim = ViscoelasticSim::makeSnapshotTag('S', 'I', 'M', ' ');
+  constexpr uint32_t tag_pos = ViscoelasticSim::makeSnapshotTag('P', 'O', 'S', ' ');
+  constexpr uint32_t tag_prev_pos = ViscoelasticSim::makeSnapshotTag('P', 'P', 'O', 'S');
+  constexpr uint32_t tag_vels = ViscoelasticSim::makeSnapshotTag('V', 'E', 'L', 'S');
+  constexpr uint32_t tag_type = ViscoelasticSim::makeSnapshotTag('T', 'Y', 'P', 'E');
+  constexpr uint32_t tag_uids = ViscoelasticSim::makeSnapshotTag('U', 'I', 'D', 'S');
+  constexpr uint32_t tag_free_uids = ViscoelasticSim::makeSnapshotTag('F', 'U', 'I', 'D');
+  constexpr uint32_t tag_sdf = ViscoelasticSim::makeSnapshotTag('S', 'D', 'F', ' ');
+
+  // Material and settings of the sim
+  struct TSnapshotSim {
+    uint32_t num_particles = 0;
+    uint32_t next_uid = 0;
+    int32_t  num_substeps = 1;
+    uint32_t in_2d = 0;
+    float    rest_density = 0.0f;
+    float    stiffness = 0.0f;
+    float    near_stiffness = 0.0f;
+    float    kernel_radius = 0.0f;
+    float    point_size = 0.0f;
+    float    dt = 0.0f;
+    float    gravity[3] = { 0.0f, 0.0f, 0.0f };
+    float    friction = 0.0f;
+    float    max_speed = 0.0f;
+    float    world_scale = 0.0f;
+    float    masses[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+  };
+
+  void writePadding(TBuffer& buf) {
+    static const uint8_t zeros[snapshot_alignment] = { 0 };
+    uint32_t extra = (uint32_t)(buf.size() % snapshot_alignment);
+    if (extra)
+      buf.writeBytes(zeros, snapshot_alignment - extra);
+  }
+
+  // x, y and z planes of the first n particles
+  void writeVecChunk(TBuffer& buf, uint32_t tag, const ParticlesVec& v, int n) {
+    size_t plane_bytes = n * sizeof(float);
+    ViscoelasticSim::writeSnapshotChunk(buf, tag, 1, nullptr, 3 * plane_bytes);
+    buf.writeBytes(v.x, (uint32_t)plane_bytes);
+    buf.writeBytes(v.y, (uint32_t)plane_bytes);
+    buf.writeBytes(v.z, (uint32_t)plane_bytes);
+    writePadding(buf);
+  }
+
+  void readVecChunk(ParticlesVec& v, const void* payload, int n) {
+    const float* src = (const float*)payload;
+    memcpy(v.x, src, n * sizeof(float));
+    memcpy(v.y, src + n, n * sizeof(float));
+    memcpy(v.z, src + 2 * n, n * sizeof(float));
+  }
+
+}
+
+// With a null payload only the header is written, and the caller writes the payload and the padding
+void ViscoelasticSim::writeSnapshotChunk(TBuffer& buf, uint32_t tag, uint32_t version, const void* payload, size_t nbytes) {
+  writePadding(buf);
+  TSnapshotChunk chunk;
+  chunk.tag = tag;
+  chunk.version = version;
+  chunk.nbytes = nbytes;
+  buf.write(chunk);
+  if (!payload)
+    return;
+  buf.writeBytes(payload, (uint32_t)nbytes);
+  writePadding(buf);
+}
+
+bool ViscoelasticSim::saveSnapshot(const char* filename, const TBuffer* host_chunks) const {
+  TBuffer buf;
+  return saveSnapshot(buf, host_chunks) && buf.save(filename);
+}
+
+bool ViscoelasticSim::saveSnapshot(TBuffer& buf, const TBuffer* host_chunks) const {
+  PROFILE_SCOPED_NAMED("saveSnapshot");
+  int n = num_particles;
+  size_t base = buf.size();
+  buf.reserve(base + sizeof(TSnapshotHeader) + n * (3 * 3 * sizeof(float) + sizeof(uint8_t) + sizeof(uint32_t)) + 64 * 1024);
+
+  TSnapshotHeader header;
+  buf.write(header);
+
+  TSnapshotSim s;
+  s.num_particles = n;
+  s.next_uid = next_uid;
+  s.num_substeps = num_substeps;
+  s.in_2d = in_2d ? 1 : 0;
+  s.rest_density = mat.rest_density;
+  s.stiffness = mat.stiffness;
+  s.near_stiffness = mat.near_stiffness;
+  s.kernel_radius = mat.kernel_radius;
+  s.point_size = mat.point_size;
+  s.dt = mat.dt;
+  s.gravity[0] = mat.gravity.x;
+  s.gravity[1] = mat.gravity.y;
+  s.gravity[2] = mat.gravity.z;
+  s.friction = friction;
+  s.max_speed = max_speed;
+  s.world_scale = world_scale;
+  for (int i = 0; i < 4; ++i)
+    s.masses[i] = masses[i];
+  writeSnapshotChunk(buf, tag_sim, 1, &s, sizeof(s));
+
+  writeVecChunk(buf, tag_pos, particles_pos, n);
+  writeVecChunk(buf, tag_prev_pos, particles_prev_pos, n);
+  writeVecChunk(buf, tag_vels, particles_vels, n);
+  writeSnapshotChunk(buf, tag_type, 1, particles_type, n * sizeof(uint8_t));
+  writeSnapshotChunk(buf, tag_uids, 1, particles_uid, n * sizeof(uint32_t));
+  // In the order they are recycled, so the particles added after loading get the same uids
+  std::vector<uint32_t> saved_free_uids(free_uids.begin(), free_uids.end());
+  writeSnapshotChunk(buf, tag_free_uids, 1, saved_free_uids.data(), saved_free_uids.size() * sizeof(uint32_t));
+
+  TBuffer prims;
+  sdf.save(prims);
+  writeSnapshotChunk(buf, tag_sdf, 1, prims.data(), prims.size());
+
+  // sim, pos, prev_pos, vels, type, uids, free uids and sdf
+  uint32_t num_chunks = 8;
+  if (host_chunks && !host_chunks->empty()) {
+    writePadding(buf);
+    // Count the chunks of the host
+    CMemoryDataProvider dp = host_chunks->getNewMemoryDataProvider();
+    while (dp.remainingBytes() >= sizeof(TSnapshotChunk)) {
+      const TSnapshotChunk* chunk = dp.assign<TSnapshotChunk>();
+      uint32_t padded = (uint32_t)((chunk->nbytes + snapshot_alignment - 1) & ~(uint64_t)(snapshot_alignment - 1));
+      if (padded > dp.remainingBytes())
+        return false;
+      dp.consumeBytes(padded);
+      ++num_chunks;
+    }
+    buf.write(*host_chunks);
+  }
+
+  TSnapshotHeader* out_header = (TSnapshotHeader*)(buf.data() + base);
+  out_header->num_chunks = num_chunks;
+  return true;
+}
+
+// The file is mapped and the arrays are copied from the mapping to the particles,
+// without intermediate buffers
+bool ViscoelasticSim::loadSnapshot(const char* filename, OnSnapshotChunk on_host_chunk) {
+  TMappedFile file;
+  if (!file.open(filename))
+    return false;
+  if (!loadSnapshot(file.data, file.size, on_host_chunk)) {
+    dbg("Snapshot %s is not valid\n", filename);
+    return false;
+  }
+  return true;
+}
+
+// All the chunks are validated before changing the state. data must be aligned to 32 bytes
+bool ViscoelasticSim::loadSnapshot(const void* data, size_t nbytes, OnSnapshotChunk on_host_chunk) {
+  PROFILE_SCOPED_NAMED("loadSnapshot");
+  const uint8_t* base = (const uint8_t*)data;
+  if (nbytes < sizeof(TSnapshotHeader))
+    return false;
+  const TSnapshotHeader* header = (const TSnapshotHeader*)base;
+  if (header->magic != snapshot_magic || header->version > snapshot_version)
+    return false;
+
+  struct TFound {
+    const TSnapshotChunk* chunk = nullptr;
+    const void*           payload = nullptr;
+  };
+  std::vector<TFound> chunks;
+  size_t offset = sizeof(TSnapshotHeader);
+  for (uint32_t i = 0; i < header->num_chunks; ++i) {
+    offset = (offset + snapshot_alignment - 1) & ~(size_t)(snapshot_alignment - 1);
+    if (offset + sizeof(TSnapshotChunk) > nbytes)
+      return false;
+    const TSnapshotChunk* chunk = (const TSnapshotChunk*)(base + offset);
+    offset += sizeof(TSnapshotChunk);
+    if (chunk->nbytes > nbytes - offset)
+      return false;
+    chunks.push_back({ chunk, base + offset });
+    offset += (size_t)chunk->nbytes;
+  }
+
+  auto findChunk = [&](uint32_t tag, size_t expected_bytes) -> const void* {
+    for (auto& c : chunks) {
+      if (c.chunk->tag == tag)
+        return (c.chunk->version == 1 && c.chunk->nbytes == expected_bytes) ? c.payload : nullptr;
+    }
+    return nullptr;
+  };
+
+  const TSnapshotSim* s = (const TSnapshotSim*)findChunk(tag_sim, sizeof(TSnapshotSim));
+  if (!s)
+    return false;
+  int n = (int)s->num_particles;
+  const void* pos = findChunk(tag_pos, 3 * n * sizeof(float));
+  const void* prev_pos = findChunk(tag_prev_pos, 3 * n * sizeof(float));
+  const void* vels = findChunk(tag_vels, 3 * n * sizeof(float));
+  const void* types = findChunk(tag_type, n * sizeof(uint8_t));
+  const uint32_t* uids = (const uint32_t*)findChunk(tag_uids, n * sizeof(uint32_t));
+  if (!pos || !prev_pos || !vels || !types || !uids)
+    return false;
+  for (int i = 0; i < n; ++i) {
+    if (uids[i] >= s->next_uid)
+      return false;
+  }
+  // The snapshots saved before the free uids were stored rebuild them
+  const uint32_t* saved_free_uids = nullptr;
+  size_t num_free_uids = 0;
+  for (auto& c : chunks) {
+    if (c.chunk->tag == tag_free_uids) {
+      num_free_uids = (size_t)(c.chunk->nbytes / sizeof(uint32_t));
+      saved_free_uids = (const uint32_t*)findChunk(tag_free_uids, num_free_uids * sizeof(uint32_t));
+      if (!saved_free_uids || num_free_uids + n != s->next_uid)
+        return false;
+      // Each uid is either live or free, once
+      std::vector<uint8_t> seen(s->next_uid, 0);
+      for (int i = 0; i < n; ++i)
+        seen[uids[i]] = 1;
+      for (size_t i = 0; i < num_free_uids; ++i) {
+        if (saved_free_uids[i] >= s->next_uid || seen[saved_free_uids[i]])
+          return false;
+        seen[saved_free_uids[i]] = 1;
+      }
+    }
+  }
+
+  if (n > max_particles) {
+    max_particles = n;
+    init();
+  }
+  // uid_to_index can be indexed by any uid
+  if (uid_to_index.size() < s->next_uid)
+    uid_to_index.resize(s->next_uid);
+
+  num_substeps = s->num_substeps;
+  in_2d = s->in_2d != 0;
+  mat.rest_density = s->rest_density;
+  mat.stiffness = s->stiffness;
+  mat.near_stiffness = s->near_stiffness;
+  mat.kernel_radius = s->kernel_radius;
+  mat.point_size = s->point_size;
+  mat.dt = s->dt;
+  mat.gravity = VEC3(s->gravity[0], s->gravity[1], s->gravity[2]);
+  friction = s->friction;
+  max_speed = s->max_speed;
+  world_scale = s->world_scale;
+  for (int i = 0; i < 4; ++i)
+    masses[i] = s->masses[i];
+
+  readVecChunk(particles_pos, pos, n);
+  readVecChunk(particles_prev_pos, prev_pos, n);
+  readVecChunk(particles_vels, vels, n);
+  memcpy(particles_type, types, n * sizeof(uint8_t));
+  memcpy(particles_uid, uids, n * sizeof(uint32_t));
+  num_particles = n;
+  attributes.clearOwned(0, n);
+
+  // Rebuild the uids map and the free list
+  std::fill(uid_to_index.begin(), uid_to_index.end(), invalid_uid);
+  for (int i = 0; i < n; ++i)
+    uid_to_index[uids[i]] = i;
+  next_uid = s->next_uid;
+  free_uids.clear();
+  if (saved_free_uids) {
+    free_uids.assign(saved_free_uids, saved_free_uids + num_free_uids);
+  }
+  else {
+    for (uint32_t uid = 0; uid < next_uid; ++uid) {
+      if (uid_to_index[uid] == invalid_uid)
+        free_uids.push_back(uid);
+    }
+  }
+  spatial_hash_valid = false;
+  debug_particle = -1;
+
+  for (auto& c : chunks) {
+    if (c.chunk->tag == tag_sdf) {
+      if (c.chunk->version == 1)
+        sdf.load(c.payload, (size_t)c.chunk->nbytes);
+    }
+    else if (c.chunk->tag != tag_sim && c.chunk->tag != tag_pos && c.chunk->tag != tag_prev_pos && c.chunk->tag != tag_vels
+      && c.chunk->tag != tag_type && c.chunk->tag != tag_uids && c.chunk->tag != tag_free_uids) {
+      if (on_host_chunk && !on_host_chunk(*c.chunk, c.payload))
+        dbg("Snapshot chunk %08x was not loaded\n", c.chunk->tag);
+    }
+  }
+  return true;
+}
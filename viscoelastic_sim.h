@@ -2,8 +2,12 @@
 
 #include "cpu_spatial_subdivision.h"
 #include "particles_vec.h"
+#include "particles_attributes.h"
 #include "geometry/sdf/sdf.h"
 #include "thread_pool.h"
+#include "profile/histogram.h"
+#include "auto_tuner.h"
+#include <deque>
 
 struct ViscoelasticSim {
 
@@ -19,6 +23,15 @@ struct ViscoelasticSim {
     NumSections
   };
   double times[eSection::NumSections] = { 0.0f };
+  // Hardware counters of all the threads during each section, when enabled in the profiler
+  double counters[eSection::NumSections][Profiling::NumCounters] = { { 0.0 } };
+  // Distribution of the duration of each section and of each job of runInParallel
+  THistogram latencies[eSection::NumSections];
+  THistogram jobs_latencies;
+
+  static const char* sectionName(eSection section_id);
+  void resetLatencies();
+  bool saveLatencies(const char* filename) const;
 
   struct Material {
     float       rest_density = 4.0f;
@@ -41,6 +54,27 @@ struct ViscoelasticSim {
   ParticlesVec   aux_particles_vels;
   unsigned char* aux_particles_type = nullptr;
 
+  // All the per-particle channels, permuted together in updateSpatialHash
+  ParticlesAttributes     attributes;
+
+  // Permutation applied in the last updateSpatialHash
+  // particles_new_index[ old_slot ] = new_slot, particles_old_index[ new_slot ] = old_slot
+  std::vector<uint32_t>   particles_new_index;
+  std::vector<uint32_t>   particles_old_index;
+
+  // Stable unique id of each particle. Unlike the index, it does not change when the
+  // particles are reordered. The uids of the removed particles are recycled in the order they
+  // were released, and only once uid_reuse_delay of them are waiting or there are no new uids,
+  // so a uid kept by the caller does not find another particle soon after its removal
+  static constexpr uint32_t invalid_uid = ~0U;
+  static constexpr size_t   uid_reuse_delay = 1024;
+  uint32_t*               particles_uid = nullptr;
+  uint32_t*               aux_particles_uid = nullptr;
+  std::vector<uint32_t>   uid_to_index;
+  std::deque<uint32_t>    free_uids;
+  uint32_t                next_uid = 0;
+  uint32_t allocUID();
+
   Material                mat;
   CPUSpatialSubdivision   spatial_hash;
 
@@ -57,6 +91,9 @@ struct ViscoelasticSim {
   bool                    repel = false;
   bool                    emit = false;
   bool                    using_parallel = false;
+  // Scalar versions of the kernels in a single thread, the reference to validate the simd and
+  // parallel ones (tools/golden.cpp)
+  bool                    use_reference = false;
 
   VEC3                    interact_point = VEC3::zero;
   VEC3                    interact_dir = VEC3::axis_y;
@@ -67,46 +104,248 @@ struct ViscoelasticSim {
 
   int                     debug_particle = -1;
 
+  // The particles indices match the ranges of the spatial hash until particles are added or removed.
+  // The margin is the largest distance moved by a particle since the spatial hash was built,
+  // measured at the end of each step, so the queries also find the particles pushed by the
+  // relaxation and the collisions
+  bool                    spatial_hash_valid = false;
+  float                   spatial_hash_margin = 0.0f;
+
   int num_threads = 12;
   ThreadPool* pool = nullptr;
 
   void setNumThreads(int new_num_threads);
 
+  // Placement of the workers of the pool, applied when the pool is created
+  ThreadAffinity::ePolicy pinning = ThreadAffinity::ePolicy::None;
+  std::vector<int>        pinning_cpus;               // Used by the Explicit policy
+  void setPinning(ThreadAffinity::ePolicy new_pinning, const std::vector<int>& explicit_cpus = {});
+
+  // Threads and chunks used by the parallel sections, indexed by eSection
+  AutoTuner               tuner;
+  bool                    auto_tune = true;
+  void retune();
+
+  // The parallel relaxation splits the cells in chunks of similar estimated cost.
+  // The estimation of each cell is corrected with the measured times of the previous frames.
+  // The index of a cell in cells_ranges changes when other cells appear or empty, so the
+  // correction is stored in the slot of the cell in the hash, with the coords it belongs to
+  struct TCellCorrection {
+    CPUSpatialSubdivision::Int3 coords = CPUSpatialSubdivision::Int3(0, 0, 0);
+    float                       factor = 1.0f;
+  };
+  bool                    relaxation_balanced = true;
+  std::vector<double>     relaxation_cost;            // Prefix sum of the cost of the cells
+  std::vector<TCellCorrection> relaxation_correction; // Per cell_id
+  std::vector<int>        relaxation_bounds;
+
   std::vector< CPUSpatialSubdivision::AssignedCell > assigned_cells;
 
+  // Scratch buffers used by removeParticles
+  std::vector<uint8_t>    remove_mask;
+  std::vector<uint32_t>   removed_uids;
+
   void init();
 
-  void addParticle(VEC3 pos, VEC3 vel, uint8_t particle_type);
+  uint32_t addParticle(VEC3 pos, VEC3 vel, uint8_t particle_type);
+  // Appends up to n particles with new uids and returns the index of the first one, and the number of
+  // particles reserved in num_reserved. The caller writes their positions, velocities and types before
+  // the next update. From the main thread, like addParticle and removeParticles
+  int reserveParticles(int n, int* num_reserved);
+
+  // Shape of the particles of addParticlesBulk, in the units of the sim
+  struct BulkShape {
+    enum class eType { Box, Sphere, Lattice, Sdf };
+    eType              type = eType::Box;
+    VEC3               vmin = VEC3::zero;          // Box, Lattice, and the region sampled by Sdf, which should be tight
+    VEC3               vmax = VEC3::ones;
+    VEC3               center = VEC3::zero;        // Sphere, a disc in the yz plane in 2d
+    float              radius = 1.0f;
+    float              spacing = 8.0f;             // Lattice
+    float              jitter = 0.0f;              // Lattice, as a fraction of the spacing
+    const SDF::sdFunc* sdf = nullptr;              // Sdf, evaluated in world units
+    bool               sdf_inside = true;          // Where the sdf is negative, or positive like the free space of the sim
+    TTransform         transform;                  // Applied to the positions of all the shapes
+    VEC3               velocity = VEC3::zero;
+    float              velocity_jitter = 0.0f;
+    uint8_t            particle_type = 0;
+    int                num_types = 1;              // Consecutive ranges of types starting at particle_type
+    uint32_t           seed = 0;
+
+    // Particles of the lattice and in each axis
+    int latticeCount(bool in_2d, int* nx = nullptr, int* ny = nullptr, int* nz = nullptr) const;
+  };
+
+  // Adds n particles inside the shape, or all the particles of the lattice when n < 0. The slots are
+  // reserved at once and filled in parallel. The random values depend only on the seed and the index of
+  // the particle in the call, so the particles are the same for any number of threads.
+  // Must be called from the main thread, like runInParallel. Returns the index of the first particle,
+  // the number of particles added is returned in num_added
+  int addParticlesBulk(int n, const BulkShape& shape, int* num_added = nullptr);
+  void fillParticlesBulk(int first, int begin, int end, int count, const BulkShape& shape);
+  void removeAllParticles();
   void removeParticle(int particle_id);
   void removeParticles(std::vector<int>& particles_to_remove);
+  void removeParticles(const uint8_t* remove_mask);
   void getParticleIDsNear(std::vector<int>& out_ids, VEC3 ref_point, float rad) const;
 
+  // Calls fn(idx) for each particle inside the shape (any of the CPUSpatialSubdivision::Query* types)
+  // Only the cells touched by the shape are visited when the spatial hash is valid
+  template< typename Shape, typename Fn >
+  void queryParticles(const Shape& shape, Fn fn) const {
+    if (!spatial_hash_valid) {
+      for (int i = 0; i < num_particles; ++i) {
+        if (shape.isInside(particles_pos.get(i)))
+          fn(i);
+      }
+      return;
+    }
+    spatial_hash.query(shape, particles_pos, spatial_hash_margin, fn);
+  }
+
+  // Ray casting vs the particles, as spheres of radius particle_radius. dir must be normalized
+  using RayHit = CPUSpatialSubdivision::RayHit;
+  bool raycastParticles(VEC3 src, VEC3 dir, float max_dist, float particle_radius, RayHit& hit) const;
+  void raycastAllParticles(VEC3 src, VEC3 dir, float max_dist, float particle_radius, std::vector<RayHit>& out_hits) const;
+  float raycastDensity(VEC3 src, VEC3 dir, float max_dist) const;
+  void raycastParticles(const VEC3* srcs, const VEC3* dirs, int num_rays, float max_dist, float particle_radius, RayHit* out_hits);
+
+  // Snapshot of the state in a versioned file of chunks. Each chunk starts with a TSnapshotChunk and
+  // its payload is aligned to 32 bytes. The chunks unknown to the sim are given to on_host_chunk,
+  // so the host can store its own state (written with writeSnapshotChunk in host_chunks)
+  static constexpr uint32_t makeSnapshotTag(char a, char b, char c, char d) {
+    return (uint32_t)a | ((uint32_t)b << 8) | ((uint32_t)c << 16) | ((uint32_t)d << 24);
+  }
+  static constexpr uint32_t snapshot_magic = 0x504E5356;      // VSNP
+  static constexpr uint32_t snapshot_version = 1;
+  struct TSnapshotChunk {
+    uint32_t tag = 0;
+    uint32_t version = 0;
+    uint64_t nbytes = 0;          // Of the payload, without the padding
+    uint64_t reserved[2] = { 0, 0 };
+  };
+  using OnSnapshotChunk = std::function<bool(const TSnapshotChunk& chunk, const void* payload)>;
+  static void writeSnapshotChunk(TBuffer& buf, uint32_t tag, uint32_t version, const void* payload, size_t nbytes);
+  bool saveSnapshot(const char* filename, const TBuffer* host_chunks = nullptr) const;
+  bool saveSnapshot(TBuffer& buf, const TBuffer* host_chunks = nullptr) const;
+  bool loadSnapshot(const char* filename, OnSnapshotChunk on_host_chunk = nullptr);
+  bool loadSnapshot(const void* data, size_t nbytes, OnSnapshotChunk on_host_chunk = nullptr);
+
+  // Returns -1 if the uid is not associated to a live particle
+  int indexOfUID(uint32_t uid) const {
+    if (uid >= (uint32_t)uid_to_index.size())
+      return -1;
+    uint32_t idx = uid_to_index[uid];
+    return idx == invalid_uid ? -1 : (int)idx;
+  }
+  void indicesOfUIDs(const uint32_t* uids, int n, int* out_indices) const {
+    for (int i = 0; i < n; ++i)
+      out_indices[i] = indexOfUID(uids[i]);
+  }
+
   void updateSpatialHash();
+  void reorderParticles();
+  void gatherParticles(int new_num_particles);
   void resolveCollisions(float dt, int start, int end);
   void processRange(float dt, const CPUSpatialSubdivision::CellRange& range, const ParticlesVec& __restrict ppos, ParticlesVec* __restrict deltas);
   void updateStep(float dt);
+  void updateStepReference(float dt);
+  void processRangeReference(float dt, const CPUSpatialSubdivision::CellRange& range, const ParticlesVec& ppos, ParticlesVec* deltas);
   void update(float dt);
   void doubleDensityRelaxationPara(float dt, ThreadPool& pool);
+  void updateRelaxationBounds(int num_splits);
+  void updateRelaxationCorrection(int num_splits);
   void doubleDensityRelaxation(float dt);
 
+  // Utilisation of each parallel region, updated each time the region runs
+  struct TParallelStats {
+    const char*        name = nullptr;
+    int                num_runs = 0;
+    std::vector<float> chunk_begin;       // Time since the region started, in seconds, of the last run
+    std::vector<float> chunk_time;        // Execution time of each chunk
+    std::vector<float> chunk_wait;        // Time from the end of each chunk to the join
+    double             wall_time = 0.0;   // The values below are moving averages
+    double             mean_chunk = 0.0;
+    double             max_chunk = 0.0;
+    double             imbalance = 1.0;   // max / mean of the chunk times
+    double             utilisation = 0.0; // Busy time / (wall time * num threads used)
+
+    void update(double new_wall_time, int num_threads);
+  };
+  std::vector<TParallelStats> parallel_stats;
+  TParallelStats& parallelStats(const char* region_name);
+
+  // Splits [0..num_jobs) in num_splits chunks executed by the pool, and waits for all of them.
+  // Must be called from the main thread, as the stats of the region are not protected.
+  // At most max_workers threads of the pool pull the chunks, all of them when max_workers <= 0
+  // The chunks are multiple of the simd width, so the simd kernels run the same particles in the
+  // simd and in the scalar paths for any num_splits, and the results do not depend on the tuner
   template< typename Fn >
-  void runInParallel(int num_jobs, int num_splits, Fn fn) {
-    PROFILE_SCOPED_NAMED("runInParallel");
+  void runInParallel(int num_jobs, int num_splits, Fn fn, const char* region_name = "parallel", int max_workers = 0) {
+    constexpr int simd_width = 8;
+    std::vector<int> bounds(num_splits + 1);
     int chunk_size = (num_jobs + num_splits - 1) / num_splits;
+    chunk_size = (chunk_size + simd_width - 1) & ~(simd_width - 1);
+    for (int job_id = 0; job_id <= num_splits; ++job_id)
+      bounds[job_id] = std::min(job_id * chunk_size, num_jobs);
+    runInParallelChunks(bounds.data(), num_splits, fn, region_name, max_workers);
+  }
+
+  // Same, but chunk job_id is [bounds[job_id]..bounds[job_id+1])
+  template< typename Fn >
+  void runInParallelChunks(const int* bounds, int num_splits, Fn fn, const char* region_name, int max_workers = 0) {
+    PROFILE_SCOPED_NAMED("runInParallel");
+    TParallelStats& stats = parallelStats(region_name);
+    stats.chunk_begin.resize(num_splits);
+    stats.chunk_time.resize(num_splits);
+    stats.chunk_wait.resize(num_splits);
+    int num_workers = std::min(num_splits, max_workers > 0 ? std::min(max_workers, num_threads) : num_threads);
+    num_workers = std::max(num_workers, 1);
+    std::atomic<int> next_chunk{ 0 };
+    TTimer tm_region;
     std::vector<std::future<void>> jobs;
-    for (int job_id = 0; job_id < num_splits; ++job_id) {
-      int start = job_id * chunk_size;
-      int end = std::min(start + chunk_size, num_jobs);
-      jobs.emplace_back(pool->enqueue([&, start, end, job_id]() {
-        PROFILE_SCOPED_NAMED("C");
-        fn(start, end, job_id);
+    for (int worker_id = 0; worker_id < num_workers; ++worker_id) {
+      jobs.emplace_back(pool->enqueue([&]() {
+        int job_id;
+        while ((job_id = next_chunk.fetch_add(1, std::memory_order_relaxed)) < num_splits) {
+          PROFILE_SCOPED_NAMED("C");
+          TTimer tm;
+          stats.chunk_begin[job_id] = (float)tm_region.elapsedSinceStart();
+          fn(bounds[job_id], bounds[job_id + 1], job_id);
+          double elapsed = tm.elapsed();
+          stats.chunk_time[job_id] = (float)elapsed;
+          jobs_latencies.recordSeconds(elapsed);
+        }
         }));
     }
     for (auto& job : jobs)
       job.get();
+    stats.update(tm_region.elapsedSinceStart(), num_workers);
   }
 
-  void saveTime(eSection section_id, TTimer& tm) {
-    times[ section_id ] = times[section_id] * 0.9f + tm.elapsed() * 0.1f;
+  // Measures a section, including the hardware counters when they are enabled
+  struct TSectionTimer {
+    TTimer               tm;
+    Profiling::TCounters counters_start;
+    bool                 has_counters = false;
+    TSectionTimer() {
+      if (Profiling::countersEnabled())
+        has_counters = Profiling::readCounters(counters_start);
+    }
+  };
+
+  void saveTime(eSection section_id, TSectionTimer& st) {
+    double elapsed = st.tm.elapsed();
+    times[ section_id ] = times[section_id] * 0.9f + elapsed * 0.1f;
+    latencies[section_id].recordSeconds(elapsed);
+    // The sequential relaxation does not use the configuration of the tuner
+    if (auto_tune && (using_parallel || section_id != eSection::Relaxation))
+      tuner.record(section_id, elapsed);
+    Profiling::TCounters counters_end;
+    if (st.has_counters && Profiling::readCounters(counters_end)) {
+      Profiling::TCounters delta = counters_end - st.counters_start;
+      for (int k = 0; k < Profiling::NumCounters; ++k)
+        counters[section_id][k] = counters[section_id][k] * 0.9 + delta.values[k] * 0.1;
+    }
   }
 };